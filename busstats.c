@@ -0,0 +1,401 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#include "busstats.h"
+
+#include <string.h>
+
+#define CRC15_POLY 0x4599
+#define HEADER_VALID 0x80000000
+
+// state of the bit stuffing as a frame is serialized
+typedef struct _stuff_state_t {
+  uint16_t crc;
+  uint8_t last;                 // polarity of the last bit sent
+  uint8_t run;                  // number of bits of the same polarity
+  uint16_t stuffed;             // stuff bits inserted
+  } stuff_state_t;
+
+static inline uint16_t crc15_bit(uint16_t crc, uint8_t bit)
+  {
+  uint8_t next = bit ^ ((crc >> 14) & 1);
+  crc = (crc << 1) & 0x7FFF;
+  if (next)
+    crc ^= CRC15_POLY;
+
+  return crc;
+  }
+
+static inline void stuff_bit(stuff_state_t *state, uint8_t bit)
+  {
+  if (state->run > 0 && bit == state->last)
+    state->run++;
+  else
+    {
+    state->last = bit;
+    state->run = 1;
+    }
+
+  if (state->run == 5)
+    {
+    // the stuff bit is the complement, and starts a new run
+    state->stuffed++;
+    state->last = !state->last;
+    state->run = 1;
+    }
+  }
+
+static inline void send_bits(stuff_state_t *state, uint16_t value, uint8_t num_bits, bool crc)
+  {
+  while (num_bits-- > 0)
+    {
+    uint8_t bit = (value >> num_bits) & 1;
+    if (crc)
+      state->crc = crc15_bit(state->crc, bit);
+
+    stuff_bit(state, bit);
+    }
+  }
+
+// serialize the SOF, arbitration and control fields
+static void send_header(stuff_state_t *state, uint16_t id, uint8_t len)
+  {
+  memset(state, 0, sizeof(stuff_state_t));
+  send_bits(state, 0, 1, true);                 // SOF
+  send_bits(state, id, 11, true);
+  send_bits(state, 0, 3, true);                 // RTR, IDE, r0
+  send_bits(state, len, 4, true);
+  }
+
+uint16_t can_frame_bits(const canmsg_t *msg)
+  {
+  uint8_t len = get_can_len(msg);
+  if (len > 8)
+    len = 8;
+
+  stuff_state_t state;
+  send_header(&state, get_can_id(msg), len);
+
+  for (uint8_t i = 0; i < len; i++)
+    send_bits(&state, msg->data[i], 8, true);
+
+  send_bits(&state, state.crc, 15, false);
+
+  return CAN_STUFFED_BITS(len) + state.stuffed + CAN_TRAILER_BITS;
+  }
+
+static inline uint8_t pack_state(const stuff_state_t *state)
+  {
+  return (state->last * 5) + (state->run - 1);
+  }
+
+static inline void unpack_state(uint8_t packed, stuff_state_t *state)
+  {
+  state->last = packed >= 5 ? 1 : 0;
+  state->run = (packed % 5) + 1;
+  }
+
+result_t busstats_init(busstats_t *stats, uint32_t bitrate)
+  {
+  if (stats == 0 || bitrate == 0)
+    return e_bad_parameter;
+
+  memset(stats, 0, sizeof(busstats_t));
+  stats->bitrate = bitrate;
+
+  for (uint16_t byte = 0; byte < 256; byte++)
+    {
+    uint16_t crc = 0;
+    for (int8_t bit = 7; bit >= 0; bit--)
+      crc = crc15_bit(crc, (byte >> bit) & 1);
+
+    stats->crc_table[byte] = crc;
+
+    // the stuffing of a byte depends only on the previous run
+    for (uint8_t packed = 0; packed < 10; packed++)
+      {
+      stuff_state_t state;
+      memset(&state, 0, sizeof(state));
+      unpack_state(packed, &state);
+      send_bits(&state, byte, 8, false);
+
+      stats->stuff_table[packed][byte] = pack_state(&state) | (state.stuffed << 4);
+      }
+    }
+
+  return s_ok;
+  }
+
+// cost a frame using the lookup tables
+static uint16_t frame_bits(busstats_t *stats, const canmsg_t *msg, uint16_t id, uint8_t len)
+  {
+  uint32_t header = stats->header_cache[id][len];
+  if ((header & HEADER_VALID) == 0)
+    {
+    stuff_state_t state;
+    send_header(&state, id, len);
+    header = HEADER_VALID | state.crc | (((uint32_t)pack_state(&state)) << 16) | (((uint32_t)state.stuffed) << 20);
+    stats->header_cache[id][len] = header;
+    }
+
+  uint16_t crc = (uint16_t)(header & 0x7FFF);
+  uint8_t packed = (header >> 16) & 0x0F;
+  uint16_t stuffed = (header >> 20) & 0x0F;
+
+  for (uint8_t i = 0; i < len; i++)
+    {
+    uint8_t byte = msg->data[i];
+    crc = ((crc << 8) ^ stats->crc_table[((crc >> 7) ^ byte) & 0xFF]) & 0x7FFF;
+
+    uint8_t entry = stats->stuff_table[packed][byte];
+    stuffed += entry >> 4;
+    packed = entry & 0x0F;
+    }
+
+  // the top 7 bits of the crc are sent a bit at a time, the rest as a byte
+  stuff_state_t state;
+  unpack_state(packed, &state);
+  state.stuffed = stuffed;
+  send_bits(&state, crc >> 8, 7, false);
+
+  uint8_t entry = stats->stuff_table[pack_state(&state)][crc & 0xFF];
+  stuffed = state.stuffed + (entry >> 4);
+
+  return CAN_STUFFED_BITS(len) + stuffed + CAN_TRAILER_BITS;
+  }
+
+result_t busstats_add(busstats_t *stats, const timed_canmsg_t *msgs, uint32_t count)
+  {
+  if (stats == 0 || msgs == 0)
+    return e_bad_parameter;
+
+  for (uint32_t i = 0; i < count; i++)
+    {
+    const timed_canmsg_t *msg = &msgs[i];
+    uint16_t id = get_can_id(&msg->msg);
+    uint8_t len = get_can_len(&msg->msg);
+    if (len > 8)
+      len = 8;
+
+    uint16_t bits = frame_bits(stats, &msg->msg, id, len);
+    uint16_t worst = CAN_WORST_FRAME_BITS(len);
+
+    if (stats->frames == 0 || msg->timestamp < stats->start)
+      stats->start = msg->timestamp;
+
+    if (msg->timestamp > stats->end)
+      stats->end = msg->timestamp;
+
+    stats->frames++;
+    stats->bits += bits;
+    stats->worst_bits += worst;
+
+    canfly_block block = get_canfly_block(id);
+    stats->block_frames[block]++;
+    stats->block_bits[block] += bits;
+
+    busstats_id_t *id_stats = &stats->ids[id];
+    if (id_stats->frames == 0)
+      id_stats->first_seen = msg->timestamp;
+    else if (msg->timestamp >= id_stats->last_seen)
+      {
+      uint64_t interval = msg->timestamp - id_stats->last_seen;
+      if (id_stats->min_interval == 0 || (interval > 0 && interval < id_stats->min_interval))
+        id_stats->min_interval = interval;
+      }
+
+    id_stats->last_seen = msg->timestamp;
+    id_stats->frames++;
+    id_stats->bits += bits;
+    id_stats->worst_bits += worst;
+    if (worst > id_stats->max_frame_bits)
+      id_stats->max_frame_bits = worst;
+    }
+
+  return s_ok;
+  }
+
+result_t busstats_utilization(const busstats_t *stats, float *actual, float *worst)
+  {
+  if (stats == 0 || actual == 0 || worst == 0)
+    return e_bad_parameter;
+
+  if (stats->end <= stats->start)
+    return e_more_data;
+
+  double capacity = ((double)(stats->end - stats->start)) * stats->bitrate / 1000000.0;
+  *actual = (float)(stats->bits * 100.0 / capacity);
+  *worst = (float)(stats->worst_bits * 100.0 / capacity);
+
+  return s_ok;
+  }
+
+result_t busstats_rate(const busstats_t *stats, uint16_t id, float *rate)
+  {
+  if (stats == 0 || rate == 0 || id > ID_MASK)
+    return e_bad_parameter;
+
+  if (stats->ids[id].frames == 0)
+    return e_not_found;
+
+  if (stats->end <= stats->start)
+    return e_more_data;
+
+  *rate = (float)(stats->ids[id].frames * 1000000.0 / (stats->end - stats->start));
+  return s_ok;
+  }
+
+// period used for an ID when projecting latency, microseconds
+static double id_period(const busstats_t *stats, uint16_t id)
+  {
+  const busstats_id_t *id_stats = &stats->ids[id];
+  if (id_stats->min_interval > 0)
+    return (double)id_stats->min_interval;
+
+  // only seen once, treat as sporadic over the whole capture
+  return stats->end > stats->start ? (double)(stats->end - stats->start) : 1000000.0;
+  }
+
+result_t busstats_latency(const busstats_t *stats, uint16_t id, uint32_t *latency)
+  {
+  if (stats == 0 || latency == 0 || id > ID_MASK)
+    return e_bad_parameter;
+
+  if (stats->ids[id].frames == 0)
+    return e_not_found;
+
+  double bit_time = 1000000.0 / stats->bitrate;
+  double frame_time = stats->ids[id].max_frame_bits * bit_time;
+
+  // blocking by the longest lower priority frame already on the bus
+  double blocking = 0;
+  for (uint16_t lp = id + 1; lp < NUM_CAN_IDS; lp++)
+    if (stats->ids[lp].frames > 0 && stats->ids[lp].max_frame_bits * bit_time > blocking)
+      blocking = stats->ids[lp].max_frame_bits * bit_time;
+
+  // busy period, iterated to a fixed point
+  double queued = blocking;
+  for (uint16_t iteration = 0; iteration < 1000; iteration++)
+    {
+    double next = blocking;
+    for (uint16_t hp = 0; hp < id; hp++)
+      {
+      const busstats_id_t *hp_stats = &stats->ids[hp];
+      if (hp_stats->frames == 0)
+        continue;
+
+      double period = id_period(stats, hp);
+      next += ((uint64_t)((queued + bit_time) / period) + 1) * (hp_stats->max_frame_bits * bit_time);
+      }
+
+    // cannot be sent within a second, the bus is saturated
+    if (next + frame_time > 1000000.0)
+      return e_overflow;
+
+    if (next <= queued)
+      {
+      *latency = (uint32_t)(queued + frame_time + 0.5);
+      return s_ok;
+      }
+
+    queued = next;
+    }
+
+  return e_overflow;
+  }
+
+static const char *block_names[num_canfly_blocks] = {
+  "other",
+  "alarm",
+  "edu",
+  "status"
+  };
+
+result_t busstats_report(const busstats_t *stats, FILE *fp)
+  {
+  if (stats == 0 || fp == 0)
+    return e_bad_parameter;
+
+  float actual = 0;
+  float worst = 0;
+  busstats_utilization(stats, &actual, &worst);
+
+  fprintf(fp, "Duration %.3f s, %llu frames, %llu bits at %u bit/s\n",
+          (stats->end - stats->start) / 1000000.0,
+          (unsigned long long)stats->frames,
+          (unsigned long long)stats->bits,
+          (unsigned)stats->bitrate);
+  fprintf(fp, "Utilization %.2f%% (worst case stuffing %.2f%%)\n\n", actual, worst);
+
+  fprintf(fp, "%-8s %12s %14s %8s\n", "block", "frames", "bits", "%bits");
+  for (uint16_t block = 0; block < num_canfly_blocks; block++)
+    fprintf(fp, "%-8s %12llu %14llu %8.2f\n", block_names[block],
+            (unsigned long long)stats->block_frames[block],
+            (unsigned long long)stats->block_bits[block],
+            stats->bits == 0 ? 0.0 : stats->block_bits[block] * 100.0 / stats->bits);
+
+  fprintf(fp, "\n%5s %-40s %12s %10s %8s %8s %12s\n", "id", "name", "frames", "rate/s", "bits", "%bus", "latency us");
+  for (uint16_t id = 0; id < NUM_CAN_IDS; id++)
+    {
+    const busstats_id_t *id_stats = &stats->ids[id];
+    if (id_stats->frames == 0)
+      continue;
+
+    const canfly_id_info_t *info = find_canfly_id(id);
+    float rate = 0;
+    busstats_rate(stats, id, &rate);
+
+    uint32_t latency;
+    char latency_str[16];
+    if (succeeded(busstats_latency(stats, id, &latency)))
+      snprintf(latency_str, sizeof(latency_str), "%u", (unsigned)latency);
+    else
+      strcpy(latency_str, "overload");
+
+    fprintf(fp, "%5u %-40s %12llu %10.2f %8.1f %8.3f %12s\n",
+            (unsigned)id,
+            info == 0 ? "" : info->name,
+            (unsigned long long)id_stats->frames,
+            rate,
+            (double)id_stats->bits / id_stats->frames,
+            actual * ((double)id_stats->bits / (stats->bits == 0 ? 1 : stats->bits)),
+            latency_str);
+    }
+
+  return s_ok;
+  }
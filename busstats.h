@@ -0,0 +1,146 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#ifndef __busstats_h__
+#define __busstats_h__
+
+#include "canlog.h"
+#include <stdio.h>
+
+/*************************************************
+ * Bus utilization analysis.
+ *
+ * A standard (11 bit) data frame is sent as
+ *  SOF(1) ID(11) RTR(1) IDE(1) r0(1) DLC(4) DATA(8n) CRC(15)
+ * which are subject to bit stuffing, followed by
+ *  CRC delimiter(1) ACK(2) EOF(7) IFS(3)
+ * which are not.  A stuff bit is inserted after 5 consecutive bits of
+ * the same polarity, so the stuffed length depends on the ID, the data
+ * and the CRC.
+ */
+#define CAN_STUFFED_BITS(len) (34 + ((len) << 3))
+#define CAN_TRAILER_BITS 13
+// worst case frame length for a data length (0..8)
+#define CAN_WORST_FRAME_BITS(len) (CAN_STUFFED_BITS(len) + CAN_TRAILER_BITS + ((CAN_STUFFED_BITS(len) - 1) >> 2))
+
+typedef struct _busstats_id_t {
+  uint64_t frames;              // frames received
+  uint64_t bits;                // on-wire bits including stuffing
+  uint64_t worst_bits;          // on-wire bits assuming worst case stuffing
+  uint64_t first_seen;          // timestamp of first frame
+  uint64_t last_seen;           // timestamp of last frame
+  uint64_t min_interval;        // shortest time between 2 frames
+  uint16_t max_frame_bits;      // longest worst-case frame seen
+  } busstats_id_t;
+
+typedef struct _busstats_t {
+  uint32_t bitrate;             // bits/second
+  uint64_t start;               // first timestamp
+  uint64_t end;                 // last timestamp
+  uint64_t frames;
+  uint64_t bits;
+  uint64_t worst_bits;
+  uint64_t block_frames[num_canfly_blocks];
+  uint64_t block_bits[num_canfly_blocks];
+  busstats_id_t ids[NUM_CAN_IDS];
+  // lookup tables used to cost a frame a byte at a time
+  uint16_t crc_table[256];
+  uint8_t stuff_table[10][256];
+  // crc and stuffing state after the header, by ID and length
+  uint32_t header_cache[NUM_CAN_IDS][9];
+  } busstats_t;
+
+/**
+ * @brief Calculate the on-wire length of a frame
+ * @param msg Message to cost
+ * @return number of bits including stuff bits and the inter-frame space
+ */
+extern uint16_t can_frame_bits(const canmsg_t *msg);
+/**
+ * @brief Initialize the statistics
+ * @param stats     Statistics to initialize
+ * @param bitrate   Bus bit rate in bits/second
+ * @return s_ok if initialized
+ */
+extern result_t busstats_init(busstats_t *stats, uint32_t bitrate);
+/**
+ * @brief Add a batch of messages to the statistics
+ * @param stats     Statistics
+ * @param msgs      Messages in timestamp order
+ * @param count     Number of messages
+ * @return s_ok if added
+ */
+extern result_t busstats_add(busstats_t *stats, const timed_canmsg_t *msgs, uint32_t count);
+/**
+ * @brief Return the bus utilization
+ * @param stats     Statistics
+ * @param actual    Percentage of the bus used by the frames as sent
+ * @param worst     Percentage of the bus used assuming worst case stuffing
+ * @return s_ok if calculated, e_more_data if no time has elapsed
+ */
+extern result_t busstats_utilization(const busstats_t *stats, float *actual, float *worst);
+/**
+ * @brief Return the average rate an ID is received at
+ * @param stats     Statistics
+ * @param id        CanFly ID
+ * @param rate      Frames per second
+ * @return s_ok if calculated, e_not_found if the ID was not received
+ */
+extern result_t busstats_rate(const busstats_t *stats, uint16_t id, float *rate);
+/**
+ * @brief Project the worst case latency of an ID
+ * @param stats     Statistics
+ * @param id        CanFly ID
+ * @param latency   Worst case time from queuing to reception, microseconds
+ * @return s_ok if calculated, e_not_found if the ID was not received,
+ * e_overflow if the bus is overloaded at this priority
+ * @remark The period of each ID is taken as the shortest interval seen.
+ * The latency is the classic CAN response time: the blocking of one
+ * lower priority frame plus the interference from all higher priority
+ * frames plus the transmission time of the frame.
+ */
+extern result_t busstats_latency(const busstats_t *stats, uint16_t id, uint32_t *latency);
+/**
+ * @brief Write a report of the statistics
+ * @param stats     Statistics
+ * @param fp        Stream to write to
+ * @return s_ok if written
+ */
+extern result_t busstats_report(const busstats_t *stats, FILE *fp);
+
+#endif
@@ -0,0 +1,450 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#include "canawait.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define NO_HEAP_INDEX UINT32_MAX
+
+struct _canawait_t {
+  uint64_t now;
+  uint32_t max_tasks;
+  uint32_t num_tasks;
+  uint32_t heap_size;
+  cotask_t **heap;              // tasks with a timeout, earliest first
+  cotask_t *ready_head;         // tasks to resume, in the order their waits ended
+  cotask_t *ready_tail;
+  cowait_t *heads[NUM_CAN_IDS];
+  cowait_t *tails[NUM_CAN_IDS];
+  };
+
+static void heap_swap(canawait_t *loop, uint32_t a, uint32_t b)
+  {
+  cotask_t *t = loop->heap[a];
+  loop->heap[a] = loop->heap[b];
+  loop->heap[b] = t;
+  loop->heap[a]->heap_index = a;
+  loop->heap[b]->heap_index = b;
+  }
+
+static void heap_up(canawait_t *loop, uint32_t i)
+  {
+  while (i > 0)
+    {
+    uint32_t parent = (i - 1) / 2;
+    if (loop->heap[parent]->deadline <= loop->heap[i]->deadline)
+      break;
+
+    heap_swap(loop, i, parent);
+    i = parent;
+    }
+  }
+
+static void heap_down(canawait_t *loop, uint32_t i)
+  {
+  for (;;)
+    {
+    uint32_t least = i;
+    uint32_t left = (i * 2) + 1;
+    uint32_t right = left + 1;
+    if (left < loop->heap_size && loop->heap[left]->deadline < loop->heap[least]->deadline)
+      least = left;
+    if (right < loop->heap_size && loop->heap[right]->deadline < loop->heap[least]->deadline)
+      least = right;
+    if (least == i)
+      break;
+
+    heap_swap(loop, i, least);
+    i = least;
+    }
+  }
+
+static void heap_remove(canawait_t *loop, cotask_t *task)
+  {
+  uint32_t i = task->heap_index;
+  if (i == NO_HEAP_INDEX)
+    return;
+
+  task->heap_index = NO_HEAP_INDEX;
+  if (i != --loop->heap_size)
+    {
+    loop->heap[i] = loop->heap[loop->heap_size];
+    loop->heap[i]->heap_index = i;
+    heap_up(loop, i);
+    heap_down(loop, loop->heap[i]->heap_index);
+    }
+  }
+
+static void unlink_wait(canawait_t *loop, cowait_t *wait)
+  {
+  if (!wait->linked)
+    return;
+
+  if (wait->prev != 0)
+    wait->prev->next = wait->next;
+  else
+    loop->heads[wait->id] = wait->next;
+
+  if (wait->next != 0)
+    wait->next->prev = wait->prev;
+  else
+    loop->tails[wait->id] = wait->prev;
+
+  wait->linked = false;
+  }
+
+// end the wait of a task and queue it to resume
+static void finish_wait(canawait_t *loop, cotask_t *task, result_t result)
+  {
+  for (uint8_t i = 0; i < task->num_waits; i++)
+    unlink_wait(loop, &task->waits[i]);
+
+  heap_remove(loop, task);
+  task->num_waits = 0;
+  task->pending = 0;
+  task->result = result;
+
+  task->next_ready = 0;
+  if (loop->ready_tail != 0)
+    loop->ready_tail->next_ready = task;
+  else
+    loop->ready_head = task;
+  loop->ready_tail = task;
+  }
+
+static void resume(canawait_t *loop, cotask_t *task)
+  {
+  if (task->fn(task) == co_done)
+    {
+    // a task that ends while still waiting gives up the wait
+    for (uint8_t i = 0; i < task->num_waits; i++)
+      unlink_wait(loop, &task->waits[i]);
+
+    heap_remove(loop, task);
+    task->num_waits = 0;
+    task->loop = 0;
+    loop->num_tasks--;
+    }
+  }
+
+static void run_ready(canawait_t *loop)
+  {
+  cotask_t *task;
+  while ((task = loop->ready_head) != 0)
+    {
+    loop->ready_head = task->next_ready;
+    if (loop->ready_head == 0)
+      loop->ready_tail = 0;
+
+    resume(loop, task);
+    }
+  }
+
+static void expire(canawait_t *loop)
+  {
+  while (loop->heap_size > 0 && loop->heap[0]->deadline <= loop->now)
+    finish_wait(loop, loop->heap[0], e_timeout_error);
+
+  run_ready(loop);
+  }
+
+static void deliver(canawait_t *loop, uint64_t timestamp, const canmsg_t *msg)
+  {
+  uint16_t id = get_can_id(msg);
+  cowait_t *next;
+  for (cowait_t *wait = loop->heads[id]; wait != 0; wait = next)
+    {
+    next = wait->next;
+    if (wait->predicate != 0 && !wait->predicate(msg, wait->arg))
+      continue;
+
+    cotask_t *task = wait->task;
+    unlink_wait(loop, wait);
+    task->msgs[wait->slot].timestamp = timestamp;
+    task->msgs[wait->slot].msg = *msg;
+    task->received |= (uint8_t)(1 << wait->slot);
+    if (--task->pending == 0)
+      finish_wait(loop, task, s_ok);
+    }
+
+  // resume now so a task waiting for the next value sees the rest of the batch
+  run_ready(loop);
+  }
+
+result_t canawait_create(uint32_t max_tasks, canawait_t **loop)
+  {
+  if (max_tasks == 0 || loop == 0)
+    return e_bad_parameter;
+
+  canawait_t *lp = (canawait_t *)calloc(1, sizeof(canawait_t));
+  if (lp == 0)
+    return e_not_enough_memory;
+
+  if ((lp->heap = (cotask_t **)malloc(sizeof(cotask_t *) * max_tasks)) == 0)
+    {
+    free(lp);
+    return e_not_enough_memory;
+    }
+
+  lp->max_tasks = max_tasks;
+  *loop = lp;
+  return s_ok;
+  }
+
+result_t canawait_start(canawait_t *loop, cotask_t *task, cotask_fn fn, void *arg, uint64_t now)
+  {
+  if (loop == 0 || task == 0 || fn == 0 || task->loop != 0)
+    return e_bad_parameter;
+
+  if (loop->num_tasks == loop->max_tasks)
+    return e_no_space;
+
+  memset(task, 0, sizeof(cotask_t));
+  task->fn = fn;
+  task->arg = arg;
+  task->result = s_ok;
+  task->loop = loop;
+  task->heap_index = NO_HEAP_INDEX;
+  loop->num_tasks++;
+
+  // the loop may have been idle since the last dispatch, so the
+  // timeouts of the waits the task makes are from the time given
+  loop->now = now;
+  resume(loop, task);
+  return s_ok;
+  }
+
+result_t canawait_cancel(cotask_t *task)
+  {
+  if (task == 0)
+    return e_bad_parameter;
+
+  canawait_t *loop = task->loop;
+  if (loop == 0)
+    return s_false;
+
+  for (uint8_t i = 0; i < task->num_waits; i++)
+    unlink_wait(loop, &task->waits[i]);
+
+  heap_remove(loop, task);
+  task->num_waits = 0;
+
+  // a task whose wait has ended may be queued to resume
+  cotask_t *prev = 0;
+  for (cotask_t *ready = loop->ready_head; ready != 0; prev = ready, ready = ready->next_ready)
+    {
+    if (ready != task)
+      continue;
+
+    if (prev != 0)
+      prev->next_ready = task->next_ready;
+    else
+      loop->ready_head = task->next_ready;
+    if (loop->ready_tail == task)
+      loop->ready_tail = prev;
+    break;
+    }
+
+  task->loop = 0;
+  loop->num_tasks--;
+  return s_ok;
+  }
+
+result_t canawait_dispatch(canawait_t *loop, const timed_canmsg_t *msgs, uint32_t count, uint64_t now)
+  {
+  if (loop == 0 || (msgs == 0 && count > 0))
+    return e_bad_parameter;
+
+  loop->now = now;
+  expire(loop);
+
+  for (uint32_t i = 0; i < count; i++)
+    {
+    const canmsg_t *msg = &msgs[i].msg;
+    if (get_can_len(msg) > 0 && msg->data[0] == CANFLY_PACKED_UINT16)
+      {
+      canmsg_t expanded[PACKED_UINT16_MAX];
+      uint16_t num_expanded;
+      if (succeeded(expand_packed_msg(msg, expanded, &num_expanded)))
+        for (uint16_t j = 0; j < num_expanded; j++)
+          deliver(loop, msgs[i].timestamp, &expanded[j]);
+      }
+    else
+      deliver(loop, msgs[i].timestamp, msg);
+    }
+
+  return s_ok;
+  }
+
+result_t canawait_expire(canawait_t *loop, uint64_t now, uint64_t *next)
+  {
+  if (loop == 0)
+    return e_bad_parameter;
+
+  loop->now = now;
+  expire(loop);
+
+  if (next != 0)
+    *next = loop->heap_size > 0 ? loop->heap[0]->deadline : UINT64_MAX;
+
+  return s_ok;
+  }
+
+uint32_t canawait_running(canawait_t *loop)
+  {
+  return loop == 0 ? 0 : loop->num_tasks;
+  }
+
+result_t canawait_close(canawait_t *loop)
+  {
+  if (loop == 0)
+    return e_bad_parameter;
+
+  free(loop->heap);
+  free(loop);
+  return s_ok;
+  }
+
+// reset the wait state of a task before it waits
+static result_t begin_wait(cotask_t *task)
+  {
+  if (task == 0 || task->loop == 0 || task->num_waits != 0)
+    return e_invalid_operation;
+
+  task->received = 0;
+  task->pending = 0;
+  return s_ok;
+  }
+
+static void add_wait(cotask_t *task, uint16_t id, canawait_predicate predicate, void *arg)
+  {
+  canawait_t *loop = task->loop;
+  cowait_t *wait = &task->waits[task->num_waits];
+  wait->task = task;
+  wait->predicate = predicate;
+  wait->arg = arg;
+  wait->id = id;
+  wait->slot = task->num_waits++;
+  wait->linked = true;
+
+  // waiters on an id are resumed in the order they began waiting
+  wait->next = 0;
+  wait->prev = loop->tails[id];
+  if (wait->prev != 0)
+    wait->prev->next = wait;
+  else
+    loop->heads[id] = wait;
+  loop->tails[id] = wait;
+
+  task->pending++;
+  }
+
+static void set_timeout(cotask_t *task, uint32_t timeout)
+  {
+  if (timeout == CANAWAIT_FOREVER)
+    return;
+
+  canawait_t *loop = task->loop;
+  task->deadline = loop->now + timeout;
+  task->heap_index = loop->heap_size;
+  loop->heap[loop->heap_size++] = task;
+  heap_up(loop, task->heap_index);
+  }
+
+result_t canawait_next(cotask_t *task, uint16_t id, uint32_t timeout)
+  {
+  return canawait_when(task, id, 0, 0, timeout);
+  }
+
+result_t canawait_when(cotask_t *task, uint16_t id, canawait_predicate predicate, void *arg, uint32_t timeout)
+  {
+  result_t result;
+  if (failed(result = begin_wait(task)))
+    return result;
+
+  if (id >= NUM_CAN_IDS)
+    return e_bad_parameter;
+
+  add_wait(task, id, predicate, arg);
+  set_timeout(task, timeout);
+  return s_ok;
+  }
+
+result_t canawait_all(cotask_t *task, const uint16_t *ids, uint16_t count, uint32_t timeout)
+  {
+  result_t result;
+  if (failed(result = begin_wait(task)))
+    return result;
+
+  if (ids == 0 || count == 0 || count > CANAWAIT_MAX_IDS)
+    return e_bad_parameter;
+
+  for (uint16_t i = 0; i < count; i++)
+    if (ids[i] >= NUM_CAN_IDS)
+      return e_bad_parameter;
+
+  for (uint16_t i = 0; i < count; i++)
+    add_wait(task, ids[i], 0, 0);
+
+  set_timeout(task, timeout);
+  return s_ok;
+  }
+
+result_t canawait_sleep(cotask_t *task, uint32_t timeout)
+  {
+  result_t result;
+  if (failed(result = begin_wait(task)))
+    return result;
+
+  if (timeout == CANAWAIT_FOREVER)
+    return e_bad_parameter;
+
+  set_timeout(task, timeout);
+  return s_ok;
+  }
+
+bool canawait_equals(const canmsg_t *msg, void *arg)
+  {
+  variant_t value;
+  if (arg == 0 || failed(msg_to_variant(msg, &value)))
+    return false;
+
+  return compare_variant(&value, (const variant_t *)arg) == 0;
+  }
@@ -0,0 +1,240 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#ifndef __canawait_h__
+#define __canawait_h__
+
+#include "canlog.h"
+
+/*************************************************
+ * Tasks that wait for parameters.
+ *
+ * A task is a function that is entered again each time it resumes.  The
+ * CO_ macros make its body a switch on the line it last waited at, in
+ * the manner of protothreads, so a waiting task costs no stack and
+ * resuming it is a call and a jump.  Locals do not survive a wait, state
+ * that must is kept in the structure the task is embedded in.
+ *
+ *  static costate wait_for_edu(cotask_t *task)
+ *    {
+ *    edu_check_t *check = (edu_check_t *)task->arg;
+ *    CO_BEGIN(task);
+ *    CO_WHEN(task, id_edu_valid, canawait_equals, &check->valid, 500000);
+ *    if (failed(task->result))
+ *      return co_done;           // no valid EDU within 500 ms
+ *
+ *    for (check->samples = 0; check->samples < 10; check->samples++)
+ *      {
+ *      CO_NEXT(task, id_engine_rpm, CANAWAIT_FOREVER);
+ *      ... task->msgs[0] is the next engine rpm
+ *      }
+ *    CO_END(task);
+ *    }
+ *
+ * After each wait task->result is s_ok, or e_timeout_error when the
+ * timeout passed first.  task->msgs holds the messages that ended the
+ * wait in the order the ids were given, and task->received has a bit
+ * set for each that arrived.
+ *
+ * The tasks waiting for an id are kept on a list for that id, so a
+ * message only visits the tasks that wait for it.  Timeouts are kept in
+ * a heap.  Everything runs on the thread that calls canawait_dispatch,
+ * canawait_expire and canawait_start, tasks are resumed in the order
+ * their waits were satisfied.
+ */
+
+// ids one task can wait for at once
+#define CANAWAIT_MAX_IDS 8
+#define CANAWAIT_FOREVER UINT32_MAX
+
+typedef enum _costate {
+  co_waiting,
+  co_done,
+  } costate;
+
+typedef struct _cotask_t cotask_t;
+typedef struct _canawait_t canawait_t;
+
+typedef costate (*cotask_fn)(cotask_t *task);
+typedef bool (*canawait_predicate)(const canmsg_t *msg, void *arg);
+
+typedef struct _cowait_t {
+  cotask_t *task;
+  struct _cowait_t *next;
+  struct _cowait_t *prev;
+  canawait_predicate predicate;
+  void *arg;
+  uint16_t id;
+  uint8_t slot;                 // index into the msgs of the task
+  bool linked;
+  } cowait_t;
+
+struct _cotask_t {
+  cotask_fn fn;
+  void *arg;                    // for the task
+  uint16_t line;                // where to resume, 0 to start
+  result_t result;              // of the last wait
+  uint8_t received;             // bit set for each message that arrived
+  timed_canmsg_t msgs[CANAWAIT_MAX_IDS];
+  // owned by the loop
+  canawait_t *loop;
+  cowait_t waits[CANAWAIT_MAX_IDS];
+  uint8_t num_waits;
+  uint8_t pending;              // waits not yet satisfied
+  uint32_t heap_index;          // position in the timeout heap, UINT32_MAX if none
+  uint64_t deadline;
+  cotask_t *next_ready;
+  };
+
+#define CO_BEGIN(task) switch ((task)->line) { case 0:
+#define CO_END(task) } (task)->line = 0; return co_done
+// wait with setup, falling straight through if the wait cannot be made
+#define CO_WAIT(task, setup)                            \
+  do {                                                  \
+    (task)->line = __LINE__;                            \
+    if (succeeded((task)->result = (setup)))            \
+      return co_waiting;                                \
+    case __LINE__:;                                     \
+  } while (0)
+
+#define CO_NEXT(task, id, timeout) CO_WAIT(task, canawait_next(task, id, timeout))
+#define CO_WHEN(task, id, predicate, arg, timeout) CO_WAIT(task, canawait_when(task, id, predicate, arg, timeout))
+#define CO_ALL(task, ids, count, timeout) CO_WAIT(task, canawait_all(task, ids, count, timeout))
+#define CO_SLEEP(task, timeout) CO_WAIT(task, canawait_sleep(task, timeout))
+#define CO_YIELD(task) CO_SLEEP(task, 0)
+
+/**
+ * @brief Create a loop
+ * @param max_tasks Most tasks that can be running at once
+ * @param loop      Created loop
+ * @return s_ok if created
+ */
+extern result_t canawait_create(uint32_t max_tasks, canawait_t **loop);
+/**
+ * @brief Start a task, running it until it first waits
+ * @param loop  Loop
+ * @param task  Task, owned by the caller and left alone once it is done
+ * @param fn    Body of the task
+ * @param arg   Passed in task->arg
+ * @param now   Current time, microseconds, the timeout of the first
+ *              wait runs from it
+ * @return s_ok if started, e_no_space if max_tasks are running
+ */
+extern result_t canawait_start(canawait_t *loop, cotask_t *task, cotask_fn fn, void *arg, uint64_t now);
+/**
+ * @brief Stop a task without resuming it
+ * @param task  Task to stop
+ * @return s_ok if stopped, s_false if it was not running
+ */
+extern result_t canawait_cancel(cotask_t *task);
+/**
+ * @brief Resume the tasks waiting for the messages, packed messages are
+ * expanded
+ * @param loop  Loop
+ * @param msgs  Messages
+ * @param count Number of messages
+ * @param now   Current time, microseconds, timeouts expire first
+ * @return s_ok
+ */
+extern result_t canawait_dispatch(canawait_t *loop, const timed_canmsg_t *msgs, uint32_t count, uint64_t now);
+/**
+ * @brief Resume the tasks whose timeouts have passed
+ * @param loop  Loop
+ * @param now   Current time, microseconds
+ * @param next  Optional, time of the next timeout, UINT64_MAX if none
+ * @return s_ok
+ */
+extern result_t canawait_expire(canawait_t *loop, uint64_t now, uint64_t *next);
+/**
+ * @brief Return the number of tasks running
+ * @param loop  Loop
+ * @return tasks that have not finished
+ */
+extern uint32_t canawait_running(canawait_t *loop);
+/**
+ * @brief Close a loop, tasks still waiting are dropped
+ * @param loop  Loop to close
+ * @return s_ok if closed
+ */
+extern result_t canawait_close(canawait_t *loop);
+
+/**
+ * @brief Wait for the next message with an id, use CO_NEXT
+ * @param task    Running task
+ * @param id      Id to wait for
+ * @param timeout Microseconds, or CANAWAIT_FOREVER
+ * @return s_ok if waiting
+ */
+extern result_t canawait_next(cotask_t *task, uint16_t id, uint32_t timeout);
+/**
+ * @brief Wait for the next message with an id that is accepted by a
+ * predicate, use CO_WHEN
+ * @param task      Running task
+ * @param id        Id to wait for
+ * @param predicate Called for each message with the id
+ * @param arg       Passed to the predicate
+ * @param timeout   Microseconds, or CANAWAIT_FOREVER
+ * @return s_ok if waiting
+ */
+extern result_t canawait_when(cotask_t *task, uint16_t id, canawait_predicate predicate, void *arg, uint32_t timeout);
+/**
+ * @brief Wait for the next message of each id, use CO_ALL
+ * @param task    Running task
+ * @param ids     Ids to wait for
+ * @param count   Number of ids, up to CANAWAIT_MAX_IDS
+ * @param timeout Microseconds, or CANAWAIT_FOREVER
+ * @return s_ok if waiting
+ */
+extern result_t canawait_all(cotask_t *task, const uint16_t *ids, uint16_t count, uint32_t timeout);
+/**
+ * @brief Wait for a time, use CO_SLEEP
+ * @param task    Running task
+ * @param timeout Microseconds
+ * @return s_ok if waiting
+ * @remark The task resumes with e_timeout_error
+ */
+extern result_t canawait_sleep(cotask_t *task, uint32_t timeout);
+/**
+ * @brief Predicate that accepts a message equal to a value
+ * @param msg Message
+ * @param arg const variant_t * to compare with
+ * @return true if the value of the message compares equal
+ */
+extern bool canawait_equals(const canmsg_t *msg, void *arg);
+
+#endif
@@ -0,0 +1,242 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#include "cancoalesce.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define VALUE_WORDS ((sizeof(timed_canmsg_t) + 7) / 8)
+
+// the value is copied a word at a time with relaxed atomics, so a read
+// that races the producer is retried rather than undefined
+typedef struct _coalesce_slot_t {
+  uint32_t seq;                 // odd while the producer writes the slot
+  uint32_t pending;             // 1 while the ID is in the changed ring
+  uint64_t value[VALUE_WORDS];  // timed_canmsg_t
+  } coalesce_slot_t;
+
+struct _cancoalesce_t {
+  uint64_t never[NUM_CAN_IDS / 64];
+  // written by the producer
+  uint32_t head;                // next entry of the changed ring
+  uint8_t pad1[60];
+  // written by the consumer
+  uint32_t tail;                // next changed entry to drain
+  uint8_t pad2[60];
+  cancoalesce_stats_t producer; // values, coalesced, events and overflowed
+  uint64_t drained;
+  canqueue_t events;
+  timed_canmsg_t *event_storage;
+  uint32_t delivered[NUM_CAN_IDS];  // sequence of the value last drained, consumer only
+  uint16_t changed[NUM_CAN_IDS];    // ring of IDs, each at most once
+  coalesce_slot_t slots[NUM_CAN_IDS];
+  };
+
+// counters are only written by one side, the other may read them at any time
+static inline void add_one(uint64_t *counter)
+  {
+  __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+  }
+
+result_t cancoalesce_create(const cancoalesce_options_t *options, cancoalesce_t **queue)
+  {
+  if (options == 0 || queue == 0)
+    return e_bad_parameter;
+
+  cancoalesce_t *qp = (cancoalesce_t *)calloc(1, sizeof(cancoalesce_t));
+  if (qp == 0)
+    return e_not_enough_memory;
+
+  if ((qp->event_storage = (timed_canmsg_t *)malloc(sizeof(timed_canmsg_t) * options->events)) == 0)
+    {
+    free(qp);
+    return e_not_enough_memory;
+    }
+
+  result_t result;
+  if (failed(result = canqueue_init(&qp->events, qp->event_storage, options->events)))
+    {
+    free(qp->event_storage);
+    free(qp);
+    return result;
+    }
+
+  memcpy(qp->never, options->never, sizeof(qp->never));
+  *queue = qp;
+  return s_ok;
+  }
+
+static void push_one(cancoalesce_t *queue, const timed_canmsg_t *msg)
+  {
+  uint16_t id = get_can_id(&msg->msg);
+  coalesce_slot_t *slot = &queue->slots[id];
+  add_one(&queue->producer.values);
+
+  // while an overflowed value is pending, later ones join it so the order holds
+  if ((queue->never[id >> 6] & (1ULL << (id & 63))) != 0 &&
+      __atomic_load_n(&slot->pending, __ATOMIC_ACQUIRE) == 0)
+    {
+    uint32_t n = 1;
+    if (succeeded(canqueue_push(&queue->events, msg, &n)))
+      {
+      add_one(&queue->producer.events);
+      return;
+      }
+
+    add_one(&queue->producer.overflowed);
+    }
+
+  uint64_t value[VALUE_WORDS] = { 0 };
+  memcpy(value, msg, sizeof(timed_canmsg_t));
+
+  uint32_t seq = slot->seq;
+  __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  for (uint16_t i = 0; i < VALUE_WORDS; i++)
+    __atomic_store_n(&slot->value[i], value[i], __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+
+  // the exchange pairs with the one in drain, so a value written before
+  // the ID was found pending is seen by that drain
+  if (__atomic_exchange_n(&slot->pending, 1, __ATOMIC_ACQ_REL) != 0)
+    {
+    add_one(&queue->producer.coalesced);
+    return;
+    }
+
+  queue->changed[queue->head & (NUM_CAN_IDS - 1)] = id;
+  __atomic_store_n(&queue->head, queue->head + 1, __ATOMIC_RELEASE);
+  }
+
+result_t cancoalesce_push(cancoalesce_t *queue, const timed_canmsg_t *msgs, uint32_t count)
+  {
+  if (queue == 0 || (msgs == 0 && count > 0))
+    return e_bad_parameter;
+
+  for (uint32_t i = 0; i < count; i++)
+    {
+    const canmsg_t *msg = &msgs[i].msg;
+    if (get_can_len(msg) > 0 && msg->data[0] == CANFLY_PACKED_UINT16)
+      {
+      canmsg_t expanded[PACKED_UINT16_MAX];
+      uint16_t num_expanded;
+      if (succeeded(expand_packed_msg(msg, expanded, &num_expanded)))
+        for (uint16_t j = 0; j < num_expanded; j++)
+          {
+          timed_canmsg_t value = { msgs[i].timestamp, expanded[j] };
+          push_one(queue, &value);
+          }
+      }
+    else
+      push_one(queue, &msgs[i]);
+    }
+
+  return s_ok;
+  }
+
+result_t cancoalesce_drain(cancoalesce_t *queue, timed_canmsg_t *msgs, uint32_t *count)
+  {
+  if (queue == 0 || msgs == 0 || count == 0)
+    return e_bad_parameter;
+
+  uint32_t n = *count;
+  if (failed(canqueue_pop(&queue->events, msgs, &n)))
+    n = 0;
+
+  uint32_t tail = queue->tail;
+  uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+  while (n < *count && tail != head)
+    {
+    uint16_t id = queue->changed[tail & (NUM_CAN_IDS - 1)];
+    __atomic_store_n(&queue->tail, ++tail, __ATOMIC_RELEASE);
+
+    // clear pending before reading, a value written after this queues the ID again
+    coalesce_slot_t *slot = &queue->slots[id];
+    __atomic_exchange_n(&slot->pending, 0, __ATOMIC_ACQ_REL);
+
+    uint32_t seq;
+    uint64_t value[VALUE_WORDS];
+    for (;;)
+      {
+      seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+      if (seq & 1)
+        continue;
+
+      for (uint16_t i = 0; i < VALUE_WORDS; i++)
+        value[i] = __atomic_load_n(&slot->value[i], __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+        break;
+      }
+
+    // a value already returned when the ID was queued again is not repeated
+    if (seq == queue->delivered[id])
+      continue;
+
+    queue->delivered[id] = seq;
+    memcpy(&msgs[n++], value, sizeof(timed_canmsg_t));
+    }
+
+  __atomic_store_n(&queue->drained, queue->drained + n, __ATOMIC_RELAXED);
+  *count = n;
+  return n == 0 ? e_no_more_information : s_ok;
+  }
+
+result_t cancoalesce_stats(cancoalesce_t *queue, cancoalesce_stats_t *stats)
+  {
+  if (queue == 0 || stats == 0)
+    return e_bad_parameter;
+
+  stats->values = __atomic_load_n(&queue->producer.values, __ATOMIC_RELAXED);
+  stats->coalesced = __atomic_load_n(&queue->producer.coalesced, __ATOMIC_RELAXED);
+  stats->events = __atomic_load_n(&queue->producer.events, __ATOMIC_RELAXED);
+  stats->overflowed = __atomic_load_n(&queue->producer.overflowed, __ATOMIC_RELAXED);
+  stats->drained = __atomic_load_n(&queue->drained, __ATOMIC_RELAXED);
+  return s_ok;
+  }
+
+result_t cancoalesce_close(cancoalesce_t *queue)
+  {
+  if (queue == 0)
+    return e_bad_parameter;
+
+  free(queue->event_storage);
+  free(queue);
+  return s_ok;
+  }
@@ -0,0 +1,127 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#ifndef __cancoalesce_h__
+#define __cancoalesce_h__
+
+#include "canqueue.h"
+
+/*************************************************
+ * Latest value queue for a slow consumer.
+ *
+ * The queue holds one slot for each ID.  A value for an ID that has not
+ * been drained yet overwrites it in place, so a consumer that falls
+ * behind sees the latest value of each ID that changed rather than
+ * every frame, and memory is fixed by the number of IDs.
+ *
+ * The IDs that changed are kept in a ring, each ID at most once, so a
+ * drain visits only those and takes time in proportion to the number
+ * it returns.  IDs marked never coalesce, such as alarms and node
+ * status, have every value queued in order and returned before the
+ * changed IDs.  Should that queue fill, the value is coalesced into
+ * the slot, as are later values of the ID until it is drained, so the
+ * latest value still arrives after the ones queued before it.
+ *
+ * One producer and one consumer, which may be different threads.  No
+ * locks are taken, slots are read under a sequence lock.
+ */
+typedef struct _cancoalesce_options_t {
+  uint32_t events;              // never coalesced values queued, a power of 2
+  uint64_t never[NUM_CAN_IDS / 64];  // IDs whose every value is queued
+  } cancoalesce_options_t;
+
+typedef struct _cancoalesce_stats_t {
+  uint64_t values;              // values pushed, after packed messages are expanded
+  uint64_t coalesced;           // values that replaced one not yet drained
+  uint64_t events;              // never coalesced values queued
+  uint64_t overflowed;          // never coalesced values coalesced as the queue was full
+  uint64_t drained;             // values returned to the consumer
+  } cancoalesce_stats_t;
+
+typedef struct _cancoalesce_t cancoalesce_t;
+
+/**
+ * @brief Mark a range of IDs as never coalesced
+ * @param options Options to update
+ * @param first   First ID, e.g. id_low_oil_pressure_alarm or id_status_node_0
+ * @param last    Last ID, inclusive
+ */
+static inline void cancoalesce_never(cancoalesce_options_t *options, uint16_t first, uint16_t last)
+  {
+  for (uint32_t id = first; id <= last && id < NUM_CAN_IDS; id++)
+    options->never[id >> 6] |= 1ULL << (id & 63);
+  }
+
+/**
+ * @brief Create a queue
+ * @param options Never coalesced IDs and how many of their values to queue
+ * @param queue   Created queue
+ * @return s_ok if created
+ */
+extern result_t cancoalesce_create(const cancoalesce_options_t *options, cancoalesce_t **queue);
+/**
+ * @brief Add messages, from the producer
+ * @param queue   Queue
+ * @param msgs    Messages, packed messages are expanded
+ * @param count   Number of messages
+ * @return s_ok, the producer never waits
+ */
+extern result_t cancoalesce_push(cancoalesce_t *queue, const timed_canmsg_t *msgs, uint32_t count);
+/**
+ * @brief Take the queued and changed values, from the consumer
+ * @param queue   Queue
+ * @param msgs    Buffer for the values
+ * @param count   On entry the size of the buffer, on exit the number taken
+ * @return s_ok if values were taken, e_no_more_information if nothing has changed
+ */
+extern result_t cancoalesce_drain(cancoalesce_t *queue, timed_canmsg_t *msgs, uint32_t *count);
+/**
+ * @brief Return the statistics of a queue
+ * @param queue   Queue
+ * @param stats   Statistics
+ * @return s_ok
+ */
+extern result_t cancoalesce_stats(cancoalesce_t *queue, cancoalesce_stats_t *stats);
+/**
+ * @brief Release a queue
+ * @param queue   Queue to release
+ * @return s_ok if released
+ */
+extern result_t cancoalesce_close(cancoalesce_t *queue);
+
+#endif
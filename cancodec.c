@@ -0,0 +1,470 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#include "cancodec.h"
+#include "canendian.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// tag byte of a message
+#define TAG_ID 0x01             // the ID is the one predicted
+#define TAG_FLAGS 0x02          // the flags follow
+#define TAG_TIME_SHIFT 2
+#define TAG_TIME_MASK 0x1C
+#define TAG_DATA_SHIFT 5
+#define TAG_DATA_MASK 0x60
+#define TAG_RESERVED 0x80
+
+// how the timestamp is sent
+#define TIME_PREDICTED 0
+#define TIME_INT8 1
+#define TIME_INT16 2
+#define TIME_INT32 3
+#define TIME_ABSOLUTE 4
+
+// how the data is sent
+#define DATA_SAME 0
+#define DATA_SAME_MASK 1
+#define DATA_NEW_MASK 2
+
+#define NO_ID 0xFFFF
+
+// bytes, bits kept and sign extension shift of each way of sending the time
+static const uint8_t time_length[8] = { 0, 1, 2, 4, 8, 0, 0, 0 };
+static const uint64_t time_bits[8] = { 0, 0xFF, 0xFFFF, 0xFFFFFFFF, UINT64_MAX, 0, 0, 0 };
+static const uint8_t time_shift[8] = { 0, 56, 48, 32, 0, 0, 0, 0 };
+
+// bit n set for each non zero byte n
+static inline uint8_t byte_mask(uint64_t value)
+  {
+  value |= value >> 4;
+  value |= value >> 2;
+  value |= value >> 1;
+  value &= 0x0101010101010101ULL;
+  return (uint8_t)((value * 0x0102040810204080ULL) >> 56);
+  }
+
+// the state of an ID, set up the first time it is seen in a block
+static inline cancodec_id_t *get_id(cancodec_t *codec, uint16_t id, uint64_t timestamp)
+  {
+  cancodec_id_t *state = &codec->ids[id];
+  uint64_t bit = 1ULL << (id & 63);
+  if ((codec->seen[id >> 6] & bit) == 0)
+    {
+    codec->seen[id >> 6] |= bit;
+
+    // the type byte of a message is its declared type
+    const canfly_id_info_t *info = find_canfly_id(id);
+    state->data = info != 0 && info->type < CANFLY_BINARY ? info->type : 0;
+    state->timestamp = timestamp;
+    state->period = 0;
+    state->flags = id;
+    state->next = NO_ID;
+    state->mask = 0;
+    }
+
+  return state;
+  }
+
+static inline void update_time(cancodec_id_t *state, uint64_t timestamp, bool first)
+  {
+  state->period = first ? 0 : (uint32_t)(timestamp - state->timestamp);
+  state->timestamp = timestamp;
+  }
+
+result_t cancodec_encode(cancodec_t *codec, const timed_canmsg_t *msgs, uint32_t count, uint8_t *buffer, uint32_t size, uint32_t *length)
+  {
+  if (codec == 0 || (msgs == 0 && count > 0) || buffer == 0 || length == 0)
+    return e_bad_parameter;
+
+  if (size < CANCODEC_BLOCK_HEADER_SIZE)
+    return e_buffer_too_small;
+
+  memset(codec->seen, 0, sizeof(codec->seen));
+
+  uint64_t last_time = count > 0 ? msgs[0].timestamp : 0;
+  put_le32(buffer, count);
+  put_le64(buffer + 4, last_time);
+
+  uint8_t *p = buffer + CANCODEC_BLOCK_HEADER_SIZE;
+  const uint8_t *end = buffer + size;
+  uint16_t prev = NO_ID;
+
+  for (uint32_t i = 0; i < count; i++)
+    {
+    if (end - p < CANCODEC_MAX_MESSAGE)
+      return e_buffer_too_small;
+
+    const timed_canmsg_t *msg = &msgs[i];
+    uint16_t id = get_can_id(&msg->msg);
+    uint8_t *tag = p++;
+    *tag = 0;
+
+    if (prev != NO_ID && codec->ids[prev].next == id)
+      *tag |= TAG_ID;
+    else
+      {
+      *p++ = (uint8_t)id;
+      *p++ = (uint8_t)(id >> 8);
+      }
+
+    if (prev != NO_ID)
+      codec->ids[prev].next = id;
+
+    prev = id;
+
+    bool first = (codec->seen[id >> 6] & (1ULL << (id & 63))) == 0;
+    cancodec_id_t *state = get_id(codec, id, last_time);
+
+    if (msg->msg.flags != state->flags)
+      {
+      *tag |= TAG_FLAGS;
+      *p++ = (uint8_t)msg->msg.flags;
+      *p++ = (uint8_t)(msg->msg.flags >> 8);
+      state->flags = msg->msg.flags;
+      }
+
+    int64_t residual = (int64_t)(msg->timestamp - (state->timestamp + state->period));
+    if (residual == 0)
+      ;
+    else if (residual >= INT8_MIN && residual <= INT8_MAX)
+      {
+      *tag |= TIME_INT8 << TAG_TIME_SHIFT;
+      *p++ = (uint8_t)residual;
+      }
+    else if (residual >= INT16_MIN && residual <= INT16_MAX)
+      {
+      *tag |= TIME_INT16 << TAG_TIME_SHIFT;
+      *p++ = (uint8_t)residual;
+      *p++ = (uint8_t)(residual >> 8);
+      }
+    else if (residual >= INT32_MIN && residual <= INT32_MAX)
+      {
+      *tag |= TIME_INT32 << TAG_TIME_SHIFT;
+      put_le32(p, (uint32_t)residual);
+      p += 4;
+      }
+    else
+      {
+      *tag |= TIME_ABSOLUTE << TAG_TIME_SHIFT;
+      put_le64(p, msg->timestamp);
+      p += 8;
+      }
+
+    update_time(state, msg->timestamp, first);
+    last_time = msg->timestamp;
+
+    uint64_t data = fetch_le64(msg->msg.data);
+    uint64_t change = data ^ state->data;
+    if (change != 0)
+      {
+      uint8_t mask = byte_mask(change);
+      if (mask == state->mask)
+        *tag |= DATA_SAME_MASK << TAG_DATA_SHIFT;
+      else
+        {
+        *tag |= DATA_NEW_MASK << TAG_DATA_SHIFT;
+        *p++ = mask;
+        state->mask = mask;
+        }
+
+      for (; mask != 0; mask &= mask - 1)
+        *p++ = (uint8_t)(change >> (__builtin_ctz(mask) << 3));
+
+      state->data = data;
+      }
+    }
+
+  *length = (uint32_t)(p - buffer);
+  return s_ok;
+  }
+
+result_t cancodec_count(const uint8_t *buffer, uint32_t length, uint32_t *count)
+  {
+  if (buffer == 0 || count == 0)
+    return e_bad_parameter;
+
+  if (length < CANCODEC_BLOCK_HEADER_SIZE)
+    return e_corrupt;
+
+  *count = fetch_le32(buffer);
+  return s_ok;
+  }
+
+// decode one message, the buffer must hold CANCODEC_MAX_MESSAGE bytes
+static inline const uint8_t *decode_message(cancodec_t *codec, const uint8_t *p, uint16_t *prev, uint64_t *last_time, timed_canmsg_t *msg)
+  {
+  uint8_t tag = *p++;
+  uint16_t id;
+
+  if ((tag & TAG_ID) != 0)
+    {
+    if (*prev == NO_ID || (id = codec->ids[*prev].next) == NO_ID)
+      return 0;
+    }
+  else
+    {
+    id = p[0] | (((uint16_t)p[1]) << 8);
+    p += 2;
+    if (id > ID_MASK)
+      return 0;
+    }
+
+  if (*prev != NO_ID)
+    codec->ids[*prev].next = id;
+
+  *prev = id;
+
+  bool first = (codec->seen[id >> 6] & (1ULL << (id & 63))) == 0;
+  cancodec_id_t *state = get_id(codec, id, *last_time);
+
+  if ((tag & TAG_FLAGS) != 0)
+    {
+    state->flags = p[0] | (((uint16_t)p[1]) << 8);
+    p += 2;
+    if ((state->flags & ID_MASK) != id)
+      return 0;
+    }
+
+  // the buffer always holds 8 bytes, so the time is read without
+  // branching on how it was sent
+  uint8_t mode = (tag & TAG_TIME_MASK) >> TAG_TIME_SHIFT;
+  if (mode > TIME_ABSOLUTE)
+    return 0;
+
+  uint8_t shift = time_shift[mode];
+  int64_t residual = ((int64_t)((fetch_le64(p) & time_bits[mode]) << shift)) >> shift;
+  uint64_t timestamp = (mode == TIME_ABSOLUTE ? 0 : state->timestamp + state->period) + (uint64_t)residual;
+  p += time_length[mode];
+
+  update_time(state, timestamp, first);
+  *last_time = timestamp;
+
+  uint8_t mask;
+  switch ((tag & TAG_DATA_MASK) >> TAG_DATA_SHIFT)
+    {
+    case DATA_SAME :
+      mask = 0;
+      break;
+    case DATA_SAME_MASK :
+      mask = state->mask;
+      break;
+    case DATA_NEW_MASK :
+      mask = state->mask = *p++;
+      break;
+    default :
+      return 0;
+    }
+
+  uint64_t change = 0;
+  for (; mask != 0; mask &= mask - 1)
+    change |= ((uint64_t)*p++) << (__builtin_ctz(mask) << 3);
+
+  state->data ^= change;
+
+  msg->timestamp = timestamp;
+  msg->msg.flags = state->flags;
+  put_le64(msg->msg.data, state->data);
+
+  return (tag & TAG_RESERVED) != 0 ? 0 : p;
+  }
+
+result_t cancodec_decode(cancodec_t *codec, const uint8_t *buffer, uint32_t length, timed_canmsg_t *msgs, uint32_t *count)
+  {
+  if (codec == 0 || buffer == 0 || count == 0 || (msgs == 0 && *count > 0))
+    return e_bad_parameter;
+
+  uint32_t num_msgs;
+  result_t result;
+  if (failed(result = cancodec_count(buffer, length, &num_msgs)))
+    return result;
+
+  if (num_msgs > *count)
+    return e_buffer_too_small;
+
+  memset(codec->seen, 0, sizeof(codec->seen));
+
+  uint64_t last_time = fetch_le64(buffer + 4);
+  uint16_t prev = NO_ID;
+  const uint8_t *p = buffer + CANCODEC_BLOCK_HEADER_SIZE;
+  const uint8_t *end = buffer + length;
+  uint8_t tail[CANCODEC_MAX_MESSAGE * 2];
+  bool copied = false;
+
+  for (uint32_t i = 0; i < num_msgs; i++)
+    {
+    // the last few messages are decoded from a padded copy, so a whole
+    // message can always be read without checking the length
+    if (!copied && end - p < CANCODEC_MAX_MESSAGE)
+      {
+      uint32_t remaining = (uint32_t)(end - p);
+      memset(tail, 0, sizeof(tail));
+      memcpy(tail, p, remaining);
+      p = tail;
+      end = tail + remaining;
+      copied = true;
+      }
+
+    if ((p = decode_message(codec, p, &prev, &last_time, &msgs[i])) == 0 || p > end)
+      return e_corrupt;
+    }
+
+  if (p != end)
+    return e_corrupt;
+
+  *count = num_msgs;
+  return s_ok;
+  }
+
+result_t cancodec_compress(const char *capture, const char *output, uint32_t block_size)
+  {
+  if (capture == 0 || output == 0)
+    return e_bad_parameter;
+
+  if (block_size == 0)
+    block_size = CANCODEC_DEFAULT_BLOCK;
+
+  result_t result;
+  canlog_t *log;
+  if (failed(result = canlog_open(capture, &log)))
+    return result;
+
+  uint32_t size = CANCODEC_MAX_BLOCK(block_size);
+  cancodec_t *codec = (cancodec_t *)malloc(sizeof(cancodec_t));
+  timed_canmsg_t *msgs = (timed_canmsg_t *)malloc(sizeof(timed_canmsg_t) * block_size);
+  uint8_t *block = (uint8_t *)malloc(size + 8);
+  FILE *fp = 0;
+
+  if (codec == 0 || msgs == 0 || block == 0)
+    result = e_not_enough_memory;
+  else if ((fp = fopen(output, "wb")) == 0)
+    result = e_path_not_found;
+  else
+    {
+    uint8_t header[CANCODEC_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    put_le32(header, CANCODEC_MAGIC);
+    header[4] = (uint8_t)CANCODEC_VERSION;
+    put_le32(header + 8, block_size);
+    if (fwrite(header, sizeof(header), 1, fp) != 1)
+      result = e_no_space;
+
+    uint32_t count = block_size;
+    while (succeeded(result) && succeeded(canlog_read(log, msgs, &count)))
+      {
+      uint32_t length;
+      if (succeeded(result = cancodec_encode(codec, msgs, count, block + 8, size, &length)))
+        {
+        put_le32(block, length);
+        put_le32(block + 4, crc32_update(0, block + 8, length));
+        if (fwrite(block, length + 8, 1, fp) != 1)
+          result = e_no_space;
+        }
+
+      count = block_size;
+      }
+
+    if (fclose(fp) != 0 && succeeded(result))
+      result = e_no_space;
+    }
+
+  canlog_close(log);
+  free(block);
+  free(msgs);
+  free(codec);
+  return result;
+  }
+
+result_t cancodec_expand(const char *input, const char *capture)
+  {
+  if (input == 0 || capture == 0)
+    return e_bad_parameter;
+
+  FILE *fp = fopen(input, "rb");
+  if (fp == 0)
+    return e_path_not_found;
+
+  result_t result = s_ok;
+  uint8_t header[CANCODEC_HEADER_SIZE];
+  uint32_t block_size = 0;
+  if (fread(header, sizeof(header), 1, fp) != 1 ||
+      fetch_le32(header) != CANCODEC_MAGIC ||
+      header[4] != CANCODEC_VERSION ||
+      (block_size = fetch_le32(header + 8)) == 0)
+    result = e_corrupt;
+
+  canlog_t *log = 0;
+  if (succeeded(result))
+    result = canlog_create(capture, &log);
+
+  uint32_t size = CANCODEC_MAX_BLOCK(block_size);
+  cancodec_t *codec = (cancodec_t *)malloc(sizeof(cancodec_t));
+  timed_canmsg_t *msgs = (timed_canmsg_t *)malloc(sizeof(timed_canmsg_t) * block_size);
+  uint8_t *block = (uint8_t *)malloc(size);
+  if (succeeded(result) && (codec == 0 || msgs == 0 || block == 0))
+    result = e_not_enough_memory;
+
+  uint8_t prefix[8];
+  while (succeeded(result) && fread(prefix, sizeof(prefix), 1, fp) == 1)
+    {
+    uint32_t length = fetch_le32(prefix);
+    uint32_t count = block_size;
+    if (length > size ||
+        fread(block, length, 1, fp) != 1 ||
+        crc32_update(0, block, length) != fetch_le32(prefix + 4) ||
+        failed(cancodec_decode(codec, block, length, msgs, &count)))
+      result = e_corrupt;
+    else
+      result = canlog_write(log, msgs, count);
+    }
+
+  if (log != 0)
+    {
+    result_t closed = canlog_close(log);
+    if (succeeded(result))
+      result = closed;
+    }
+
+  fclose(fp);
+  free(block);
+  free(msgs);
+  free(codec);
+  return result;
+  }
@@ -0,0 +1,148 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#ifndef __cancodec_h__
+#define __cancodec_h__
+
+#include "canlog.h"
+
+/*************************************************
+ * Compressed blocks of timed messages.
+ *
+ * A block is coded against a prediction of each message from the last
+ * message with the same ID in the block, so blocks decode on their own
+ * and the decoded messages are bit for bit the ones encoded.
+ *
+ * Each message starts with a tag byte saying which parts of it were
+ * not predicted:
+ *
+ * ID         the ID that followed the previous message's ID last time,
+ *            otherwise 2 bytes
+ * flags      the last flags of the ID, otherwise 2 bytes
+ * timestamp  the last time of the ID plus its last interval, otherwise
+ *            the difference from that as 1, 2 or 4 bytes, or the time
+ *            as 8 bytes
+ * data       the XOR with the last data of the ID.  Nothing if there
+ *            is no change, the changed bytes if the same bytes changed
+ *            as last time, otherwise a mask of the changed bytes and
+ *            the bytes
+ *
+ * The first message of an ID in a block is predicted from the declared
+ * type in CanFlyID.def, so the type byte is never sent, and the time of
+ * the message before it.  Multi byte fields are little endian.
+ *
+ * Block   count (4), time of the first message (8), messages
+ *
+ * A compressed capture is a header of magic 'CFPK' (4), version (2),
+ * 0 (2), messages per block (4), 0 (4), followed by the blocks, each
+ * preceded by its length (4) and the crc32 of the block (4).
+ */
+#define CANCODEC_MAGIC 0x4b504643       // 'CFPK'
+#define CANCODEC_VERSION 1
+#define CANCODEC_HEADER_SIZE 16
+#define CANCODEC_BLOCK_HEADER_SIZE 12
+// the most a message can be coded as
+#define CANCODEC_MAX_MESSAGE 22
+#define CANCODEC_MAX_BLOCK(count) (CANCODEC_BLOCK_HEADER_SIZE + ((count) * CANCODEC_MAX_MESSAGE))
+#define CANCODEC_DEFAULT_BLOCK 65536
+
+typedef struct _cancodec_id_t {
+  uint64_t timestamp;           // time of the last message
+  uint64_t data;                // data of the last message
+  uint32_t period;              // interval before the last message
+  uint16_t flags;               // flags of the last message
+  uint16_t next;                // ID of the message after the last one
+  uint8_t mask;                 // bytes that changed in the last message
+  } cancodec_id_t;
+
+/**
+ * @struct cancodec_t
+ * Prediction state used while coding a block.
+ */
+typedef struct _cancodec_t {
+  uint64_t seen[NUM_CAN_IDS / 64];
+  cancodec_id_t ids[NUM_CAN_IDS];
+  } cancodec_t;
+
+/**
+ * @brief Encode a block of messages
+ * @param codec   Working state
+ * @param msgs    Messages to encode
+ * @param count   Number of messages
+ * @param buffer  Buffer for the block, CANCODEC_MAX_BLOCK(count) is always enough
+ * @param size    Size of the buffer
+ * @param length  Length of the block
+ * @return s_ok if encoded, e_buffer_too_small if the buffer is too small
+ */
+extern result_t cancodec_encode(cancodec_t *codec, const timed_canmsg_t *msgs, uint32_t count, uint8_t *buffer, uint32_t size, uint32_t *length);
+/**
+ * @brief Return the number of messages in a block
+ * @param buffer  Block
+ * @param length  Length of the block
+ * @param count   Number of messages
+ * @return s_ok if the block has a header
+ */
+extern result_t cancodec_count(const uint8_t *buffer, uint32_t length, uint32_t *count);
+/**
+ * @brief Decode a block of messages
+ * @param codec   Working state
+ * @param buffer  Block
+ * @param length  Length of the block
+ * @param msgs    Decoded messages
+ * @param count   On entry the size of msgs, on exit the number decoded
+ * @return s_ok if decoded, e_buffer_too_small if msgs can't hold the
+ * block, e_corrupt if the block is not valid
+ */
+extern result_t cancodec_decode(cancodec_t *codec, const uint8_t *buffer, uint32_t length, timed_canmsg_t *msgs, uint32_t *count);
+/**
+ * @brief Compress a capture log
+ * @param capture     Capture log to read
+ * @param output      Compressed capture to write
+ * @param block_size  Messages per block, 0 for the default
+ * @return s_ok if written
+ */
+extern result_t cancodec_compress(const char *capture, const char *output, uint32_t block_size);
+/**
+ * @brief Expand a compressed capture to a capture log
+ * @param input       Compressed capture
+ * @param capture     Capture log to write
+ * @return s_ok if written, e_corrupt if a block does not check
+ */
+extern result_t cancodec_expand(const char *input, const char *capture);
+
+#endif
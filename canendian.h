@@ -0,0 +1,123 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#ifndef __canendian_h__
+#define __canendian_h__
+
+#include <stdint.h>
+
+/*************************************************
+ * Little endian byte order.
+ *
+ * The CanFly bus protocol is big endian, but the capture, journal and
+ * network file formats written by the tools are little endian.  These
+ * store and fetch helpers are shared by those modules and are written
+ * out byte by byte so they work on unaligned buffers on any host, and so
+ * the compiler can fold them into a single load or store.
+ *
+ * This header is internal to the capture and tool modules, it is not
+ * part of the portable neutron core.
+ */
+
+/**
+ * @brief Store a 16 bit value little endian
+ * @param buffer  Where to store the value, need not be aligned
+ * @param value   Value to store
+ */
+static inline void put_le16(uint8_t *buffer, uint16_t value)
+  {
+  buffer[0] = (uint8_t)value;
+  buffer[1] = (uint8_t)(value >> 8);
+  }
+
+/**
+ * @brief Fetch a 16 bit little endian value
+ * @param buffer  Where to fetch the value from, need not be aligned
+ * @return the value
+ */
+static inline uint16_t fetch_le16(const uint8_t *buffer)
+  {
+  return (uint16_t)(((uint16_t)buffer[0]) | (((uint16_t)buffer[1]) << 8));
+  }
+
+/**
+ * @brief Store a 32 bit value little endian
+ * @param buffer  Where to store the value, need not be aligned
+ * @param value   Value to store
+ */
+static inline void put_le32(uint8_t *buffer, uint32_t value)
+  {
+  buffer[0] = (uint8_t)value;
+  buffer[1] = (uint8_t)(value >> 8);
+  buffer[2] = (uint8_t)(value >> 16);
+  buffer[3] = (uint8_t)(value >> 24);
+  }
+
+/**
+ * @brief Fetch a 32 bit little endian value
+ * @param buffer  Where to fetch the value from, need not be aligned
+ * @return the value
+ */
+static inline uint32_t fetch_le32(const uint8_t *buffer)
+  {
+  return ((uint32_t)buffer[0]) | (((uint32_t)buffer[1]) << 8) |
+         (((uint32_t)buffer[2]) << 16) | (((uint32_t)buffer[3]) << 24);
+  }
+
+/**
+ * @brief Store a 64 bit value little endian
+ * @param buffer  Where to store the value, need not be aligned
+ * @param value   Value to store
+ */
+static inline void put_le64(uint8_t *buffer, uint64_t value)
+  {
+  put_le32(buffer, (uint32_t)value);
+  put_le32(buffer + 4, (uint32_t)(value >> 32));
+  }
+
+/**
+ * @brief Fetch a 64 bit little endian value
+ * @param buffer  Where to fetch the value from, need not be aligned
+ * @return the value
+ */
+static inline uint64_t fetch_le64(const uint8_t *buffer)
+  {
+  return ((uint64_t)fetch_le32(buffer)) | (((uint64_t)fetch_le32(buffer + 4)) << 32);
+  }
+
+#endif
@@ -0,0 +1,762 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#define _GNU_SOURCE
+#include "canexport.h"
+#include "canendian.h"
+#include "canring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define DEFAULT_CHUNK_SIZE 262144
+#define READ_BATCH 4096
+
+typedef struct _export_row_t {
+  uint64_t timestamp;
+  uint32_t seq;                 // position in the chunk, keeps the sort stable
+  uint16_t id;
+  variant_t value;
+  } export_row_t;
+
+typedef struct _chunk_slot_t {
+  uint32_t num_rows;
+  uint64_t records;
+  uint64_t errors;
+  export_row_t *rows;
+  uint32_t max_rows;            // rows allocated, grown as a chunk needs
+  // csv rows formatted by the worker, the first and last timestamps
+  // may continue in the next chunk so are left for the writer
+  uint32_t head_end;            // rows before this are the first timestamp
+  uint32_t tail_start;          // rows from this are the last timestamp
+  uint64_t text_values;
+  uint64_t text_rows;
+  char *text;
+  size_t text_length;
+  size_t text_capacity;
+  } chunk_slot_t;
+
+typedef struct _export_t {
+  const canexport_options_t *options;
+  uint64_t num_records;
+  uint64_t num_chunks;
+  uint32_t chunk_size;
+  canring_t ring;               // chunks decoded ahead of the writer
+  uint16_t num_slots;
+  chunk_slot_t *slots;
+  int16_t column[NUM_CAN_IDS];  // csv column of each ID, -1 if none
+  } export_t;
+
+// values of a variant type as stored in a column file
+static uint16_t value_size(variant_type vt)
+  {
+  switch (vt)
+    {
+    case v_bool :
+    case v_int8 :
+    case v_uint8 :
+      return 1;
+    case v_int16 :
+    case v_uint16 :
+      return 2;
+    case v_utc :
+      return sizeof(tm_t);
+    default :
+      return 4;
+    }
+  }
+
+static variant_type declared_variant_type(uint16_t type)
+  {
+  switch (type)
+    {
+    case CANFLY_BOOL : return v_bool;
+    case CANFLY_INT8 : return v_int8;
+    case CANFLY_UINT8 : return v_uint8;
+    case CANFLY_INT16 : return v_int16;
+    case CANFLY_UINT16 : return v_uint16;
+    case CANFLY_INT32 : return v_int32;
+    case CANFLY_UINT32 : return v_uint32;
+    case CANFLY_FLOAT : return v_float;
+    case CANFLY_UTC : return v_utc;
+    default : return v_none;
+    }
+  }
+
+static int compare_rows(const void *a, const void *b)
+  {
+  const export_row_t *r1 = (const export_row_t *)a;
+  const export_row_t *r2 = (const export_row_t *)b;
+
+  if (r1->timestamp != r2->timestamp)
+    return r1->timestamp < r2->timestamp ? -1 : 1;
+
+  return r1->seq < r2->seq ? -1 : r1->seq > r2->seq ? 1 : 0;
+  }
+
+static void add_row(chunk_slot_t *slot, uint64_t timestamp, const canmsg_t *msg)
+  {
+  export_row_t *row = &slot->rows[slot->num_rows];
+  if (failed(msg_to_variant(msg, &row->value)))
+    {
+    slot->errors++;
+    return;
+    }
+
+  row->timestamp = timestamp;
+  row->seq = slot->num_rows++;
+  row->id = get_can_id(msg);
+  }
+
+typedef struct _csv_cell_t {
+  int16_t column;
+  const variant_t *value;
+  } csv_cell_t;
+
+// longest text a row can format to
+static size_t max_row_length(void)
+  {
+  return 32 + (num_canfly_ids * 64);
+  }
+
+// format a row from cells sorted by column, returns the length
+static size_t format_row(char *out, uint64_t timestamp, const csv_cell_t *cells, uint16_t count)
+  {
+  char *p = out;
+  uint16_t length = 0;
+  variant_t seconds;
+  variant_to_string(create_variant_uint32((uint32_t)(timestamp / 1000000), &seconds), p, 16, &length);
+  p += length;
+
+  *p++ = '.';
+  uint32_t micros = (uint32_t)(timestamp % 1000000);
+  for (int16_t digit = 5; digit >= 0; digit--)
+    {
+    p[digit] = (char)('0' + (micros % 10));
+    micros /= 10;
+    }
+
+  p += 6;
+
+  int16_t written = 0;
+  for (uint16_t i = 0; i < count; i++)
+    {
+    // a separator for each column up to and including this one
+    memset(p, ',', cells[i].column + 1 - written);
+    p += cells[i].column + 1 - written;
+    written = cells[i].column + 1;
+
+    variant_to_string(cells[i].value, p, 64, &length);
+    p += length;
+    }
+
+  memset(p, ',', num_canfly_ids - written);
+  p += num_canfly_ids - written;
+  *p++ = '\n';
+
+  return p - out;
+  }
+
+static bool reserve_text(chunk_slot_t *slot, size_t length)
+  {
+  if (slot->text_length + length <= slot->text_capacity)
+    return true;
+
+  size_t capacity = slot->text_capacity == 0 ? 1048576 : slot->text_capacity;
+  while (slot->text_length + length > capacity)
+    capacity <<= 1;
+
+  char *text = (char *)realloc(slot->text, capacity);
+  if (text == 0)
+    return false;
+
+  slot->text = text;
+  slot->text_capacity = capacity;
+  return true;
+  }
+
+// make room for count more rows, grown rather than sized for a chunk of
+// packed messages so a slot holds only as many rows as it has needed
+static bool reserve_rows(chunk_slot_t *slot, uint32_t count)
+  {
+  if (slot->num_rows + count <= slot->max_rows)
+    return true;
+
+  uint32_t max_rows = slot->max_rows == 0 ? READ_BATCH : slot->max_rows;
+  while (slot->num_rows + count > max_rows)
+    max_rows <<= 1;
+
+  export_row_t *rows = (export_row_t *)realloc(slot->rows, sizeof(export_row_t) * max_rows);
+  if (rows == 0)
+    return false;
+
+  slot->rows = rows;
+  slot->max_rows = max_rows;
+  return true;
+  }
+
+// format the rows between the first and last timestamps of a chunk
+static result_t format_chunk(export_t *exp, chunk_slot_t *slot)
+  {
+  slot->text_length = 0;
+  slot->text_rows = 0;
+  slot->text_values = 0;
+  slot->head_end = 0;
+  slot->tail_start = 0;
+
+  if (slot->num_rows == 0)
+    return s_ok;
+
+  const export_row_t *rows = slot->rows;
+  uint32_t end = 1;
+  while (end < slot->num_rows && rows[end].timestamp == rows[0].timestamp)
+    end++;
+
+  slot->head_end = end;
+
+  uint32_t start = slot->num_rows - 1;
+  while (start > 0 && rows[start - 1].timestamp == rows[slot->num_rows - 1].timestamp)
+    start--;
+
+  slot->tail_start = start < end ? end : start;
+
+  csv_cell_t cells[NUM_CAN_IDS];
+  size_t max_length = max_row_length();
+
+  for (uint32_t first = slot->head_end; first < slot->tail_start; )
+    {
+    uint32_t last = first;
+    uint16_t count = 0;
+
+    for (; last < slot->tail_start && rows[last].timestamp == rows[first].timestamp; last++)
+      {
+      int16_t column = exp->column[rows[last].id];
+      if (column < 0)
+        continue;
+
+      // insert in column order, a repeated ID keeps the later value
+      uint16_t pos = count;
+      while (pos > 0 && cells[pos - 1].column > column)
+        pos--;
+
+      if (pos > 0 && cells[pos - 1].column == column)
+        cells[pos - 1].value = &rows[last].value;
+      else
+        {
+        memmove(&cells[pos + 1], &cells[pos], (count - pos) * sizeof(csv_cell_t));
+        cells[pos].column = column;
+        cells[pos].value = &rows[last].value;
+        count++;
+        }
+
+      slot->text_values++;
+      }
+
+    if (count > 0)
+      {
+      if (!reserve_text(slot, max_length))
+        return e_not_enough_memory;
+
+      slot->text_length += format_row(slot->text + slot->text_length, rows[first].timestamp, cells, count);
+      slot->text_rows++;
+      }
+
+    first = last;
+    }
+
+  return s_ok;
+  }
+
+static result_t decode_chunk(export_t *exp, canlog_t *log, timed_canmsg_t *msgs, uint64_t chunk, chunk_slot_t *slot)
+  {
+  result_t result;
+  uint64_t first = chunk * exp->chunk_size;
+  uint64_t remaining = exp->num_records - first;
+  if (remaining > exp->chunk_size)
+    remaining = exp->chunk_size;
+
+  slot->num_rows = 0;
+  slot->records = 0;
+  slot->errors = 0;
+
+  if (failed(result = canlog_seek(log, first)))
+    return result;
+
+  bool sorted = true;
+  uint64_t last = 0;
+  while (remaining > 0)
+    {
+    uint32_t count = remaining > READ_BATCH ? READ_BATCH : (uint32_t)remaining;
+    if (failed(result = canlog_read(log, msgs, &count)))
+      return result;
+
+    // a packed message expands to 3 rows
+    if (!reserve_rows(slot, count * PACKED_UINT16_MAX))
+      return e_not_enough_memory;
+
+    for (uint32_t i = 0; i < count; i++)
+      {
+      const canmsg_t *msg = &msgs[i].msg;
+      if (msgs[i].timestamp < last)
+        sorted = false;
+
+      last = msgs[i].timestamp;
+
+      if (get_can_len(msg) > 0 && msg->data[0] == CANFLY_PACKED_UINT16)
+        {
+        canmsg_t expanded[PACKED_UINT16_MAX];
+        uint16_t num_expanded;
+        if (failed(expand_packed_msg(msg, expanded, &num_expanded)))
+          slot->errors++;
+        else
+          for (uint16_t j = 0; j < num_expanded; j++)
+            add_row(slot, msgs[i].timestamp, &expanded[j]);
+        }
+      else
+        add_row(slot, msgs[i].timestamp, msg);
+      }
+
+    slot->records += count;
+    remaining -= count;
+    }
+
+  // captures are written in time order, only merged buses need a sort
+  if (!sorted)
+    qsort(slot->rows, slot->num_rows, sizeof(export_row_t), compare_rows);
+
+  return s_ok;
+  }
+
+static void *export_worker(void *arg)
+  {
+  export_t *exp = (export_t *)arg;
+  canlog_t *log = 0;
+  timed_canmsg_t *msgs = (timed_canmsg_t *)malloc(sizeof(timed_canmsg_t) * READ_BATCH);
+
+  result_t result = msgs == 0 ? e_not_enough_memory : canlog_open(exp->options->capture, &log);
+
+  uint64_t chunk;
+  while (succeeded(result) && succeeded(canring_claim(&exp->ring, &chunk)))
+    {
+    chunk_slot_t *slot = &exp->slots[chunk % exp->num_slots];
+    result = decode_chunk(exp, log, msgs, chunk, slot);
+    if (succeeded(result) && exp->options->format == cf_csv && !exp->options->hold)
+      result = format_chunk(exp, slot);
+
+    canring_publish(&exp->ring, chunk, result);
+    }
+
+  if (failed(result))
+    canring_stop(&exp->ring, result);
+
+  if (log != 0)
+    canlog_close(log);
+
+  free(msgs);
+  return 0;
+  }
+
+// state of the csv writer, carried across chunks
+typedef struct _csv_writer_t {
+  FILE *fp;
+  bool hold;
+  bool row_open;
+  uint64_t timestamp;
+  const int16_t *column;        // csv column of each ID, -1 if none
+  bool present[NUM_CAN_IDS];
+  variant_t cells[NUM_CAN_IDS];
+  char *line;
+  uint64_t rows;
+  } csv_writer_t;
+
+static void csv_header(csv_writer_t *csv)
+  {
+  fputs("timestamp", csv->fp);
+  for (uint16_t i = 0; i < num_canfly_ids; i++)
+    {
+    fputc(',', csv->fp);
+    fputs(canfly_ids[i].name, csv->fp);
+    }
+
+  fputc('\n', csv->fp);
+  }
+
+static void csv_flush_row(csv_writer_t *csv)
+  {
+  if (!csv->row_open)
+    return;
+
+  csv_cell_t cells[NUM_CAN_IDS];
+  uint16_t count = 0;
+  for (uint16_t i = 0; i < num_canfly_ids; i++)
+    {
+    uint16_t id = canfly_ids[i].id;
+    if (csv->present[id])
+      {
+      cells[count].column = (int16_t)i;
+      cells[count++].value = &csv->cells[id];
+      if (!csv->hold)
+        csv->present[id] = false;
+      }
+    }
+
+  fwrite(csv->line, format_row(csv->line, csv->timestamp, cells, count), 1, csv->fp);
+  csv->row_open = false;
+  csv->rows++;
+  }
+
+static void csv_append(csv_writer_t *csv, const export_row_t *rows, uint32_t first, uint32_t last, canexport_stats_t *stats)
+  {
+  for (uint32_t i = first; i < last; i++)
+    {
+    const export_row_t *row = &rows[i];
+    if (csv->column[row->id] < 0)
+      continue;
+
+    if (csv->row_open && row->timestamp != csv->timestamp)
+      csv_flush_row(csv);
+
+    csv->timestamp = row->timestamp;
+    csv->row_open = true;
+    csv->present[row->id] = true;
+    copy_variant(&row->value, &csv->cells[row->id]);
+    stats->values++;
+    }
+  }
+
+static void csv_write(csv_writer_t *csv, const chunk_slot_t *slot, canexport_stats_t *stats)
+  {
+  // when holding values every row depends on the ones before it
+  if (csv->hold)
+    {
+    csv_append(csv, slot->rows, 0, slot->num_rows, stats);
+    return;
+    }
+
+  csv_append(csv, slot->rows, 0, slot->head_end, stats);
+  if (slot->text_rows > 0)
+    {
+    csv_flush_row(csv);
+    fwrite(slot->text, slot->text_length, 1, csv->fp);
+    csv->rows += slot->text_rows;
+    stats->values += slot->text_values;
+    }
+
+  csv_append(csv, slot->rows, slot->tail_start, slot->num_rows, stats);
+  }
+
+// state of the column writer
+typedef struct _column_writer_t {
+  const char *directory;
+  FILE *files[NUM_CAN_IDS];
+  variant_type types[NUM_CAN_IDS];
+  result_t error;
+  } column_writer_t;
+
+static FILE *open_column(column_writer_t *cols, uint16_t id, const variant_t *first)
+  {
+  if (cols->files[id] != 0)
+    return cols->files[id];
+
+  char path[4096];
+  const canfly_id_info_t *info = find_canfly_id(id);
+  if (info != 0)
+    {
+    snprintf(path, sizeof(path), "%s/%s.col", cols->directory, info->name);
+    cols->types[id] = declared_variant_type(info->type);
+    }
+  else
+    snprintf(path, sizeof(path), "%s/id_%u.col", cols->directory, (unsigned)id);
+
+  // an ID without a declared type keeps the type of its first value
+  if (cols->types[id] == v_none)
+    cols->types[id] = first->vt;
+
+  FILE *fp = fopen(path, "wb");
+  if (fp == 0)
+    {
+    cols->error = e_path_not_found;
+    return 0;
+    }
+
+  uint8_t header[CANEXPORT_COLUMN_HEADER_SIZE];
+  memset(header, 0, sizeof(header));
+  put_le32(header, CANEXPORT_COLUMN_MAGIC);
+  put_le16(header + 4, CANEXPORT_COLUMN_VERSION);
+  put_le16(header + 6, id);
+  put_le16(header + 8, cols->types[id]);
+  put_le16(header + 10, value_size(cols->types[id]));
+  fwrite(header, sizeof(header), 1, fp);
+
+  cols->files[id] = fp;
+  return fp;
+  }
+
+static void columns_write(column_writer_t *cols, const chunk_slot_t *slot, canexport_stats_t *stats)
+  {
+  for (uint32_t i = 0; i < slot->num_rows; i++)
+    {
+    const export_row_t *row = &slot->rows[i];
+    if (row->value.vt == v_none)
+      continue;
+
+    FILE *fp = open_column(cols, row->id, &row->value);
+    if (fp == 0)
+      return;
+
+    variant_t value;
+    if (row->value.vt == cols->types[row->id])
+      copy_variant(&row->value, &value);
+    else if (failed(coerce_variant(&row->value, &value, cols->types[row->id])))
+      {
+      stats->errors++;
+      continue;
+      }
+
+    uint8_t record[8 + sizeof(tm_t)];
+    uint16_t size = value_size(value.vt);
+    put_le64(record, row->timestamp);
+    switch (value.vt)
+      {
+      case v_bool : record[8] = value.value.boolean ? 1 : 0; break;
+      case v_int8 : record[8] = (uint8_t)value.value.int8; break;
+      case v_uint8 : record[8] = value.value.uint8; break;
+      case v_int16 : put_le16(record + 8, (uint16_t)value.value.int16); break;
+      case v_uint16 : put_le16(record + 8, value.value.uint16); break;
+      case v_int32 : put_le32(record + 8, (uint32_t)value.value.int32); break;
+      case v_float :
+        {
+        uint32_t bits;
+        memcpy(&bits, &value.value.flt, sizeof(bits));
+        put_le32(record + 8, bits);
+        }
+        break;
+      case v_utc :
+        {
+        const uint16_t *fields = &value.value.utc.year;
+        for (uint16_t f = 0; f < 7; f++)
+          put_le16(record + 8 + (f << 1), fields[f]);
+        }
+        break;
+      default : put_le32(record + 8, value.value.uint32); break;
+      }
+
+    fwrite(record, 8 + size, 1, fp);
+    stats->values++;
+    }
+  }
+
+result_t canexport_run(const canexport_options_t *options, canexport_stats_t *stats)
+  {
+  if (options == 0 || options->capture == 0 || options->output == 0)
+    return e_bad_parameter;
+
+  canexport_stats_t local_stats;
+  if (stats == 0)
+    stats = &local_stats;
+
+  memset(stats, 0, sizeof(canexport_stats_t));
+
+  result_t result;
+  canlog_t *log;
+  if (failed(result = canlog_open(options->capture, &log)))
+    return result;
+
+  export_t exp;
+  memset(&exp, 0, sizeof(exp));
+  exp.options = options;
+  exp.chunk_size = options->chunk_size == 0 ? DEFAULT_CHUNK_SIZE : options->chunk_size;
+  result = canlog_count(log, &exp.num_records);
+  canlog_close(log);
+  if (failed(result))
+    return result;
+
+  if (exp.num_records > 0 && exp.chunk_size > exp.num_records)
+    exp.chunk_size = (uint32_t)exp.num_records;
+
+  exp.num_chunks = (exp.num_records + exp.chunk_size - 1) / exp.chunk_size;
+
+  for (uint16_t id = 0; id < NUM_CAN_IDS; id++)
+    exp.column[id] = -1;
+
+  for (uint16_t i = 0; i < num_canfly_ids; i++)
+    exp.column[canfly_ids[i].id] = (int16_t)i;
+
+  uint16_t num_threads = options->threads;
+  if (num_threads == 0)
+    num_threads = (uint16_t)sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (num_threads == 0)
+    num_threads = 1;
+
+  // a small capture doesn't need a worker per cpu
+  if (exp.num_chunks > 0 && num_threads > exp.num_chunks)
+    num_threads = (uint16_t)exp.num_chunks;
+
+  // two chunks per worker so the workers decode while the writer writes
+  exp.num_slots = num_threads * 2;
+  exp.slots = (chunk_slot_t *)calloc(exp.num_slots, sizeof(chunk_slot_t));
+  if (exp.slots == 0)
+    return e_not_enough_memory;
+
+  csv_writer_t *csv = 0;
+  column_writer_t *cols = 0;
+  if (succeeded(result))
+    {
+    if (options->format == cf_csv)
+      {
+      csv = (csv_writer_t *)calloc(1, sizeof(csv_writer_t));
+      if (csv == 0)
+        result = e_not_enough_memory;
+      else if ((csv->line = (char *)malloc(max_row_length())) == 0)
+        result = e_not_enough_memory;
+      else if ((csv->fp = fopen(options->output, "w")) == 0)
+        result = e_path_not_found;
+      else
+        {
+        csv->hold = options->hold;
+        csv->column = exp.column;
+        csv_header(csv);
+        }
+      }
+    else
+      {
+      cols = (column_writer_t *)calloc(1, sizeof(column_writer_t));
+      if (cols == 0)
+        result = e_not_enough_memory;
+      else
+        cols->directory = options->output;
+      }
+    }
+
+  pthread_t *workers = 0;
+  uint16_t started = 0;
+  if (succeeded(result) && succeeded(result = canring_init(&exp.ring, exp.num_slots, exp.num_chunks)))
+    {
+    workers = (pthread_t *)calloc(num_threads, sizeof(pthread_t));
+    if (workers == 0)
+      result = e_not_enough_memory;
+
+    while (succeeded(result) && started < num_threads)
+      {
+      if (pthread_create(&workers[started], 0, export_worker, &exp) != 0)
+        {
+        // stop the workers that did start
+        result = e_not_enough_memory;
+        canring_stop(&exp.ring, result);
+        break;
+        }
+
+      started++;
+      }
+
+    uint64_t last_timestamp = 0;
+
+    // write the chunks in file order
+    for (uint64_t chunk = 0; chunk < exp.num_chunks && succeeded(result); chunk++)
+      {
+      if (failed(result = canring_wait(&exp.ring, chunk)))
+        break;
+
+      chunk_slot_t *slot = &exp.slots[chunk % exp.num_slots];
+      stats->records += slot->records;
+      stats->errors += slot->errors;
+
+      // chunks are only sorted within themselves, so a capture that goes
+      // back in time across a chunk boundary cannot be written in order
+      if (slot->num_rows > 0)
+        {
+        if (slot->rows[0].timestamp < last_timestamp)
+          result = e_out_of_range;
+        else
+          last_timestamp = slot->rows[slot->num_rows - 1].timestamp;
+        }
+
+      if (succeeded(result) && csv != 0)
+        csv_write(csv, slot, stats);
+      else if (succeeded(result))
+        {
+        columns_write(cols, slot, stats);
+        result = cols->error;
+        }
+
+      canring_release(&exp.ring, chunk, result);
+      }
+
+    for (uint16_t i = 0; i < started; i++)
+      pthread_join(workers[i], 0);
+
+    free(workers);
+    canring_close(&exp.ring);
+    }
+
+  if (csv != 0)
+    {
+    if (csv->fp != 0)
+      {
+      csv_flush_row(csv);
+      if (fclose(csv->fp) != 0 && succeeded(result))
+        result = e_no_space;
+      }
+
+    stats->rows = csv->rows;
+    free(csv->line);
+    free(csv);
+    }
+
+  if (cols != 0)
+    {
+    for (uint16_t id = 0; id < NUM_CAN_IDS; id++)
+      if (cols->files[id] != 0 && fclose(cols->files[id]) != 0 && succeeded(result))
+        result = e_no_space;
+
+    free(cols);
+    }
+
+  for (uint16_t i = 0; i < exp.num_slots; i++)
+    {
+    free(exp.slots[i].rows);
+    free(exp.slots[i].text);
+    }
+
+  free(exp.slots);
+  return result;
+  }
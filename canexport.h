@@ -0,0 +1,96 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#ifndef __canexport_h__
+#define __canexport_h__
+
+#include "canlog.h"
+
+/*************************************************
+ * Parallel export of a capture log to tables.
+ *
+ * The capture is split into chunks which are decoded and sorted by
+ * timestamp on a pool of worker threads.  The chunks are written in
+ * file order by the calling thread while the workers decode ahead.
+ * Records may be out of order within a chunk, but a capture that goes
+ * back in time across chunks is rejected; put it in order with
+ * canmerge first.
+ *
+ * Wide CSV has a timestamp column and one column per ID in
+ * CanFlyID.def, named from the enumeration.  A row is written for each
+ * distinct timestamp with the values received at that time.
+ *
+ * Column files are written one per ID, named <enum name>.col, holding
+ * a header followed by records of a little endian timestamp and the
+ * value encoded as the declared type of the ID.
+ */
+#define CANEXPORT_COLUMN_MAGIC 0x4c434643   // 'CFCL'
+#define CANEXPORT_COLUMN_VERSION 1
+#define CANEXPORT_COLUMN_HEADER_SIZE 16
+
+typedef enum _canexport_format {
+  cf_csv,
+  cf_columns,
+  } canexport_format;
+
+typedef struct _canexport_options_t {
+  const char *capture;          // capture log to read
+  const char *output;           // csv file, or directory for column files
+  canexport_format format;
+  uint16_t threads;             // worker threads, 0 for one per cpu
+  uint32_t chunk_size;          // records decoded per chunk, 0 for the default
+  bool hold;                    // csv: repeat the last value of an ID in every row
+  } canexport_options_t;
+
+typedef struct _canexport_stats_t {
+  uint64_t records;             // records read
+  uint64_t values;              // values written
+  uint64_t errors;              // records that did not decode
+  uint64_t rows;                // csv rows written
+  } canexport_stats_t;
+
+/**
+ * @brief Export a capture log
+ * @param options   What to export and how
+ * @param stats     Optional, counts of the records exported
+ * @return s_ok if exported, e_out_of_range if the capture is not in time
+ * order across chunks
+ */
+extern result_t canexport_run(const canexport_options_t *options, canexport_stats_t *stats);
+
+#endif
@@ -0,0 +1,628 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+// large captures need 64 bit file offsets on 32 bit targets
+#define _FILE_OFFSET_BITS 64
+
+#include "canlog.h"
+#include "canendian.h"
+#include "cantrace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+// number of records transferred to/from the file in one call
+#define CANLOG_BATCH 4096
+
+typedef struct _keyframe_entry_t {
+  uint64_t timestamp;
+  uint64_t record;
+  uint64_t offset;              // offset of the keyframe in the index file
+  } keyframe_entry_t;
+
+struct _canlog_t {
+  FILE *fp;
+  bool writing;
+  char *index_path;
+  FILE *index;                  // keyframe file, 0 if there is none
+  canlog_state_t *state;        // state of a writer emitting keyframes
+  uint64_t interval;
+  uint64_t next_keyframe;
+  uint64_t records;             // records written
+  keyframe_entry_t *entries;
+  uint32_t num_entries;
+  uint32_t max_entries;
+  uint8_t buffer[CANLOG_BATCH * CANLOG_RECORD_SIZE];
+  };
+
+void canlog_encode(const timed_canmsg_t *msg, uint8_t *buffer)
+  {
+  put_le64(buffer, msg->timestamp);
+  put_le16(buffer + 8, msg->msg.flags);
+  memcpy(buffer + 10, msg->msg.data, 8);
+  }
+
+void canlog_decode(const uint8_t *buffer, timed_canmsg_t *msg)
+  {
+  msg->timestamp = fetch_le64(buffer);
+  msg->msg.flags = fetch_le16(buffer + 8);
+  memcpy(msg->msg.data, buffer + 10, 8);
+  }
+
+static canlog_t *alloc_log(const char *path)
+  {
+  canlog_t *lp = (canlog_t *)calloc(1, sizeof(canlog_t));
+  if (lp == 0)
+    return 0;
+
+  if ((lp->index_path = (char *)malloc(strlen(path) + sizeof(CANLOG_INDEX_SUFFIX))) == 0)
+    {
+    free(lp);
+    return 0;
+    }
+
+  strcpy(lp->index_path, path);
+  strcat(lp->index_path, CANLOG_INDEX_SUFFIX);
+  return lp;
+  }
+
+static void free_log(canlog_t *lp)
+  {
+  if (lp->index != 0)
+    fclose(lp->index);
+
+  free(lp->index_path);
+  free(lp->state);
+  free(lp->entries);
+  free(lp);
+  }
+
+void canlog_state_clear(canlog_state_t *state)
+  {
+  memset(state->valid, 0, sizeof(state->valid));
+  }
+
+static void set_latest(canlog_state_t *state, uint64_t timestamp, const canmsg_t *msg)
+  {
+  uint16_t id = get_can_id(msg);
+  state->latest[id].timestamp = timestamp;
+  state->latest[id].msg = *msg;
+  state->valid[id >> 6] |= 1ULL << (id & 63);
+  }
+
+void canlog_state_apply(canlog_state_t *state, const timed_canmsg_t *msgs, uint32_t count)
+  {
+  for (uint32_t i = 0; i < count; i++)
+    {
+    const canmsg_t *msg = &msgs[i].msg;
+    if (get_can_len(msg) > 0 && msg->data[0] == CANFLY_PACKED_UINT16)
+      {
+      canmsg_t expanded[PACKED_UINT16_MAX];
+      uint16_t num_expanded;
+      if (succeeded(expand_packed_msg(msg, expanded, &num_expanded)))
+        for (uint16_t j = 0; j < num_expanded; j++)
+          set_latest(state, msgs[i].timestamp, &expanded[j]);
+      }
+    else
+      set_latest(state, msgs[i].timestamp, msg);
+    }
+  }
+
+static result_t add_entry(canlog_t *log, uint64_t timestamp, uint64_t record, uint64_t offset)
+  {
+  if (log->num_entries == log->max_entries)
+    {
+    uint32_t max_entries = log->max_entries == 0 ? 256 : log->max_entries * 2;
+    keyframe_entry_t *entries = (keyframe_entry_t *)realloc(log->entries, max_entries * sizeof(keyframe_entry_t));
+    if (entries == 0)
+      return e_not_enough_memory;
+
+    log->entries = entries;
+    log->max_entries = max_entries;
+    }
+
+  keyframe_entry_t *entry = &log->entries[log->num_entries++];
+  entry->timestamp = timestamp;
+  entry->record = record;
+  entry->offset = offset;
+  return s_ok;
+  }
+
+// write the state before the record that is about to be written
+static result_t write_keyframe(canlog_t *log, uint64_t timestamp)
+  {
+  uint16_t count = 0;
+  for (uint16_t w = 0; w < NUM_CAN_IDS / 64; w++)
+    count += (uint16_t)__builtin_popcountll(log->state->valid[w]);
+
+  uint8_t header[CANLOG_KEYFRAME_HEADER_SIZE];
+  memset(header, 0, sizeof(header));
+  put_le32(header, CANLOG_KEYFRAME_MAGIC);
+  put_le16(header + 4, count);
+  put_le64(header + 8, timestamp);
+  put_le64(header + 16, log->records);
+
+  off_t offset = ftello(log->index);
+  uint32_t crc = crc32_update(0, header, sizeof(header));
+  if (fwrite(header, sizeof(header), 1, log->index) != 1)
+    return e_no_space;
+
+  for (uint16_t w = 0; w < NUM_CAN_IDS / 64; w++)
+    {
+    uint64_t valid = log->state->valid[w];
+    while (valid != 0)
+      {
+      uint16_t id = (w << 6) + __builtin_ctzll(valid);
+      valid &= valid - 1;
+
+      uint8_t record[CANLOG_RECORD_SIZE];
+      canlog_encode(&log->state->latest[id], record);
+      crc = crc32_update(crc, record, sizeof(record));
+      if (fwrite(record, sizeof(record), 1, log->index) != 1)
+        return e_no_space;
+      }
+    }
+
+  uint8_t trailer[4];
+  put_le32(trailer, crc);
+  if (fwrite(trailer, sizeof(trailer), 1, log->index) != 1)
+    return e_no_space;
+
+  return add_entry(log, timestamp, log->records, (uint64_t)offset);
+  }
+
+// append the index and footer to the keyframes
+static result_t write_index(canlog_t *log)
+  {
+  off_t offset = ftello(log->index);
+  uint32_t crc = 0;
+  for (uint32_t i = 0; i < log->num_entries; i++)
+    {
+    uint8_t entry[CANLOG_INDEX_ENTRY_SIZE];
+    put_le64(entry, log->entries[i].timestamp);
+    put_le64(entry + 8, log->entries[i].record);
+    put_le64(entry + 16, log->entries[i].offset);
+    crc = crc32_update(crc, entry, sizeof(entry));
+    if (fwrite(entry, sizeof(entry), 1, log->index) != 1)
+      return e_no_space;
+    }
+
+  uint8_t footer[CANLOG_FOOTER_SIZE];
+  put_le64(footer, (uint64_t)offset);
+  put_le32(footer + 8, log->num_entries);
+  put_le32(footer + 12, crc);
+  put_le32(footer + 16, CANLOG_FOOTER_MAGIC);
+  if (fwrite(footer, sizeof(footer), 1, log->index) != 1)
+    return e_no_space;
+
+  return s_ok;
+  }
+
+// read and check a keyframe, leaving the records in the log buffer
+static result_t read_keyframe(canlog_t *log, uint64_t offset, uint64_t *timestamp, uint64_t *record, uint16_t *count)
+  {
+  uint8_t header[CANLOG_KEYFRAME_HEADER_SIZE];
+  if (fseeko(log->index, (off_t)offset, SEEK_SET) != 0 ||
+      fread(header, sizeof(header), 1, log->index) != 1 ||
+      fetch_le32(header) != CANLOG_KEYFRAME_MAGIC ||
+      fetch_le16(header + 4) > NUM_CAN_IDS)
+    return e_corrupt;
+
+  *count = fetch_le16(header + 4);
+  *timestamp = fetch_le64(header + 8);
+  *record = fetch_le64(header + 16);
+
+  uint8_t trailer[4];
+  if ((*count > 0 && fread(log->buffer, CANLOG_RECORD_SIZE, *count, log->index) != *count) ||
+      fread(trailer, sizeof(trailer), 1, log->index) != 1)
+    return e_corrupt;
+
+  uint32_t crc = crc32_update(0, header, sizeof(header));
+  crc = crc32_update(crc, log->buffer, *count * CANLOG_RECORD_SIZE);
+  return crc == fetch_le32(trailer) ? s_ok : e_corrupt;
+  }
+
+static bool read_index(canlog_t *log)
+  {
+  uint8_t footer[CANLOG_FOOTER_SIZE];
+  if (fseeko(log->index, -CANLOG_FOOTER_SIZE, SEEK_END) != 0 ||
+      fread(footer, sizeof(footer), 1, log->index) != 1 ||
+      fetch_le32(footer + 16) != CANLOG_FOOTER_MAGIC ||
+      fseeko(log->index, (off_t)fetch_le64(footer), SEEK_SET) != 0)
+    return false;
+
+  uint32_t count = fetch_le32(footer + 8);
+  uint32_t crc = 0;
+  for (uint32_t i = 0; i < count; i++)
+    {
+    uint8_t entry[CANLOG_INDEX_ENTRY_SIZE];
+    if (fread(entry, sizeof(entry), 1, log->index) != 1)
+      return false;
+
+    crc = crc32_update(crc, entry, sizeof(entry));
+    if (failed(add_entry(log, fetch_le64(entry), fetch_le64(entry + 8), fetch_le64(entry + 16))))
+      return false;
+    }
+
+  return crc == fetch_le32(footer + 12);
+  }
+
+static void load_index(canlog_t *log)
+  {
+  uint8_t header[CANLOG_INDEX_HEADER_SIZE];
+  if (fread(header, sizeof(header), 1, log->index) != 1 ||
+      fetch_le32(header) != CANLOG_INDEX_MAGIC ||
+      fetch_le16(header + 4) != CANLOG_INDEX_VERSION)
+    {
+    fclose(log->index);
+    log->index = 0;
+    return;
+    }
+
+  log->interval = fetch_le64(header + 8);
+
+  if (!read_index(log))
+    {
+    // the writer didn't close the log, walk the keyframes instead
+    log->num_entries = 0;
+    uint64_t offset = CANLOG_INDEX_HEADER_SIZE;
+    uint64_t timestamp;
+    uint64_t record;
+    uint16_t count;
+    while (succeeded(read_keyframe(log, offset, &timestamp, &record, &count)) &&
+           succeeded(add_entry(log, timestamp, record, offset)))
+      offset += CANLOG_KEYFRAME_HEADER_SIZE + (count * CANLOG_RECORD_SIZE) + 4;
+    }
+
+  // a keyframe can be written ahead of records lost when the writer stopped
+  uint64_t records;
+  if (succeeded(canlog_count(log, &records)))
+    while (log->num_entries > 0 && log->entries[log->num_entries - 1].record >= records)
+      log->num_entries--;
+  }
+
+result_t canlog_create(const char *path, canlog_t **log)
+  {
+  if (path == 0 || log == 0)
+    return e_bad_parameter;
+
+  canlog_t *lp = alloc_log(path);
+  if (lp == 0)
+    return e_not_enough_memory;
+
+  if ((lp->fp = fopen(path, "wb")) == 0)
+    {
+    free_log(lp);
+    return errno == ENOENT ? e_path_not_found : e_invalid_operation;
+    }
+
+  lp->writing = true;
+  // keyframes and the block summary of an earlier capture don't belong to this one
+  unlink(lp->index_path);
+  char *summary_path = (char *)malloc(strlen(path) + sizeof(CANLOG_SUMMARY_SUFFIX));
+  if (summary_path != 0)
+    {
+    strcpy(summary_path, path);
+    strcat(summary_path, CANLOG_SUMMARY_SUFFIX);
+    unlink(summary_path);
+    free(summary_path);
+    }
+
+  uint8_t header[CANLOG_HEADER_SIZE];
+  memset(header, 0, sizeof(header));
+  put_le32(header, CANLOG_MAGIC);
+  put_le16(header + 4, CANLOG_VERSION);
+  put_le16(header + 6, CANLOG_RECORD_SIZE);
+
+  if (fwrite(header, CANLOG_HEADER_SIZE, 1, lp->fp) != 1)
+    {
+    fclose(lp->fp);
+    free_log(lp);
+    return e_no_space;
+    }
+
+  *log = lp;
+  return s_ok;
+  }
+
+result_t canlog_open(const char *path, canlog_t **log)
+  {
+  if (path == 0 || log == 0)
+    return e_bad_parameter;
+
+  canlog_t *lp = alloc_log(path);
+  if (lp == 0)
+    return e_not_enough_memory;
+
+  if ((lp->fp = fopen(path, "rb")) == 0)
+    {
+    free_log(lp);
+    return e_path_not_found;
+    }
+
+  lp->writing = false;
+
+  uint8_t header[CANLOG_HEADER_SIZE];
+  if (fread(header, CANLOG_HEADER_SIZE, 1, lp->fp) != 1 ||
+      fetch_le32(header) != CANLOG_MAGIC ||
+      fetch_le16(header + 4) != CANLOG_VERSION ||
+      fetch_le16(header + 6) != CANLOG_RECORD_SIZE)
+    {
+    fclose(lp->fp);
+    free_log(lp);
+    return e_corrupt;
+    }
+
+  // keyframes are optional, a log without them is replayed from the start
+  if ((lp->index = fopen(lp->index_path, "rb")) != 0)
+    load_index(lp);
+
+  *log = lp;
+  return s_ok;
+  }
+
+result_t canlog_write(canlog_t *log, const timed_canmsg_t *msgs, uint32_t count)
+  {
+  if (log == 0 || msgs == 0)
+    return e_bad_parameter;
+
+  if (!log->writing)
+    return e_invalid_operation;
+
+  while (count > 0)
+    {
+    CANTRACE_BEGIN(trace);
+    uint32_t n = count > CANLOG_BATCH ? CANLOG_BATCH : count;
+    for (uint32_t i = 0; i < n; i++)
+      {
+      if (log->state != 0)
+        {
+        if (msgs[i].timestamp >= log->next_keyframe)
+          {
+          result_t result;
+          if (log->next_keyframe != 0 && failed(result = write_keyframe(log, msgs[i].timestamp)))
+            return result;
+
+          log->next_keyframe = ((msgs[i].timestamp / log->interval) + 1) * log->interval;
+          }
+
+        canlog_state_apply(log->state, &msgs[i], 1);
+        }
+
+      canlog_encode(&msgs[i], log->buffer + (i * CANLOG_RECORD_SIZE));
+      log->records++;
+      }
+
+    if (fwrite(log->buffer, CANLOG_RECORD_SIZE, n, log->fp) != n)
+      return e_no_space;
+
+    CANTRACE_END(trace, ts_log, n);
+    msgs += n;
+    count -= n;
+    }
+
+  return s_ok;
+  }
+
+result_t canlog_read(canlog_t *log, timed_canmsg_t *msgs, uint32_t *count)
+  {
+  if (log == 0 || msgs == 0 || count == 0)
+    return e_bad_parameter;
+
+  if (log->writing)
+    return e_invalid_operation;
+
+  uint32_t total = 0;
+  while (total < *count)
+    {
+    uint32_t n = *count - total;
+    if (n > CANLOG_BATCH)
+      n = CANLOG_BATCH;
+
+    // a partial record at the end of the file is ignored
+    size_t read = fread(log->buffer, CANLOG_RECORD_SIZE, n, log->fp);
+    for (size_t i = 0; i < read; i++)
+      canlog_decode(log->buffer + (i * CANLOG_RECORD_SIZE), &msgs[total + i]);
+
+    total += (uint32_t)read;
+    if (read < n)
+      break;
+    }
+
+  *count = total;
+  return total == 0 ? e_no_more_information : s_ok;
+  }
+
+result_t canlog_seek(canlog_t *log, uint64_t record)
+  {
+  if (log == 0)
+    return e_bad_parameter;
+
+  if (fseeko(log->fp, (off_t)(CANLOG_HEADER_SIZE + (record * CANLOG_RECORD_SIZE)), SEEK_SET) != 0)
+    return e_out_of_range;
+
+  return s_ok;
+  }
+
+result_t canlog_count(canlog_t *log, uint64_t *count)
+  {
+  if (log == 0 || count == 0)
+    return e_bad_parameter;
+
+  off_t pos = ftello(log->fp);
+  if (fseeko(log->fp, 0, SEEK_END) != 0)
+    return e_invalid_operation;
+
+  off_t end = ftello(log->fp);
+  fseeko(log->fp, pos, SEEK_SET);
+
+  *count = end < CANLOG_HEADER_SIZE ? 0 : (uint64_t)(end - CANLOG_HEADER_SIZE) / CANLOG_RECORD_SIZE;
+  return s_ok;
+  }
+
+result_t canlog_set_keyframes(canlog_t *log, uint64_t interval)
+  {
+  if (log == 0 || interval == 0)
+    return e_bad_parameter;
+
+  if (!log->writing || log->records > 0 || log->state != 0)
+    return e_invalid_operation;
+
+  if ((log->state = (canlog_state_t *)malloc(sizeof(canlog_state_t))) == 0)
+    return e_not_enough_memory;
+
+  canlog_state_clear(log->state);
+  log->interval = interval;
+
+  uint8_t header[CANLOG_INDEX_HEADER_SIZE];
+  memset(header, 0, sizeof(header));
+  put_le32(header, CANLOG_INDEX_MAGIC);
+  put_le16(header + 4, CANLOG_INDEX_VERSION);
+  put_le64(header + 8, interval);
+
+  if ((log->index = fopen(log->index_path, "wb")) == 0 ||
+      fwrite(header, sizeof(header), 1, log->index) != 1)
+    {
+    if (log->index != 0)
+      fclose(log->index);
+
+    log->index = 0;
+    free(log->state);
+    log->state = 0;
+    return e_no_space;
+    }
+
+  return s_ok;
+  }
+
+result_t canlog_seek_time(canlog_t *log, uint64_t timestamp, canlog_state_t *state)
+  {
+  if (log == 0 || state == 0)
+    return e_bad_parameter;
+
+  if (log->writing)
+    return e_invalid_operation;
+
+  canlog_state_clear(state);
+
+  // last keyframe at or before the time
+  uint32_t lo = 0;
+  uint32_t hi = log->num_entries;
+  while (lo < hi)
+    {
+    uint32_t mid = lo + ((hi - lo) >> 1);
+    if (log->entries[mid].timestamp <= timestamp)
+      lo = mid + 1;
+    else
+      hi = mid;
+    }
+
+  result_t result;
+  uint64_t record = 0;
+  const keyframe_entry_t *entry = lo > 0 ? &log->entries[lo - 1] : 0;
+  if (entry != 0)
+    {
+    uint64_t kf_timestamp;
+    uint16_t count;
+    if (failed(result = read_keyframe(log, entry->offset, &kf_timestamp, &record, &count)))
+      return result;
+
+    if (kf_timestamp != entry->timestamp || record != entry->record)
+      return e_corrupt;
+
+    for (uint16_t i = 0; i < count; i++)
+      {
+      timed_canmsg_t msg;
+      canlog_decode(log->buffer + (i * CANLOG_RECORD_SIZE), &msg);
+      set_latest(state, msg.timestamp, &msg.msg);
+      }
+    }
+
+  if (failed(result = canlog_seek(log, record)))
+    return result;
+
+  // replay the records since the keyframe
+  for (;;)
+    {
+    size_t n = fread(log->buffer, CANLOG_RECORD_SIZE, CANLOG_BATCH, log->fp);
+    for (size_t i = 0; i < n; i++)
+      {
+      timed_canmsg_t msg;
+      canlog_decode(log->buffer + (i * CANLOG_RECORD_SIZE), &msg);
+
+      // the keyframe was taken just before this record
+      if (entry != 0 && record == entry->record && i == 0 && msg.timestamp != entry->timestamp)
+        return e_corrupt;
+
+      if (msg.timestamp >= timestamp)
+        return canlog_seek(log, record + i);
+
+      canlog_state_apply(state, &msg, 1);
+      }
+
+    record += n;
+    if (n < CANLOG_BATCH)
+      return canlog_seek(log, record);
+    }
+  }
+
+result_t canlog_close(canlog_t *log)
+  {
+  if (log == 0)
+    return e_bad_parameter;
+
+  result_t result = s_ok;
+  if (log->writing && log->index != 0)
+    {
+    // the index is closed even if writing it failed
+    bool written = succeeded(write_index(log));
+    if (fclose(log->index) != 0 || !written)
+      result = e_no_space;
+
+    log->index = 0;
+    }
+
+  if (fclose(log->fp) != 0)
+    result = e_no_space;
+
+  free_log(log);
+  return result;
+  }
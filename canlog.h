@@ -0,0 +1,220 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#ifndef __canlog_h__
+#define __canlog_h__
+
+#include "neutron.h"
+
+/**
+ * @struct timed_canmsg_t
+ * A can message with the time it was received.
+ * @param timestamp Microseconds, from an arbitrary monotonic base
+ * @param msg       The message
+ */
+typedef struct _timed_canmsg_t {
+  uint64_t timestamp;
+  canmsg_t msg;
+  } timed_canmsg_t;
+
+/*************************************************
+ * A capture log is a file of timed messages.
+ *
+ * The file starts with a header, followed by fixed size records
+ * of the timestamp (8 bytes), the flags (2 bytes) and the 8 data bytes
+ * all stored little endian.
+ */
+#define CANLOG_MAGIC 0x474c4643       // 'CFLG'
+#define CANLOG_VERSION 1
+#define CANLOG_HEADER_SIZE 16
+#define CANLOG_RECORD_SIZE 18
+
+/*************************************************
+ * Keyframes.
+ *
+ * A writer can be asked to emit keyframes, which hold the latest message
+ * of every CanFly ID, at a fixed interval of capture time.  They are
+ * stored in a sidecar file <log>.idx so the record layout of the log is
+ * unchanged, with a sparse index of (time, record, offset) appended when
+ * the log is closed.  If the writer stops without closing, the index is
+ * rebuilt by walking the keyframes.
+ *
+ * canlog_seek_time finds the keyframe before a time by a binary search
+ * of the index, loads it and replays only the records after it, so the
+ * cost of a seek is bounded by the keyframe interval rather than the
+ * length of the flight.  Timestamps in a log are expected to be in order.
+ *
+ * Index file, little endian
+ * header    magic 'CFKX' (4), version (2), 0 (2), interval (8)
+ * keyframe  magic 'CFKF' (4), count (2), 0 (2), timestamp (8),
+ *           record (8), count * log record, crc32 (4)
+ * index     count * (timestamp (8), record (8), offset (8))
+ * footer    offset of index (8), count (4), crc32 of index (4), magic 'CFKI' (4)
+ *
+ * The keyframe timestamp and record are those of the first record that
+ * the keyframe state does not include.
+ */
+#define CANLOG_INDEX_SUFFIX ".idx"
+#define CANLOG_SUMMARY_SUFFIX ".blk"  // block summary built by canquery
+#define CANLOG_INDEX_MAGIC 0x584b4643     // 'CFKX'
+#define CANLOG_KEYFRAME_MAGIC 0x464b4643  // 'CFKF'
+#define CANLOG_FOOTER_MAGIC 0x494b4643    // 'CFKI'
+#define CANLOG_INDEX_VERSION 1
+#define CANLOG_INDEX_HEADER_SIZE 16
+#define CANLOG_KEYFRAME_HEADER_SIZE 24
+#define CANLOG_INDEX_ENTRY_SIZE 24
+#define CANLOG_FOOTER_SIZE 20
+
+/**
+ * @struct canlog_state_t
+ * The latest message of each CanFly ID.
+ * @param valid     Bit per ID that has a message
+ * @param latest    Last message of each ID, packed messages are expanded
+ */
+typedef struct _canlog_state_t {
+  uint64_t valid[NUM_CAN_IDS / 64];
+  timed_canmsg_t latest[NUM_CAN_IDS];
+  } canlog_state_t;
+
+/**
+ * @brief Return the latest message of an ID
+ * @param state State to query
+ * @param id    CanFly ID
+ * @return The message, 0 if none has been seen
+ */
+static inline const timed_canmsg_t *canlog_state_get(const canlog_state_t *state, uint16_t id)
+  {
+  id &= ID_MASK;
+  return (state->valid[id >> 6] & (1ULL << (id & 63))) != 0 ? &state->latest[id] : 0;
+  }
+/**
+ * @brief Clear a state
+ * @param state State to clear
+ */
+extern void canlog_state_clear(canlog_state_t *state);
+/**
+ * @brief Update a state with messages
+ * @param state State to update
+ * @param msgs  Messages, in time order
+ * @param count Number of messages
+ */
+extern void canlog_state_apply(canlog_state_t *state, const timed_canmsg_t *msgs, uint32_t count);
+
+typedef struct _canlog_t canlog_t;
+/**
+ * @brief Create a new capture log, truncating any existing file
+ * @param path  Path to the file
+ * @param log   Opened log
+ * @return s_ok if the log was created
+ */
+extern result_t canlog_create(const char *path, canlog_t **log);
+/**
+ * @brief Open an existing capture log for reading
+ * @param path  Path to the file
+ * @param log   Opened log
+ * @return s_ok if opened, e_path_not_found if the file does not exist,
+ * e_corrupt if the file is not a capture log
+ */
+extern result_t canlog_open(const char *path, canlog_t **log);
+/**
+ * @brief Append messages to a log opened with canlog_create
+ * @param log   Log to write to
+ * @param msgs  Messages to write
+ * @param count Number of messages
+ * @return s_ok if written
+ */
+extern result_t canlog_write(canlog_t *log, const timed_canmsg_t *msgs, uint32_t count);
+/**
+ * @brief Read the next batch of messages from a log
+ * @param log   Log to read from
+ * @param msgs  Buffer to read into
+ * @param count On entry the size of the buffer, on exit the number read
+ * @return s_ok if messages are returned, e_no_more_information at the end of the log
+ */
+extern result_t canlog_read(canlog_t *log, timed_canmsg_t *msgs, uint32_t *count);
+/**
+ * @brief Position the log at a record
+ * @param log     Log to position
+ * @param record  Record number, 0 is the first message
+ * @return s_ok if the log was positioned
+ */
+extern result_t canlog_seek(canlog_t *log, uint64_t record);
+/**
+ * @brief Return the number of records in a log
+ * @param log     Log
+ * @param count   Number of records
+ * @return s_ok if the count is returned
+ */
+extern result_t canlog_count(canlog_t *log, uint64_t *count);
+/**
+ * @brief Emit keyframes while writing a log
+ * @param log       Log opened with canlog_create, before anything is written
+ * @param interval  Capture time between keyframes, microseconds
+ * @return s_ok if keyframes will be written
+ */
+extern result_t canlog_set_keyframes(canlog_t *log, uint64_t interval);
+/**
+ * @brief Position a log at a time and return the state at that time
+ * @param log       Log opened with canlog_open
+ * @param timestamp Time to seek to
+ * @param state     Latest message of each ID before the time
+ * @return s_ok if the log is positioned at the first record at or after
+ * the time (or the end of the log), e_corrupt if a keyframe does not
+ * match the log.  A log without keyframes is replayed from the start.
+ */
+extern result_t canlog_seek_time(canlog_t *log, uint64_t timestamp, canlog_state_t *state);
+/**
+ * @brief Flush and close a log
+ * @param log Log to close
+ * @return s_ok if closed
+ */
+extern result_t canlog_close(canlog_t *log);
+/**
+ * @brief Encode a timed message as a log record
+ * @param msg     Message to encode
+ * @param buffer  CANLOG_RECORD_SIZE bytes
+ */
+extern void canlog_encode(const timed_canmsg_t *msg, uint8_t *buffer);
+/**
+ * @brief Decode a log record
+ * @param buffer  CANLOG_RECORD_SIZE bytes
+ * @param msg     Decoded message
+ */
+extern void canlog_decode(const uint8_t *buffer, timed_canmsg_t *msg);
+
+#endif
@@ -0,0 +1,396 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#include "canmerge.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct _recent_t {
+  uint64_t timestamp;
+  uint64_t data;
+  uint16_t flags;
+  uint8_t buses;                // buses that delivered the message, 0 if unused
+  } recent_t;
+
+typedef struct _merge_bus_t {
+  canqueue_t queue;
+  timed_canmsg_t *storage;
+  timed_canmsg_t batch[CANMERGE_BATCH];  // messages taken from the queue
+  uint32_t first;
+  uint32_t count;
+  uint64_t watermark;           // time of the latest message taken
+  bool heard;                   // a message has been taken
+  bool closed;                  // set by the producer
+  bool drained;                 // closed and nothing left
+  uint64_t dropped;             // updated by the producer
+  canmerge_bus_stats_t stats;
+  } merge_bus_t;
+
+struct _canmerge_t {
+  canmerge_config_t config;
+  merge_bus_t buses[CANMERGE_MAX_BUSES];
+  uint16_t heap[CANMERGE_MAX_BUSES];  // buses with messages in hand
+  uint16_t heap_size;
+  uint64_t last_time;           // time of the last message delivered
+  bool finished;
+  uint8_t carriers[NUM_CAN_IDS];      // buses that have carried each ID
+  uint8_t next[NUM_CAN_IDS];          // next recent slot of each ID
+  recent_t recent[NUM_CAN_IDS][CANMERGE_RECENT];
+  };
+
+result_t canmerge_create(const canmerge_config_t *config, canmerge_t **merge)
+  {
+  if (config == 0 || merge == 0 ||
+      config->num_buses == 0 || config->num_buses > CANMERGE_MAX_BUSES ||
+      config->capacity < 2 || (config->capacity & (config->capacity - 1)) != 0)
+    return e_bad_parameter;
+
+  canmerge_t *mp = (canmerge_t *)calloc(1, sizeof(canmerge_t));
+  if (mp == 0)
+    return e_not_enough_memory;
+
+  mp->config = *config;
+  for (uint16_t b = 0; b < config->num_buses; b++)
+    {
+    merge_bus_t *bus = &mp->buses[b];
+    if ((bus->storage = (timed_canmsg_t *)malloc(sizeof(timed_canmsg_t) * config->capacity)) == 0)
+      {
+      canmerge_close(mp);
+      return e_not_enough_memory;
+      }
+
+    canqueue_init(&bus->queue, bus->storage, config->capacity);
+    }
+
+  *merge = mp;
+  return s_ok;
+  }
+
+uint32_t canmerge_space(canmerge_t *merge, uint16_t bus)
+  {
+  if (merge == 0 || bus >= merge->config.num_buses)
+    return 0;
+
+  canqueue_t *queue = &merge->buses[bus].queue;
+  uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+  return (queue->mask + 1) - (head - tail);
+  }
+
+result_t canmerge_push(canmerge_t *merge, uint16_t bus, const timed_canmsg_t *msgs, uint32_t count)
+  {
+  if (merge == 0 || bus >= merge->config.num_buses || (msgs == 0 && count > 0))
+    return e_bad_parameter;
+
+  if (count == 0)
+    return s_ok;
+
+  uint32_t queued = count;
+  canqueue_push(&merge->buses[bus].queue, msgs, &queued);
+  if (queued == count)
+    return s_ok;
+
+  __atomic_fetch_add(&merge->buses[bus].dropped, count - queued, __ATOMIC_RELAXED);
+  return e_no_space;
+  }
+
+result_t canmerge_close_bus(canmerge_t *merge, uint16_t bus)
+  {
+  if (merge == 0 || bus >= merge->config.num_buses)
+    return e_bad_parameter;
+
+  __atomic_store_n(&merge->buses[bus].closed, true, __ATOMIC_RELEASE);
+  return s_ok;
+  }
+
+static uint64_t head_time(const canmerge_t *merge, uint16_t bus)
+  {
+  const merge_bus_t *bp = &merge->buses[bus];
+  return bp->batch[bp->first].timestamp;
+  }
+
+// ties go to the lower bus so the merge is repeatable
+static bool earlier(const canmerge_t *merge, uint16_t a, uint16_t b)
+  {
+  uint64_t ta = head_time(merge, a);
+  uint64_t tb = head_time(merge, b);
+  return ta < tb || (ta == tb && a < b);
+  }
+
+static void sift_down(canmerge_t *merge, uint16_t pos)
+  {
+  uint16_t *heap = merge->heap;
+  for (;;)
+    {
+    uint16_t child = (pos << 1) + 1;
+    if (child >= merge->heap_size)
+      break;
+
+    if (child + 1 < merge->heap_size && earlier(merge, heap[child + 1], heap[child]))
+      child++;
+
+    if (!earlier(merge, heap[child], heap[pos]))
+      break;
+
+    uint16_t swap = heap[pos];
+    heap[pos] = heap[child];
+    heap[child] = swap;
+    pos = child;
+    }
+  }
+
+static void heap_add(canmerge_t *merge, uint16_t bus)
+  {
+  uint16_t *heap = merge->heap;
+  uint16_t pos = merge->heap_size++;
+  heap[pos] = bus;
+
+  while (pos > 0)
+    {
+    uint16_t parent = (pos - 1) >> 1;
+    if (!earlier(merge, heap[pos], heap[parent]))
+      break;
+
+    uint16_t swap = heap[pos];
+    heap[pos] = heap[parent];
+    heap[parent] = swap;
+    pos = parent;
+    }
+  }
+
+// take the next batch from a bus queue, false if there is none
+static bool refill(canmerge_t *merge, uint16_t bus)
+  {
+  merge_bus_t *bp = &merge->buses[bus];
+  if (bp->drained)
+    return false;
+
+  // read before the queue, everything pushed before the close is then seen
+  bool closed = __atomic_load_n(&bp->closed, __ATOMIC_ACQUIRE);
+
+  uint32_t count = CANMERGE_BATCH;
+  if (failed(canqueue_pop(&bp->queue, bp->batch, &count)))
+    {
+    bp->drained = closed;
+    return false;
+    }
+
+  bp->first = 0;
+  bp->count = count;
+  bp->watermark = bp->batch[count - 1].timestamp;
+  bp->heard = true;
+  bp->stats.received += count;
+  return true;
+  }
+
+// count a miss for each carrier of the ID that did not deliver the message
+static void account(canmerge_t *merge, uint16_t id, const recent_t *recent)
+  {
+  if (recent->buses == 0)
+    return;
+
+  for (uint8_t missing = merge->carriers[id] & ~recent->buses; missing != 0; missing &= missing - 1)
+    merge->buses[__builtin_ctz(missing)].stats.missed++;
+  }
+
+// true if the message is delivered rather than being a duplicate or late
+static bool deliver(canmerge_t *merge, uint16_t bus, const timed_canmsg_t *msg)
+  {
+  merge_bus_t *bp = &merge->buses[bus];
+  uint16_t id = get_can_id(&msg->msg);
+  uint8_t bit = (uint8_t)(1 << bus);
+  uint64_t data;
+  memcpy(&data, msg->msg.data, sizeof(data));
+
+  merge->carriers[id] |= bit;
+
+  recent_t *recent = merge->recent[id];
+  for (uint16_t i = 0; i < CANMERGE_RECENT; i++)
+    {
+    recent_t *r = &recent[i];
+    if (r->buses == 0 || (r->buses & bit) != 0 || r->flags != msg->msg.flags || r->data != data)
+      continue;
+
+    uint64_t gap = msg->timestamp > r->timestamp ? msg->timestamp - r->timestamp : r->timestamp - msg->timestamp;
+    if (gap <= merge->config.window)
+      {
+      r->buses |= bit;
+      bp->stats.duplicates++;
+      return false;
+      }
+    }
+
+  if (msg->timestamp < merge->last_time)
+    {
+    bp->stats.late++;
+    return false;
+    }
+
+  recent_t *r = &recent[merge->next[id]];
+  merge->next[id] = (merge->next[id] + 1) % CANMERGE_RECENT;
+  account(merge, id, r);
+
+  r->timestamp = msg->timestamp;
+  r->data = data;
+  r->flags = msg->msg.flags;
+  r->buses = bit;
+
+  merge->last_time = msg->timestamp;
+  bp->stats.delivered++;
+  return true;
+  }
+
+// true if no bus with nothing in hand can still send a message before the time
+static bool releasable(canmerge_t *merge, uint64_t timestamp, uint64_t now, bool *added)
+  {
+  bool waiting = false;
+  *added = false;
+
+  for (uint16_t b = 0; b < merge->config.num_buses; b++)
+    {
+    merge_bus_t *bp = &merge->buses[b];
+    if (bp->count > 0 || bp->drained)
+      continue;
+
+    if (refill(merge, b))
+      {
+      heap_add(merge, b);
+      *added = true;
+      }
+    else if (!bp->drained && !(bp->heard && bp->watermark >= timestamp))
+      waiting = true;
+    }
+
+  if (!waiting)
+    return true;
+
+  return merge->config.latency != 0 && now >= timestamp && now - timestamp >= merge->config.latency;
+  }
+
+result_t canmerge_pop(canmerge_t *merge, uint64_t now, timed_canmsg_t *msgs, uint32_t *count)
+  {
+  if (merge == 0 || msgs == 0 || count == 0)
+    return e_bad_parameter;
+
+  uint32_t n = 0;
+  while (n < *count)
+    {
+    if (merge->heap_size == 0)
+      {
+      // every bus is empty, see if any has more
+      bool added = false;
+      for (uint16_t b = 0; b < merge->config.num_buses; b++)
+        if (merge->buses[b].count == 0 && refill(merge, b))
+          {
+          heap_add(merge, b);
+          added = true;
+          }
+
+      if (!added)
+        break;
+      }
+
+    uint16_t bus = merge->heap[0];
+    merge_bus_t *bp = &merge->buses[bus];
+
+    bool added;
+    if (!releasable(merge, bp->batch[bp->first].timestamp, now, &added))
+      break;
+
+    // a bus that was topped up may have something earlier
+    if (added && merge->heap[0] != bus)
+      continue;
+
+    timed_canmsg_t msg = bp->batch[bp->first];
+    bp->first++;
+    bp->count--;
+
+    if (bp->count > 0 || refill(merge, bus))
+      sift_down(merge, 0);
+    else
+      {
+      merge->heap[0] = merge->heap[--merge->heap_size];
+      sift_down(merge, 0);
+      }
+
+    if (deliver(merge, bus, &msg))
+      msgs[n++] = msg;
+    }
+
+  *count = n;
+  if (n > 0)
+    return s_ok;
+
+  for (uint16_t b = 0; b < merge->config.num_buses; b++)
+    if (!merge->buses[b].drained)
+      return e_no_more_information;
+
+  // the end of every bus, count the misses of the messages still held
+  if (!merge->finished)
+    {
+    merge->finished = true;
+    for (uint16_t id = 0; id < NUM_CAN_IDS; id++)
+      for (uint16_t i = 0; i < CANMERGE_RECENT; i++)
+        account(merge, id, &merge->recent[id][i]);
+    }
+
+  return e_stream_closed;
+  }
+
+result_t canmerge_stats(canmerge_t *merge, uint16_t bus, canmerge_bus_stats_t *stats)
+  {
+  if (merge == 0 || bus >= merge->config.num_buses || stats == 0)
+    return e_bad_parameter;
+
+  *stats = merge->buses[bus].stats;
+  stats->dropped = __atomic_load_n(&merge->buses[bus].dropped, __ATOMIC_RELAXED);
+  return s_ok;
+  }
+
+result_t canmerge_close(canmerge_t *merge)
+  {
+  if (merge == 0)
+    return e_bad_parameter;
+
+  for (uint16_t b = 0; b < CANMERGE_MAX_BUSES; b++)
+    free(merge->buses[b].storage);
+
+  free(merge);
+  return s_ok;
+  }
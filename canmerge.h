@@ -0,0 +1,144 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#ifndef __canmerge_h__
+#define __canmerge_h__
+
+#include "canqueue.h"
+
+/*************************************************
+ * Merge of redundant buses.
+ *
+ * Each bus feeds a canqueue_t, so a reader thread per interface can
+ * push while one thread merges.  The merge keeps a min heap of the
+ * buses ordered by the time of the next message on each, and takes the
+ * earliest message once every bus that has nothing queued has been
+ * heard from at or after that time, or has been closed.  A live bus
+ * that goes quiet would hold the merge up, so a latency can be set
+ * after which messages are released without waiting for it.
+ *
+ * A message is a duplicate if a message with the same flags and data
+ * was delivered from another bus within the window.  The last few
+ * messages delivered for each ID are kept for this, so the work per
+ * message is fixed and nothing is allocated after canmerge_create.
+ *
+ * When the record of a delivered message is reused, each bus that has
+ * carried the ID but did not deliver a copy of the message is counted
+ * as having missed it.  The window should be shorter than the period
+ * of the ID's so a repeated value is not taken as a duplicate.
+ */
+#define CANMERGE_MAX_BUSES 8
+// messages remembered per ID for duplicate detection
+#define CANMERGE_RECENT 4
+// messages taken from a bus queue at once
+#define CANMERGE_BATCH 256
+
+typedef struct _canmerge_config_t {
+  uint16_t num_buses;
+  uint32_t capacity;            // messages queued per bus, a power of 2
+  uint32_t window;              // duplicate window, microseconds
+  uint32_t latency;             // longest wait for a quiet bus, microseconds, 0 to wait until it is closed
+  } canmerge_config_t;
+
+typedef struct _canmerge_bus_stats_t {
+  uint64_t received;            // messages taken from the bus
+  uint64_t delivered;           // messages this bus delivered first
+  uint64_t duplicates;          // messages already delivered by another bus
+  uint64_t missed;              // messages delivered by another bus and not seen on this one
+  uint64_t late;                // messages older than one already delivered, discarded
+  uint64_t dropped;             // messages the bus queue had no room for
+  } canmerge_bus_stats_t;
+
+typedef struct _canmerge_t canmerge_t;
+
+/**
+ * @brief Create a merge
+ * @param config  Buses and windows
+ * @param merge   Created merge
+ * @return s_ok if created
+ */
+extern result_t canmerge_create(const canmerge_config_t *config, canmerge_t **merge);
+/**
+ * @brief Return the number of messages a bus can queue
+ * @param merge Merge
+ * @param bus   Bus number
+ * @return Free space in the bus queue
+ */
+extern uint32_t canmerge_space(canmerge_t *merge, uint16_t bus);
+/**
+ * @brief Queue messages received on a bus, called by the bus's producer
+ * @param merge Merge
+ * @param bus   Bus number
+ * @param msgs  Messages, in time order
+ * @param count Number of messages
+ * @return s_ok if all were queued, e_no_space if some were dropped
+ */
+extern result_t canmerge_push(canmerge_t *merge, uint16_t bus, const timed_canmsg_t *msgs, uint32_t count);
+/**
+ * @brief Mark the end of a bus, called by the bus's producer after its last push
+ * @param merge Merge
+ * @param bus   Bus number
+ * @return s_ok if closed
+ */
+extern result_t canmerge_close_bus(canmerge_t *merge, uint16_t bus);
+/**
+ * @brief Take the merged messages that are ready
+ * @param merge Merge
+ * @param now   Current time in the time base of the messages, used with the latency
+ * @param msgs  Buffer for the messages
+ * @param count On entry the size of the buffer, on exit the number returned
+ * @return s_ok if messages are returned, e_no_more_information if none
+ * are ready, e_stream_closed once every bus is closed and drained
+ */
+extern result_t canmerge_pop(canmerge_t *merge, uint64_t now, timed_canmsg_t *msgs, uint32_t *count);
+/**
+ * @brief Return the statistics of a bus, called by the thread that pops
+ * @param merge Merge
+ * @param bus   Bus number
+ * @param stats Statistics
+ * @return s_ok if returned
+ */
+extern result_t canmerge_stats(canmerge_t *merge, uint16_t bus, canmerge_bus_stats_t *stats);
+/**
+ * @brief Release a merge
+ * @param merge Merge to release
+ * @return s_ok if released
+ */
+extern result_t canmerge_close(canmerge_t *merge);
+
+#endif
@@ -0,0 +1,547 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#define _GNU_SOURCE
+#include "canpipe.h"
+#include "cantrace.h"
+#include "canstats.h"
+#include "canclock.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define SHARDS_PER_THREAD 8
+
+typedef struct _pipe_shard_t {
+  pthread_mutex_t lock;         // guards pending and scheduled
+  timed_canmsg_t *pending;      // appended by submit
+  uint32_t num_pending;
+  uint32_t pending_capacity;
+  timed_canmsg_t *work;         // swapped with pending by the worker decoding the shard
+  uint32_t work_capacity;
+  bool scheduled;               // on a deque or being decoded
+  uint16_t home;                // worker whose deque the shard is pushed to
+  } pipe_shard_t;
+
+typedef struct _pipe_worker_t {
+  canpipe_t *pipe;
+  uint16_t index;
+  pthread_t thread;
+  pthread_mutex_t lock;         // guards the deque and the statistics
+  uint16_t *deque;              // ring of shards, each shard is on at most one deque
+  uint32_t head;                // oldest, where thieves take from
+  uint32_t count;
+  canpipe_worker_stats_t stats;
+  } pipe_worker_t;
+
+struct _canpipe_t {
+  canpipe_config_t config;
+  pipe_shard_t *shards;
+  pipe_worker_t *workers;
+  uint16_t num_started;
+  pthread_mutex_t lock;         // guards the waits below
+  pthread_cond_t work_cond;     // idle workers wait for shards
+  pthread_cond_t done_cond;     // submit and flush wait for decoding
+  uint16_t idle;
+  bool closing;
+  _Atomic uint32_t queued;      // shards on deques
+  _Atomic uint64_t in_flight;   // messages submitted and not yet decoded
+  _Atomic bool waiting;         // submit or flush is waiting
+  uint64_t started_ns;
+  // submission scratch, used only by the submitting thread
+  timed_canmsg_t *scratch;
+  uint32_t scratch_capacity;
+  uint32_t *shard_counts;
+  };
+
+static inline uint16_t shard_of(const canpipe_t *pipe, const canmsg_t *msg)
+  {
+  return get_can_id(msg) % pipe->config.num_shards;
+  }
+
+static void push_shard(canpipe_t *pipe, uint16_t shard)
+  {
+  pipe_worker_t *worker = &pipe->workers[pipe->shards[shard].home];
+  pthread_mutex_lock(&worker->lock);
+  worker->deque[(worker->head + worker->count++) % pipe->config.num_shards] = shard;
+  pthread_mutex_unlock(&worker->lock);
+
+  atomic_fetch_add(&pipe->queued, 1);
+
+  pthread_mutex_lock(&pipe->lock);
+  if (pipe->idle > 0)
+    pthread_cond_signal(&pipe->work_cond);
+  pthread_mutex_unlock(&pipe->lock);
+  }
+
+// the newest shard of a worker's own deque, or the oldest of another's
+static bool take_shard(pipe_worker_t *worker, bool steal, uint16_t *shard)
+  {
+  canpipe_t *pipe = worker->pipe;
+  bool taken = false;
+
+  pthread_mutex_lock(&worker->lock);
+  if (worker->count > 0)
+    {
+    if (steal)
+      {
+      *shard = worker->deque[worker->head];
+      worker->head = (worker->head + 1) % pipe->config.num_shards;
+      }
+    else
+      *shard = worker->deque[(worker->head + worker->count - 1) % pipe->config.num_shards];
+
+    worker->count--;
+    taken = true;
+    }
+  pthread_mutex_unlock(&worker->lock);
+
+  if (taken)
+    atomic_fetch_sub(&pipe->queued, 1);
+
+  return taken;
+  }
+
+static bool find_shard(pipe_worker_t *worker, uint16_t *shard, bool *stolen)
+  {
+  canpipe_t *pipe = worker->pipe;
+  *stolen = false;
+  if (take_shard(worker, false, shard))
+    return true;
+
+  uint16_t num_threads = pipe->config.num_threads;
+  for (uint16_t i = 1; i < num_threads; i++)
+    if (take_shard(&pipe->workers[(worker->index + i) % num_threads], true, shard))
+      {
+      *stolen = true;
+      return true;
+      }
+
+  return false;
+  }
+
+static void decoded(canpipe_t *pipe, uint32_t count)
+  {
+  atomic_fetch_sub(&pipe->in_flight, count);
+  if (atomic_load(&pipe->waiting))
+    {
+    pthread_mutex_lock(&pipe->lock);
+    pthread_cond_broadcast(&pipe->done_cond);
+    pthread_mutex_unlock(&pipe->lock);
+    }
+  }
+
+// decode everything pending on a shard, then release it
+static void decode_shard(pipe_worker_t *worker, uint16_t index)
+  {
+  canpipe_t *pipe = worker->pipe;
+  const canpipe_config_t *config = &pipe->config;
+  pipe_shard_t *shard = &pipe->shards[index];
+
+  for (;;)
+    {
+    pthread_mutex_lock(&shard->lock);
+    uint32_t count = shard->num_pending;
+    if (count == 0)
+      {
+      shard->scheduled = false;
+      pthread_mutex_unlock(&shard->lock);
+      return;
+      }
+
+    timed_canmsg_t *msgs = shard->pending;
+    uint32_t capacity = shard->pending_capacity;
+    shard->pending = shard->work;
+    shard->pending_capacity = shard->work_capacity;
+    shard->num_pending = 0;
+    shard->work = msgs;
+    shard->work_capacity = capacity;
+    pthread_mutex_unlock(&shard->lock);
+
+    uint64_t start = monotonic_ns();
+    uint64_t errors = 0;
+    for (uint32_t i = 0; i < count; i++)
+      {
+      variant_t value;
+      variant_t coerced;
+      result_t result = config->live ?
+                        canstats_decode(&msgs[i].msg, msgs[i].timestamp, &value) :
+                        msg_to_variant(&msgs[i].msg, &value);
+      if (failed(result) ||
+          (config->coerce != v_none && failed(coerce_variant(&value, &coerced, config->coerce))))
+        {
+        errors++;
+        continue;
+        }
+
+      if (config->callback != 0)
+        {
+        CANTRACE_BEGIN(trace);
+        (*config->callback)(worker->index, msgs[i].timestamp, &msgs[i].msg,
+                            config->coerce != v_none ? &coerced : &value, config->arg);
+        CANTRACE_END(trace, ts_rules, get_can_id(&msgs[i].msg));
+        }
+      }
+
+    uint64_t busy = monotonic_ns() - start;
+    pthread_mutex_lock(&worker->lock);
+    worker->stats.messages += count;
+    worker->stats.errors += errors;
+    worker->stats.runs++;
+    worker->stats.busy_ns += busy;
+    pthread_mutex_unlock(&worker->lock);
+
+    decoded(pipe, count);
+    }
+  }
+
+static void *pipe_worker(void *arg)
+  {
+  pipe_worker_t *worker = (pipe_worker_t *)arg;
+  canpipe_t *pipe = worker->pipe;
+
+  for (;;)
+    {
+    uint16_t shard;
+    bool stolen;
+    if (find_shard(worker, &shard, &stolen))
+      {
+      if (stolen)
+        {
+        pthread_mutex_lock(&worker->lock);
+        worker->stats.steals++;
+        pthread_mutex_unlock(&worker->lock);
+        }
+
+      decode_shard(worker, shard);
+      continue;
+      }
+
+    pthread_mutex_lock(&pipe->lock);
+    if (atomic_load(&pipe->queued) == 0)
+      {
+      if (pipe->closing)
+        {
+        pthread_mutex_unlock(&pipe->lock);
+        break;
+        }
+
+      pipe->idle++;
+      pthread_cond_wait(&pipe->work_cond, &pipe->lock);
+      pipe->idle--;
+      }
+    pthread_mutex_unlock(&pipe->lock);
+    }
+
+  return 0;
+  }
+
+static void free_pipe(canpipe_t *pipe)
+  {
+  if (pipe->shards != 0)
+    for (uint16_t i = 0; i < pipe->config.num_shards; i++)
+      {
+      pthread_mutex_destroy(&pipe->shards[i].lock);
+      free(pipe->shards[i].pending);
+      free(pipe->shards[i].work);
+      }
+
+  if (pipe->workers != 0)
+    for (uint16_t i = 0; i < pipe->config.num_threads; i++)
+      {
+      pthread_mutex_destroy(&pipe->workers[i].lock);
+      free(pipe->workers[i].deque);
+      }
+
+  pthread_cond_destroy(&pipe->work_cond);
+  pthread_cond_destroy(&pipe->done_cond);
+  pthread_mutex_destroy(&pipe->lock);
+  free(pipe->shards);
+  free(pipe->workers);
+  free(pipe->scratch);
+  free(pipe->shard_counts);
+  free(pipe);
+  }
+
+static void stop_workers(canpipe_t *pipe)
+  {
+  pthread_mutex_lock(&pipe->lock);
+  pipe->closing = true;
+  pthread_cond_broadcast(&pipe->work_cond);
+  pthread_mutex_unlock(&pipe->lock);
+
+  for (uint16_t i = 0; i < pipe->num_started; i++)
+    pthread_join(pipe->workers[i].thread, 0);
+  }
+
+result_t canpipe_create(const canpipe_config_t *config, canpipe_t **pipe)
+  {
+  if (config == 0 || pipe == 0 || config->num_threads == 0 || config->capacity == 0)
+    return e_bad_parameter;
+
+  canpipe_t *pp = (canpipe_t *)calloc(1, sizeof(canpipe_t));
+  if (pp == 0)
+    return e_not_enough_memory;
+
+  pp->config = *config;
+  if (pp->config.num_shards == 0)
+    pp->config.num_shards = config->num_threads * SHARDS_PER_THREAD > NUM_CAN_IDS
+                          ? NUM_CAN_IDS : config->num_threads * SHARDS_PER_THREAD;
+
+  pthread_mutex_init(&pp->lock, 0);
+  pthread_cond_init(&pp->work_cond, 0);
+  pthread_cond_init(&pp->done_cond, 0);
+  atomic_init(&pp->queued, 0);
+  atomic_init(&pp->in_flight, 0);
+  atomic_init(&pp->waiting, false);
+  pp->started_ns = monotonic_ns();
+
+  uint16_t num_shards = pp->config.num_shards;
+  uint16_t num_threads = pp->config.num_threads;
+  pp->shards = (pipe_shard_t *)calloc(num_shards, sizeof(pipe_shard_t));
+  pp->workers = (pipe_worker_t *)calloc(num_threads, sizeof(pipe_worker_t));
+  pp->shard_counts = (uint32_t *)calloc(num_shards + 1, sizeof(uint32_t));
+  if (pp->shards == 0 || pp->workers == 0 || pp->shard_counts == 0)
+    {
+    free_pipe(pp);
+    return e_not_enough_memory;
+    }
+
+  for (uint16_t i = 0; i < num_shards; i++)
+    {
+    pthread_mutex_init(&pp->shards[i].lock, 0);
+    pp->shards[i].home = i % num_threads;
+    }
+
+  result_t result = s_ok;
+  for (uint16_t i = 0; i < num_threads; i++)
+    {
+    pipe_worker_t *worker = &pp->workers[i];
+    worker->pipe = pp;
+    worker->index = i;
+    pthread_mutex_init(&worker->lock, 0);
+    if ((worker->deque = (uint16_t *)malloc(sizeof(uint16_t) * num_shards)) == 0)
+      result = e_not_enough_memory;
+    }
+
+  for (; pp->num_started < num_threads && succeeded(result); pp->num_started++)
+    if (pthread_create(&pp->workers[pp->num_started].thread, 0, pipe_worker, &pp->workers[pp->num_started]) != 0)
+      {
+      result = e_invalid_operation;
+      break;
+      }
+
+  if (failed(result))
+    {
+    stop_workers(pp);
+    free_pipe(pp);
+    return result;
+    }
+
+  *pipe = pp;
+  return s_ok;
+  }
+
+static result_t append(pipe_shard_t *shard, const timed_canmsg_t *msgs, uint32_t count, bool *schedule)
+  {
+  pthread_mutex_lock(&shard->lock);
+  if (shard->num_pending + count > shard->pending_capacity)
+    {
+    uint32_t capacity = shard->pending_capacity == 0 ? 1024 : shard->pending_capacity;
+    while (capacity < shard->num_pending + count)
+      capacity *= 2;
+
+    timed_canmsg_t *pending = (timed_canmsg_t *)realloc(shard->pending, sizeof(timed_canmsg_t) * capacity);
+    if (pending == 0)
+      {
+      pthread_mutex_unlock(&shard->lock);
+      return e_not_enough_memory;
+      }
+
+    shard->pending = pending;
+    shard->pending_capacity = capacity;
+    }
+
+  memcpy(shard->pending + shard->num_pending, msgs, sizeof(timed_canmsg_t) * count);
+  shard->num_pending += count;
+  *schedule = !shard->scheduled;
+  shard->scheduled = true;
+  pthread_mutex_unlock(&shard->lock);
+  return s_ok;
+  }
+
+// wait until at most limit messages are in flight
+static void wait_in_flight(canpipe_t *pipe, uint64_t limit)
+  {
+  if (atomic_load(&pipe->in_flight) <= limit)
+    return;
+
+  pthread_mutex_lock(&pipe->lock);
+  atomic_store(&pipe->waiting, true);
+  while (atomic_load(&pipe->in_flight) > limit)
+    pthread_cond_wait(&pipe->done_cond, &pipe->lock);
+  atomic_store(&pipe->waiting, false);
+  pthread_mutex_unlock(&pipe->lock);
+  }
+
+result_t canpipe_submit(canpipe_t *pipe, const timed_canmsg_t *msgs, uint32_t count)
+  {
+  if (pipe == 0 || (msgs == 0 && count > 0))
+    return e_bad_parameter;
+
+  if (count == 0)
+    return s_ok;
+
+  // packed messages can expand to several
+  uint64_t most = (uint64_t)count * PACKED_UINT16_MAX;
+  if (most > UINT32_MAX)
+    return e_bad_parameter;
+
+  if (most > pipe->scratch_capacity)
+    {
+    timed_canmsg_t *scratch = (timed_canmsg_t *)malloc(sizeof(timed_canmsg_t) * most * 2);
+    if (scratch == 0)
+      return e_not_enough_memory;
+
+    free(pipe->scratch);
+    pipe->scratch = scratch;
+    pipe->scratch_capacity = (uint32_t)most;
+    }
+
+  // expand into the second half of the scratch, counting the messages of each shard
+  uint16_t num_shards = pipe->config.num_shards;
+  uint32_t *counts = pipe->shard_counts;
+  timed_canmsg_t *expanded = pipe->scratch + pipe->scratch_capacity;
+  uint32_t num_expanded = 0;
+  memset(counts, 0, sizeof(uint32_t) * (num_shards + 1));
+  for (uint32_t i = 0; i < count; i++)
+    {
+    const canmsg_t *msg = &msgs[i].msg;
+    if (get_can_len(msg) > 0 && msg->data[0] == CANFLY_PACKED_UINT16)
+      {
+      canmsg_t values[PACKED_UINT16_MAX];
+      uint16_t num_values;
+      if (failed(expand_packed_msg(msg, values, &num_values)))
+        num_values = 0;
+
+      for (uint16_t j = 0; j < num_values; j++)
+        {
+        expanded[num_expanded].timestamp = msgs[i].timestamp;
+        expanded[num_expanded].msg = values[j];
+        counts[shard_of(pipe, &values[j]) + 1]++;
+        num_expanded++;
+        }
+      }
+    else
+      {
+      expanded[num_expanded++] = msgs[i];
+      counts[shard_of(pipe, msg) + 1]++;
+      }
+    }
+
+  // group by shard, keeping the order within each
+  for (uint16_t s = 0; s < num_shards; s++)
+    counts[s + 1] += counts[s];
+
+  for (uint32_t i = 0; i < num_expanded; i++)
+    pipe->scratch[counts[shard_of(pipe, &expanded[i].msg)]++] = expanded[i];
+
+  // counts[s] is now the end of shard s
+  uint64_t limit = pipe->config.capacity > num_expanded ? pipe->config.capacity - num_expanded : 0;
+  wait_in_flight(pipe, limit);
+  atomic_fetch_add(&pipe->in_flight, num_expanded);
+
+  result_t result = s_ok;
+  uint32_t start = 0;
+  for (uint16_t s = 0; s < num_shards; s++)
+    {
+    uint32_t end = counts[s];
+    if (end == start)
+      continue;
+
+    bool schedule;
+    if (failed(append(&pipe->shards[s], pipe->scratch + start, end - start, &schedule)))
+      {
+      decoded(pipe, end - start);
+      result = e_not_enough_memory;
+      }
+    else if (schedule)
+      push_shard(pipe, s);
+
+    start = end;
+    }
+
+  return result;
+  }
+
+result_t canpipe_flush(canpipe_t *pipe)
+  {
+  if (pipe == 0)
+    return e_bad_parameter;
+
+  wait_in_flight(pipe, 0);
+  return s_ok;
+  }
+
+result_t canpipe_stats(canpipe_t *pipe, uint16_t worker, canpipe_worker_stats_t *stats)
+  {
+  if (pipe == 0 || stats == 0 || worker >= pipe->config.num_threads)
+    return e_bad_parameter;
+
+  pipe_worker_t *wp = &pipe->workers[worker];
+  pthread_mutex_lock(&wp->lock);
+  *stats = wp->stats;
+  pthread_mutex_unlock(&wp->lock);
+
+  stats->elapsed_ns = monotonic_ns() - pipe->started_ns;
+  return s_ok;
+  }
+
+result_t canpipe_close(canpipe_t *pipe)
+  {
+  if (pipe == 0)
+    return e_bad_parameter;
+
+  canpipe_flush(pipe);
+  stop_workers(pipe);
+  free_pipe(pipe);
+  return s_ok;
+  }
@@ -0,0 +1,126 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#ifndef __canpipe_h__
+#define __canpipe_h__
+
+#include "canlog.h"
+
+/*************************************************
+ * Parallel decode stage.
+ *
+ * Messages are sharded on their id.  Each shard keeps its messages in
+ * the order they were submitted and is only ever decoded by one worker
+ * at a time, so the values of each id reach the callback in order.
+ * There is no order between ids.
+ *
+ * A shard with new messages is pushed onto the deque of its home
+ * worker.  A worker takes the most recently pushed shard from its own
+ * deque, and when that is empty it steals the oldest from another
+ * worker's.  The home worker keeps a shard warm in its cache while the
+ * load is even, and stealing evens it out when it is not.
+ *
+ * Each worker decodes with msg_to_variant, optionally coerces the value,
+ * then calls the callback, which is where rules are evaluated.  The
+ * callback runs on the worker thread.  Packed messages are expanded on
+ * submission.  A live pipe decodes with canstats_decode so the latency
+ * from the receive timestamp is recorded.
+ *
+ * canpipe_submit is called from one thread.  It waits while the
+ * messages in flight would exceed the capacity.
+ */
+typedef void (*canpipe_fn)(uint16_t worker, uint64_t timestamp, const canmsg_t *msg, const variant_t *value, void *arg);
+
+typedef struct _canpipe_config_t {
+  uint16_t num_threads;
+  uint16_t num_shards;          // 0 for 8 per thread
+  uint32_t capacity;            // messages in flight before submission waits
+  variant_type coerce;          // type to coerce each value to, v_none to leave it
+  canpipe_fn callback;
+  void *arg;                    // passed to the callback
+  bool live;                    // timestamps are receive times, record the latency to decode
+  } canpipe_config_t;
+
+typedef struct _canpipe_worker_stats_t {
+  uint64_t messages;            // messages decoded
+  uint64_t errors;              // messages that did not decode or coerce
+  uint64_t runs;                // shard runs decoded
+  uint64_t steals;              // shards taken from another worker
+  uint64_t busy_ns;             // time spent decoding
+  uint64_t elapsed_ns;          // time since the pipe was created
+  } canpipe_worker_stats_t;
+
+typedef struct _canpipe_t canpipe_t;
+
+/**
+ * @brief Create a pipe and start its workers
+ * @param config  Threads, shards and callback
+ * @param pipe    Created pipe
+ * @return s_ok if created
+ */
+extern result_t canpipe_create(const canpipe_config_t *config, canpipe_t **pipe);
+/**
+ * @brief Submit messages to be decoded
+ * @param pipe    Pipe
+ * @param msgs    Messages
+ * @param count   Number of messages
+ * @return s_ok if submitted
+ */
+extern result_t canpipe_submit(canpipe_t *pipe, const timed_canmsg_t *msgs, uint32_t count);
+/**
+ * @brief Wait until everything submitted has been decoded
+ * @param pipe    Pipe
+ * @return s_ok
+ */
+extern result_t canpipe_flush(canpipe_t *pipe);
+/**
+ * @brief Return the statistics of a worker
+ * @param pipe    Pipe
+ * @param worker  Worker, 0 to num_threads - 1
+ * @param stats   Statistics, busy_ns / elapsed_ns is the utilization
+ * @return s_ok if returned
+ */
+extern result_t canpipe_stats(canpipe_t *pipe, uint16_t worker, canpipe_worker_stats_t *stats);
+/**
+ * @brief Flush the pipe, stop the workers and release it
+ * @param pipe    Pipe to close
+ * @return s_ok if closed
+ */
+extern result_t canpipe_close(canpipe_t *pipe);
+
+#endif
@@ -0,0 +1,695 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#define _GNU_SOURCE
+#include "canquery.h"
+#include "canendian.h"
+#include "canring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define READ_BATCH 4096
+
+// the blocks of a capture that match the query
+typedef struct _capture_plan_t {
+  uint32_t block_size;
+  uint64_t num_records;
+  uint64_t size;                // size and modification time of the capture
+  uint64_t mtime;
+  uint64_t num_blocks;
+  uint32_t *blocks;
+  uint32_t num_matches;
+  uint32_t max_matches;
+  bool indexed;                 // the summary was built by this query
+  } capture_plan_t;
+
+typedef struct _work_t {
+  uint32_t capture;
+  uint32_t block;
+  } work_t;
+
+typedef struct _block_slot_t {
+  uint32_t num_rows;
+  uint64_t records;
+  uint64_t errors;
+  canquery_row_t *rows;
+  } block_slot_t;
+
+typedef struct _query_run_t {
+  const canquery_t *query;
+  bool all_ids;
+  capture_plan_t *plans;
+  work_t *items;
+  uint64_t num_items;
+  pthread_mutex_t lock;
+  uint32_t next_capture;        // next capture a worker plans
+  result_t error;               // failure while planning
+  canring_t ring;               // blocks decoded ahead of the caller
+  uint16_t num_slots;
+  block_slot_t *slots;
+  } query_run_t;
+
+static void set_id(uint64_t *ids, uint16_t id)
+  {
+  ids[id >> 6] |= 1ULL << (id & 63);
+  }
+
+static bool has_id(const uint64_t *ids, uint16_t id)
+  {
+  return (ids[id >> 6] & (1ULL << (id & 63))) != 0;
+  }
+
+void canquery_init(canquery_t *query, const char *const *captures, uint32_t count, canquery_callback callback, void *arg)
+  {
+  memset(query, 0, sizeof(canquery_t));
+  query->captures = captures;
+  query->num_captures = count;
+  query->end = UINT64_MAX;
+  query->callback = callback;
+  query->arg = arg;
+  }
+
+static char *summary_path(const char *capture)
+  {
+  char *path = (char *)malloc(strlen(capture) + sizeof(CANQUERY_SUFFIX));
+  if (path != 0)
+    {
+    strcpy(path, capture);
+    strcat(path, CANQUERY_SUFFIX);
+    }
+
+  return path;
+  }
+
+// the size and modification time a summary is checked against, so a
+// capture recorded again with the same length is not read with the old one
+static result_t capture_fingerprint(const char *capture, uint64_t *size, uint64_t *mtime)
+  {
+  struct stat st;
+  if (stat(capture, &st) != 0)
+    return e_path_not_found;
+
+  *size = (uint64_t)st.st_size;
+  *mtime = ((uint64_t)st.st_mtim.tv_sec * 1000000000) + st.st_mtim.tv_nsec;
+  return s_ok;
+  }
+
+static void put_block(uint8_t *block, uint64_t earliest, uint64_t latest, const uint64_t *ids)
+  {
+  put_le64(block, earliest);
+  put_le64(block + 8, latest);
+  for (uint16_t w = 0; w < NUM_CAN_IDS / 64; w++)
+    put_le64(block + 16 + (w << 3), ids[w]);
+  }
+
+static result_t write_summary(canlog_t *log, FILE *fp, uint32_t block_size, uint64_t num_records, uint64_t size, uint64_t mtime)
+  {
+  timed_canmsg_t *msgs = (timed_canmsg_t *)malloc(sizeof(timed_canmsg_t) * READ_BATCH);
+  if (msgs == 0)
+    return e_not_enough_memory;
+
+  result_t result = s_ok;
+  uint64_t num_blocks = (num_records + block_size - 1) / block_size;
+  uint8_t header[CANQUERY_HEADER_SIZE];
+  memset(header, 0, sizeof(header));
+  if (fwrite(header, sizeof(header), 1, fp) != 1)
+    result = e_no_space;
+
+  uint32_t crc = 0;
+  uint64_t ids[NUM_CAN_IDS / 64];
+  uint8_t block[CANQUERY_BLOCK_SIZE];
+  for (uint64_t b = 0; b < num_blocks && succeeded(result); b++)
+    {
+    uint64_t earliest = UINT64_MAX;
+    uint64_t latest = 0;
+    memset(ids, 0, sizeof(ids));
+
+    uint64_t remaining = num_records - (b * block_size);
+    if (remaining > block_size)
+      remaining = block_size;
+
+    while (remaining > 0 && succeeded(result))
+      {
+      uint32_t count = remaining > READ_BATCH ? READ_BATCH : (uint32_t)remaining;
+      if (failed(result = canlog_read(log, msgs, &count)))
+        break;
+
+      for (uint32_t i = 0; i < count; i++)
+        {
+        const canmsg_t *msg = &msgs[i].msg;
+        if (msgs[i].timestamp < earliest)
+          earliest = msgs[i].timestamp;
+
+        if (msgs[i].timestamp > latest)
+          latest = msgs[i].timestamp;
+
+        set_id(ids, get_can_id(msg));
+
+        // a packed message holds the values of other ID's
+        uint16_t id;
+        uint16_t value;
+        if (get_can_len(msg) > 0 && msg->data[0] == CANFLY_PACKED_UINT16)
+          for (uint16_t j = 0; succeeded(get_param_packed_uint16(msg, j, &id, &value)); j++)
+            set_id(ids, id);
+        }
+
+      remaining -= count;
+      }
+
+    put_block(block, earliest, latest, ids);
+    crc = crc32_update(crc, block, sizeof(block));
+    if (succeeded(result) && fwrite(block, sizeof(block), 1, fp) != 1)
+      result = e_no_space;
+    }
+
+  free(msgs);
+  if (failed(result))
+    return result;
+
+  put_le32(header, CANQUERY_MAGIC);
+  header[4] = (uint8_t)CANQUERY_VERSION;
+  put_le32(header + 8, block_size);
+  put_le32(header + 12, (uint32_t)num_blocks);
+  put_le64(header + 16, num_records);
+  put_le32(header + 24, crc);
+  put_le64(header + 32, size);
+  put_le64(header + 40, mtime);
+
+  if (fseek(fp, 0, SEEK_SET) != 0 || fwrite(header, sizeof(header), 1, fp) != 1)
+    return e_no_space;
+
+  return s_ok;
+  }
+
+result_t canquery_index(const char *capture, uint32_t block_size)
+  {
+  if (capture == 0)
+    return e_bad_parameter;
+
+  if (block_size == 0)
+    block_size = CANQUERY_DEFAULT_BLOCK;
+
+  result_t result;
+  canlog_t *log;
+  if (failed(result = canlog_open(capture, &log)))
+    return result;
+
+  // taken before the capture is read, so a summary of a capture that
+  // changes while it is read is rebuilt by the next query
+  uint64_t size;
+  uint64_t mtime;
+  uint64_t num_records;
+  char *path = summary_path(capture);
+  char *temp = path == 0 ? 0 : (char *)malloc(strlen(path) + 16);
+  if (temp == 0)
+    result = e_not_enough_memory;
+  else if (succeeded(result = capture_fingerprint(capture, &size, &mtime)) &&
+           succeeded(result = canlog_count(log, &num_records)))
+    {
+    // written aside and renamed so a reader never sees half a summary
+    sprintf(temp, "%s.%d", path, (int)getpid());
+    FILE *fp = fopen(temp, "wb");
+    if (fp == 0)
+      result = e_path_not_found;
+    else
+      {
+      result = write_summary(log, fp, block_size, num_records, size, mtime);
+      if (fclose(fp) != 0 && succeeded(result))
+        result = e_no_space;
+
+      if (succeeded(result) && rename(temp, path) != 0)
+        result = e_invalid_operation;
+
+      if (failed(result))
+        remove(temp);
+      }
+    }
+
+  canlog_close(log);
+  free(temp);
+  free(path);
+  return result;
+  }
+
+static bool block_matches(const query_run_t *run, const uint8_t *block)
+  {
+  const canquery_t *query = run->query;
+  uint64_t earliest = fetch_le64(block);
+  uint64_t latest = fetch_le64(block + 8);
+  if (latest < query->start || earliest >= query->end)
+    return false;
+
+  if (run->all_ids)
+    return true;
+
+  for (uint16_t w = 0; w < NUM_CAN_IDS / 64; w++)
+    if ((fetch_le64(block + 16 + (w << 3)) & query->ids[w]) != 0)
+      return true;
+
+  return false;
+  }
+
+static result_t add_match(capture_plan_t *plan, uint32_t block)
+  {
+  if (plan->num_matches == plan->max_matches)
+    {
+    uint32_t max_matches = plan->max_matches == 0 ? 256 : plan->max_matches * 2;
+    uint32_t *blocks = (uint32_t *)realloc(plan->blocks, max_matches * sizeof(uint32_t));
+    if (blocks == 0)
+      return e_not_enough_memory;
+
+    plan->blocks = blocks;
+    plan->max_matches = max_matches;
+    }
+
+  plan->blocks[plan->num_matches++] = block;
+  return s_ok;
+  }
+
+// read a summary and keep the blocks that match, e_corrupt if the
+// summary is missing or does not describe the capture
+static result_t read_summary(query_run_t *run, const char *capture, capture_plan_t *plan)
+  {
+  char *path = summary_path(capture);
+  if (path == 0)
+    return e_not_enough_memory;
+
+  FILE *fp = fopen(path, "rb");
+  free(path);
+  if (fp == 0)
+    return e_corrupt;
+
+  uint8_t header[CANQUERY_HEADER_SIZE];
+  result_t result = s_ok;
+  if (fread(header, sizeof(header), 1, fp) != 1 ||
+      fetch_le32(header) != CANQUERY_MAGIC ||
+      header[4] != CANQUERY_VERSION ||
+      fetch_le32(header + 8) == 0 ||
+      fetch_le64(header + 16) != plan->num_records ||
+      fetch_le64(header + 32) != plan->size ||
+      fetch_le64(header + 40) != plan->mtime)
+    result = e_corrupt;
+  else
+    {
+    plan->block_size = fetch_le32(header + 8);
+    plan->num_blocks = fetch_le32(header + 12);
+    if (plan->num_blocks != (plan->num_records + plan->block_size - 1) / plan->block_size)
+      result = e_corrupt;
+    }
+
+  uint32_t crc = 0;
+  uint8_t block[CANQUERY_BLOCK_SIZE];
+  plan->num_matches = 0;
+  for (uint32_t b = 0; succeeded(result) && b < plan->num_blocks; b++)
+    {
+    if (fread(block, sizeof(block), 1, fp) != 1)
+      result = e_corrupt;
+    else
+      {
+      crc = crc32_update(crc, block, sizeof(block));
+      if (block_matches(run, block))
+        result = add_match(plan, b);
+      }
+    }
+
+  if (succeeded(result) && crc != fetch_le32(header + 24))
+    result = e_corrupt;
+
+  fclose(fp);
+  return result;
+  }
+
+static result_t plan_capture(query_run_t *run, uint32_t capture)
+  {
+  const char *path = run->query->captures[capture];
+  capture_plan_t *plan = &run->plans[capture];
+
+  result_t result;
+  canlog_t *log;
+  if (failed(result = canlog_open(path, &log)))
+    return result;
+
+  result = canlog_count(log, &plan->num_records);
+  canlog_close(log);
+  if (failed(result) ||
+      failed(result = capture_fingerprint(path, &plan->size, &plan->mtime)))
+    return result;
+
+  if ((result = read_summary(run, path, plan)) != e_corrupt)
+    return result;
+
+  // no summary yet, or the capture has changed since it was built
+  if (failed(result = canquery_index(path, run->query->block_size)))
+    return result;
+
+  plan->indexed = true;
+  return read_summary(run, path, plan);
+  }
+
+static void *plan_worker(void *arg)
+  {
+  query_run_t *run = (query_run_t *)arg;
+
+  pthread_mutex_lock(&run->lock);
+  while (run->next_capture < run->query->num_captures && succeeded(run->error))
+    {
+    uint32_t capture = run->next_capture++;
+    pthread_mutex_unlock(&run->lock);
+
+    result_t result = plan_capture(run, capture);
+
+    pthread_mutex_lock(&run->lock);
+    if (failed(result))
+      run->error = result;
+    }
+
+  pthread_mutex_unlock(&run->lock);
+  return 0;
+  }
+
+static int compare_rows(const void *a, const void *b)
+  {
+  const canquery_row_t *r1 = (const canquery_row_t *)a;
+  const canquery_row_t *r2 = (const canquery_row_t *)b;
+
+  if (r1->timestamp != r2->timestamp)
+    return r1->timestamp < r2->timestamp ? -1 : 1;
+
+  // ties are broken on the capture field, which holds the file position while sorting
+  return r1->capture < r2->capture ? -1 : r1->capture > r2->capture ? 1 : 0;
+  }
+
+static void add_row(const query_run_t *run, block_slot_t *slot, uint32_t capture, uint64_t timestamp, const canmsg_t *msg)
+  {
+  uint16_t id = get_can_id(msg);
+  if (!run->all_ids && !has_id(run->query->ids, id))
+    return;
+
+  canquery_row_t *row = &slot->rows[slot->num_rows];
+  if (failed(msg_to_variant(msg, &row->value)))
+    {
+    slot->errors++;
+    return;
+    }
+
+  row->timestamp = timestamp;
+  row->capture = capture;
+  row->id = id;
+  slot->num_rows++;
+  }
+
+static result_t decode_block(query_run_t *run, canlog_t *log, timed_canmsg_t *msgs, const work_t *item, block_slot_t *slot)
+  {
+  const canquery_t *query = run->query;
+  const capture_plan_t *plan = &run->plans[item->capture];
+  uint64_t first = (uint64_t)item->block * plan->block_size;
+  uint64_t remaining = plan->num_records - first;
+  if (remaining > plan->block_size)
+    remaining = plan->block_size;
+
+  slot->num_rows = 0;
+  slot->records = 0;
+  slot->errors = 0;
+
+  result_t result;
+  if (failed(result = canlog_seek(log, first)))
+    return result;
+
+  bool sorted = true;
+  uint64_t last = 0;
+  while (remaining > 0)
+    {
+    uint32_t count = remaining > READ_BATCH ? READ_BATCH : (uint32_t)remaining;
+    if (failed(result = canlog_read(log, msgs, &count)))
+      return result;
+
+    for (uint32_t i = 0; i < count; i++)
+      {
+      const canmsg_t *msg = &msgs[i].msg;
+      uint64_t timestamp = msgs[i].timestamp;
+      if (timestamp < query->start || timestamp >= query->end)
+        continue;
+
+      if (timestamp < last)
+        sorted = false;
+
+      last = timestamp;
+
+      if (get_can_len(msg) > 0 && msg->data[0] == CANFLY_PACKED_UINT16)
+        {
+        canmsg_t expanded[PACKED_UINT16_MAX];
+        uint16_t num_expanded;
+        if (failed(expand_packed_msg(msg, expanded, &num_expanded)))
+          slot->errors++;
+        else
+          for (uint16_t j = 0; j < num_expanded; j++)
+            add_row(run, slot, item->capture, timestamp, &expanded[j]);
+        }
+      else
+        add_row(run, slot, item->capture, timestamp, msg);
+      }
+
+    slot->records += count;
+    remaining -= count;
+    }
+
+  // captures are written in time order, only merged buses need a sort
+  if (!sorted)
+    {
+    // qsort is not stable, keep rows with the same time in file order
+    for (uint32_t i = 0; i < slot->num_rows; i++)
+      slot->rows[i].capture = i;
+
+    qsort(slot->rows, slot->num_rows, sizeof(canquery_row_t), compare_rows);
+    for (uint32_t i = 0; i < slot->num_rows; i++)
+      slot->rows[i].capture = item->capture;
+    }
+
+  return s_ok;
+  }
+
+static void *query_worker(void *arg)
+  {
+  query_run_t *run = (query_run_t *)arg;
+  canlog_t *log = 0;
+  uint32_t capture = 0;
+  timed_canmsg_t *msgs = (timed_canmsg_t *)malloc(sizeof(timed_canmsg_t) * READ_BATCH);
+
+  result_t result = msgs == 0 ? e_not_enough_memory : s_ok;
+  uint64_t item;
+  while (succeeded(result) && succeeded(canring_claim(&run->ring, &item)))
+    {
+    block_slot_t *slot = &run->slots[item % run->num_slots];
+    const work_t *work = &run->items[item];
+    if (log == 0 || capture != work->capture)
+      {
+      if (log != 0)
+        canlog_close(log);
+
+      log = 0;
+      capture = work->capture;
+      result = canlog_open(run->query->captures[capture], &log);
+      }
+
+    if (succeeded(result))
+      result = decode_block(run, log, msgs, work, slot);
+
+    canring_publish(&run->ring, item, result);
+    }
+
+  if (failed(result))
+    canring_stop(&run->ring, result);
+
+  if (log != 0)
+    canlog_close(log);
+
+  free(msgs);
+  return 0;
+  }
+
+static result_t deliver_blocks(query_run_t *run, canquery_stats_t *stats)
+  {
+  result_t result = s_ok;
+  for (uint64_t item = 0; item < run->num_items && succeeded(result); item++)
+    {
+    if (failed(result = canring_wait(&run->ring, item)))
+      break;
+
+    block_slot_t *slot = &run->slots[item % run->num_slots];
+    stats->scanned++;
+    stats->records += slot->records;
+    stats->errors += slot->errors;
+    stats->values += slot->num_rows;
+
+    if (slot->num_rows > 0)
+      result = (*run->query->callback)(slot->rows, slot->num_rows, run->query->arg);
+
+    canring_release(&run->ring, item, result);
+    }
+
+  return result;
+  }
+
+// run a worker function on a number of threads and wait for them all
+static result_t run_workers(query_run_t *run, uint16_t num_threads, void *(*worker)(void *), bool deliver, canquery_stats_t *stats)
+  {
+  result_t result = s_ok;
+  pthread_t *workers = (pthread_t *)calloc(num_threads, sizeof(pthread_t));
+  if (workers == 0)
+    return e_not_enough_memory;
+
+  uint16_t started = 0;
+  for (; started < num_threads; started++)
+    if (pthread_create(&workers[started], 0, worker, run) != 0)
+      break;
+
+  if (started == 0)
+    result = e_not_enough_memory;
+  else if (deliver)
+    result = deliver_blocks(run, stats);
+
+  for (uint16_t i = 0; i < started; i++)
+    pthread_join(workers[i], 0);
+
+  free(workers);
+  if (failed(result))
+    return result;
+
+  return deliver ? run->ring.error : run->error;
+  }
+
+result_t canquery_run(const canquery_t *query, canquery_stats_t *stats)
+  {
+  if (query == 0 || query->callback == 0 || (query->captures == 0 && query->num_captures > 0))
+    return e_bad_parameter;
+
+  canquery_stats_t local_stats;
+  if (stats == 0)
+    stats = &local_stats;
+
+  memset(stats, 0, sizeof(canquery_stats_t));
+  stats->captures = query->num_captures;
+
+  query_run_t run;
+  memset(&run, 0, sizeof(run));
+  run.query = query;
+  run.all_ids = true;
+  for (uint16_t w = 0; w < NUM_CAN_IDS / 64; w++)
+    if (query->ids[w] != 0)
+      run.all_ids = false;
+
+  uint16_t num_threads = query->threads;
+  if (num_threads == 0)
+    num_threads = (uint16_t)sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (num_threads == 0)
+    num_threads = 1;
+
+  run.plans = (capture_plan_t *)calloc(query->num_captures + 1, sizeof(capture_plan_t));
+  if (run.plans == 0)
+    return e_not_enough_memory;
+
+  pthread_mutex_init(&run.lock, 0);
+
+  // read the summaries, building any that are missing
+  result_t result = run_workers(&run, num_threads, plan_worker, false, stats);
+
+  uint32_t max_block = 0;
+  for (uint32_t c = 0; c < query->num_captures && succeeded(result); c++)
+    {
+    stats->blocks += run.plans[c].num_blocks;
+    stats->indexed += run.plans[c].indexed ? 1 : 0;
+    run.num_items += run.plans[c].num_matches;
+    if (run.plans[c].num_matches > 0 && run.plans[c].block_size > max_block)
+      max_block = run.plans[c].block_size;
+    }
+
+  if (succeeded(result) && run.num_items > 0)
+    {
+    run.items = (work_t *)malloc(run.num_items * sizeof(work_t));
+    if (run.items == 0)
+      result = e_not_enough_memory;
+    else
+      {
+      uint64_t n = 0;
+      for (uint32_t c = 0; c < query->num_captures; c++)
+        for (uint32_t b = 0; b < run.plans[c].num_matches; b++)
+          {
+          run.items[n].capture = c;
+          run.items[n++].block = run.plans[c].blocks[b];
+          }
+      }
+
+    // two blocks per worker so the workers decode while the caller consumes
+    run.num_slots = num_threads * 2;
+    if (succeeded(result) && (run.slots = (block_slot_t *)calloc(run.num_slots, sizeof(block_slot_t))) == 0)
+      result = e_not_enough_memory;
+
+    for (uint16_t i = 0; i < run.num_slots && succeeded(result); i++)
+      {
+      // a packed message expands to 3 rows
+      run.slots[i].rows = (canquery_row_t *)malloc(sizeof(canquery_row_t) * max_block * PACKED_UINT16_MAX);
+      if (run.slots[i].rows == 0)
+        result = e_not_enough_memory;
+      }
+
+    if (succeeded(result) && succeeded(result = canring_init(&run.ring, run.num_slots, run.num_items)))
+      {
+      result = run_workers(&run, num_threads, query_worker, true, stats);
+      canring_close(&run.ring);
+      }
+    }
+
+  if (run.slots != 0)
+    for (uint16_t i = 0; i < run.num_slots; i++)
+      free(run.slots[i].rows);
+
+  for (uint32_t c = 0; c < query->num_captures; c++)
+    free(run.plans[c].blocks);
+
+  free(run.slots);
+  free(run.items);
+  free(run.plans);
+  pthread_mutex_destroy(&run.lock);
+  return result;
+  }
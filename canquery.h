@@ -0,0 +1,155 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#ifndef __canquery_h__
+#define __canquery_h__
+
+#include "canlog.h"
+
+/*************************************************
+ * Time range and ID set queries over capture logs.
+ *
+ * Each capture is summarised in blocks of records.  A block records
+ * the earliest and latest timestamp and a bitmap of the ID's it holds,
+ * with packed messages counted under the ID's they expand to.  The
+ * summary is kept in a sidecar file <capture>.blk, built the first time
+ * a capture is queried.  It records the length, size and modification
+ * time of the capture and is rebuilt if any of them has changed, and
+ * canlog_create removes the summary of the capture it replaces.
+ *
+ * A query reads the summaries, keeps only the blocks that overlap the
+ * time range and hold one of the ID's, and decodes those blocks on a
+ * pool of worker threads.  The calling thread streams the decoded
+ * values to a callback in capture order, and in time order within a
+ * capture, while the workers decode ahead.  Each capture has its own
+ * time base so the values of different captures are not interleaved.
+ *
+ * Summary file, little endian
+ * header  magic 'CFBX' (4), version (2), 0 (2), block size (4),
+ *         number of blocks (4), records (8), crc32 of the blocks (4), 0 (4),
+ *         capture size (8), capture modification time, nanoseconds (8)
+ * block   earliest (8), latest (8), ID bitmap (256)
+ */
+#define CANQUERY_MAGIC 0x58424643       // 'CFBX'
+#define CANQUERY_VERSION 2
+#define CANQUERY_SUFFIX CANLOG_SUMMARY_SUFFIX
+#define CANQUERY_HEADER_SIZE 48
+#define CANQUERY_BLOCK_SIZE (16 + (NUM_CAN_IDS / 8))
+#define CANQUERY_DEFAULT_BLOCK 4096
+
+/**
+ * @struct canquery_row_t
+ * A value returned by a query
+ * @param timestamp Time the message was received
+ * @param capture   Index of the capture in the query
+ * @param id        CanFly ID of the value
+ * @param value     Decoded value
+ */
+typedef struct _canquery_row_t {
+  uint64_t timestamp;
+  uint32_t capture;
+  uint16_t id;
+  variant_t value;
+  } canquery_row_t;
+
+/**
+ * @brief Called with each batch of results
+ * @param rows  Values, in time order
+ * @param count Number of values
+ * @param arg   Argument from the query
+ * @return s_ok to continue, a failure stops the query and is returned by canquery_run
+ */
+typedef result_t (*canquery_callback)(const canquery_row_t *rows, uint32_t count, void *arg);
+
+typedef struct _canquery_t {
+  const char *const *captures;  // capture logs to search
+  uint32_t num_captures;
+  uint64_t start;               // first time included, microseconds
+  uint64_t end;                 // first time not included
+  uint64_t ids[NUM_CAN_IDS / 64]; // ID's to return, all if none are set
+  uint16_t threads;             // worker threads, 0 for one per cpu
+  uint32_t block_size;          // records per block of a new summary
+  canquery_callback callback;
+  void *arg;
+  } canquery_t;
+
+typedef struct _canquery_stats_t {
+  uint64_t captures;            // captures searched
+  uint64_t indexed;             // summaries built by the query
+  uint64_t blocks;              // blocks in the captures
+  uint64_t scanned;             // blocks decoded
+  uint64_t records;             // records decoded
+  uint64_t values;              // values returned
+  uint64_t errors;              // records that did not decode
+  } canquery_stats_t;
+
+/**
+ * @brief Set up a query for all ID's and all time
+ * @param query     Query to set up
+ * @param captures  Capture logs to search
+ * @param count     Number of captures
+ * @param callback  Called with the results
+ * @param arg       Argument passed to the callback
+ */
+extern void canquery_init(canquery_t *query, const char *const *captures, uint32_t count, canquery_callback callback, void *arg);
+/**
+ * @brief Add an ID to the ID's a query returns
+ * @param query Query
+ * @param id    CanFly ID
+ */
+static inline void canquery_add_id(canquery_t *query, uint16_t id)
+  {
+  id &= ID_MASK;
+  query->ids[id >> 6] |= 1ULL << (id & 63);
+  }
+/**
+ * @brief Build the block summary of a capture
+ * @param capture     Capture log
+ * @param block_size  Records per block, 0 for the default
+ * @return s_ok if the summary was written
+ */
+extern result_t canquery_index(const char *capture, uint32_t block_size);
+/**
+ * @brief Run a query
+ * @param query Query to run
+ * @param stats Optional, counts of the work done
+ * @return s_ok if the query completed
+ */
+extern result_t canquery_run(const canquery_t *query, canquery_stats_t *stats);
+
+#endif
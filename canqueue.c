@@ -0,0 +1,94 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#include "canqueue.h"
+
+#include <string.h>
+
+result_t canqueue_init(canqueue_t *queue, timed_canmsg_t *msgs, uint32_t capacity)
+  {
+  if (queue == 0 || msgs == 0 || capacity < 2 || (capacity & (capacity - 1)) != 0)
+    return e_bad_parameter;
+
+  memset(queue, 0, sizeof(canqueue_t));
+  atomic_init(&queue->head, 0);
+  atomic_init(&queue->tail, 0);
+  queue->mask = capacity - 1;
+  queue->msgs = msgs;
+
+  return s_ok;
+  }
+
+result_t canqueue_push(canqueue_t *queue, const timed_canmsg_t *msgs, uint32_t *count)
+  {
+  if (queue == 0 || msgs == 0 || count == 0)
+    return e_bad_parameter;
+
+  uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+  uint32_t space = (queue->mask + 1) - (head - tail);
+
+  uint32_t n = *count > space ? space : *count;
+  for (uint32_t i = 0; i < n; i++)
+    queue->msgs[(head + i) & queue->mask] = msgs[i];
+
+  atomic_store_explicit(&queue->head, head + n, memory_order_release);
+
+  result_t result = n == *count ? s_ok : e_no_space;
+  *count = n;
+  return result;
+  }
+
+result_t canqueue_pop(canqueue_t *queue, timed_canmsg_t *msgs, uint32_t *count)
+  {
+  if (queue == 0 || msgs == 0 || count == 0)
+    return e_bad_parameter;
+
+  uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+  uint32_t available = head - tail;
+
+  uint32_t n = *count > available ? available : *count;
+  for (uint32_t i = 0; i < n; i++)
+    msgs[i] = queue->msgs[(tail + i) & queue->mask];
+
+  atomic_store_explicit(&queue->tail, tail + n, memory_order_release);
+
+  *count = n;
+  return n == 0 ? e_no_more_information : s_ok;
+  }
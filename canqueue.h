@@ -0,0 +1,85 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#ifndef __canqueue_h__
+#define __canqueue_h__
+
+#include "canlog.h"
+#include <stdatomic.h>
+
+/*************************************************
+ * Single producer, single consumer queue of timed messages.
+ *
+ * The producer and consumer may be different threads, no locks are
+ * taken and neither side makes a system call.
+ */
+typedef struct _canqueue_t {
+  _Atomic uint32_t head;        // next slot written by the producer
+  uint8_t pad1[60];
+  _Atomic uint32_t tail;        // next slot read by the consumer
+  uint8_t pad2[60];
+  uint32_t mask;                // capacity - 1
+  timed_canmsg_t *msgs;
+  } canqueue_t;
+
+/**
+ * @brief Initialize a queue
+ * @param queue     Queue to initialize
+ * @param msgs      Storage for the queue
+ * @param capacity  Number of messages in the storage, must be a power of 2
+ * @return s_ok if initialized
+ */
+extern result_t canqueue_init(canqueue_t *queue, timed_canmsg_t *msgs, uint32_t capacity);
+/**
+ * @brief Add messages to the queue
+ * @param queue     Queue
+ * @param msgs      Messages to add
+ * @param count     On entry the number of messages, on exit the number queued
+ * @return s_ok if all were queued, e_no_space if the queue filled
+ */
+extern result_t canqueue_push(canqueue_t *queue, const timed_canmsg_t *msgs, uint32_t *count);
+/**
+ * @brief Remove messages from the queue
+ * @param queue     Queue
+ * @param msgs      Buffer to receive into
+ * @param count     On entry the size of the buffer, on exit the number removed
+ * @return s_ok if messages were returned, e_no_more_information if the queue is empty
+ */
+extern result_t canqueue_pop(canqueue_t *queue, timed_canmsg_t *msgs, uint32_t *count);
+
+#endif
@@ -0,0 +1,147 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#include "canring.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+result_t canring_init(canring_t *ring, uint16_t num_slots, uint64_t num_items)
+  {
+  if (ring == 0 || num_slots == 0)
+    return e_bad_parameter;
+
+  memset(ring, 0, sizeof(canring_t));
+  ring->slots = (canring_slot_t *)calloc(num_slots, sizeof(canring_slot_t));
+  if (ring->slots == 0)
+    return e_not_enough_memory;
+
+  ring->num_slots = num_slots;
+  ring->num_items = num_items;
+  ring->error = s_ok;
+  pthread_mutex_init(&ring->lock, 0);
+  pthread_cond_init(&ring->cond, 0);
+  return s_ok;
+  }
+
+void canring_close(canring_t *ring)
+  {
+  if (ring->slots == 0)
+    return;
+
+  pthread_cond_destroy(&ring->cond);
+  pthread_mutex_destroy(&ring->lock);
+  free(ring->slots);
+  ring->slots = 0;
+  }
+
+result_t canring_claim(canring_t *ring, uint64_t *item)
+  {
+  result_t result = s_false;
+
+  pthread_mutex_lock(&ring->lock);
+  if (ring->next_item < ring->num_items && succeeded(ring->error))
+    {
+    *item = ring->next_item++;
+
+    // wait for the consumer to release the slot
+    while (*item >= ring->consumed + ring->num_slots && succeeded(ring->error))
+      pthread_cond_wait(&ring->cond, &ring->lock);
+
+    // once stopped the consumer may still be reading the slot
+    result = ring->error;
+    }
+
+  pthread_mutex_unlock(&ring->lock);
+  return result;
+  }
+
+void canring_publish(canring_t *ring, uint64_t item, result_t result)
+  {
+  canring_slot_t *slot = &ring->slots[item % ring->num_slots];
+
+  pthread_mutex_lock(&ring->lock);
+  if (failed(result))
+    {
+    if (succeeded(ring->error))
+      ring->error = result;
+    }
+  else
+    {
+    slot->item = item;
+    slot->ready = true;
+    }
+
+  pthread_cond_broadcast(&ring->cond);
+  pthread_mutex_unlock(&ring->lock);
+  }
+
+result_t canring_wait(canring_t *ring, uint64_t item)
+  {
+  const canring_slot_t *slot = &ring->slots[item % ring->num_slots];
+
+  pthread_mutex_lock(&ring->lock);
+  while (!(slot->ready && slot->item == item) && succeeded(ring->error))
+    pthread_cond_wait(&ring->cond, &ring->lock);
+
+  result_t result = ring->error;
+  pthread_mutex_unlock(&ring->lock);
+  return result;
+  }
+
+void canring_release(canring_t *ring, uint64_t item, result_t result)
+  {
+  pthread_mutex_lock(&ring->lock);
+  ring->slots[item % ring->num_slots].ready = false;
+  ring->consumed++;
+  if (failed(result) && succeeded(ring->error))
+    ring->error = result;
+
+  pthread_cond_broadcast(&ring->cond);
+  pthread_mutex_unlock(&ring->lock);
+  }
+
+void canring_stop(canring_t *ring, result_t error)
+  {
+  pthread_mutex_lock(&ring->lock);
+  if (succeeded(ring->error))
+    ring->error = error;
+
+  pthread_cond_broadcast(&ring->cond);
+  pthread_mutex_unlock(&ring->lock);
+  }
@@ -0,0 +1,130 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#ifndef __canring_h__
+#define __canring_h__
+
+#include "neutron.h"
+#include <pthread.h>
+
+/*************************************************
+ * Ordered ring of work slots.
+ *
+ * A number of items, chunks or blocks of a capture, are decoded by a
+ * pool of worker threads and consumed by one thread in item order.
+ * Item n is decoded into slot n % num_slots, so the workers run at most
+ * num_slots items ahead of the consumer, and a worker waits for the
+ * consumer to release a slot before filling it again.
+ *
+ * The ring only orders the items, the slots themselves are arrays kept
+ * by the caller.  A failure of a worker or the consumer stops the ring:
+ * no further slot is handed out and the waits return the error.
+ *
+ *  worker                            consumer
+ *  while (succeeded(canring_claim))  for each item
+ *    fill slot                         canring_wait
+ *    canring_publish                   read slot
+ *                                      canring_release
+ */
+typedef struct _canring_slot_t {
+  uint64_t item;                // item the slot holds
+  bool ready;                   // filled and not yet released
+  } canring_slot_t;
+
+typedef struct _canring_t {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint64_t num_items;
+  uint64_t next_item;           // next item a worker claims
+  uint64_t consumed;            // items released by the consumer
+  uint16_t num_slots;
+  canring_slot_t *slots;
+  result_t error;               // first failure, stops the ring
+  } canring_t;
+
+/**
+ * @brief Initialize a ring
+ * @param ring      Ring to initialize
+ * @param num_slots Number of slots, items in flight
+ * @param num_items Number of items to decode
+ * @return s_ok if initialized
+ */
+extern result_t canring_init(canring_t *ring, uint16_t num_slots, uint64_t num_items);
+/**
+ * @brief Release the resources of a ring once the workers have stopped
+ * @param ring  Ring
+ */
+extern void canring_close(canring_t *ring);
+/**
+ * @brief Claim the next item to decode and wait for its slot to be free
+ * @param ring  Ring
+ * @param item  Item claimed, its slot is item % num_slots
+ * @return s_ok if claimed, s_false if every item is claimed or the error
+ * that stopped the ring
+ */
+extern result_t canring_claim(canring_t *ring, uint64_t *item);
+/**
+ * @brief Hand a filled slot to the consumer, or stop the ring
+ * @param ring    Ring
+ * @param item    Item claimed
+ * @param result  s_ok if the slot was filled, otherwise the failure
+ */
+extern void canring_publish(canring_t *ring, uint64_t item, result_t result);
+/**
+ * @brief Wait for the next item in order
+ * @param ring  Ring
+ * @param item  Item to wait for, one more than the last released
+ * @return s_ok when the slot of the item is filled, or the error that
+ * stopped the ring
+ */
+extern result_t canring_wait(canring_t *ring, uint64_t item);
+/**
+ * @brief Release the slot of an item once it is consumed
+ * @param ring    Ring
+ * @param item    Item consumed
+ * @param result  s_ok to carry on, a failure stops the ring
+ */
+extern void canring_release(canring_t *ring, uint64_t item, result_t result);
+/**
+ * @brief Stop the ring, waking the workers and the consumer
+ * @param ring    Ring
+ * @param error   Failure returned by the waits
+ */
+extern void canring_stop(canring_t *ring, result_t error);
+
+#endif
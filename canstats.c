@@ -0,0 +1,352 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#define _GNU_SOURCE
+#include "canstats.h"
+
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <pthread.h>
+
+// frames a thread without a slot counts before trying to claim one again
+#define CLAIM_RETRY 4096
+
+static canstats_segment_t *published;
+static uint32_t generation;           // incremented each time a segment is created
+static char published_name[64];
+static pthread_mutex_t slot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slot_key;
+
+// the slot is only valid in the segment it was claimed from
+static _Thread_local canstats_slot_t *thread_slot;
+static _Thread_local uint32_t thread_generation;
+static _Thread_local uint32_t thread_retry;
+
+uint64_t canstats_now(void)
+  {
+  // served by the vDSO, no system call
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+  }
+
+static inline uint16_t latency_bucket(uint64_t latency)
+  {
+  if (latency < CANSTATS_SUB_BUCKETS)
+    return (uint16_t)latency;
+
+  uint16_t exponent = 63 - __builtin_clzll(latency);
+  if (exponent > CANSTATS_MAX_EXPONENT)
+    return CANSTATS_NUM_BUCKETS - 1;
+
+  uint16_t sub = (latency >> (exponent - 4)) & (CANSTATS_SUB_BUCKETS - 1);
+  return ((exponent - 3) * CANSTATS_SUB_BUCKETS) + sub;
+  }
+
+uint64_t canstats_bucket_value(uint16_t bucket)
+  {
+  if (bucket < CANSTATS_SUB_BUCKETS)
+    return bucket;
+
+  uint16_t exponent = (bucket / CANSTATS_SUB_BUCKETS) + 3;
+  uint64_t sub = bucket % CANSTATS_SUB_BUCKETS;
+  return (CANSTATS_SUB_BUCKETS + sub) << (exponent - 4);
+  }
+
+result_t canstats_create(const char *name)
+  {
+  if (name == 0 || strlen(name) >= sizeof(published_name))
+    return e_bad_parameter;
+
+  if (__atomic_load_n(&published, __ATOMIC_ACQUIRE) != 0)
+    return e_exists;
+
+  int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+  if (fd < 0)
+    return e_invalid_operation;
+
+  if (ftruncate(fd, sizeof(canstats_segment_t)) != 0)
+    {
+    close(fd);
+    return e_no_space;
+    }
+
+  void *mem = mmap(0, sizeof(canstats_segment_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED)
+    return e_not_enough_memory;
+
+  canstats_segment_t *segment = (canstats_segment_t *)mem;
+  memset(segment, 0, sizeof(canstats_segment_t));
+  segment->version = CANSTATS_VERSION;
+  segment->num_slots = CANSTATS_MAX_THREADS;
+  segment->slot_size = sizeof(canstats_slot_t);
+  segment->pid = (uint32_t)getpid();
+  // readers check the magic last
+  atomic_thread_fence(memory_order_release);
+  segment->magic = CANSTATS_MAGIC;
+
+  strcpy(published_name, name);
+  pthread_mutex_lock(&slot_lock);
+  __atomic_store_n(&generation, generation + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&published, segment, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&slot_lock);
+  return s_ok;
+  }
+
+result_t canstats_close(void)
+  {
+  pthread_mutex_lock(&slot_lock);
+  canstats_segment_t *segment = __atomic_load_n(&published, __ATOMIC_ACQUIRE);
+  __atomic_store_n(&published, 0, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&slot_lock);
+  if (segment == 0)
+    return e_not_initialized;
+
+  munmap(segment, sizeof(canstats_segment_t));
+  shm_unlink(published_name);
+
+  return s_ok;
+  }
+
+// release the slot of an exiting thread, unless its segment has gone
+static void release_slot(void *arg)
+  {
+  canstats_slot_t *slot = (canstats_slot_t *)arg;
+
+  pthread_mutex_lock(&slot_lock);
+  if (__atomic_load_n(&published, __ATOMIC_RELAXED) != 0 && thread_generation == generation)
+    __atomic_store_n(&slot->in_use, 0, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&slot_lock);
+  }
+
+static void create_key(void)
+  {
+  pthread_key_create(&slot_key, release_slot);
+  }
+
+// claim a slot for the calling thread, 0 if none are free
+static canstats_slot_t *claim_slot(void)
+  {
+  pthread_once(&key_once, create_key);
+
+  pthread_mutex_lock(&slot_lock);
+  canstats_segment_t *segment = published;
+  canstats_slot_t *slot = 0;
+  for (uint16_t i = 0; segment != 0 && i < CANSTATS_MAX_THREADS; i++)
+    {
+    if (__atomic_load_n(&segment->slots[i].in_use, __ATOMIC_ACQUIRE) == 0)
+      {
+      slot = &segment->slots[i];
+      slot->thread_id = (uint32_t)syscall(SYS_gettid);
+      __atomic_store_n(&slot->in_use, 1, __ATOMIC_RELEASE);
+      break;
+      }
+    }
+
+  thread_slot = slot;
+  thread_generation = generation;
+  thread_retry = CLAIM_RETRY;
+  pthread_mutex_unlock(&slot_lock);
+
+  pthread_setspecific(slot_key, slot);
+  return slot;
+  }
+
+// return the slot of the calling thread, 0 if it has none
+static inline canstats_slot_t *current_slot(canstats_segment_t *segment)
+  {
+  canstats_slot_t *slot = thread_slot;
+  if (thread_generation != __atomic_load_n(&generation, __ATOMIC_RELAXED) ||
+      (slot == 0 && --thread_retry == 0))
+    slot = claim_slot();
+
+  if (slot == 0)
+    __atomic_fetch_add(&segment->overflow, 1, __ATOMIC_RELAXED);
+
+  return slot;
+  }
+
+void canstats_count(const canmsg_t *msg, result_t result)
+  {
+  canstats_segment_t *segment = __atomic_load_n(&published, __ATOMIC_ACQUIRE);
+  if (segment == 0 || msg == 0)
+    return;
+
+  canstats_slot_t *slot = current_slot(segment);
+  if (slot == 0)
+    return;
+
+  if (failed(result))
+    {
+    uint16_t code = (uint16_t)-result;
+    slot->failures[code < CANSTATS_NUM_CODES ? code : CANSTATS_NUM_CODES - 1]++;
+    return;
+    }
+
+  slot->frames[get_can_id(msg)]++;
+  }
+
+result_t canstats_decode(const canmsg_t *msg, uint64_t ingest, variant_t *v)
+  {
+  result_t result = msg_to_variant(msg, v);
+#ifndef CANFLY_STATS
+  // msg_to_variant only counts the frame in a CANFLY_STATS build
+  canstats_count(msg, result);
+#endif
+  if (failed(result) || __atomic_load_n(&published, __ATOMIC_ACQUIRE) == 0)
+    return result;
+
+  // the slot was claimed when the frame was counted
+  canstats_slot_t *slot = thread_slot;
+  if (slot == 0)
+    return result;
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  uint64_t now = ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+  ingest *= 1000;
+  slot->latency[latency_bucket(now > ingest ? now - ingest : 0)]++;
+
+  return result;
+  }
+
+result_t canstats_open(const char *name, const canstats_segment_t **segment)
+  {
+  if (name == 0 || segment == 0)
+    return e_bad_parameter;
+
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0)
+    return e_not_found;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(canstats_segment_t))
+    {
+    close(fd);
+    return e_corrupt;
+    }
+
+  void *mem = mmap(0, sizeof(canstats_segment_t), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED)
+    return e_not_enough_memory;
+
+  *segment = (const canstats_segment_t *)mem;
+  return s_ok;
+  }
+
+void canstats_release(const canstats_segment_t *segment)
+  {
+  if (segment != 0)
+    munmap((void *)segment, sizeof(canstats_segment_t));
+  }
+
+result_t canstats_merge(const canstats_segment_t *segment, canstats_totals_t *totals)
+  {
+  if (segment == 0 || totals == 0)
+    return e_bad_parameter;
+
+  if (segment->magic != CANSTATS_MAGIC ||
+      segment->version != CANSTATS_VERSION ||
+      segment->slot_size != sizeof(canstats_slot_t))
+    return e_corrupt;
+
+  memset(totals, 0, sizeof(canstats_totals_t));
+
+  totals->overflow = __atomic_load_n(&segment->overflow, __ATOMIC_RELAXED);
+
+  // the counters are read while being written, each value is a snapshot.
+  // A released slot keeps its counts for the next thread to claim it
+  for (uint16_t i = 0; i < CANSTATS_MAX_THREADS; i++)
+    {
+    const canstats_slot_t *slot = &segment->slots[i];
+    if (__atomic_load_n(&slot->in_use, __ATOMIC_ACQUIRE) != 0)
+      totals->threads++;
+
+    for (uint16_t id = 0; id < NUM_CAN_IDS; id++)
+      totals->id_frames[id] += slot->frames[id];
+
+    for (uint16_t code = 0; code < CANSTATS_NUM_CODES; code++)
+      totals->failures[code] += slot->failures[code];
+
+    for (uint16_t bucket = 0; bucket < CANSTATS_NUM_BUCKETS; bucket++)
+      totals->latency[bucket] += slot->latency[bucket];
+    }
+
+  totals->frames = totals->overflow;
+  for (uint16_t id = 0; id < NUM_CAN_IDS; id++)
+    totals->frames += totals->id_frames[id];
+
+  for (uint16_t bucket = 0; bucket < CANSTATS_NUM_BUCKETS; bucket++)
+    totals->latency_count += totals->latency[bucket];
+
+  return s_ok;
+  }
+
+result_t canstats_percentile(const canstats_totals_t *totals, float percent, uint64_t *latency)
+  {
+  if (totals == 0 || latency == 0 || percent < 0 || percent > 100)
+    return e_bad_parameter;
+
+  if (totals->latency_count == 0)
+    return e_more_data;
+
+  uint64_t rank = (uint64_t)((totals->latency_count - 1) * (percent / 100.0));
+  uint64_t seen = 0;
+  for (uint16_t bucket = 0; bucket < CANSTATS_NUM_BUCKETS; bucket++)
+    {
+    seen += totals->latency[bucket];
+    if (seen > rank)
+      {
+      *latency = canstats_bucket_value(bucket);
+      return s_ok;
+      }
+    }
+
+  *latency = canstats_bucket_value(CANSTATS_NUM_BUCKETS - 1);
+  return s_ok;
+  }
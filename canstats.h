@@ -0,0 +1,179 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#ifndef __canstats_h__
+#define __canstats_h__
+
+#include "neutron.h"
+
+/*************************************************
+ * Receive and decode path instrumentation.
+ *
+ * In a build with CANFLY_STATS defined every msg_to_variant is counted
+ * once a segment is created, otherwise only the frames decoded by
+ * canstats_decode are, and the decoder in variant.c does not depend on
+ * this module or on POSIX.  Each
+ * thread that decodes claims a slot in a shared memory segment and
+ * updates its own counters without atomic operations.  A reader, in
+ * this or another process, merges the slots to get the totals, so the
+ * counters can be left enabled in production.
+ *
+ * A slot is released when its thread exits and the next thread to
+ * claim it carries on from its counters.  When every slot is taken a
+ * thread counts its frames in the shared overflow counter until one is
+ * released.
+ *
+ * canstats_decode also records the latency from the frame being
+ * received, using the timestamp socketcan gives each frame.
+ *
+ * Latency is recorded in a log-linear histogram: values below 16ns
+ * have their own bucket, above that each power of 2 is split into 16
+ * buckets, giving a resolution of 1/16 of the value.
+ */
+#define CANSTATS_MAGIC 0x54534643     // 'CFST'
+#define CANSTATS_VERSION 1
+#define CANSTATS_MAX_THREADS 16
+#define CANSTATS_NUM_CODES 64         // indexed by -result_t
+#define CANSTATS_SUB_BUCKETS 16
+#define CANSTATS_MAX_EXPONENT 39      // about 550 seconds
+#define CANSTATS_NUM_BUCKETS ((CANSTATS_MAX_EXPONENT - 2) * CANSTATS_SUB_BUCKETS)
+
+typedef struct _canstats_slot_t {
+  uint32_t in_use;              // set when a thread owns the slot
+  uint32_t thread_id;
+  uint64_t frames[NUM_CAN_IDS]; // frames decoded, by can id
+  uint64_t failures[CANSTATS_NUM_CODES];
+  uint64_t latency[CANSTATS_NUM_BUCKETS];
+  } canstats_slot_t;
+
+typedef struct _canstats_segment_t {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t num_slots;
+  uint32_t slot_size;
+  uint32_t pid;                 // process publishing the counters
+  uint64_t overflow;            // frames decoded by threads without a slot
+  canstats_slot_t slots[CANSTATS_MAX_THREADS];
+  } canstats_segment_t;
+
+// merged counters
+typedef struct _canstats_totals_t {
+  uint16_t threads;
+  uint64_t frames;
+  uint64_t overflow;
+  uint64_t id_frames[NUM_CAN_IDS];
+  uint64_t failures[CANSTATS_NUM_CODES];
+  uint64_t latency[CANSTATS_NUM_BUCKETS];
+  uint64_t latency_count;
+  } canstats_totals_t;
+
+/**
+ * @brief Create the shared memory segment counters are published in
+ * @param name  POSIX shared memory name, e.g. /canfly-stats
+ * @return s_ok if created
+ * @remark Until this is called nothing is counted.
+ */
+extern result_t canstats_create(const char *name);
+/**
+ * @brief Stop publishing and remove the segment
+ * @return s_ok if removed
+ * @remark No thread may be decoding when this is called.
+ */
+extern result_t canstats_close(void);
+/**
+ * @brief Return a timestamp to pass to canstats_decode
+ * @return microseconds since the epoch, the time base of socketcan timestamps
+ */
+extern uint64_t canstats_now(void);
+/**
+ * @brief Count a decoded message, called by msg_to_variant in a build
+ * with CANFLY_STATS defined and by canstats_decode
+ * @param msg     Message decoded
+ * @param result  Result of the decode
+ */
+extern void canstats_count(const canmsg_t *msg, result_t result);
+
+#ifdef CANFLY_STATS
+#define CANSTATS_COUNT(msg, result) canstats_count(msg, result)
+#else
+#define CANSTATS_COUNT(msg, result)
+#endif
+/**
+ * @brief Decode a message and record its latency
+ * @param msg     Message to decode
+ * @param ingest  Time the message was received, the timestamp of a
+ *                received frame or canstats_now
+ * @param v       Decoded value
+ * @return result of msg_to_variant
+ */
+extern result_t canstats_decode(const canmsg_t *msg, uint64_t ingest, variant_t *v);
+/**
+ * @brief Map a published segment for reading
+ * @param name    POSIX shared memory name
+ * @param segment Mapped segment
+ * @return s_ok if opened, e_not_found if no process is publishing
+ */
+extern result_t canstats_open(const char *name, const canstats_segment_t **segment);
+/**
+ * @brief Unmap a segment opened by canstats_open
+ * @param segment Mapped segment
+ */
+extern void canstats_release(const canstats_segment_t *segment);
+/**
+ * @brief Merge the per-thread counters
+ * @param segment Segment to read
+ * @param totals  Merged counters
+ * @return s_ok if merged, e_corrupt if the segment is not valid
+ */
+extern result_t canstats_merge(const canstats_segment_t *segment, canstats_totals_t *totals);
+/**
+ * @brief Return a latency percentile
+ * @param totals  Merged counters
+ * @param percent Percentile (0..100)
+ * @param latency Latency in nanoseconds
+ * @return s_ok if calculated, e_more_data if no latencies are recorded
+ */
+extern result_t canstats_percentile(const canstats_totals_t *totals, float percent, uint64_t *latency);
+/**
+ * @brief Return the smallest latency recorded in a bucket
+ * @param bucket  Histogram bucket
+ * @return latency in nanoseconds
+ */
+extern uint64_t canstats_bucket_value(uint16_t bucket);
+
+#endif
@@ -0,0 +1,230 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#define _GNU_SOURCE
+#include "cantrace.h"
+#include "canclock.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#ifdef CANFLY_TRACE
+bool cantrace_enabled;
+__thread cantrace_ring_t *cantrace_ring;
+
+// events a thread without a ring skips before trying to attach again
+#define ATTACH_RETRY 4096
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static cantrace_ring_t *rings[CANTRACE_MAX_THREADS];
+static uint32_t num_rings;
+static __thread uint32_t attach_retry;
+// the cycle counter and clock when tracing was first enabled
+static uint64_t base_ticks;
+static uint64_t base_ns;
+
+static const char *stage_names[ts_num_stages] = { "receive", "decode", "encode", "rules", "transmit", "log" };
+static const char *arg_names[ts_num_stages] = { "count", "id", "id", "id", "count", "count" };
+
+// keep the events of an exiting thread until they are dumped
+static void retire_ring(void *arg)
+  {
+  cantrace_ring_t *ring = (cantrace_ring_t *)arg;
+
+  pthread_mutex_lock(&rings_lock);
+  ring->state = rs_retired;
+  pthread_mutex_unlock(&rings_lock);
+  }
+
+static void create_key(void)
+  {
+  pthread_key_create(&ring_key, retire_ring);
+  }
+
+cantrace_ring_t *cantrace_attach(void)
+  {
+  if (attach_retry > 0)
+    {
+    attach_retry--;
+    return 0;
+    }
+
+  pthread_once(&key_once, create_key);
+
+  cantrace_ring_t *ring = 0;
+  pthread_mutex_lock(&rings_lock);
+  for (uint32_t i = 0; i < num_rings && ring == 0; i++)
+    if (rings[i]->state == rs_free)
+      ring = rings[i];
+
+  if (ring == 0 && num_rings < CANTRACE_MAX_THREADS &&
+      (ring = (cantrace_ring_t *)malloc(sizeof(cantrace_ring_t))) != 0)
+    rings[num_rings++] = ring;
+
+  if (ring != 0)
+    {
+    ring->head = 0;
+    ring->tid = (uint32_t)syscall(SYS_gettid);
+    ring->state = rs_active;
+    }
+  pthread_mutex_unlock(&rings_lock);
+
+  if (ring == 0)
+    {
+    attach_retry = ATTACH_RETRY;
+    return 0;
+    }
+
+  pthread_setspecific(ring_key, ring);
+  cantrace_ring = ring;
+  return ring;
+  }
+
+result_t cantrace_enable(bool enable)
+  {
+  pthread_mutex_lock(&rings_lock);
+  if (enable && base_ns == 0)
+    {
+    base_ticks = cantrace_ticks();
+    base_ns = monotonic_ns();
+    }
+  pthread_mutex_unlock(&rings_lock);
+
+  __atomic_store_n(&cantrace_enabled, enable, __ATOMIC_RELAXED);
+  return s_ok;
+  }
+
+result_t cantrace_dump(const char *path)
+  {
+  if (path == 0)
+    return e_bad_parameter;
+
+  FILE *fp = fopen(path, "w");
+  if (fp == 0)
+    return e_path_not_found;
+
+  // a free ring may be taken by a new thread while it is read, and a
+  // retired one is only freed once it has been written
+  cantrace_ring_t *snapshot[CANTRACE_MAX_THREADS];
+  bool retired[CANTRACE_MAX_THREADS];
+  uint32_t count = 0;
+  pthread_mutex_lock(&rings_lock);
+  for (uint32_t i = 0; i < num_rings; i++)
+    if (rings[i]->state != rs_free)
+      {
+      retired[count] = rings[i]->state == rs_retired;
+      snapshot[count++] = rings[i];
+      }
+
+  uint64_t ticks0 = base_ticks;
+  uint64_t ns0 = base_ns;
+  pthread_mutex_unlock(&rings_lock);
+
+  // cycles per microsecond, measured over the time tracing has been enabled
+  double per_us = 1000;
+  uint64_t elapsed_ns = ns0 != 0 ? monotonic_ns() - ns0 : 0;
+  if (elapsed_ns > 0)
+    per_us = (cantrace_ticks() - ticks0) * 1000.0 / elapsed_ns;
+
+  uint32_t pid = (uint32_t)getpid();
+  fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"canfly\"}}", pid);
+
+  for (uint32_t r = 0; r < count; r++)
+    {
+    const cantrace_ring_t *ring = snapshot[r];
+    fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+            pid, ring->tid, ring->tid);
+
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t first = head > CANTRACE_RING_SIZE ? head - CANTRACE_RING_SIZE : 0;
+    for (uint32_t i = first; i < head; i++)
+      {
+      cantrace_event_t event = ring->events[i & (CANTRACE_RING_SIZE - 1)];
+
+      // the owner may have lapped this event while it was copied, the
+      // event at the head may be half written over the oldest
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      uint32_t now = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+      if (now - i >= CANTRACE_RING_SIZE)
+        continue;
+
+      if (event.stage >= ts_num_stages || event.start < ticks0)
+        continue;
+
+      fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"canfly\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"%s\":%u}}",
+              stage_names[event.stage], pid, ring->tid,
+              (event.start - ticks0) / per_us, event.duration / per_us,
+              arg_names[event.stage], event.arg);
+      }
+    }
+
+  fprintf(fp, "\n]}\n");
+  result_t result = ferror(fp) ? e_no_space : s_ok;
+  if (fclose(fp) != 0)
+    result = e_no_space;
+
+  if (succeeded(result))
+    {
+    pthread_mutex_lock(&rings_lock);
+    for (uint32_t r = 0; r < count; r++)
+      if (retired[r])
+        snapshot[r]->state = rs_free;
+    pthread_mutex_unlock(&rings_lock);
+    }
+
+  return result;
+  }
+#else
+result_t cantrace_enable(bool enable)
+  {
+  (void)enable;
+  return e_not_supported;
+  }
+
+result_t cantrace_dump(const char *path)
+  {
+  (void)path;
+  return e_not_supported;
+  }
+#endif
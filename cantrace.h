@@ -0,0 +1,170 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#ifndef __cantrace_h__
+#define __cantrace_h__
+
+#include "neutron.h"
+#include <time.h>
+
+/*************************************************
+ * Stage tracing.
+ *
+ * Each thread records fixed size events into a ring of its own, timed
+ * with the cycle counter, so recording takes no lock and makes no
+ * system call.  A ring keeps the most recent CANTRACE_RING_SIZE events
+ * of its thread.  cantrace_dump writes the rings as Chrome trace event
+ * JSON, which chrome://tracing and Perfetto load, and may be called at
+ * any time from any thread.
+ *
+ * A ring is retired when its thread exits and is reused by a new
+ * thread once it has been dumped, so threads that come and go do not
+ * run out of rings.  While CANTRACE_MAX_THREADS threads hold a ring,
+ * the events of any others are not recorded.
+ *
+ * The trace points are compiled in when CANFLY_TRACE is defined, and
+ * otherwise compile to nothing.  When compiled in, tracing is off until
+ * cantrace_enable is called, a trace point that is off is a load and a
+ * branch.
+ *
+ *  CANTRACE_BEGIN(trace);
+ *  ...
+ *  CANTRACE_END(trace, ts_decode, id);
+ */
+#define CANTRACE_RING_SIZE 16384      // events per thread, a power of 2
+#define CANTRACE_MAX_THREADS 64
+
+typedef enum _cantrace_stage {
+  ts_receive,
+  ts_decode,
+  ts_encode,
+  ts_rules,
+  ts_transmit,
+  ts_log,
+  ts_num_stages,
+  } cantrace_stage;
+
+typedef struct _cantrace_event_t {
+  uint64_t start;               // cycle counter
+  uint32_t duration;            // cycles, saturated
+  uint16_t stage;
+  uint16_t arg;                 // CAN id or message count
+  } cantrace_event_t;
+
+typedef enum _cantrace_ring_state {
+  rs_active,                    // owned by a thread
+  rs_retired,                   // thread has exited, the events are not dumped
+  rs_free,                      // dumped, may be reused
+  } cantrace_ring_state;
+
+typedef struct _cantrace_ring_t {
+  uint32_t head;                // events recorded, the next is at head & mask
+  uint32_t tid;
+  uint32_t state;               // cantrace_ring_state, changed under the registry lock
+  cantrace_event_t events[CANTRACE_RING_SIZE];
+  } cantrace_ring_t;
+
+/**
+ * @brief Turn tracing on or off
+ * @param enable  true to record events
+ * @return s_ok, e_not_supported if built without CANFLY_TRACE
+ */
+extern result_t cantrace_enable(bool enable);
+/**
+ * @brief Write the events recorded so far as Chrome trace event JSON
+ * @param path  File to write
+ * @return s_ok if written, e_not_supported if built without CANFLY_TRACE
+ */
+extern result_t cantrace_dump(const char *path);
+
+#ifdef CANFLY_TRACE
+extern bool cantrace_enabled;
+extern __thread cantrace_ring_t *cantrace_ring;
+/**
+ * @brief Give the calling thread a ring, called on its first event
+ * @return the ring, 0 if CANTRACE_MAX_THREADS threads hold one
+ */
+extern cantrace_ring_t *cantrace_attach(void);
+
+static inline uint64_t cantrace_ticks(void)
+  {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+  uint64_t ticks;
+  __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(ticks));
+  return ticks;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+#endif
+  }
+
+static inline uint64_t cantrace_begin(void)
+  {
+  return __atomic_load_n(&cantrace_enabled, __ATOMIC_RELAXED) ? cantrace_ticks() : 0;
+  }
+
+static inline void cantrace_end(uint16_t stage, uint64_t start, uint16_t arg)
+  {
+  if (start == 0)
+    return;
+
+  cantrace_ring_t *ring = cantrace_ring;
+  if (ring == 0 && (ring = cantrace_attach()) == 0)
+    return;
+
+  uint64_t duration = cantrace_ticks() - start;
+  uint32_t head = ring->head;
+  cantrace_event_t *event = &ring->events[head & (CANTRACE_RING_SIZE - 1)];
+  event->start = start;
+  event->duration = duration > UINT32_MAX ? UINT32_MAX : (uint32_t)duration;
+  event->stage = stage;
+  event->arg = arg;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  }
+
+#define CANTRACE_BEGIN(name) uint64_t name = cantrace_begin()
+#define CANTRACE_END(name, stage, arg) cantrace_end(stage, name, (uint16_t)(arg))
+#else
+#define CANTRACE_BEGIN(name)
+#define CANTRACE_END(name, stage, arg)
+#endif
+
+#endif
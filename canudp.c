@@ -0,0 +1,522 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#define _GNU_SOURCE
+#include "canudp.h"
+#include "canendian.h"
+#include "cantrace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// socket receive buffer asked for by a receiver
+#define CANUDP_RECEIVE_BUFFER (1 << 20)
+// datagrams a receiver takes as reordered rather than a restarted sender
+#define CANUDP_REORDER 64
+
+struct _canudp_sender_t {
+  int fd;
+  struct sockaddr_in dest;
+  uint16_t size;
+  uint32_t deadline;
+  uint32_t sequence;
+  uint16_t num_full;            // datagrams filled and waiting to be sent
+  uint16_t length;              // bytes in the datagram being filled
+  uint16_t count;               // messages in the datagram being filled
+  uint64_t base;                // base time of the datagram being filled
+  uint64_t started;             // time the first message of a waiting datagram was queued
+  canudp_stats_t stats;
+  uint16_t lengths[CANUDP_BATCH];
+  uint8_t buffers[CANUDP_BATCH][CANUDP_MAX_DATAGRAM];
+  };
+
+struct _canudp_receiver_t {
+  int fd;
+  uint16_t num_received;        // datagrams taken by the last recvmmsg
+  uint16_t next;                // datagram being unpacked
+  uint16_t offset;              // offset of the next message in that datagram
+  uint16_t remaining;           // messages left in that datagram
+  uint64_t base;
+  bool have_sequence;
+  uint32_t sequence;            // next sequence expected
+  canudp_stats_t stats;
+  struct mmsghdr hdrs[CANUDP_BATCH];
+  struct iovec iov[CANUDP_BATCH];
+  uint8_t buffers[CANUDP_BATCH][CANUDP_MAX_DATAGRAM];
+  };
+
+static result_t parse_address(const char *text, uint16_t port, struct sockaddr_in *addr)
+  {
+  memset(addr, 0, sizeof(struct sockaddr_in));
+  addr->sin_family = AF_INET;
+  addr->sin_port = htons(port);
+  if (text == 0 || inet_pton(AF_INET, text, &addr->sin_addr) != 1)
+    return e_bad_parameter;
+
+  return s_ok;
+  }
+
+result_t canudp_sender_open(const canudp_config_t *config, canudp_sender_t **sender)
+  {
+  if (config == 0 || sender == 0 || config->port == 0 ||
+      config->size > CANUDP_MAX_DATAGRAM ||
+      (config->size != 0 && config->size < CANUDP_HEADER_SIZE + CANUDP_RECORD_HEADER + 8))
+    return e_bad_parameter;
+
+  struct sockaddr_in dest;
+  struct in_addr local = { htonl(INADDR_ANY) };
+  if (failed(parse_address(config->group, config->port, &dest)) ||
+      (config->interface != 0 && inet_pton(AF_INET, config->interface, &local) != 1))
+    return e_bad_parameter;
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0)
+    return e_not_supported;
+
+  if (IN_MULTICAST(ntohl(dest.sin_addr.s_addr)))
+    {
+    int ttl = config->ttl == 0 ? 1 : config->ttl;
+    unsigned char loop = config->loopback ? 1 : 0;
+    if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 ||
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0 ||
+        (config->interface != 0 &&
+         setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &local, sizeof(local)) < 0))
+      {
+      close(fd);
+      return e_invalid_operation;
+      }
+    }
+
+  canudp_sender_t *sp = (canudp_sender_t *)calloc(1, sizeof(canudp_sender_t));
+  if (sp == 0)
+    {
+    close(fd);
+    return e_not_enough_memory;
+    }
+
+  sp->fd = fd;
+  sp->dest = dest;
+  sp->size = config->size == 0 ? CANUDP_MAX_DATAGRAM : config->size;
+  sp->deadline = config->deadline;
+  sp->length = CANUDP_HEADER_SIZE;
+
+  *sender = sp;
+  return s_ok;
+  }
+
+// write the header of the datagram being filled and queue it
+static void finish_datagram(canudp_sender_t *sender)
+  {
+  uint8_t *p = sender->buffers[sender->num_full];
+  put_le32(p, CANUDP_MAGIC);
+  p[4] = CANUDP_VERSION;
+  p[5] = 0;
+  put_le16(p + 6, sender->count);
+  put_le32(p + 8, sender->sequence++);
+  put_le64(p + 12, sender->base);
+
+  sender->lengths[sender->num_full++] = sender->length;
+  sender->length = CANUDP_HEADER_SIZE;
+  sender->count = 0;
+  }
+
+// send the queued datagrams, those the kernel refuses are dropped
+static result_t send_datagrams(canudp_sender_t *sender)
+  {
+  struct mmsghdr hdrs[CANUDP_BATCH];
+  struct iovec iov[CANUDP_BATCH];
+  uint16_t n = sender->num_full;
+
+  memset(hdrs, 0, sizeof(struct mmsghdr) * n);
+  for (uint16_t i = 0; i < n; i++)
+    {
+    iov[i].iov_base = sender->buffers[i];
+    iov[i].iov_len = sender->lengths[i];
+    hdrs[i].msg_hdr.msg_name = &sender->dest;
+    hdrs[i].msg_hdr.msg_namelen = sizeof(sender->dest);
+    hdrs[i].msg_hdr.msg_iov = &iov[i];
+    hdrs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+  result_t result = s_ok;
+  uint16_t sent = 0;
+  while (sent < n)
+    {
+    CANTRACE_BEGIN(trace);
+    int rc = sendmmsg(sender->fd, hdrs + sent, n - sent, 0);
+    CANTRACE_END(trace, ts_transmit, rc > 0 ? rc : 0);
+    sender->stats.calls++;
+    if (rc < 0 && errno == EINTR)
+      continue;
+
+    if (rc <= 0)
+      {
+      // skip the datagram the kernel refused and carry on with the rest
+      sender->stats.errors++;
+      result = errno == ENOBUFS || errno == EAGAIN ? e_no_space : e_invalid_operation;
+      rc = 1;
+      }
+    else
+      sender->stats.datagrams += (uint64_t)rc;
+
+    sent += (uint16_t)rc;
+    }
+
+  // the datagram being filled moves to the front
+  if (sender->count > 0)
+    memcpy(sender->buffers[0], sender->buffers[n], sender->length);
+
+  sender->num_full = 0;
+  return result;
+  }
+
+result_t canudp_send(canudp_sender_t *sender, const timed_canmsg_t *msgs, uint32_t count, uint64_t now)
+  {
+  if (sender == 0 || (msgs == 0 && count > 0))
+    return e_bad_parameter;
+
+  for (uint32_t i = 0; i < count; i++)
+    {
+    const timed_canmsg_t *msg = &msgs[i];
+    uint16_t len = get_can_len(&msg->msg);
+    if (len > 8)
+      len = 8;
+
+    // a message that will not fit, or whose time cannot be held as an
+    // offset from the base, starts a new datagram
+    if (sender->count > 0 &&
+        (sender->length + CANUDP_RECORD_HEADER + len > sender->size ||
+         msg->timestamp < sender->base || msg->timestamp - sender->base > UINT32_MAX))
+      {
+      finish_datagram(sender);
+      if (sender->num_full == CANUDP_BATCH)
+        send_datagrams(sender);
+      }
+
+    if (sender->count == 0)
+      {
+      sender->base = msg->timestamp;
+      if (sender->num_full == 0)
+        sender->started = now;
+      }
+
+    uint8_t *p = sender->buffers[sender->num_full] + sender->length;
+    put_le32(p, (uint32_t)(msg->timestamp - sender->base));
+    put_le16(p + 4, msg->msg.flags);
+    memcpy(p + CANUDP_RECORD_HEADER, msg->msg.data, len);
+    sender->length += CANUDP_RECORD_HEADER + len;
+    sender->count++;
+    sender->stats.messages++;
+    }
+
+  // full datagrams go now, the one being filled waits for its deadline
+  result_t result = s_ok;
+  if (sender->num_full > 0)
+    {
+    result = send_datagrams(sender);
+    sender->started = now;
+    }
+
+  canudp_poll(sender, now, 0);
+  return result;
+  }
+
+result_t canudp_poll(canudp_sender_t *sender, uint64_t now, uint64_t *next)
+  {
+  if (sender == 0)
+    return e_bad_parameter;
+
+  result_t result = s_ok;
+  if (sender->count > 0 && now - sender->started >= sender->deadline)
+    result = canudp_flush(sender);
+
+  if (next != 0)
+    *next = sender->count > 0 ? sender->started + sender->deadline : UINT64_MAX;
+
+  return result;
+  }
+
+result_t canudp_flush(canudp_sender_t *sender)
+  {
+  if (sender == 0)
+    return e_bad_parameter;
+
+  if (sender->count > 0)
+    finish_datagram(sender);
+
+  if (sender->num_full == 0)
+    return s_ok;
+
+  return send_datagrams(sender);
+  }
+
+result_t canudp_sender_stats(canudp_sender_t *sender, canudp_stats_t *stats)
+  {
+  if (sender == 0 || stats == 0)
+    return e_bad_parameter;
+
+  *stats = sender->stats;
+  return s_ok;
+  }
+
+result_t canudp_sender_close(canudp_sender_t *sender)
+  {
+  if (sender == 0)
+    return e_bad_parameter;
+
+  result_t result = canudp_flush(sender);
+  close(sender->fd);
+  free(sender);
+  return result;
+  }
+
+result_t canudp_receiver_open(const canudp_config_t *config, canudp_receiver_t **receiver)
+  {
+  if (config == 0 || receiver == 0 || config->port == 0)
+    return e_bad_parameter;
+
+  struct sockaddr_in group;
+  struct in_addr local = { htonl(INADDR_ANY) };
+  if (failed(parse_address(config->group, config->port, &group)) ||
+      (config->interface != 0 && inet_pton(AF_INET, config->interface, &local) != 1))
+    return e_bad_parameter;
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0)
+    return e_not_supported;
+
+  // several receivers on one host may share the group
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  // room for bursts of full datagrams, the kernel limits this to rmem_max
+  int size = CANUDP_RECEIVE_BUFFER;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+  bool multicast = IN_MULTICAST(ntohl(group.sin_addr.s_addr));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = group.sin_port;
+  addr.sin_addr.s_addr = multicast ? group.sin_addr.s_addr : htonl(INADDR_ANY);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+    close(fd);
+    return e_invalid_operation;
+    }
+
+  if (multicast)
+    {
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr = group.sin_addr;
+    mreq.imr_interface = local;
+    if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+      {
+      close(fd);
+      return e_invalid_operation;
+      }
+    }
+
+  canudp_receiver_t *rp = (canudp_receiver_t *)calloc(1, sizeof(canudp_receiver_t));
+  if (rp == 0)
+    {
+    close(fd);
+    return e_not_enough_memory;
+    }
+
+  rp->fd = fd;
+  for (uint16_t i = 0; i < CANUDP_BATCH; i++)
+    {
+    rp->iov[i].iov_base = rp->buffers[i];
+    rp->iov[i].iov_len = CANUDP_MAX_DATAGRAM;
+    rp->hdrs[i].msg_hdr.msg_iov = &rp->iov[i];
+    rp->hdrs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+  *receiver = rp;
+  return s_ok;
+  }
+
+// check the header of the next datagram and start unpacking it
+static bool open_datagram(canudp_receiver_t *receiver)
+  {
+  const uint8_t *p = receiver->buffers[receiver->next];
+  uint32_t length = receiver->hdrs[receiver->next].msg_len;
+
+  if (length < CANUDP_HEADER_SIZE || fetch_le32(p) != CANUDP_MAGIC || p[4] != CANUDP_VERSION)
+    {
+    receiver->stats.corrupt++;
+    return false;
+    }
+
+  uint32_t sequence = fetch_le32(p + 8);
+  int32_t gap = receiver->have_sequence ? (int32_t)(sequence - receiver->sequence) : 0;
+  if (gap >= 0 || gap < -CANUDP_REORDER)
+    {
+    // far behind is a sender that restarted, so follow it
+    if (gap > 0)
+      receiver->stats.lost += (uint64_t)gap;
+
+    receiver->sequence = sequence + 1;
+    }
+  else if (receiver->stats.lost > 0)
+    // a datagram from just behind the expected one was reordered, not
+    // lost, and does not move the sequence back
+    receiver->stats.lost--;
+
+  receiver->have_sequence = true;
+  receiver->stats.datagrams++;
+
+  receiver->remaining = fetch_le16(p + 6);
+  receiver->base = fetch_le64(p + 12);
+  receiver->offset = CANUDP_HEADER_SIZE;
+  return true;
+  }
+
+// unpack messages of the current datagrams into msgs, returns the number unpacked
+static uint32_t unpack(canudp_receiver_t *receiver, timed_canmsg_t *msgs, uint32_t count)
+  {
+  uint32_t n = 0;
+  while (n < count && receiver->next < receiver->num_received)
+    {
+    if (receiver->remaining == 0)
+      {
+      if (receiver->offset == 0 && open_datagram(receiver))
+        continue;
+
+      receiver->next++;
+      receiver->offset = 0;
+      continue;
+      }
+
+    const uint8_t *p = receiver->buffers[receiver->next];
+    uint32_t length = receiver->hdrs[receiver->next].msg_len;
+    uint16_t offset = receiver->offset;
+    if ((uint32_t)offset + CANUDP_RECORD_HEADER > length)
+      {
+      receiver->stats.corrupt++;
+      receiver->remaining = 0;
+      continue;
+      }
+
+    uint16_t flags = fetch_le16(p + offset + 4);
+    uint16_t len = (flags >> 12) > 8 ? 8 : (flags >> 12);
+    if ((uint32_t)offset + CANUDP_RECORD_HEADER + len > length)
+      {
+      receiver->stats.corrupt++;
+      receiver->remaining = 0;
+      continue;
+      }
+
+    timed_canmsg_t *msg = &msgs[n++];
+    msg->timestamp = receiver->base + fetch_le32(p + offset);
+    msg->msg.flags = flags;
+    memset(msg->msg.data, 0, 8);
+    memcpy(msg->msg.data, p + offset + CANUDP_RECORD_HEADER, len);
+
+    receiver->offset = offset + CANUDP_RECORD_HEADER + len;
+    receiver->remaining--;
+    receiver->stats.messages++;
+    }
+
+  return n;
+  }
+
+result_t canudp_receive(canudp_receiver_t *receiver, timed_canmsg_t *msgs, uint32_t *count, int timeout_ms)
+  {
+  if (receiver == 0 || msgs == 0 || count == 0 || *count == 0)
+    return e_bad_parameter;
+
+  uint32_t n = unpack(receiver, msgs, *count);
+  while (n == 0)
+    {
+    struct pollfd pfd = { receiver->fd, POLLIN, 0 };
+    int rc = poll(&pfd, 1, timeout_ms);
+    if (rc == 0)
+      return e_timeout_error;
+
+    if (rc < 0)
+      return errno == EINTR ? e_operation_cancelled : e_invalid_operation;
+
+    CANTRACE_BEGIN(trace);
+    rc = recvmmsg(receiver->fd, receiver->hdrs, CANUDP_BATCH, MSG_DONTWAIT, 0);
+    CANTRACE_END(trace, ts_receive, rc > 0 ? rc : 0);
+    if (rc < 0)
+      {
+      if (errno == EAGAIN || errno == EINTR)
+        continue;
+
+      return e_invalid_operation;
+      }
+
+    receiver->stats.calls++;
+    receiver->num_received = (uint16_t)rc;
+    receiver->next = 0;
+    receiver->offset = 0;
+    receiver->remaining = 0;
+    n = unpack(receiver, msgs, *count);
+    }
+
+  *count = n;
+  return s_ok;
+  }
+
+result_t canudp_receiver_stats(canudp_receiver_t *receiver, canudp_stats_t *stats)
+  {
+  if (receiver == 0 || stats == 0)
+    return e_bad_parameter;
+
+  *stats = receiver->stats;
+  return s_ok;
+  }
+
+result_t canudp_receiver_close(canudp_receiver_t *receiver)
+  {
+  if (receiver == 0)
+    return e_bad_parameter;
+
+  close(receiver->fd);
+  free(receiver);
+  return s_ok;
+  }
@@ -0,0 +1,167 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#ifndef __canudp_h__
+#define __canudp_h__
+
+#include "canlog.h"
+
+/*************************************************
+ * Batched UDP transport of timed messages.
+ *
+ * The sender packs messages into datagrams of up to the configured
+ * size.  A datagram that is full is sent at the end of the canudp_send
+ * call that filled it, together with any others, in one sendmmsg.  A
+ * partly filled datagram is sent once its oldest message has waited
+ * for the deadline, so canudp_poll must be called at least that often.
+ *
+ * The receiver takes datagrams with recvmmsg into its own buffers and
+ * unpacks the messages straight into the caller's buffer.  A datagram
+ * that does not fit is left for the next call, so none are lost on the
+ * way out of the receiver.  Gaps in the datagram sequence are counted.
+ *
+ * Datagram, little endian
+ * header   magic 'CFUD' (4), version (1), 0 (1), count (2),
+ *          sequence (4), base time (8)
+ * message  time - base time (4), flags (2), data (length from the flags)
+ */
+#define CANUDP_MAGIC 0x44554643         // 'CFUD'
+#define CANUDP_VERSION 1
+#define CANUDP_HEADER_SIZE 20
+#define CANUDP_RECORD_HEADER 6
+// largest datagram, an ethernet MTU less the IP and UDP headers
+#define CANUDP_MAX_DATAGRAM 1472
+// datagrams handed to sendmmsg or taken from recvmmsg at once
+#define CANUDP_BATCH 32
+
+typedef struct _canudp_config_t {
+  const char *group;            // multicast group or unicast address to send to
+  uint16_t port;
+  const char *interface;        // address of the local interface, 0 for the default
+  uint16_t size;                // datagram size, 0 for CANUDP_MAX_DATAGRAM
+  uint32_t deadline;            // longest a message waits to be sent, microseconds
+  uint8_t ttl;                  // multicast ttl, 0 for 1
+  bool loopback;                // deliver multicast to receivers on this host
+  } canudp_config_t;
+
+typedef struct _canudp_stats_t {
+  uint64_t messages;            // messages sent or received
+  uint64_t datagrams;           // datagrams sent or received
+  uint64_t calls;               // sendmmsg or recvmmsg calls
+  uint64_t errors;              // datagrams that could not be sent
+  uint64_t lost;                // receiver: datagrams missing from the sequence
+  uint64_t corrupt;             // receiver: datagrams that were not valid
+  } canudp_stats_t;
+
+typedef struct _canudp_sender_t canudp_sender_t;
+typedef struct _canudp_receiver_t canudp_receiver_t;
+
+/**
+ * @brief Open a sender
+ * @param config  Where to send and how to batch
+ * @param sender  Opened sender
+ * @return s_ok if opened, e_bad_parameter if the address is not valid
+ */
+extern result_t canudp_sender_open(const canudp_config_t *config, canudp_sender_t **sender);
+/**
+ * @brief Queue messages, sending the datagrams that fill
+ * @param sender  Sender
+ * @param msgs    Messages to send
+ * @param count   Number of messages
+ * @param now     Current time, microseconds, used for the deadline
+ * @return s_ok if queued
+ */
+extern result_t canudp_send(canudp_sender_t *sender, const timed_canmsg_t *msgs, uint32_t count, uint64_t now);
+/**
+ * @brief Send a partly filled datagram whose deadline has passed
+ * @param sender  Sender
+ * @param now     Current time, microseconds
+ * @param next    Optional, time the next deadline falls due, UINT64_MAX if nothing is waiting
+ * @return s_ok
+ */
+extern result_t canudp_poll(canudp_sender_t *sender, uint64_t now, uint64_t *next);
+/**
+ * @brief Send everything queued
+ * @param sender  Sender
+ * @return s_ok if sent
+ */
+extern result_t canudp_flush(canudp_sender_t *sender);
+/**
+ * @brief Return the statistics of a sender
+ * @param sender  Sender
+ * @param stats   Statistics
+ * @return s_ok if returned
+ */
+extern result_t canudp_sender_stats(canudp_sender_t *sender, canudp_stats_t *stats);
+/**
+ * @brief Flush and close a sender
+ * @param sender  Sender to close
+ * @return s_ok if closed
+ */
+extern result_t canudp_sender_close(canudp_sender_t *sender);
+/**
+ * @brief Open a receiver, joining the group if it is a multicast address
+ * @param config  Group and port to receive from
+ * @param receiver  Opened receiver
+ * @return s_ok if opened
+ */
+extern result_t canudp_receiver_open(const canudp_config_t *config, canudp_receiver_t **receiver);
+/**
+ * @brief Receive messages
+ * @param receiver    Receiver
+ * @param msgs        Buffer for the messages
+ * @param count       On entry the size of the buffer, on exit the number received
+ * @param timeout_ms  Time to wait when nothing is waiting, -1 to wait forever
+ * @return s_ok if messages are returned, e_timeout_error if none arrived
+ */
+extern result_t canudp_receive(canudp_receiver_t *receiver, timed_canmsg_t *msgs, uint32_t *count, int timeout_ms);
+/**
+ * @brief Return the statistics of a receiver
+ * @param receiver  Receiver
+ * @param stats     Statistics
+ * @return s_ok if returned
+ */
+extern result_t canudp_receiver_stats(canudp_receiver_t *receiver, canudp_stats_t *stats);
+/**
+ * @brief Close a receiver
+ * @param receiver  Receiver to close
+ * @return s_ok if closed
+ */
+extern result_t canudp_receiver_close(canudp_receiver_t *receiver);
+
+#endif
@@ -0,0 +1,198 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#define _GNU_SOURCE
+#include "checkpoint.h"
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// the crc covers the slot from seq to data, less the crc itself
+static uint32_t slot_crc(const checkpoint_slot_t *slot)
+  {
+  uint32_t crc = crc32_update(0, &slot->seq, sizeof(slot->seq));
+  return crc32_update(crc, &slot->timestamp, sizeof(slot->timestamp) + sizeof(slot->flags) + sizeof(slot->data));
+  }
+
+static uint32_t header_crc(const checkpoint_header_t *header)
+  {
+  return crc32_update(0, header, offsetof(checkpoint_header_t, crc));
+  }
+
+static void init_header(checkpoint_header_t *header)
+  {
+  memset(header, 0, sizeof(checkpoint_header_t));
+  header->magic = CHECKPOINT_MAGIC;
+  header->version = CHECKPOINT_VERSION;
+  header->slot_size = sizeof(checkpoint_slot_t);
+  header->num_slots = NUM_CAN_IDS;
+  header->crc = header_crc(header);
+  }
+
+result_t checkpoint_open(const char *path, checkpoint_t *cp)
+  {
+  if (path == 0 || cp == 0)
+    return e_bad_parameter;
+
+  memset(cp, 0, sizeof(checkpoint_t));
+
+  int fd = open(path, O_CREAT | O_RDWR, 0644);
+  if (fd < 0)
+    return e_path_not_found;
+
+  struct stat st;
+  bool fresh = fstat(fd, &st) != 0 || st.st_size != sizeof(checkpoint_file_t);
+  if (fresh && (ftruncate(fd, 0) != 0 || ftruncate(fd, sizeof(checkpoint_file_t)) != 0))
+    {
+    close(fd);
+    return e_no_space;
+    }
+
+  void *mem = mmap(0, sizeof(checkpoint_file_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED)
+    return e_not_enough_memory;
+
+  checkpoint_file_t *file = (checkpoint_file_t *)mem;
+  checkpoint_header_t expected;
+  init_header(&expected);
+  if (!fresh && memcmp(&file->header, &expected, sizeof(expected)) != 0)
+    fresh = true;
+
+  cp->file = file;
+  if (fresh)
+    {
+    memset(file, 0, sizeof(checkpoint_file_t));
+    file->header = expected;
+    return s_ok;
+    }
+
+  for (uint32_t id = 0; id < NUM_CAN_IDS; id++)
+    {
+    checkpoint_slot_t *slot = &file->slots[id];
+    if (slot->seq == 0)
+      continue;
+
+    if ((slot->seq & 1) != 0 || slot->crc != slot_crc(slot) || (slot->flags & ID_MASK) != id)
+      {
+      memset(slot, 0, sizeof(checkpoint_slot_t));
+      cp->discarded++;
+      continue;
+      }
+
+    cp->valid[id >> 6] |= 1ULL << (id & 63);
+    cp->stale[id >> 6] |= 1ULL << (id & 63);
+    cp->restored++;
+    }
+
+  return s_ok;
+  }
+
+static void update_slot(checkpoint_t *cp, uint64_t timestamp, const canmsg_t *msg)
+  {
+  uint16_t id = get_can_id(msg);
+  checkpoint_slot_t *slot = &cp->file->slots[id];
+
+  // build the slot first so the window a crash can tear is only the stores,
+  // a crash part way through leaves the sequence odd
+  checkpoint_slot_t next;
+  next.seq = (slot->seq | 1) + 1;
+  next.timestamp = timestamp;
+  next.flags = msg->flags;
+  memcpy(next.data, msg->data, 8);
+  next.crc = slot_crc(&next);
+
+  __atomic_store_n(&slot->seq, next.seq - 1, __ATOMIC_RELAXED);
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  slot->crc = next.crc;
+  slot->timestamp = next.timestamp;
+  slot->flags = next.flags;
+  memcpy(slot->data, next.data, 8);
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  __atomic_store_n(&slot->seq, next.seq, __ATOMIC_RELAXED);
+
+  cp->valid[id >> 6] |= 1ULL << (id & 63);
+  cp->stale[id >> 6] &= ~(1ULL << (id & 63));
+  }
+
+result_t checkpoint_update(checkpoint_t *cp, const timed_canmsg_t *msgs, uint32_t count)
+  {
+  if (cp == 0 || cp->file == 0 || (msgs == 0 && count > 0))
+    return e_bad_parameter;
+
+  for (uint32_t i = 0; i < count; i++)
+    {
+    const canmsg_t *msg = &msgs[i].msg;
+    if (get_can_len(msg) > 0 && msg->data[0] == CANFLY_PACKED_UINT16)
+      {
+      canmsg_t expanded[PACKED_UINT16_MAX];
+      uint16_t num_expanded;
+      if (succeeded(expand_packed_msg(msg, expanded, &num_expanded)))
+        for (uint16_t j = 0; j < num_expanded; j++)
+          update_slot(cp, msgs[i].timestamp, &expanded[j]);
+      }
+    else
+      update_slot(cp, msgs[i].timestamp, msg);
+    }
+
+  return s_ok;
+  }
+
+result_t checkpoint_sync(checkpoint_t *cp, bool wait)
+  {
+  if (cp == 0 || cp->file == 0)
+    return e_bad_parameter;
+
+  if (msync(cp->file, sizeof(checkpoint_file_t), wait ? MS_SYNC : MS_ASYNC) != 0)
+    return e_invalid_operation;
+
+  return s_ok;
+  }
+
+result_t checkpoint_close(checkpoint_t *cp)
+  {
+  if (cp == 0 || cp->file == 0)
+    return e_bad_parameter;
+
+  munmap(cp->file, sizeof(checkpoint_file_t));
+  cp->file = 0;
+  return s_ok;
+  }
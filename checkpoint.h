@@ -0,0 +1,154 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#ifndef __checkpoint_h__
+#define __checkpoint_h__
+
+#include "canlog.h"
+#include <stddef.h>
+#include <string.h>
+
+/*************************************************
+ * Memory mapped checkpoint of the latest values.
+ *
+ * The latest message of every ID is kept in a file mapped into the
+ * process, so updating it is a few stores and no system calls.  The
+ * kernel writes the pages back, a restarted process maps the same file
+ * and has every value again, with its timestamp, without waiting for
+ * slow IDs to be sent.
+ *
+ * Restored values are marked stale until a new message for the ID
+ * arrives.  Each slot carries a checksum, and is odd sequenced while it
+ * is written, so a slot torn by a crash or a partial write back is
+ * discarded on its own rather than losing the file.  A header with a
+ * version and checksum guards the layout, a file that does not match is
+ * started again empty.
+ *
+ * The file is in host byte order, it is for restarting on the same
+ * machine.  checkpoint_sync may be called from a timer to start the
+ * write back early, it is never needed on the message path.
+ */
+#define CHECKPOINT_MAGIC 0x50434643   // 'CFCP'
+#define CHECKPOINT_VERSION 1
+
+typedef struct _checkpoint_slot_t {
+  uint32_t seq;                 // odd while written, 0 if never written
+  uint32_t crc;                 // of the sequence, timestamp and message
+  uint64_t timestamp;
+  uint16_t flags;
+  uint8_t data[8];
+  uint8_t pad[6];
+  } checkpoint_slot_t;
+
+typedef struct _checkpoint_header_t {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t slot_size;
+  uint32_t num_slots;
+  uint32_t crc;                 // of the fields above
+  uint8_t pad[48];
+  } checkpoint_header_t;
+
+typedef struct _checkpoint_file_t {
+  checkpoint_header_t header;
+  checkpoint_slot_t slots[NUM_CAN_IDS];
+  } checkpoint_file_t;
+
+typedef struct _checkpoint_t {
+  checkpoint_file_t *file;
+  uint64_t valid[NUM_CAN_IDS / 64];   // bit per ID that has a value
+  uint64_t stale[NUM_CAN_IDS / 64];   // bit per ID restored and not yet refreshed
+  uint32_t restored;            // values restored when opened
+  uint32_t discarded;           // slots that failed their check when opened
+  } checkpoint_t;
+
+/**
+ * @brief Open a checkpoint, restoring the values it holds
+ * @param path  File to map, created if it does not exist
+ * @param cp    Checkpoint, restored holds the number of values restored,
+ * 0 if the file was new or did not match the layout and was started again
+ * @return s_ok if opened
+ */
+extern result_t checkpoint_open(const char *path, checkpoint_t *cp);
+/**
+ * @brief Update the checkpoint with messages
+ * @param cp    Checkpoint
+ * @param msgs  Messages in time order, packed messages are expanded
+ * @param count Number of messages
+ * @return s_ok
+ */
+extern result_t checkpoint_update(checkpoint_t *cp, const timed_canmsg_t *msgs, uint32_t count);
+/**
+ * @brief Start writing the checkpoint back to the file
+ * @param cp    Checkpoint
+ * @param wait  Wait until it is written
+ * @return s_ok if started, or written when waiting
+ */
+extern result_t checkpoint_sync(checkpoint_t *cp, bool wait);
+/**
+ * @brief Unmap a checkpoint, the file is kept for the next open
+ * @param cp    Checkpoint
+ * @return s_ok if closed
+ */
+extern result_t checkpoint_close(checkpoint_t *cp);
+
+/**
+ * @brief Return the latest value of an ID
+ * @param cp    Checkpoint
+ * @param id    CanFly ID
+ * @param msg   Latest message and the time it was received
+ * @param stale Optional, set if the value was restored and not yet refreshed
+ * @return s_ok if returned, e_no_more_information if the ID has no value
+ */
+static inline result_t checkpoint_get(const checkpoint_t *cp, uint16_t id, timed_canmsg_t *msg, bool *stale)
+  {
+  id &= ID_MASK;
+  if ((cp->valid[id >> 6] & (1ULL << (id & 63))) == 0)
+    return e_no_more_information;
+
+  const checkpoint_slot_t *slot = &cp->file->slots[id];
+  msg->timestamp = slot->timestamp;
+  msg->msg.flags = slot->flags;
+  memcpy(msg->msg.data, slot->data, 8);
+  if (stale != 0)
+    *stale = (cp->stale[id >> 6] & (1ULL << (id & 63))) != 0;
+
+  return s_ok;
+  }
+
+#endif
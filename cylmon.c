@@ -0,0 +1,233 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#include "cylmon.h"
+
+#include <string.h>
+#include <math.h>
+
+result_t cylmon_init(cylmon_t *mon, const cylmon_config_t *config)
+  {
+  if (mon == 0 ||
+      (config != 0 && (!(config->alpha > 0 && config->alpha < 1) ||
+                       config->z_off > config->z_on ||
+                       !(config->min_sigma > 0))))
+    return e_bad_parameter;
+
+  memset(mon, 0, sizeof(cylmon_t));
+  if (config != 0)
+    mon->config = *config;
+  else
+    {
+    mon->config.alpha = 0.0005f;
+    mon->config.z_on = 4;
+    mon->config.z_off = 3;
+    mon->config.min_sigma = 2;
+    mon->config.warmup = 600;
+    mon->config.persistence = 5;
+    }
+
+  mon->num_cylinders = CYLMON_MAX_CYLINDERS;
+  return s_ok;
+  }
+
+static void report(cylmon_t *mon, const cylmon_event_t *ev, timed_canmsg_t *event, uint16_t *count)
+  {
+  if (mon->config.callback != 0)
+    mon->config.callback(ev, mon->config.arg);
+
+  if (mon->config.event_id != 0 && event != 0)
+    {
+    float z = fminf(fmaxf(ev->z * 100, -32767), 32767);
+    event->timestamp = ev->timestamp;
+    create_can_msg_int16(&event->msg, mon->config.event_id + ev->bank * CYLMON_MAX_CYLINDERS + ev->cylinder,
+                         ev->active ? (int16_t)z : 0);
+    (*count)++;
+    }
+  }
+
+static void update(cylmon_t *mon, cylmon_bank bank_num, uint16_t cylinder, uint64_t timestamp, float value,
+                   timed_canmsg_t *event, uint16_t *count)
+  {
+  const cylmon_config_t *config = &mon->config;
+  cylmon_bank_t *bank = &mon->banks[bank_num];
+  uint8_t bit = 1 << cylinder;
+
+  bank->value[cylinder] = value;
+  bank->valid |= bit;
+
+  // mean of the other cylinders, leaving out any that are flagged so one
+  // bad cylinder doesn't drag the others.  The same work whichever
+  // cylinder changed.
+  uint8_t reference = bank->valid & ~bank->flagged & ~bit;
+  float sum = 0;
+  uint16_t others = 0;
+  for (uint16_t i = 0; i < CYLMON_MAX_CYLINDERS; i++)
+    {
+    bool use = ((reference >> i) & 1) != 0 && i < mon->num_cylinders;
+    sum += use ? bank->value[i] : 0;
+    others += use ? 1 : 0;
+    }
+
+  if (others == 0)
+    return;
+
+  float deviation = value - sum / others;
+  float delta = deviation - bank->mean[cylinder];
+
+  // the noise is measured from the change between samples, so a slow
+  // drift does not widen the band it is tested against
+  float step = deviation - bank->last[cylinder];
+  bool first = (bank->seen & bit) == 0;
+  bank->last[cylinder] = deviation;
+  bank->seen |= bit;
+
+  float variance = fmaxf(bank->variance[cylinder], config->min_sigma * config->min_sigma);
+  float z2 = delta * delta / variance;
+
+  if ((bank->flagged & bit) == 0)
+    {
+    bool warming = bank->samples[cylinder] < config->warmup;
+    if (!warming && z2 > config->z_on * config->z_on)
+      {
+      if (++bank->over[cylinder] < config->persistence)
+        return;
+
+      bank->flagged |= bit;
+      bank->over[cylinder] = 0;
+      }
+    else
+      {
+      // learn quickly at first, then settle on alpha
+      float alpha = warming ? fmaxf(config->alpha, 1.0f / (bank->samples[cylinder] + 1)) : config->alpha;
+      if (warming)
+        bank->samples[cylinder]++;
+
+      bank->over[cylinder] = 0;
+      bank->mean[cylinder] += alpha * delta;
+      if (!first)
+        bank->variance[cylinder] += alpha * (step * step * 0.5f - bank->variance[cylinder]);
+      return;
+      }
+    }
+  else if (z2 < config->z_off * config->z_off)
+    {
+    if (++bank->over[cylinder] < config->persistence)
+      return;
+
+    bank->flagged &= ~bit;
+    bank->over[cylinder] = 0;
+    }
+  else
+    {
+    bank->over[cylinder] = 0;
+    return;
+    }
+
+  cylmon_event_t ev;
+  ev.timestamp = timestamp;
+  ev.bank = bank_num;
+  ev.cylinder = cylinder;
+  ev.value = value;
+  ev.deviation = deviation;
+  ev.z = delta / sqrtf(variance);
+  ev.active = (bank->flagged & bit) != 0;
+  report(mon, &ev, event, count);
+  }
+
+static void add_value(cylmon_t *mon, uint64_t timestamp, const canmsg_t *msg, timed_canmsg_t *event, uint16_t *count)
+  {
+  uint16_t id = get_can_id(msg);
+  cylmon_bank bank;
+  uint16_t cylinder;
+
+  if (id >= id_cylinder_head_temperature1 && id <= id_cylinder_head_temperature6)
+    {
+    bank = cm_cht;
+    cylinder = id - id_cylinder_head_temperature1;
+    }
+  else if (id >= id_exhaust_gas_temperature1 && id <= id_exhaust_gas_temperature6)
+    {
+    bank = cm_egt;
+    cylinder = id - id_exhaust_gas_temperature1;
+    }
+  else if (id == id_num_cylinders)
+    {
+    uint16_t num_cylinders;
+    if (succeeded(get_param_uint16(msg, &num_cylinders)) &&
+        num_cylinders >= 2 && num_cylinders <= CYLMON_MAX_CYLINDERS)
+      mon->num_cylinders = num_cylinders;
+
+    return;
+    }
+  else
+    return;
+
+  if (cylinder >= mon->num_cylinders)
+    return;
+
+  variant_t v;
+  float value;
+  if (failed(msg_to_variant(msg, &v)) || failed(coerce_to_float(&v, &value)))
+    return;
+
+  update(mon, bank, cylinder, timestamp, value, event != 0 ? event + *count : 0, count);
+  }
+
+result_t cylmon_add(cylmon_t *mon, const timed_canmsg_t *msg, timed_canmsg_t *event, uint16_t *count)
+  {
+  if (mon == 0 || msg == 0 || count == 0)
+    return e_bad_parameter;
+
+  *count = 0;
+
+  // a bank of temperatures is usually sent packed
+  if (get_can_len(&msg->msg) > 0 && msg->msg.data[0] == CANFLY_PACKED_UINT16)
+    {
+    canmsg_t expanded[PACKED_UINT16_MAX];
+    uint16_t num_expanded;
+    if (succeeded(expand_packed_msg(&msg->msg, expanded, &num_expanded)))
+      for (uint16_t i = 0; i < num_expanded; i++)
+        add_value(mon, msg->timestamp, &expanded[i], event, count);
+
+    return s_ok;
+    }
+
+  add_value(mon, msg->timestamp, &msg->msg, event, count);
+  return s_ok;
+  }
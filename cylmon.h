@@ -0,0 +1,140 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#ifndef __cylmon_h__
+#define __cylmon_h__
+
+#include "canlog.h"
+
+/*************************************************
+ * Cylinder temperature anomaly detection.
+ *
+ * Each cylinder of a bank (the six CHT's or the six EGT's) is compared
+ * with the mean of the other cylinders in the bank.  The deviation has an
+ * EWMA mean per cylinder, which learns how that cylinder normally sits
+ * relative to the others, and an EWMA variance of the sample to sample
+ * noise.  A cylinder whose deviation moves more than z_on standard
+ * deviations from its normal for a number of frames is flagged, and
+ * cleared when it falls back under z_off.  The EWMA time constant sets
+ * the slowest drift that is caught: the mean lags a drift of r per
+ * sample by r / alpha.
+ *
+ * Comparing with the bank removes changes that affect every cylinder,
+ * such as power and mixture changes, so a single cylinder drifting away
+ * shows well before it reaches a threshold alarm.  The statistics of a
+ * flagged cylinder are frozen so they don't learn the fault.
+ *
+ * The bank is held as arrays of the cylinders.  A frame updates one
+ * cylinder, the bank mean is summed across the arrays, so every frame
+ * does the same small amount of work and the z test needs no square root.
+ */
+#define CYLMON_MAX_CYLINDERS 6
+
+typedef enum _cylmon_bank {
+  cm_cht,
+  cm_egt,
+  num_cylmon_banks
+  } cylmon_bank;
+
+typedef struct _cylmon_event_t {
+  uint64_t timestamp;
+  cylmon_bank bank;
+  uint16_t cylinder;            // 0 based
+  float value;                  // temperature, K
+  float deviation;              // difference from the mean of the other cylinders
+  float z;                      // standard deviations from the normal deviation
+  bool active;                  // true when flagged, false when cleared
+  } cylmon_event_t;
+
+typedef void (*cylmon_callback)(const cylmon_event_t *event, void *arg);
+
+typedef struct _cylmon_config_t {
+  float alpha;                  // EWMA weight of a new sample
+  float z_on;                   // flag when |z| exceeds this
+  float z_off;                  // clear when |z| falls below this
+  float min_sigma;              // floor on the standard deviation, K
+  uint32_t warmup;              // samples before a cylinder can be flagged
+  uint8_t persistence;          // consecutive samples past z_on to flag, or z_off to clear
+  uint16_t event_id;            // if not 0 events are also sent as frames, see cylmon_add
+  cylmon_callback callback;     // called for each event, may be 0
+  void *arg;
+  } cylmon_config_t;
+
+typedef struct _cylmon_bank_t {
+  float value[CYLMON_MAX_CYLINDERS];
+  float mean[CYLMON_MAX_CYLINDERS];     // EWMA of the deviation
+  float variance[CYLMON_MAX_CYLINDERS]; // EWMA variance of the deviation noise
+  float last[CYLMON_MAX_CYLINDERS];     // last deviation
+  uint32_t samples[CYLMON_MAX_CYLINDERS];
+  uint8_t over[CYLMON_MAX_CYLINDERS];   // consecutive samples past z_on / z_off
+  uint8_t valid;                // bit per cylinder with a value
+  uint8_t seen;                 // bit per cylinder with a deviation
+  uint8_t flagged;              // bit per flagged cylinder
+  } cylmon_bank_t;
+
+typedef struct _cylmon_t {
+  cylmon_config_t config;
+  uint16_t num_cylinders;
+  cylmon_bank_t banks[num_cylmon_banks];
+  } cylmon_t;
+
+/**
+ * @brief Initialize a monitor
+ * @param mon     Monitor
+ * @param config  Configuration, 0 for the defaults of alpha 0.0005 (a time
+ * constant of 200s at 10Hz), z 4/3, sigma at least 2K, 600 samples warmup
+ * and 5 samples persistence
+ * @return s_ok if initialized, e_bad_parameter if alpha is not in (0, 1),
+ * z_off is above z_on or min_sigma is not positive
+ */
+extern result_t cylmon_init(cylmon_t *mon, const cylmon_config_t *config);
+/**
+ * @brief Add a frame
+ * @param mon     Monitor
+ * @param msg     Frame, CHT, EGT and id_num_cylinders are used, packed
+ * frames are expanded
+ * @param event   If the event_id is configured, a buffer for
+ * PACKED_UINT16_MAX frames.  The
+ * frame is ID event_id + bank * 6 + cylinder, CANFLY_INT16 z * 100 when
+ * flagged and 0 when cleared.
+ * @param count   Number of frames produced
+ * @return s_ok if added
+ */
+extern result_t cylmon_add(cylmon_t *mon, const timed_canmsg_t *msg, timed_canmsg_t *event, uint16_t *count);
+
+#endif
@@ -0,0 +1,507 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#include "edugen.h"
+
+#include <string.h>
+#include <math.h>
+
+#define USEC_PER_HOUR 3600000000.0
+
+// left/right sensor pairs that report a divergence
+static const struct {
+  uint16_t divergence_id;
+  uint16_t alarm_id;
+  float magnitude;
+  } divergence_pairs[] = {
+  { id_map_divergence, id_map_divergence_alarm, 5000 },
+  { id_rpm_divergence, id_rpm_divergence_alarm, 150 },
+  { id_fuel_pressure_divergence, id_fuel_pressure_divergence_alarm, 3000 },
+  { id_iat_divergence, id_iat_divergence_alarm, 15 },
+  { id_timing_divergence, id_timing_divergence_alarm, 5 },
+  };
+
+#define NUM_DIVERGENCE_PAIRS (sizeof(divergence_pairs) / sizeof(divergence_pairs[0]))
+
+static uint64_t next_random(edugen_t *gen)
+  {
+  // xorshift64*
+  gen->seed ^= gen->seed >> 12;
+  gen->seed ^= gen->seed << 25;
+  gen->seed ^= gen->seed >> 27;
+  return gen->seed * 0x2545F4914F6CDD1DULL;
+  }
+
+// uniform in (0, 1]
+static float uniform(edugen_t *gen)
+  {
+  return ((next_random(gen) >> 40) + 1) / 16777216.0f;
+  }
+
+// approximately normal, mean 0 and standard deviation 1
+static float gaussian(edugen_t *gen)
+  {
+  // sum of 4 uniforms has a variance of 1/3
+  float sum = uniform(gen) + uniform(gen) + uniform(gen) + uniform(gen);
+  return (sum - 2.0f) * 1.7320508f;
+  }
+
+// time of the next event of a poisson process
+static uint64_t next_event(edugen_t *gen, float rate_per_hour)
+  {
+  if (rate_per_hour <= 0)
+    return UINT64_MAX;
+
+  return gen->now + (uint64_t)(-logf(uniform(gen)) * USEC_PER_HOUR / rate_per_hour);
+  }
+
+// a realistic value for a published ID
+static void default_signal(uint16_t id, float *nominal, float *noise)
+  {
+  *noise = 0;
+  if (id >= id_cylinder_head_temperature1 && id <= id_cylinder_head_temperature6)
+    {
+    *nominal = 420 + ((id - id_cylinder_head_temperature1) * 3);
+    *noise = 1.5f;
+    return;
+    }
+
+  if (id >= id_exhaust_gas_temperature1 && id <= id_exhaust_gas_temperature6)
+    {
+    *nominal = 1000 + ((id - id_exhaust_gas_temperature1) * 5);
+    *noise = 4;
+    return;
+    }
+
+  if (id >= id_cylinder_head_temperature1_status && id <= id_exhaust_gas_temperature6_status)
+    {
+    *nominal = 1;
+    return;
+    }
+
+  switch (id)
+    {
+    case id_fuel_pressure :               *nominal = 300; *noise = 2; break;
+    case id_manifold_pressure :           *nominal = 900; *noise = 3; break;
+    case id_oil_temperature :             *nominal = 360; *noise = 0.5f; break;
+    case id_outside_air_temperature :     *nominal = 288; *noise = 0.2f; break;
+    case id_inlet_air_temperature :       *nominal = 293; *noise = 0.3f; break;
+    case id_oil_pressure :                *nominal = 400; *noise = 3; break;
+    case id_engine_rpm :                  *nominal = 2400; *noise = 10; break;
+    case id_fuel_flow_rate :              *nominal = 30; *noise = 0.5f; break;
+    case id_dc_voltage :                  *nominal = 14; break;
+    case id_dc_current :                  *nominal = 10; *noise = 0.5f; break;
+    case id_edu_pressure_altitude :       *nominal = 1500; *noise = 1; break;
+    case id_num_cylinders :               *nominal = 6; break;
+    case id_left_fuel_quantity :
+    case id_right_fuel_quantity :         *nominal = 60; break;
+    case id_edu_valid :                   *nominal = 1; break;
+    case id_engine_hp :                   *nominal = 10000; *noise = 50; break;
+    case id_fuel_total :                  *nominal = 120; break;
+    case id_fuel_endurance :              *nominal = 400; break;
+    case id_engine_hours :                *nominal = 123456; break;
+    case id_egt_divergence :              *nominal = 20; *noise = 2; break;
+    case id_cht_divergence :              *nominal = 15; *noise = 1; break;
+    case id_map_divergence :              *nominal = 50; *noise = 10; break;
+    case id_fuel_pressure_divergence :    *nominal = 30; *noise = 5; break;
+    case id_rpm_divergence :
+    case id_timing_divergence :
+    case id_iat_divergence :
+    case id_advance_divergence :          *nominal = 1; *noise = 0.3f; break;
+    default :
+      // alarms are clear, status nodes report running
+      *nominal = get_canfly_block(id) == cb_status ? bs_running : 0;
+      break;
+    }
+  }
+
+static inline bool due_before(const edugen_t *gen, uint16_t a, uint16_t b)
+  {
+  return gen->channels[a].next_due < gen->channels[b].next_due;
+  }
+
+static void sift_down(edugen_t *gen, uint16_t count, uint16_t pos)
+  {
+  for (;;)
+    {
+    uint16_t smallest = pos;
+    uint16_t left = (pos << 1) + 1;
+    uint16_t right = left + 1;
+
+    if (left < count && due_before(gen, gen->heap[left], gen->heap[smallest]))
+      smallest = left;
+
+    if (right < count && due_before(gen, gen->heap[right], gen->heap[smallest]))
+      smallest = right;
+
+    if (smallest == pos)
+      return;
+
+    uint16_t tmp = gen->heap[pos];
+    gen->heap[pos] = gen->heap[smallest];
+    gen->heap[smallest] = tmp;
+    pos = smallest;
+    }
+  }
+
+// number of channels in the heap, channels with no rate are at the end
+static uint16_t heap_size(const edugen_t *gen)
+  {
+  uint16_t count = 0;
+  for (uint16_t i = 0; i < gen->num_channels; i++)
+    if (gen->channels[i].period != 0)
+      count++;
+
+  return count;
+  }
+
+static void build_heap(edugen_t *gen)
+  {
+  uint16_t count = 0;
+  for (uint16_t i = 0; i < gen->num_channels; i++)
+    if (gen->channels[i].period != 0)
+      gen->heap[count++] = i;
+
+  for (int32_t pos = (count >> 1) - 1; pos >= 0; pos--)
+    sift_down(gen, count, (uint16_t)pos);
+  }
+
+static edugen_channel_t *find_channel(edugen_t *gen, uint16_t id)
+  {
+  for (uint16_t i = 0; i < gen->num_channels; i++)
+    if (gen->channels[i].id == id)
+      return &gen->channels[i];
+
+  return 0;
+  }
+
+result_t edugen_init(edugen_t *gen, uint64_t seed)
+  {
+  if (gen == 0)
+    return e_bad_parameter;
+
+  if (num_canfly_ids > EDUGEN_MAX_CHANNELS)
+    return e_no_space;
+
+  memset(gen, 0, sizeof(edugen_t));
+  gen->seed = seed == 0 ? 0x9E3779B97F4A7C15ULL : seed;
+  gen->next_stale = UINT64_MAX;
+  gen->next_divergence = UINT64_MAX;
+  gen->next_alarm_burst = UINT64_MAX;
+
+  for (uint16_t i = 0; i < num_canfly_ids; i++)
+    {
+    edugen_channel_t *channel = &gen->channels[i];
+    channel->id = canfly_ids[i].id;
+    channel->type = canfly_ids[i].type;
+    channel->period = get_canfly_block(channel->id) == cb_edu ? 100000 : 1000000;
+    channel->normal_period = channel->period;
+    default_signal(channel->id, &channel->nominal, &channel->noise);
+    channel->value = channel->nominal;
+    // spread the channels so they are not all sent at once
+    channel->next_due = next_random(gen) % channel->period;
+    }
+
+  gen->num_channels = num_canfly_ids;
+  build_heap(gen);
+
+  return s_ok;
+  }
+
+static void set_period(edugen_t *gen, edugen_channel_t *channel, uint32_t period)
+  {
+  channel->period = period;
+  if (channel->next_due < gen->now)
+    channel->next_due = gen->now;
+  }
+
+result_t edugen_set_rate(edugen_t *gen, uint16_t id, float rate)
+  {
+  if (gen == 0 || rate < 0)
+    return e_bad_parameter;
+
+  edugen_channel_t *channel = find_channel(gen, id);
+  if (channel == 0)
+    return e_not_found;
+
+  uint32_t period = rate == 0 ? 0 : (uint32_t)(1000000.0f / rate);
+  if (rate > 0 && period == 0)
+    period = 1;
+
+  channel->normal_period = period;
+  if (channel->fault != ef_alarm_burst)
+    set_period(gen, channel, period);
+
+  build_heap(gen);
+  return s_ok;
+  }
+
+result_t edugen_scale_rates(edugen_t *gen, float factor)
+  {
+  if (gen == 0 || factor <= 0)
+    return e_bad_parameter;
+
+  for (uint16_t i = 0; i < gen->num_channels; i++)
+    {
+    edugen_channel_t *channel = &gen->channels[i];
+    if (channel->normal_period == 0)
+      continue;
+
+    uint32_t period = (uint32_t)(channel->normal_period / factor);
+    channel->normal_period = period == 0 ? 1 : period;
+    if (channel->fault != ef_alarm_burst)
+      set_period(gen, channel, channel->normal_period);
+    }
+
+  build_heap(gen);
+  return s_ok;
+  }
+
+result_t edugen_set_signal(edugen_t *gen, uint16_t id, float nominal, float noise, float drift)
+  {
+  if (gen == 0 || noise < 0)
+    return e_bad_parameter;
+
+  edugen_channel_t *channel = find_channel(gen, id);
+  if (channel == 0)
+    return e_not_found;
+
+  channel->nominal = nominal;
+  channel->noise = noise;
+  channel->drift = drift;
+  return s_ok;
+  }
+
+result_t edugen_set_faults(edugen_t *gen, const edugen_faults_t *faults)
+  {
+  if (gen == 0 || faults == 0)
+    return e_bad_parameter;
+
+  gen->faults = *faults;
+  gen->next_stale = next_event(gen, faults->stale_rate);
+  gen->next_divergence = next_event(gen, faults->divergence_rate);
+  gen->next_alarm_burst = next_event(gen, faults->alarm_burst_rate);
+
+  return s_ok;
+  }
+
+// pick a random channel from a block that is not already faulted
+static edugen_channel_t *pick_channel(edugen_t *gen, canfly_block block)
+  {
+  uint16_t candidates[EDUGEN_MAX_CHANNELS];
+  uint16_t count = 0;
+
+  for (uint16_t i = 0; i < gen->num_channels; i++)
+    if (gen->channels[i].fault == ef_none &&
+        gen->channels[i].period != 0 &&
+        get_canfly_block(gen->channels[i].id) == block)
+      candidates[count++] = i;
+
+  if (count == 0)
+    return 0;
+
+  return &gen->channels[candidates[next_random(gen) % count]];
+  }
+
+static void start_fault(edugen_t *gen, edugen_channel_t *channel, edugen_fault fault, float offset, uint32_t duration)
+  {
+  if (channel == 0 || channel->fault != ef_none)
+    return;
+
+  channel->fault = fault;
+  channel->offset = offset;
+  channel->fault_end = gen->now + duration;
+  }
+
+static void start_faults(edugen_t *gen)
+  {
+  bool reschedule = false;
+
+  if (gen->now >= gen->next_stale)
+    {
+    start_fault(gen, pick_channel(gen, cb_edu), ef_stale, 0, gen->faults.stale_duration);
+    gen->next_stale = next_event(gen, gen->faults.stale_rate);
+    }
+
+  if (gen->now >= gen->next_divergence)
+    {
+    uint16_t pair = (uint16_t)(next_random(gen) % NUM_DIVERGENCE_PAIRS);
+    float magnitude = divergence_pairs[pair].magnitude;
+
+    start_fault(gen, find_channel(gen, divergence_pairs[pair].divergence_id), ef_divergence, magnitude, gen->faults.divergence_duration);
+    start_fault(gen, find_channel(gen, divergence_pairs[pair].alarm_id), ef_divergence, magnitude, gen->faults.divergence_duration);
+    gen->next_divergence = next_event(gen, gen->faults.divergence_rate);
+    }
+
+  if (gen->now >= gen->next_alarm_burst)
+    {
+    edugen_channel_t *channel = pick_channel(gen, cb_alarm);
+    if (channel != 0 && gen->faults.alarm_burst_period != 0)
+      {
+      start_fault(gen, channel, ef_alarm_burst, 1, gen->faults.alarm_burst_duration);
+      channel->period = gen->faults.alarm_burst_period;
+      channel->next_due = gen->now;
+      reschedule = true;
+      }
+
+    gen->next_alarm_burst = next_event(gen, gen->faults.alarm_burst_rate);
+    }
+
+  if (reschedule)
+    build_heap(gen);
+  }
+
+static uint64_t next_fault(const edugen_t *gen)
+  {
+  uint64_t next = gen->next_stale;
+  if (gen->next_divergence < next)
+    next = gen->next_divergence;
+
+  if (gen->next_alarm_burst < next)
+    next = gen->next_alarm_burst;
+
+  return next;
+  }
+
+static float clamp(float value, float lo, float hi)
+  {
+  return value < lo ? lo : value > hi ? hi : value;
+  }
+
+static result_t make_frame(edugen_t *gen, edugen_channel_t *channel, canmsg_t *msg)
+  {
+  if (channel->fault != ef_none && gen->now >= channel->fault_end)
+    {
+    if (channel->fault == ef_alarm_burst)
+      channel->period = channel->normal_period;
+
+    channel->fault = ef_none;
+    channel->offset = 0;
+    }
+
+  if (channel->fault != ef_stale)
+    {
+    float value = channel->nominal + (channel->drift * (gen->now / 1000000.0f)) + channel->offset;
+    if (channel->noise > 0)
+      value += channel->noise * gaussian(gen);
+
+    channel->value = value;
+    }
+
+  variant_t v;
+  float value = roundf(channel->value);
+  switch (channel->type)
+    {
+    case CANFLY_UINT8 :
+      create_variant_uint8((uint8_t)clamp(value, 0, UINT8_MAX), &v);
+      break;
+    case CANFLY_INT8 :
+      create_variant_int8((int8_t)clamp(value, INT8_MIN, INT8_MAX), &v);
+      break;
+    case CANFLY_UINT16 :
+      create_variant_uint16((uint16_t)clamp(value, 0, UINT16_MAX), &v);
+      break;
+    case CANFLY_INT16 :
+      create_variant_int16((int16_t)clamp(value, INT16_MIN, INT16_MAX), &v);
+      break;
+    case CANFLY_UINT32 :
+      create_variant_uint32((uint32_t)clamp(value, 0, 4294967040.0f), &v);
+      break;
+    case CANFLY_INT32 :
+      create_variant_int32((int32_t)clamp(value, -2147483520.0f, 2147483520.0f), &v);
+      break;
+    case CANFLY_BOOL :
+      create_variant_bool(value != 0, &v);
+      break;
+    default :
+      create_variant_float(channel->value, &v);
+      break;
+    }
+
+  return variant_to_msg(&v, channel->id, channel->type, msg);
+  }
+
+result_t edugen_generate(edugen_t *gen, uint64_t until, timed_canmsg_t *msgs, uint32_t *count)
+  {
+  if (gen == 0 || msgs == 0 || count == 0)
+    return e_bad_parameter;
+
+  uint16_t active = heap_size(gen);
+  uint32_t generated = 0;
+
+  while (active > 0)
+    {
+    edugen_channel_t *channel = &gen->channels[gen->heap[0]];
+    if (channel->next_due > until)
+      break;
+
+    if (generated >= *count)
+      {
+      *count = generated;
+      return e_more_data;
+      }
+
+    gen->now = channel->next_due;
+    if (gen->now >= next_fault(gen))
+      {
+      start_faults(gen);
+      // a burst can change the order and number of the channels
+      active = heap_size(gen);
+      channel = &gen->channels[gen->heap[0]];
+      gen->now = channel->next_due;
+      }
+
+    if (succeeded(make_frame(gen, channel, &msgs[generated].msg)))
+      msgs[generated++].timestamp = gen->now;
+
+    // a channel turned off during its burst leaves the heap when the burst ends
+    if (channel->period == 0)
+      {
+      build_heap(gen);
+      active = heap_size(gen);
+      continue;
+      }
+
+    channel->next_due += channel->period;
+    sift_down(gen, active, 0);
+    }
+
+  gen->now = until;
+  *count = generated;
+  return s_ok;
+  }
@@ -0,0 +1,156 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#ifndef __edugen_h__
+#define __edugen_h__
+
+#include "canlog.h"
+
+/*************************************************
+ * Synthetic EDU traffic generator.
+ *
+ * Every ID in CanFlyID.def is a channel with a rate, a nominal value,
+ * noise and drift.  Frames are built with variant_to_msg using the
+ * declared type of the ID.  Faults are injected as random events:
+ *  stale       a sensor freezes at its last value
+ *  divergence  a left/right sensor pair diverges and the divergence
+ *              channel and its alarm report it
+ *  alarm burst a random alarm goes active and is sent at a high rate
+ *
+ * Time is simulated, the caller asks for all of the frames due up to a
+ * time, so traffic can be generated faster than real time.
+ */
+#define EDUGEN_MAX_CHANNELS 256
+
+typedef enum _edugen_fault {
+  ef_none,
+  ef_stale,
+  ef_divergence,
+  ef_alarm_burst,
+  } edugen_fault;
+
+typedef struct _edugen_channel_t {
+  uint16_t id;
+  uint16_t type;                // CANFLY_ type the id is sent as
+  uint32_t period;              // microseconds between frames, 0 if not sent
+  uint32_t normal_period;       // period when not in a fault
+  float nominal;                // value at time 0
+  float noise;                  // standard deviation of the noise
+  float drift;                  // change in nominal per second
+  float offset;                 // added to the value during a fault
+  float value;                  // last value sent
+  uint64_t next_due;            // time of the next frame
+  uint64_t fault_end;           // time the current fault clears
+  edugen_fault fault;
+  } edugen_channel_t;
+
+typedef struct _edugen_faults_t {
+  float stale_rate;             // stale sensor events per hour
+  uint32_t stale_duration;      // microseconds
+  float divergence_rate;        // sensor divergence events per hour
+  uint32_t divergence_duration; // microseconds
+  float alarm_burst_rate;       // alarm bursts per hour
+  uint32_t alarm_burst_duration;// microseconds
+  uint32_t alarm_burst_period;  // microseconds between alarm frames in a burst
+  } edugen_faults_t;
+
+typedef struct _edugen_t {
+  uint64_t now;                 // simulated time, microseconds
+  uint64_t seed;                // random number state
+  edugen_faults_t faults;
+  uint64_t next_stale;
+  uint64_t next_divergence;
+  uint64_t next_alarm_burst;
+  uint16_t num_channels;
+  edugen_channel_t channels[EDUGEN_MAX_CHANNELS];
+  // channels ordered as a binary heap on next_due
+  uint16_t heap[EDUGEN_MAX_CHANNELS];
+  } edugen_t;
+
+/**
+ * @brief Initialize a generator with a channel for every ID in CanFlyID.def
+ * @param gen   Generator
+ * @param seed  Random seed, generators with the same seed produce the same traffic
+ * @return s_ok if initialized
+ * @remark EDU ID's default to 10Hz, alarms and status to 1Hz. Faults are disabled.
+ */
+extern result_t edugen_init(edugen_t *gen, uint64_t seed);
+/**
+ * @brief Set the rate an ID is sent at
+ * @param gen   Generator
+ * @param id    CanFly ID
+ * @param rate  Frames/second, 0 to stop sending the ID
+ * @return s_ok if set, e_not_found if the ID is not generated
+ */
+extern result_t edugen_set_rate(edugen_t *gen, uint16_t id, float rate);
+/**
+ * @brief Scale the rate of all ID's
+ * @param gen     Generator
+ * @param factor  Multiplier for the default rate
+ * @return s_ok if set
+ */
+extern result_t edugen_scale_rates(edugen_t *gen, float factor);
+/**
+ * @brief Set the signal model of an ID
+ * @param gen       Generator
+ * @param id        CanFly ID
+ * @param nominal   Value at time 0
+ * @param noise     Standard deviation of the noise added to each sample
+ * @param drift     Change in the nominal value per second
+ * @return s_ok if set, e_not_found if the ID is not generated
+ */
+extern result_t edugen_set_signal(edugen_t *gen, uint16_t id, float nominal, float noise, float drift);
+/**
+ * @brief Set the fault model
+ * @param gen     Generator
+ * @param faults  Fault rates and durations
+ * @return s_ok if set
+ */
+extern result_t edugen_set_faults(edugen_t *gen, const edugen_faults_t *faults);
+/**
+ * @brief Generate the frames due up to a time
+ * @param gen     Generator
+ * @param until   Simulated time to generate to
+ * @param msgs    Buffer for the frames, in timestamp order
+ * @param count   On entry the size of the buffer, on exit the number generated
+ * @return s_ok if all frames up to the time were generated, e_more_data if
+ * the buffer filled first, call again with the same time for the rest
+ */
+extern result_t edugen_generate(edugen_t *gen, uint64_t until, timed_canmsg_t *msgs, uint32_t *count);
+
+#endif
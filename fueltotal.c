@@ -0,0 +1,274 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#include "fueltotal.h"
+#include "canendian.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define FUELTOTAL_MAGIC 0x54464643    // 'CFFT'
+#define FUELTOTAL_VERSION 1
+#define FUELTOTAL_FILE_SIZE 28
+
+result_t fueltotal_init(fueltotal_t *ft, const fueltotal_config_t *config)
+  {
+  if (ft == 0 || (config != 0 && config->publish_period == 0))
+    return e_bad_parameter;
+
+  memset(ft, 0, sizeof(fueltotal_t));
+  if (config != 0)
+    ft->config = *config;
+  else
+    {
+    ft->config.publish_period = 1000000;
+    ft->config.tank_weight = 256;
+    ft->config.refuel_threshold = 10;
+    }
+
+  return s_ok;
+  }
+
+static void add_flow(fueltotal_t *ft, uint64_t timestamp, uint32_t flow)
+  {
+  // trapezoidal rule, a frame out of order is used as the new flow only
+  if (ft->flow_time != 0 && timestamp > ft->flow_time)
+    {
+    uint64_t area = (uint64_t)(ft->flow + flow) * (timestamp - ft->flow_time);
+    ft->used += area;
+    if (ft->remaining_valid)
+      ft->remaining -= (int64_t)area;
+    }
+
+  ft->flow = flow;
+  ft->flow_time = timestamp;
+  }
+
+static void add_tank(fueltotal_t *ft, uint16_t tank, uint16_t litres)
+  {
+  ft->tanks[tank] = litres;
+  ft->tanks_valid |= 1 << tank;
+  if (ft->tanks_valid != 3)
+    return;
+
+  int64_t measured = (int64_t)(ft->tanks[0] + ft->tanks[1]) * (int64_t)FUEL_UNITS_PER_LITRE;
+  if (!ft->remaining_valid ||
+      measured - ft->remaining > (int64_t)ft->config.refuel_threshold * (int64_t)FUEL_UNITS_PER_LITRE)
+    {
+    ft->remaining = measured;
+    ft->remaining_valid = true;
+    }
+  else
+    ft->remaining += (measured - ft->remaining) / 65536 * ft->config.tank_weight;
+  }
+
+static void add_value(fueltotal_t *ft, uint16_t id, uint64_t timestamp, const variant_t *v)
+  {
+  float value;
+  if (failed(coerce_to_float(v, &value)) || !(value >= 0))
+    return;
+
+  switch (id)
+    {
+    case id_fuel_flow_rate :
+      add_flow(ft, timestamp, (uint32_t)lroundf(value * FUEL_FLOW_SCALE));
+      break;
+    case id_left_fuel_quantity :
+      add_tank(ft, 0, (uint16_t)fminf(value, UINT16_MAX));
+      break;
+    case id_right_fuel_quantity :
+      add_tank(ft, 1, (uint16_t)fminf(value, UINT16_MAX));
+      break;
+    }
+  }
+
+static void publish(fueltotal_t *ft, uint64_t timestamp, timed_canmsg_t *msgs, uint16_t *count)
+  {
+  if (!ft->remaining_valid)
+    return;
+
+  int64_t remaining = ft->remaining > 0 ? ft->remaining : 0;
+  uint32_t litres = (uint32_t)((remaining + FUEL_UNITS_PER_LITRE / 2) / FUEL_UNITS_PER_LITRE);
+
+  msgs[*count].timestamp = timestamp;
+  create_can_msg_uint16(&msgs[*count].msg, id_fuel_total, litres > UINT16_MAX ? UINT16_MAX : (uint16_t)litres);
+  (*count)++;
+
+  // no endurance with the engine stopped
+  if (ft->flow == 0)
+    return;
+
+  // hours * 100 = litres * 100 / (flow / FUEL_FLOW_SCALE)
+  double endurance = (double)remaining * 100.0 * FUEL_FLOW_SCALE / ((double)FUEL_UNITS_PER_LITRE * ft->flow);
+  msgs[*count].timestamp = timestamp;
+  create_can_msg_uint32(&msgs[*count].msg, id_fuel_endurance, endurance > UINT32_MAX ? UINT32_MAX : (uint32_t)endurance);
+  (*count)++;
+  }
+
+result_t fueltotal_add(fueltotal_t *ft, const timed_canmsg_t *msg, timed_canmsg_t *msgs, uint16_t *count)
+  {
+  if (ft == 0 || msg == 0 || msgs == 0 || count == 0)
+    return e_bad_parameter;
+
+  *count = 0;
+  variant_t v;
+  if (get_can_len(&msg->msg) > 0 && msg->msg.data[0] == CANFLY_PACKED_UINT16)
+    {
+    canmsg_t expanded[PACKED_UINT16_MAX];
+    uint16_t num_expanded;
+    if (succeeded(expand_packed_msg(&msg->msg, expanded, &num_expanded)))
+      for (uint16_t i = 0; i < num_expanded; i++)
+        if (succeeded(msg_to_variant(&expanded[i], &v)))
+          add_value(ft, get_can_id(&expanded[i]), msg->timestamp, &v);
+    }
+  else
+    {
+    uint16_t id = get_can_id(&msg->msg);
+    if ((id == id_fuel_flow_rate || id == id_left_fuel_quantity || id == id_right_fuel_quantity) &&
+        succeeded(msg_to_variant(&msg->msg, &v)))
+      add_value(ft, id, msg->timestamp, &v);
+    }
+
+  if (msg->timestamp >= ft->next_publish)
+    {
+    publish(ft, msg->timestamp, msgs, count);
+    ft->next_publish = (msg->timestamp / ft->config.publish_period + 1) * ft->config.publish_period;
+    }
+
+  return s_ok;
+  }
+
+// make a rename in the directory of path durable
+static bool sync_directory(const char *path)
+  {
+  char directory[1024];
+  const char *slash = strrchr(path, '/');
+  if (slash == 0)
+    strcpy(directory, ".");
+  else if (slash == path)
+    strcpy(directory, "/");
+  else if ((size_t)(slash - path) < sizeof(directory))
+    {
+    memcpy(directory, path, slash - path);
+    directory[slash - path] = 0;
+    }
+  else
+    return false;
+
+  int fd = open(directory, O_RDONLY | O_DIRECTORY);
+  if (fd < 0)
+    return false;
+
+  bool ok = fsync(fd) == 0;
+  close(fd);
+  return ok;
+  }
+
+result_t fueltotal_save(const fueltotal_t *ft, const char *path)
+  {
+  if (ft == 0 || path == 0)
+    return e_bad_parameter;
+
+  // magic, version, flags, used, remaining, crc
+  uint8_t buffer[FUELTOTAL_FILE_SIZE];
+  put_le64(buffer, FUELTOTAL_MAGIC | ((uint64_t)FUELTOTAL_VERSION << 32) |
+    ((uint64_t)(ft->remaining_valid ? 1 : 0) << 48));
+  put_le64(buffer + 8, ft->used);
+  put_le64(buffer + 16, (uint64_t)ft->remaining);
+  put_le32(buffer + 24, crc32_update(0, buffer, 24));
+
+  // write a new file and rename it over the old one so a power loss
+  // leaves one or the other, the directory is synced so the rename is
+  // not lost
+  char temp_path[1024];
+  if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", path) >= (int)sizeof(temp_path))
+    return e_bad_parameter;
+
+  FILE *fp = fopen(temp_path, "wb");
+  if (fp == 0)
+    return e_path_not_found;
+
+  bool ok = fwrite(buffer, FUELTOTAL_FILE_SIZE, 1, fp) == 1 &&
+    fflush(fp) == 0 &&
+    fsync(fileno(fp)) == 0;
+
+  if (fclose(fp) != 0 || !ok || rename(temp_path, path) != 0)
+    {
+    remove(temp_path);
+    return e_generic_error;
+    }
+
+  if (!sync_directory(path))
+    return e_generic_error;
+
+  return s_ok;
+  }
+
+result_t fueltotal_restore(fueltotal_t *ft, const char *path)
+  {
+  if (ft == 0 || path == 0)
+    return e_bad_parameter;
+
+  FILE *fp = fopen(path, "rb");
+  if (fp == 0)
+    return e_path_not_found;
+
+  uint8_t buffer[FUELTOTAL_FILE_SIZE];
+  size_t length = fread(buffer, 1, FUELTOTAL_FILE_SIZE, fp);
+  fclose(fp);
+
+  if (length != FUELTOTAL_FILE_SIZE)
+    return e_corrupt;
+
+  uint64_t header = fetch_le64(buffer);
+  if (fetch_le32(buffer + 24) != crc32_update(0, buffer, 24) ||
+      (uint32_t)header != FUELTOTAL_MAGIC ||
+      (uint16_t)(header >> 32) != FUELTOTAL_VERSION)
+    return e_corrupt;
+
+  ft->used = fetch_le64(buffer + 8);
+  ft->remaining = (int64_t)fetch_le64(buffer + 16);
+  ft->remaining_valid = ((header >> 48) & 1) != 0;
+  // the engine may have run while we were down, start integrating afresh
+  ft->flow_time = 0;
+
+  return s_ok;
+  }
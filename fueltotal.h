@@ -0,0 +1,122 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#ifndef __fueltotal_h__
+#define __fueltotal_h__
+
+#include "canlog.h"
+
+/*************************************************
+ * Fuel totalizer and endurance estimator.
+ *
+ * id_fuel_flow_rate is integrated with the trapezoidal rule in fixed
+ * point.  Flow is held in 1/100 l/h and each interval adds
+ * (flow0 + flow1) x microseconds, so no rounding error builds up.
+ *
+ * The remaining fuel starts from the tank quantity readings and is
+ * reduced by the fuel used.  Later tank readings are blended in with a
+ * small weight as the tank senders are noisy in flight, a reading well
+ * above the estimate is taken as a refuel.
+ *
+ * id_fuel_total and id_fuel_endurance are published at a fixed period.
+ * The totals are saved to a small file so a restart does not lose them.
+ */
+#define FUEL_FLOW_SCALE 100
+#define FUEL_UNITS_PER_LITRE (2ULL * FUEL_FLOW_SCALE * 3600000000ULL)
+
+// most frames fueltotal_add produces
+#define FUELTOTAL_MAX_MSGS 2
+
+typedef struct _fueltotal_config_t {
+  uint32_t publish_period;      // microseconds between published frames
+  uint16_t tank_weight;         // weight of a tank reading / 65536, 0 to use the tanks only at start
+  uint16_t refuel_threshold;    // litres above the estimate that is a refuel
+  } fueltotal_config_t;
+
+typedef struct _fueltotal_t {
+  fueltotal_config_t config;
+  uint64_t used;                // fuel used, FUEL_UNITS_PER_LITRE
+  int64_t remaining;            // fuel remaining, FUEL_UNITS_PER_LITRE
+  bool remaining_valid;         // false until the tanks are read
+  uint32_t flow;                // last flow, 1/100 l/h
+  uint64_t flow_time;           // time of the last flow, 0 if none since start
+  uint16_t tanks[2];            // last left and right quantity, litres
+  uint8_t tanks_valid;          // bit per tank
+  uint64_t next_publish;
+  } fueltotal_t;
+
+/**
+ * @brief Initialize a totalizer
+ * @param ft      Totalizer
+ * @param config  Configuration, 0 for 1Hz publishing with a tank weight of 1/256
+ * and a refuel threshold of 10 litres
+ * @return s_ok if initialized
+ */
+extern result_t fueltotal_init(fueltotal_t *ft, const fueltotal_config_t *config);
+/**
+ * @brief Add a frame to the totalizer
+ * @param ft      Totalizer
+ * @param msg     Frame, only the fuel flow and tank quantity ID's are used
+ * @param msgs    Buffer of at least FUELTOTAL_MAX_MSGS frames for the
+ * published total and endurance, stamped with the time of the frame
+ * @param count   Number of frames published
+ * @return s_ok if the frame was processed
+ */
+extern result_t fueltotal_add(fueltotal_t *ft, const timed_canmsg_t *msg, timed_canmsg_t *msgs, uint16_t *count);
+/**
+ * @brief Save the totals
+ * @param ft      Totalizer
+ * @param path    File to save to, replaced atomically
+ * @return s_ok if saved
+ */
+extern result_t fueltotal_save(const fueltotal_t *ft, const char *path);
+/**
+ * @brief Restore the totals saved by fueltotal_save
+ * @param ft      Initialized totalizer
+ * @param path    File to restore from
+ * @return s_ok if restored, e_path_not_found if there is no file,
+ * e_corrupt if the file is damaged
+ */
+extern result_t fueltotal_restore(fueltotal_t *ft, const char *path);
+
+static inline float fuel_units_to_litres(int64_t units)
+  {
+  return (float)((double)units / FUEL_UNITS_PER_LITRE);
+  }
+
+#endif
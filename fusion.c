@@ -0,0 +1,222 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#include "fusion.h"
+
+#include <string.h>
+#include <math.h>
+
+static const struct {
+  uint16_t fused_id;
+  uint16_t divergence_id;
+  uint16_t alarm_id;
+  float scale;
+  fusion_config_t config;
+  } channel_defaults[num_fusion_channels] = {
+  // process noise, sensor noise, gate, persistence, timeout, alarm
+  [fc_map] = { id_manifold_pressure, id_map_divergence, id_map_divergence_alarm, 100,
+    { 100, 4, 16, 3, 500000, 30 } },
+  [fc_rpm] = { id_engine_rpm, id_rpm_divergence, id_rpm_divergence_alarm, 1,
+    { 10000, 100, 16, 3, 500000, 100 } },
+  [fc_fuel_pressure] = { id_fuel_pressure, id_fuel_pressure_divergence, id_fuel_pressure_divergence_alarm, 100,
+    { 100, 25, 16, 3, 500000, 20 } },
+  [fc_iat] = { id_inlet_air_temperature, id_iat_divergence, id_iat_divergence_alarm, 1,
+    { 1, 0.25f, 16, 3, 2000000, 5 } },
+  [fc_timing] = { 0, id_timing_divergence, id_timing_divergence_alarm, 1,
+    { 1, 0.25f, 16, 3, 500000, 3 } },
+  [fc_advance] = { 0, id_advance_divergence, 0, 1,
+    { 1, 0.25f, 16, 3, 500000, 0 } },
+  };
+
+static uint16_t declared_type(uint16_t id)
+  {
+  const canfly_id_info_t *info = find_canfly_id(id);
+  return info == 0 ? CANFLY_FLOAT : info->type;
+  }
+
+result_t fusion_init(fusion_t *fusion)
+  {
+  if (fusion == 0)
+    return e_bad_parameter;
+
+  memset(fusion, 0, sizeof(fusion_t));
+  for (uint16_t i = 0; i < num_fusion_channels; i++)
+    {
+    fusion_state_t *state = &fusion->channels[i];
+    state->config = channel_defaults[i].config;
+    state->fused_id = channel_defaults[i].fused_id;
+    state->divergence_id = channel_defaults[i].divergence_id;
+    state->alarm_id = channel_defaults[i].alarm_id;
+    state->scale = channel_defaults[i].scale;
+    // resolved once so the update path does no lookups
+    state->fused_type = state->fused_id == 0 ? CANFLY_FLOAT : declared_type(state->fused_id);
+    state->divergence_type = declared_type(state->divergence_id);
+    }
+
+  return s_ok;
+  }
+
+result_t fusion_configure(fusion_t *fusion, fusion_channel channel, const fusion_config_t *config)
+  {
+  if (fusion == 0 || config == 0 || channel >= num_fusion_channels ||
+      config->sensor_noise <= 0 || config->process_noise < 0 || config->gate <= 0 ||
+      config->persistence == 0)
+    return e_bad_parameter;
+
+  fusion->channels[channel].config = *config;
+  return s_ok;
+  }
+
+static inline bool is_current(const fusion_sensor_t *sensor)
+  {
+  return sensor->state == ss_ok || sensor->state == ss_failed;
+  }
+
+static void add_msg(uint16_t id, uint16_t type, float value, canmsg_t *msgs, uint16_t *count)
+  {
+  variant_t v;
+  create_variant_float(value, &v);
+  if (succeeded(variant_to_msg(&v, id, type, &msgs[*count])))
+    (*count)++;
+  }
+
+result_t fusion_update(fusion_t *fusion, fusion_channel channel, fusion_side side,
+                       uint64_t timestamp, float value, canmsg_t *msgs, uint16_t *count)
+  {
+  if (fusion == 0 || msgs == 0 || count == 0 || channel >= num_fusion_channels ||
+      (side != fs_left && side != fs_right) || isnan(value))
+    return e_bad_parameter;
+
+  *count = 0;
+  fusion_state_t *state = &fusion->channels[channel];
+  const fusion_config_t *config = &state->config;
+  fusion_sensor_t *sensor = &state->sensors[side];
+  fusion_sensor_t *other = &state->sensors[side ^ 1];
+
+  if (other->state != ss_unknown && timestamp > other->updated + config->timeout)
+    other->state = ss_stale;
+
+  sensor->value = value;
+  sensor->updated = timestamp;
+  if (sensor->state == ss_unknown || sensor->state == ss_stale)
+    {
+    sensor->state = ss_ok;
+    sensor->outliers = 0;
+    }
+
+  result_t result = s_ok;
+  if (!state->initialized)
+    {
+    state->estimate = value;
+    state->variance = config->sensor_noise;
+    state->updated = timestamp;
+    state->initialized = true;
+    }
+  else
+    {
+    // predict, the true value is a random walk
+    if (timestamp > state->updated)
+      {
+      state->variance += config->process_noise * (float)(timestamp - state->updated) * 1e-6f;
+      state->updated = timestamp;
+      }
+
+    float innovation = value - state->estimate;
+    float innovation_variance = state->variance + config->sensor_noise;
+    bool outlier = innovation * innovation > config->gate * innovation_variance;
+
+    if (outlier && other->state == ss_ok)
+      {
+      // the reading is a real change if the other sensor agrees with it
+      float difference = value - other->value;
+      outlier = difference * difference > config->gate * 2 * config->sensor_noise;
+      }
+    else if (outlier && sensor->state == ss_ok)
+      outlier = false;          // nothing to compare with, follow the only sensor
+
+    if (sensor->state == ss_ok)
+      {
+      sensor->outliers = outlier ? sensor->outliers + 1 : 0;
+      if (sensor->outliers >= config->persistence)
+        {
+        sensor->state = ss_failed;
+        sensor->outliers = 0;
+        }
+      }
+    else if (!outlier)
+      {
+      // a failed sensor must agree for as long as it disagreed to recover
+      if (++sensor->outliers >= config->persistence)
+        {
+        sensor->state = ss_ok;
+        sensor->outliers = 0;
+        }
+      else
+        outlier = true;
+      }
+    else
+      sensor->outliers = 0;
+
+    if (outlier || sensor->state == ss_failed)
+      result = s_false;
+    else
+      {
+      float gain = state->variance / innovation_variance;
+      state->estimate += gain * innovation;
+      state->variance *= 1.0f - gain;
+      }
+    }
+
+  if (state->fused_id != 0)
+    add_msg(state->fused_id, state->fused_type, state->estimate, msgs, count);
+
+  if (is_current(sensor) && is_current(other))
+    {
+    state->divergence = fabsf(sensor->value - other->value);
+    add_msg(state->divergence_id, state->divergence_type, state->divergence * state->scale, msgs, count);
+
+    bool alarm = config->alarm > 0 && state->divergence >= config->alarm;
+    if (state->alarm_id != 0 && alarm != state->alarm_active)
+      {
+      state->alarm_active = alarm;
+      add_msg(state->alarm_id, CANFLY_UINT16, alarm ? fminf(state->divergence * state->scale, UINT16_MAX) : 0, msgs, count);
+      }
+    }
+
+  return result;
+  }
@@ -0,0 +1,163 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#ifndef __fusion_h__
+#define __fusion_h__
+
+#include "neutron.h"
+
+/*************************************************
+ * Fusion of redundant left/right engine sensors.
+ *
+ * Each channel is a scalar Kalman filter, the state is the true value
+ * modelled as a random walk and each reading from either sensor is a
+ * measurement.  A reading is an outlier if it is outside the gate of the
+ * estimate and also outside the gate of the last reading of the other
+ * sensor.  Outliers are not fused, and a sensor with consecutive outliers
+ * is marked as failed until it agrees with the estimate again.  A reading
+ * that agrees with the other sensor is a real change and is always fused.
+ *
+ * With only two sensors a slow drift can't be blamed on either side, it
+ * shows as a growing divergence and raises the divergence alarm.
+ *
+ * Every update is constant time and does no allocation.
+ */
+typedef enum _fusion_channel {
+  fc_map,                       // manifold pressure, hPa
+  fc_rpm,                       // engine rpm
+  fc_fuel_pressure,             // fuel pressure, hPa
+  fc_iat,                       // inlet air temperature, K
+  fc_timing,                    // ignition timing, degrees
+  fc_advance,                   // ignition advance, degrees
+  num_fusion_channels
+  } fusion_channel;
+
+typedef enum _fusion_side {
+  fs_left,
+  fs_right,
+  } fusion_side;
+
+typedef enum _sensor_state {
+  ss_unknown,                   // no readings yet
+  ss_ok,
+  ss_stale,                     // no reading within the timeout
+  ss_failed,                    // readings disagree with the estimate and the other sensor
+  } sensor_state;
+
+// most frames fusion_update produces
+#define FUSION_MAX_MSGS 3
+
+typedef struct _fusion_config_t {
+  float process_noise;          // variance growth of the true value per second
+  float sensor_noise;           // variance of a reading
+  float gate;                   // normalized innovation squared that is an outlier
+  uint8_t persistence;          // consecutive outliers that fail a sensor
+  uint32_t timeout;             // microseconds without a reading before a sensor is stale
+  float alarm;                  // divergence that raises the alarm, 0 for no alarm
+  } fusion_config_t;
+
+typedef struct _fusion_sensor_t {
+  float value;                  // last reading
+  uint64_t updated;             // time of the last reading
+  uint8_t outliers;             // consecutive outliers, or consecutive good readings when failed
+  sensor_state state;
+  } fusion_sensor_t;
+
+typedef struct _fusion_state_t {
+  fusion_config_t config;
+  uint16_t fused_id;            // published estimate, 0 if none
+  uint16_t fused_type;
+  uint16_t divergence_id;
+  uint16_t divergence_type;
+  uint16_t alarm_id;            // 0 if the channel has no alarm
+  float scale;                  // divergence units per channel unit
+  bool initialized;
+  bool alarm_active;
+  float estimate;
+  float variance;
+  uint64_t updated;
+  float divergence;
+  fusion_sensor_t sensors[2];
+  } fusion_state_t;
+
+typedef struct _fusion_t {
+  fusion_state_t channels[num_fusion_channels];
+  } fusion_t;
+
+/**
+ * @brief Initialize the fusion state with the default configuration
+ * @param fusion  State
+ * @return s_ok if initialized
+ */
+extern result_t fusion_init(fusion_t *fusion);
+/**
+ * @brief Change the configuration of a channel
+ * @param fusion  State
+ * @param channel Channel to change
+ * @param config  New configuration, the filter state is kept
+ * @return s_ok if changed, e_bad_parameter if a noise, the gate or the
+ * persistence is out of range
+ */
+extern result_t fusion_configure(fusion_t *fusion, fusion_channel channel, const fusion_config_t *config);
+/**
+ * @brief Add a reading from one sensor of a pair
+ * @param fusion    State
+ * @param channel   Channel the reading is for
+ * @param side      Sensor the reading came from
+ * @param timestamp Time of the reading, microseconds
+ * @param value     Reading, in the units of the fused ID
+ * @param msgs      Buffer of at least FUSION_MAX_MSGS frames for the fused
+ * value, the divergence and a change of the divergence alarm
+ * @param count     Number of frames produced
+ * @return s_ok if the reading was fused, s_false if it was rejected as an outlier
+ */
+extern result_t fusion_update(fusion_t *fusion, fusion_channel channel, fusion_side side,
+                              uint64_t timestamp, float value, canmsg_t *msgs, uint16_t *count);
+/**
+ * @brief Return the state of a sensor
+ * @param fusion  State
+ * @param channel Channel
+ * @param side    Sensor
+ * @return state of the sensor
+ */
+static inline sensor_state fusion_sensor_state(const fusion_t *fusion, fusion_channel channel, fusion_side side)
+  {
+  return fusion->channels[channel].sensors[side].state;
+  }
+
+#endif
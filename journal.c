@@ -0,0 +1,569 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#include "journal.h"
+#include "canendian.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static inline uint32_t record_offset(const journal_t *journal, uint16_t sector, uint16_t record)
+  {
+  return sector * journal->device.sector_size + JOURNAL_HEADER_SIZE + record * JOURNAL_RECORD_SIZE;
+  }
+
+static bool is_erased(const uint8_t *buffer, uint32_t length)
+  {
+  for (uint32_t i = 0; i < length; i++)
+    if (buffer[i] != 0xFF)
+      return false;
+
+  return true;
+  }
+
+// values are stored in 8 bytes, utc as milliseconds since the epoch
+static result_t encode_value(const variant_t *v, uint8_t *buffer)
+  {
+  uint64_t bits;
+  switch (v->vt)
+    {
+    case v_none : bits = 0; break;
+    case v_bool : bits = v->value.boolean ? 1 : 0; break;
+    case v_int8 : bits = (uint8_t)v->value.int8; break;
+    case v_uint8 : bits = v->value.uint8; break;
+    case v_int16 : bits = (uint16_t)v->value.int16; break;
+    case v_uint16 : bits = v->value.uint16; break;
+    case v_int32 : bits = (uint32_t)v->value.int32; break;
+    case v_uint32 : bits = v->value.uint32; break;
+    case v_epoch : bits = v->value.epoch; break;
+    case v_float :
+      {
+      uint32_t flt;
+      memcpy(&flt, &v->value.flt, sizeof(flt));
+      bits = flt;
+      }
+      break;
+    case v_utc : bits = (uint64_t)tm_to_epoch_ms(&v->value.utc); break;
+    default :
+      return e_bad_type;
+    }
+
+  put_le64(buffer, bits);
+  return s_ok;
+  }
+
+static result_t decode_value(uint8_t vt, const uint8_t *buffer, variant_t *v)
+  {
+  uint64_t bits = fetch_le64(buffer);
+  switch (vt)
+    {
+    case v_none : create_variant_nodata(v); break;
+    case v_bool : create_variant_bool(bits != 0, v); break;
+    case v_int8 : create_variant_int8((int8_t)bits, v); break;
+    case v_uint8 : create_variant_uint8((uint8_t)bits, v); break;
+    case v_int16 : create_variant_int16((int16_t)bits, v); break;
+    case v_uint16 : create_variant_uint16((uint16_t)bits, v); break;
+    case v_int32 : create_variant_int32((int32_t)bits, v); break;
+    case v_uint32 : create_variant_uint32((uint32_t)bits, v); break;
+    case v_epoch : create_variant_epoch((uint32_t)bits, v); break;
+    case v_float :
+      {
+      uint32_t flt = (uint32_t)bits;
+      float value;
+      memcpy(&value, &flt, sizeof(value));
+      create_variant_float(value, v);
+      }
+      break;
+    case v_utc :
+      v->vt = v_utc;
+      epoch_ms_to_tm((int64_t)bits, &v->value.utc);
+      break;
+    default :
+      return e_corrupt;
+    }
+
+  return s_ok;
+  }
+
+// index of the ID, or where it would be inserted
+static uint16_t find_key(const journal_t *journal, uint16_t id)
+  {
+  uint16_t lo = 0;
+  uint16_t hi = journal->num_keys;
+
+  while (lo < hi)
+    {
+    uint16_t mid = (lo + hi) >> 1;
+    if (journal->keys[mid].id < id)
+      lo = mid + 1;
+    else
+      hi = mid;
+    }
+
+  return lo;
+  }
+
+static result_t set_key(journal_t *journal, uint16_t id, uint8_t vt, const uint8_t *value, uint32_t offset)
+  {
+  result_t result;
+  variant_t v;
+  if (failed(result = decode_value(vt, value, &v)))
+    return result;
+
+  uint16_t index = find_key(journal, id);
+  if (index == journal->num_keys || journal->keys[index].id != id)
+    {
+    if (journal->num_keys == JOURNAL_MAX_KEYS)
+      return e_no_space;
+
+    memmove(&journal->keys[index + 1], &journal->keys[index], (journal->num_keys - index) * sizeof(journal_key_t));
+    journal->num_keys++;
+    journal->keys[index].id = id;
+    }
+
+  journal->keys[index].offset = offset;
+  journal->keys[index].value = v;
+  return s_ok;
+  }
+
+static bool read_header(const journal_t *journal, uint16_t sector, uint32_t *sequence)
+  {
+  uint8_t header[JOURNAL_HEADER_SIZE];
+  if (failed(journal->device.read(journal->device.context, sector * journal->device.sector_size, header, JOURNAL_HEADER_SIZE)))
+    return false;
+
+  if (fetch_le32(header) != JOURNAL_MAGIC ||
+      fetch_le32(header + 12) != crc32_update(0, header, 12))
+    return false;
+
+  *sequence = fetch_le32(header + 4);
+  return true;
+  }
+
+static result_t open_sector(journal_t *journal)
+  {
+  result_t result;
+  uint16_t sector = journal->used == 0 ? journal->head : (journal->head + 1) % journal->device.num_sectors;
+
+  if (failed(result = journal->device.erase(journal->device.context, sector)))
+    return result;
+
+  journal->erases++;
+
+  uint8_t header[JOURNAL_HEADER_SIZE];
+  put_le32(header, JOURNAL_MAGIC);
+  put_le32(header + 4, journal->sequence + 1);
+  put_le32(header + 8, 0xFFFFFFFF);
+  put_le32(header + 12, crc32_update(0, header, 12));
+  if (failed(result = journal->device.write(journal->device.context, sector * journal->device.sector_size, header, JOURNAL_HEADER_SIZE)))
+    return result;
+
+  if (journal->used == 0)
+    journal->tail = sector;
+
+  journal->sequence++;
+  journal->head = sector;
+  journal->head_records = 0;
+  journal->used++;
+  return s_ok;
+  }
+
+// append a record, reserve allows the last free sector to be used
+static result_t append(journal_t *journal, uint16_t id, uint8_t vt, const uint8_t *value, bool reserve)
+  {
+  result_t result;
+  if (journal->used == 0 || journal->head_records == journal->records_per_sector)
+    {
+    uint16_t free_sectors = journal->device.num_sectors - journal->used;
+    if (free_sectors <= (reserve ? 0 : 1))
+      return e_no_space;
+
+    if (failed(result = open_sector(journal)))
+      return result;
+    }
+
+  uint8_t record[JOURNAL_RECORD_SIZE];
+  put_le16(record, id);
+  record[2] = vt;
+  record[3] = 0;
+  memcpy(record + 4, value, 8);
+  put_le32(record + 12, crc32_update(0, record, 12));
+
+  uint32_t offset = record_offset(journal, journal->head, journal->head_records);
+  if (failed(result = journal->device.write(journal->device.context, offset, record, JOURNAL_RECORD_SIZE)))
+    return result;
+
+  journal->head_records++;
+  journal->writes++;
+
+  return set_key(journal, id, vt, value, offset);
+  }
+
+// compact the oldest sector, returns s_false if it is not finished
+static result_t compact_step(journal_t *journal, uint16_t max_records)
+  {
+  result_t result;
+  if (journal->used < 2)
+    {
+    journal->compacting = false;
+    return s_ok;
+    }
+
+  if (!journal->compacting)
+    {
+    journal->compacting = true;
+    journal->compact_record = 0;
+    }
+
+  uint16_t tail = journal->tail;
+  for (; max_records > 0 && journal->compact_record < journal->records_per_sector; max_records--)
+    {
+    uint32_t offset = record_offset(journal, tail, journal->compact_record++);
+    uint8_t record[JOURNAL_RECORD_SIZE];
+    if (failed(result = journal->device.read(journal->device.context, offset, record, JOURNAL_RECORD_SIZE)))
+      return result;
+
+    if (is_erased(record, JOURNAL_RECORD_SIZE))
+      {
+      journal->compact_record = journal->records_per_sector;
+      break;
+      }
+
+    if (fetch_le32(record + 12) != crc32_update(0, record, 12))
+      continue;
+
+    // only the latest record of an ID is kept
+    uint16_t id = fetch_le16(record);
+    uint16_t index = find_key(journal, id);
+    if (index == journal->num_keys || journal->keys[index].offset != offset)
+      continue;
+
+    if (failed(result = append(journal, id, record[2], record + 4, true)))
+      return result;
+
+    journal->copies++;
+    }
+
+  if (journal->compact_record < journal->records_per_sector)
+    return s_false;
+
+  if (failed(result = journal->device.erase(journal->device.context, tail)))
+    return result;
+
+  journal->erases++;
+  journal->tail = (tail + 1) % journal->device.num_sectors;
+  journal->used--;
+  journal->compacting = false;
+  return s_ok;
+  }
+
+static bool needs_compaction(const journal_t *journal)
+  {
+  if (journal->compacting)
+    return true;
+
+  uint16_t threshold = journal->device.num_sectors / 4;
+  if (threshold < 2)
+    threshold = 2;
+
+  if (journal->device.num_sectors - journal->used >= threshold)
+    return false;
+
+  // don't churn a journal that is nearly all live values
+  uint32_t records = (journal->used - 1) * journal->records_per_sector + journal->head_records;
+  return records - journal->num_keys >= journal->records_per_sector;
+  }
+
+result_t journal_format(const journal_device_t *device)
+  {
+  if (device == 0)
+    return e_bad_parameter;
+
+  result_t result;
+  for (uint16_t sector = 0; sector < device->num_sectors; sector++)
+    if (failed(result = device->erase(device->context, sector)))
+      return result;
+
+  return s_ok;
+  }
+
+result_t journal_open(journal_t *journal, const journal_device_t *device)
+  {
+  if (journal == 0 || device == 0 || device->num_sectors < 3 ||
+      device->sector_size < JOURNAL_HEADER_SIZE + JOURNAL_RECORD_SIZE ||
+      (uint64_t)device->sector_size * device->num_sectors > UINT32_MAX)
+    return e_bad_parameter;
+
+  memset(journal, 0, sizeof(journal_t));
+  journal->device = *device;
+  journal->records_per_sector = (uint16_t)((device->sector_size - JOURNAL_HEADER_SIZE) / JOURNAL_RECORD_SIZE);
+
+  // the newest sector is the head
+  uint32_t sequence;
+  bool found = false;
+  for (uint16_t sector = 0; sector < device->num_sectors; sector++)
+    if (read_header(journal, sector, &sequence) && (!found || sequence > journal->sequence))
+      {
+      found = true;
+      journal->head = sector;
+      journal->sequence = sequence;
+      }
+
+  if (!found)
+    return s_ok;
+
+  // the ring runs back from the head while the sequence numbers follow on
+  journal->tail = journal->head;
+  journal->used = 1;
+  uint32_t expected = journal->sequence;
+  while (journal->used < device->num_sectors)
+    {
+    uint16_t prev = (journal->tail + device->num_sectors - 1) % device->num_sectors;
+    if (!read_header(journal, prev, &sequence) || sequence != expected - 1)
+      break;
+
+    journal->tail = prev;
+    journal->used++;
+    expected--;
+    }
+
+  uint32_t length = journal->records_per_sector * JOURNAL_RECORD_SIZE;
+  uint8_t *buffer = (uint8_t *)malloc(length);
+  if (buffer == 0)
+    return e_not_enough_memory;
+
+  result_t result = s_ok;
+  for (uint16_t i = 0; i < journal->used && succeeded(result); i++)
+    {
+    uint16_t sector = (journal->tail + i) % device->num_sectors;
+    if (failed(result = device->read(device->context, record_offset(journal, sector, 0), buffer, length)))
+      break;
+
+    uint16_t record;
+    for (record = 0; record < journal->records_per_sector; record++)
+      {
+      const uint8_t *rec = buffer + record * JOURNAL_RECORD_SIZE;
+      if (is_erased(rec, JOURNAL_RECORD_SIZE))
+        break;
+
+      if (fetch_le32(rec + 12) != crc32_update(0, rec, 12) ||
+          failed(set_key(journal, fetch_le16(rec), rec[2], rec + 4, record_offset(journal, sector, record))))
+        journal->corrupt++;
+      }
+
+    if (sector == journal->head)
+      journal->head_records = record;
+    }
+
+  free(buffer);
+  return result;
+  }
+
+result_t journal_read(journal_t *journal, uint16_t id, variant_t *v)
+  {
+  if (journal == 0 || v == 0)
+    return e_bad_parameter;
+
+  uint16_t index = find_key(journal, id);
+  if (index == journal->num_keys || journal->keys[index].id != id)
+    return e_not_found;
+
+  copy_variant(&journal->keys[index].value, v);
+  return s_ok;
+  }
+
+result_t journal_write(journal_t *journal, uint16_t id, const variant_t *v)
+  {
+  if (journal == 0 || v == 0 || id > ID_MASK)
+    return e_bad_parameter;
+
+  result_t result;
+  uint8_t value[8];
+  if (failed(result = encode_value(v, value)))
+    return result;
+
+  uint16_t index = find_key(journal, id);
+  if (index < journal->num_keys && journal->keys[index].id == id)
+    {
+    uint8_t current[8];
+    if (journal->keys[index].value.vt == v->vt &&
+        succeeded(encode_value(&journal->keys[index].value, current)) &&
+        memcmp(current, value, 8) == 0)
+      {
+      journal->unchanged++;
+      return s_ok;
+      }
+    }
+  else if (journal->num_keys == JOURNAL_MAX_KEYS)
+    return e_no_space;
+
+  // a compaction that has used the reserved sector must finish first as
+  // the rest of its copies are going into that sector
+  if (journal->compacting && journal->used == journal->device.num_sectors &&
+      failed(result = compact_step(journal, UINT16_MAX)))
+    return result;
+
+  // no room for a new sector, compact until there is
+  for (uint16_t pass = 0;
+       journal->used > 0 && journal->head_records == journal->records_per_sector &&
+       journal->device.num_sectors - journal->used <= 1;
+       pass++)
+    {
+    if (pass == journal->device.num_sectors || journal->used < 2)
+      return e_no_space;
+
+    if (failed(result = compact_step(journal, UINT16_MAX)))
+      return result;
+    }
+
+  return append(journal, id, (uint8_t)v->vt, value, false);
+  }
+
+result_t journal_compact(journal_t *journal, uint16_t max_records)
+  {
+  if (journal == 0)
+    return e_bad_parameter;
+
+  if (!needs_compaction(journal))
+    return s_ok;
+
+  result_t result;
+  if (failed(result = compact_step(journal, max_records)))
+    return result;
+
+  return needs_compaction(journal) ? s_false : s_ok;
+  }
+
+/*************************************************
+ * File backed device
+ */
+typedef struct _file_device_t {
+  int fd;
+  uint32_t sector_size;
+  } file_device_t;
+
+static result_t file_read(void *context, uint32_t offset, void *buffer, uint32_t length)
+  {
+  file_device_t *fd = (file_device_t *)context;
+  return pread(fd->fd, buffer, length, offset) == (ssize_t)length ? s_ok : e_generic_error;
+  }
+
+static result_t file_write(void *context, uint32_t offset, const void *buffer, uint32_t length)
+  {
+  file_device_t *fd = (file_device_t *)context;
+  return pwrite(fd->fd, buffer, length, offset) == (ssize_t)length ? s_ok : e_generic_error;
+  }
+
+static result_t file_erase(void *context, uint16_t sector)
+  {
+  file_device_t *fd = (file_device_t *)context;
+  uint8_t erased[256];
+  memset(erased, 0xFF, sizeof(erased));
+
+  uint32_t offset = sector * fd->sector_size;
+  for (uint32_t done = 0; done < fd->sector_size; )
+    {
+    uint32_t length = fd->sector_size - done;
+    if (length > sizeof(erased))
+      length = sizeof(erased);
+
+    if (pwrite(fd->fd, erased, length, offset + done) != (ssize_t)length)
+      return e_generic_error;
+
+    done += length;
+    }
+
+  return s_ok;
+  }
+
+result_t journal_file_open(const char *path, uint32_t sector_size, uint16_t num_sectors, journal_device_t *device)
+  {
+  if (path == 0 || device == 0 || sector_size == 0 || num_sectors == 0)
+    return e_bad_parameter;
+
+  file_device_t *fd = (file_device_t *)malloc(sizeof(file_device_t));
+  if (fd == 0)
+    return e_not_enough_memory;
+
+  fd->sector_size = sector_size;
+  if ((fd->fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+    {
+    free(fd);
+    return e_path_not_found;
+    }
+
+  device->context = fd;
+  device->sector_size = sector_size;
+  device->num_sectors = num_sectors;
+  device->read = file_read;
+  device->write = file_write;
+  device->erase = file_erase;
+
+  struct stat st;
+  result_t result = s_ok;
+  if (fstat(fd->fd, &st) != 0)
+    result = e_generic_error;
+  else if (st.st_size == 0)
+    result = journal_format(device);      // new file, erase it
+  else if ((uint64_t)st.st_size != (uint64_t)sector_size * num_sectors)
+    result = e_bad_parameter;
+
+  if (failed(result))
+    {
+    close(fd->fd);
+    free(fd);
+    device->context = 0;
+    }
+
+  return result;
+  }
+
+result_t journal_file_close(journal_device_t *device)
+  {
+  if (device == 0 || device->context == 0)
+    return e_bad_parameter;
+
+  file_device_t *fd = (file_device_t *)device->context;
+  close(fd->fd);
+  free(fd);
+  device->context = 0;
+  return s_ok;
+  }
@@ -0,0 +1,160 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#ifndef __journal_h__
+#define __journal_h__
+
+#include "neutron.h"
+
+/*************************************************
+ * Log structured journal of persisted values.
+ *
+ * Values are kept by CanFly ID.  Each change appends a 16 byte record of
+ * the ID, the variant type, the value and a CRC to the head sector of a
+ * ring of flash sectors.  A value that has not changed is not written.
+ *
+ * When the free sectors run low the oldest sector is compacted.  Records
+ * in it that are still the latest value of their ID are copied to the
+ * head and the sector is erased.  Compaction is incremental, the owner
+ * calls journal_compact from an idle task.  A write that finds no free
+ * sector compacts inline.
+ *
+ * Each sector starts with a header holding a sequence number.  Opening a
+ * journal reads every header, then replays the records from the oldest
+ * sector to the newest, so recovery is O(journal size).  A record with a
+ * bad CRC, from a write torn by a power loss, is skipped.
+ *
+ * The flash is accessed through a journal_device_t.  journal_file_open
+ * provides one backed by a file so the journal can be used on Linux.
+ */
+#define JOURNAL_MAGIC 0x4e4a4643      // 'CFJN'
+#define JOURNAL_HEADER_SIZE 16
+#define JOURNAL_RECORD_SIZE 16
+// most ID's a journal holds
+#define JOURNAL_MAX_KEYS 128
+
+typedef struct _journal_device_t {
+  void *context;
+  uint32_t sector_size;
+  uint16_t num_sectors;
+  result_t (*read)(void *context, uint32_t offset, void *buffer, uint32_t length);
+  // only programs erased bytes
+  result_t (*write)(void *context, uint32_t offset, const void *buffer, uint32_t length);
+  // set a sector to 0xFF
+  result_t (*erase)(void *context, uint16_t sector);
+  } journal_device_t;
+
+typedef struct _journal_key_t {
+  uint16_t id;
+  uint32_t offset;              // offset of the latest record
+  variant_t value;
+  } journal_key_t;
+
+typedef struct _journal_t {
+  journal_device_t device;
+  uint16_t records_per_sector;
+  uint16_t used;                // sectors holding records
+  uint16_t tail;                // oldest sector
+  uint16_t head;                // sector being written
+  uint16_t head_records;        // records written to the head sector
+  uint32_t sequence;            // sequence number of the head sector
+  bool compacting;
+  uint16_t compact_record;      // next record of the tail to check
+  uint32_t writes;              // records written
+  uint32_t unchanged;           // writes skipped as the value was the same
+  uint32_t copies;              // records moved by compaction
+  uint32_t erases;              // sectors erased
+  uint32_t corrupt;             // records skipped during recovery
+  uint16_t num_keys;
+  journal_key_t keys[JOURNAL_MAX_KEYS];  // in order of ID
+  } journal_t;
+
+/**
+ * @brief Erase a device so it holds an empty journal
+ * @param device  Flash device
+ * @return s_ok if erased
+ */
+extern result_t journal_format(const journal_device_t *device);
+/**
+ * @brief Open a journal and recover the values in it
+ * @param journal Journal
+ * @param device  Flash device, at least 3 sectors
+ * @return s_ok if opened
+ */
+extern result_t journal_open(journal_t *journal, const journal_device_t *device);
+/**
+ * @brief Read the latest value of an ID
+ * @param journal Journal
+ * @param id      CanFly ID
+ * @param v       Value
+ * @return s_ok if read, e_not_found if the ID has never been written
+ */
+extern result_t journal_read(journal_t *journal, uint16_t id, variant_t *v);
+/**
+ * @brief Write a value
+ * @param journal Journal
+ * @param id      CanFly ID
+ * @param v       Value
+ * @return s_ok if written or unchanged, e_no_space if the live values
+ * don't fit the device or JOURNAL_MAX_KEYS ID's are already held
+ */
+extern result_t journal_write(journal_t *journal, uint16_t id, const variant_t *v);
+/**
+ * @brief Do some compaction work
+ * @param journal     Journal
+ * @param max_records Most records to examine
+ * @return s_ok if no compaction is needed, s_false if there is more to do
+ */
+extern result_t journal_compact(journal_t *journal, uint16_t max_records);
+/**
+ * @brief Open a file that stands in for a flash device
+ * @param path        File, created erased if it does not exist
+ * @param sector_size Bytes per sector
+ * @param num_sectors Number of sectors
+ * @param device      Device that uses the file
+ * @return s_ok if opened, e_bad_parameter if an existing file is a different size
+ */
+extern result_t journal_file_open(const char *path, uint32_t sector_size, uint16_t num_sectors, journal_device_t *device);
+/**
+ * @brief Close a file device
+ * @param device  Device opened with journal_file_open
+ * @return s_ok if closed
+ */
+extern result_t journal_file_close(journal_device_t *device);
+
+#endif
@@ -58,6 +58,73 @@ enum canfly_id {
   };
 
 #undef CANFLYID
+
+// Blocks of ID's as allocated in CanFlyID.def
+#define ALARM_ID_FIRST 1
+#define ALARM_ID_LAST 255
+#define EDU_ID_FIRST 320
+#define EDU_ID_LAST 383
+#define STATUS_ID_FIRST 1350
+#define STATUS_ID_LAST 1365
+
+// number of possible 11 bit can ID's
+#define NUM_CAN_IDS (ID_MASK + 1)
+
+typedef enum _canfly_block {
+  cb_other,
+  cb_alarm,
+  cb_edu,
+  cb_status,
+  num_canfly_blocks
+  } canfly_block;
+
+/**
+ * @brief Return the block of CanFlyID.def an ID is allocated from
+ * @param id CanFly ID
+ * @return block the ID belongs to, cb_other if not a published block
+*/
+static inline canfly_block get_canfly_block(uint16_t id)
+  {
+  if (id >= ALARM_ID_FIRST && id <= ALARM_ID_LAST)
+    return cb_alarm;
+
+  if (id >= EDU_ID_FIRST && id <= EDU_ID_LAST)
+    return cb_edu;
+
+  if (id >= STATUS_ID_FIRST && id <= STATUS_ID_LAST)
+    return cb_status;
+
+  return cb_other;
+  }
+
+/**
+ * @brief Definition of a published CanFly ID, built from CanFlyID.def
+ */
+typedef struct _canfly_id_info_t {
+  uint16_t id;                  // CanFly ID
+  uint16_t type;                // CANFLY_ data type the ID is published as
+  const char *name;             // enumeration name
+  const char *descr;            // units or description
+  } canfly_id_info_t;
+
+// All published ID's, in ascending order of ID
+extern const canfly_id_info_t canfly_ids[];
+extern const uint16_t num_canfly_ids;
+/**
+ * @brief Find the definition of a published ID
+ * @param id CanFly ID
+ * @return definition, or 0 if the ID is not published
+*/
+extern const canfly_id_info_t *find_canfly_id(uint16_t id);
+/**
+ * @brief Calculate the CRC-32 (IEEE 802.3) of a block of data
+ * @param crc     0 to start, or the result of the previous block
+ * @param data    Data to add
+ * @param length  Number of bytes
+ * @return updated CRC
+*/
+extern uint32_t crc32_update(uint32_t crc, const void *data, uint32_t length);
+
 // enumeration for a status field
 typedef enum _e_board_status {
   bs_unknown = 0,
@@ -92,6 +159,7 @@ typedef struct _status_msg_t {
 #define CANFLY_BOOL_FALSE 9     // a false flag
 #define CANFLY_FLOAT 10          // A floating point number
 #define CANFLY_UTC 11           // an encoded UTC time, seconds since 2000-01-01
+#define CANFLY_PACKED_UINT16 12 // Up to 3 unsigned 16 bit values for a set of ID's
 
 #define CANFLY_BINARY 0xFF      // the id is a binary type.
 
@@ -130,6 +198,113 @@ typedef struct _tm_t {
   uint16_t milliseconds;
   } tm_t;
 
+// days from 1970-01-01 to the CanFly epoch of 2000-01-01
+#define CANFLY_EPOCH_DAYS 10957
+#define SECONDS_PER_DAY 86400
+
+/**
+ * @brief Convert a proleptic gregorian date to days since the CanFly epoch
+ * @param year    Full year
+ * @param month   Month 1..12
+ * @param day     Day of the month 1..31
+ * @return days since 2000-01-01, negative before the epoch
+ * @remark Branch free apart from the month shift, years are counted from
+ * March so the leap day is the last day of the year.
+*/
+static inline int32_t days_from_civil(int32_t year, uint32_t month, uint32_t day)
+  {
+  year -= month <= 2;
+  int32_t era = (year >= 0 ? year : year - 399) / 400;
+  uint32_t yoe = (uint32_t)(year - era * 400);
+  uint32_t doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+  uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+  return era * 146097 + (int32_t)doe - 719468 - CANFLY_EPOCH_DAYS;
+  }
+
+/**
+ * @brief Convert days since the CanFly epoch to a gregorian date
+ * @param days    Days since 2000-01-01
+ * @param tm      Date to fill in, the time fields are not changed
+*/
+static inline void civil_from_days(int32_t days, tm_t *tm)
+  {
+  days += 719468 + CANFLY_EPOCH_DAYS;
+  int32_t era = (days >= 0 ? days : days - 146096) / 146097;
+  uint32_t doe = (uint32_t)(days - era * 146097);
+  uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  uint32_t mp = (5 * doy + 2) / 153;
+  uint32_t month = mp < 10 ? mp + 3 : mp - 9;
+
+  tm->day = (uint16_t)(doy - (153 * mp + 2) / 5 + 1);
+  tm->month = (uint16_t)month;
+  tm->year = (uint16_t)((int32_t)yoe + era * 400 + (month <= 2));
+  }
+
+/**
+ * @brief Convert a time to milliseconds since 2000-01-01 00:00:00 UTC
+ * @param tm      Time to convert
+ * @return milliseconds since the epoch
+ * @remark Leap seconds are not counted, a second of 60 runs into the next minute
+*/
+static inline int64_t tm_to_epoch_ms(const tm_t *tm)
+  {
+  int64_t seconds = (int64_t)days_from_civil(tm->year, tm->month, tm->day) * SECONDS_PER_DAY +
+    tm->hour * 3600 + tm->minute * 60 + tm->second;
+
+  return seconds * 1000 + tm->milliseconds;
+  }
+
+/**
+ * @brief Convert a time to seconds since 2000-01-01 00:00:00 UTC
+ * @param tm      Time to convert
+ * @return seconds since the epoch, milliseconds are truncated
+*/
+static inline int64_t tm_to_epoch(const tm_t *tm)
+  {
+  return (int64_t)days_from_civil(tm->year, tm->month, tm->day) * SECONDS_PER_DAY +
+    tm->hour * 3600 + tm->minute * 60 + tm->second;
+  }
+
+/**
+ * @brief Convert milliseconds since 2000-01-01 00:00:00 UTC to a time
+ * @param ms      Milliseconds since the epoch
+ * @param tm      Resulting time
+*/
+static inline void epoch_ms_to_tm(int64_t ms, tm_t *tm)
+  {
+  // floor division so times before the epoch land in the right day
+  int64_t days = (ms >= 0 ? ms : ms - (SECONDS_PER_DAY * 1000LL - 1)) / (SECONDS_PER_DAY * 1000LL);
+  uint32_t ms_of_day = (uint32_t)(ms - days * SECONDS_PER_DAY * 1000LL);
+
+  civil_from_days((int32_t)days, tm);
+  tm->milliseconds = (uint16_t)(ms_of_day % 1000);
+  ms_of_day /= 1000;
+  tm->second = (uint16_t)(ms_of_day % 60);
+  ms_of_day /= 60;
+  tm->minute = (uint16_t)(ms_of_day % 60);
+  tm->hour = (uint16_t)(ms_of_day / 60);
+  }
+
+/**
+ * @brief Convert seconds since 2000-01-01 00:00:00 UTC to a time
+ * @param seconds Seconds since the epoch
+ * @param tm      Resulting time
+*/
+static inline void epoch_to_tm(int64_t seconds, tm_t *tm)
+  {
+  int64_t days = (seconds >= 0 ? seconds : seconds - (SECONDS_PER_DAY - 1)) / SECONDS_PER_DAY;
+  uint32_t second_of_day = (uint32_t)(seconds - days * SECONDS_PER_DAY);
+
+  civil_from_days((int32_t)days, tm);
+  tm->milliseconds = 0;
+  tm->second = (uint16_t)(second_of_day % 60);
+  second_of_day /= 60;
+  tm->minute = (uint16_t)(second_of_day % 60);
+  tm->hour = (uint16_t)(second_of_day / 60);
+  }
+
 enum {
   s_orphaned = 3,
   s_dropped = 2,
@@ -198,7 +373,8 @@ typedef enum _variant_type {
   v_int32,
   v_uint32,
   v_float,
-  v_utc
+  v_utc,
+  v_epoch       // utc as seconds since 2000-01-01
   } variant_type;
 
 typedef  struct _variant_t {
@@ -213,6 +389,7 @@ typedef  struct _variant_t {
     uint32_t uint32;
     float flt;
     tm_t utc;
+    uint32_t epoch;
     } value;
   } variant_t;
 
@@ -226,6 +403,7 @@ extern const variant_t *create_variant_int32(int32_t value, variant_t *v);
 extern const variant_t *create_variant_uint32(uint32_t value, variant_t *v);
 extern const variant_t *create_variant_float(float value, variant_t *v);
 extern const variant_t *create_variant_utc(const tm_t *value, variant_t *v);
+extern const variant_t *create_variant_epoch(uint32_t value, variant_t *v);
 extern result_t msg_to_variant(const canmsg_t *msg, variant_t *v);
 extern result_t variant_to_msg(const variant_t *v, uint16_t id, uint16_t type, canmsg_t *msg);
 extern result_t coerce_to_bool(const variant_t *src, bool *value);
@@ -237,9 +415,44 @@ extern result_t coerce_to_int32(const variant_t *src, int32_t *value);
 extern result_t coerce_to_uint32(const variant_t *src, uint32_t *value);
 extern result_t coerce_to_float(const variant_t *src, float *value);
 extern result_t coerce_to_utc(const variant_t *src, tm_t *value);
+extern result_t coerce_to_epoch(const variant_t *src, uint32_t *value);
 extern result_t coerce_variant(const variant_t *src, variant_t *dst, variant_type to_type);
 extern const variant_t *copy_variant(const variant_t *src, variant_t *dst);
 extern int compare_variant(const variant_t *v1, const variant_t *v2);
+/**
+ * @brief Format a variant as text
+ * @param v       Value to format
+ * @param buffer  Buffer to format into, the text is 0 terminated
+ * @param size    Size of the buffer
+ * @param length  Optional, length of the text excluding the terminator
+ * @return s_ok if formatted, e_buffer_too_small if the buffer is too small
+ * @remark Integers are decimal, booleans true or false, floats the
+ * shortest text that reads back as the same value, utc values are
+ * ISO-8601 (2022-03-01T10:20:30Z or 2022-03-01T10:20:30.250Z) and
+ * v_none is an empty string.  No memory is allocated.
+ */
+extern result_t variant_to_string(const variant_t *v, char *buffer, uint16_t size, uint16_t *length);
+/**
+ * @brief Format a column of variants
+ * @param values    Values to format
+ * @param count     Number of values
+ * @param separator Character written after each value
+ * @param buffer    Buffer to format into, the text is 0 terminated
+ * @param size      Size of the buffer
+ * @param length    Optional, length of the text excluding the terminator
+ * @return s_ok if formatted, e_buffer_too_small if the values do not fit
+ */
+extern result_t variants_to_string(const variant_t *values, uint32_t count, char separator, char *buffer, uint32_t size, uint32_t *length);
+/**
+ * @brief Parse text as a variant
+ * @param str     Text to parse, need not be 0 terminated
+ * @param length  Length of the text
+ * @param vt      Type of the variant to create
+ * @param v       Parsed value
+ * @return s_ok if parsed, e_parse_error if the text is not a value of
+ * the type, e_out_of_range if the value does not fit the type
+ */
+extern result_t string_to_variant(const char *str, uint16_t length, variant_type vt, variant_t *v);
 
 /**
  * @brief Set the ID of a CANbus message
@@ -256,6 +469,16 @@ static inline void set_can_id(canmsg_t *msg, uint16_t id)
   msg->flags &= ~ID_MASK;
   msg->flags |= (id & ID_MASK);
   }
+/**
+ * @brief Set the length of a CANbus message
+ * @param msg Message
+ * @param len Length of the message (0..8)
+*/
+static inline void set_can_len(canmsg_t *msg, uint8_t len)
+  {
+  msg->flags &= ~LENGTH_MASK;
+  msg->flags |= ((uint16_t)(len & 0x0F)) << 12;
+  }
 /**
  * @brief Get the length of a CANbus message
  * @param msg message
@@ -353,6 +576,11 @@ static inline bool is_status_msg(const canmsg_t *msg)
   return get_can_id(msg) >= id_status_node_0 && get_can_id(msg) <= id_status_node_15;
   }
 
+static inline bool is_alarm_msg(const canmsg_t *msg)
+  {
+  return get_can_id(msg) >= ALARM_ID_FIRST && get_can_id(msg) <= ALARM_ID_LAST;
+  }
+
 /**
  * @brief Create a can message sending an boolean value
  * @param msg           Message to construct
@@ -514,5 +742,72 @@ extern result_t get_param_uint8(const canmsg_t *msg, uint8_t *value);
  */
  extern result_t get_param_float(const canmsg_t *msg, float *value);
 
+/*************************************************
+ * Packed messages.
+ *
+ * A packed message carries up to PACKED_UINT16_MAX unsigned 16 bit
+ * values in one frame.  The frame is sent using the CanFly ID of the
+ * first value, the following values belong to the ID's
+ * first + stride, first + (2 * stride)...
+ *
+ * data[0]  CANFLY_PACKED_UINT16
+ * data[1]  bits 7:4 stride (1..15), bits 3:0 count (1..3)
+ * data[2]  big endian values
+ *
+ * A bank of 6 CHT's (or 6 EGT's) is sent as 2 frames rather than 6.
+ * The packed type is not understood by msg_to_variant, a receiver
+ * should call expand_packed_msg to convert a packed frame into the
+ * individual CANFLY_UINT16 messages.
+ */
+#define PACKED_UINT16_MAX 3
+
+static inline uint8_t get_packed_count(const canmsg_t *msg)
+  {
+  return msg->data[1] & 0x0F;
+  }
+
+static inline uint8_t get_packed_stride(const canmsg_t *msg)
+  {
+  return msg->data[1] >> 4;
+  }
+/**
+ * @brief Create a packed message holding up to 3 unsigned 16 bit values
+ * @param msg           Message to construct
+ * @param message_id    11 bit CanFly ID of the first value
+ * @param stride        Difference between the ID's of successive values (1..15)
+ * @param values        Values to send
+ * @param count         Number of values (1..PACKED_UINT16_MAX)
+ * @return s_ok if created ok
+ */
+extern result_t create_can_msg_packed_uint16(canmsg_t *msg, uint16_t message_id, uint8_t stride, const uint16_t *values, uint16_t count);
+/**
+ * @brief Pack a bank of unsigned 16 bit values into as few messages as possible
+ * @param msgs          Messages to construct
+ * @param num_msgs      On entry the number of messages available, on exit the number created
+ * @param message_id    11 bit CanFly ID of the first value
+ * @param stride        Difference between the ID's of successive values (1..15)
+ * @param values        Values to send
+ * @param count         Number of values
+ * @return s_ok if created ok, e_buffer_too_small if not enough messages are available
+ */
+extern result_t create_can_msgs_packed_uint16(canmsg_t *msgs, uint16_t *num_msgs, uint16_t message_id, uint8_t stride, const uint16_t *values, uint16_t count);
+/**
+ * @brief Extract a value from a packed message
+ * @param msg         Message to extract parameter from
+ * @param index       Index of the value (0..count-1)
+ * @param id          CanFly ID the value belongs to
+ * @param value       extracted value
+ * @return s_ok if the message is a valid packed message and the index is in range
+ */
+extern result_t get_param_packed_uint16(const canmsg_t *msg, uint16_t index, uint16_t *id, uint16_t *value);
+/**
+ * @brief Expand a packed message into the equivalent CANFLY_UINT16 messages
+ * @param msg         Packed message
+ * @param msgs        Messages to construct, must hold PACKED_UINT16_MAX messages
+ * @param count       Number of messages created
+ * @return s_ok if the message was expanded
+ */
+extern result_t expand_packed_msg(const canmsg_t *msg, canmsg_t *msgs, uint16_t *count);
+
 
 #endif
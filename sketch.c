@@ -0,0 +1,489 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#include "sketch.h"
+#include "canendian.h"
+
+#include <string.h>
+#include <math.h>
+
+#define SKETCH_ZERO_BIN SKETCH_HALF_BINS
+// bits of the float a bin key is taken from
+#define KEY_SHIFT (23 - SKETCH_SUB_BITS)
+#define KEY_BIAS ((127 + SKETCH_MIN_EXPONENT) << SKETCH_SUB_BITS)
+
+static inline uint32_t float_bits(float value)
+  {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+  }
+
+static inline float bits_float(uint32_t bits)
+  {
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+  }
+
+static inline uint16_t bin_of(float value)
+  {
+  uint32_t bits = float_bits(value);
+  int32_t key = (int32_t)((bits & 0x7FFFFFFF) >> KEY_SHIFT) - KEY_BIAS;
+
+  if (key < 0)
+    return SKETCH_ZERO_BIN;
+
+  if (key >= SKETCH_HALF_BINS)
+    key = SKETCH_HALF_BINS - 1;
+
+  return (bits & 0x80000000) != 0 ? SKETCH_ZERO_BIN - 1 - key : SKETCH_ZERO_BIN + 1 + key;
+  }
+
+// the value in the middle of a bin
+static float bin_value(uint16_t bin)
+  {
+  if (bin == SKETCH_ZERO_BIN)
+    return 0;
+
+  bool negative = bin < SKETCH_ZERO_BIN;
+  uint32_t key = negative ? SKETCH_ZERO_BIN - 1 - bin : bin - SKETCH_ZERO_BIN - 1;
+  uint32_t bits = ((key + KEY_BIAS) << KEY_SHIFT) | (1u << (KEY_SHIFT - 1));
+
+  return negative ? -bits_float(bits) : bits_float(bits);
+  }
+
+static inline bool same_threshold(float t1, float t2)
+  {
+  return (isnan(t1) && isnan(t2)) || t1 == t2;
+  }
+
+result_t sketch_init(sketch_t *sketch, uint16_t id, float threshold)
+  {
+  if (sketch == 0 || id > ID_MASK)
+    return e_bad_parameter;
+
+  memset(sketch, 0, sizeof(sketch_t));
+  sketch->id = id;
+  sketch->threshold = threshold;
+  sketch->min = INFINITY;
+  sketch->max = -INFINITY;
+
+  return s_ok;
+  }
+
+void sketch_add(sketch_t *sketch, uint64_t timestamp, float value)
+  {
+  if (isnan(value))
+    return;
+
+  sketch->bins[bin_of(value)]++;
+  sketch->count++;
+  sketch->sum += value;
+  if (value < sketch->min)
+    sketch->min = value;
+  if (value > sketch->max)
+    sketch->max = value;
+
+  // the previous value is held until this sample
+  if (sketch->last_time != 0 && timestamp > sketch->last_time && sketch->last_value > sketch->threshold)
+    sketch->time_above += timestamp - sketch->last_time;
+
+  sketch->last_time = timestamp;
+  sketch->last_value = value;
+  }
+
+result_t sketch_merge(sketch_t *dst, const sketch_t *src)
+  {
+  if (dst == 0 || src == 0 || dst->id != src->id || !same_threshold(dst->threshold, src->threshold))
+    return e_bad_parameter;
+
+  for (uint16_t i = 0; i < SKETCH_BINS; i++)
+    dst->bins[i] += src->bins[i];
+
+  dst->count += src->count;
+  dst->sum += src->sum;
+  dst->time_above += src->time_above;
+  if (src->min < dst->min)
+    dst->min = src->min;
+  if (src->max > dst->max)
+    dst->max = src->max;
+
+  return s_ok;
+  }
+
+result_t sketch_quantile(const sketch_t *sketch, float quantile, float *value)
+  {
+  if (sketch == 0 || value == 0 || !(quantile >= 0 && quantile <= 1))
+    return e_bad_parameter;
+
+  if (sketch->count == 0)
+    return e_not_found;
+
+  uint64_t rank = (uint64_t)ceil(quantile * (double)sketch->count);
+  if (rank == 0)
+    rank = 1;
+
+  uint64_t seen = 0;
+  uint16_t bin;
+  for (bin = 0; bin < SKETCH_BINS - 1; bin++)
+    if ((seen += sketch->bins[bin]) >= rank)
+      break;
+
+  // the extreme bins are best described by the extremes
+  float estimate = bin_value(bin);
+  if (estimate < sketch->min || quantile == 0)
+    estimate = sketch->min;
+  if (estimate > sketch->max || quantile == 1)
+    estimate = sketch->max;
+
+  *value = estimate;
+  return s_ok;
+  }
+
+result_t sketch_histogram(const sketch_t *sketch, const float *edges, uint16_t num_edges, uint64_t *counts)
+  {
+  if (sketch == 0 || counts == 0 || (edges == 0 && num_edges > 0))
+    return e_bad_parameter;
+
+  memset(counts, 0, (num_edges + 1) * sizeof(uint64_t));
+
+  uint16_t edge = 0;
+  for (uint16_t bin = 0; bin < SKETCH_BINS; bin++)
+    {
+    if (sketch->bins[bin] == 0)
+      continue;
+
+    float value = bin_value(bin);
+    while (edge < num_edges && value >= edges[edge])
+      edge++;
+
+    counts[edge] += sketch->bins[bin];
+    }
+
+  return s_ok;
+  }
+
+/*************************************************
+ * Serialization
+ */
+static uint16_t put_varint(uint8_t *buffer, uint64_t value)
+  {
+  uint16_t length = 0;
+  while (value >= 0x80)
+    {
+    buffer[length++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+    }
+
+  buffer[length++] = (uint8_t)value;
+  return length;
+  }
+
+static bool fetch_varint(const uint8_t *buffer, uint32_t size, uint32_t *pos, uint64_t *value)
+  {
+  *value = 0;
+  for (uint16_t shift = 0; shift < 64; shift += 7)
+    {
+    if (*pos >= size)
+      return false;
+
+    uint8_t byte = buffer[(*pos)++];
+    *value |= ((uint64_t)(byte & 0x7F)) << shift;
+    if ((byte & 0x80) == 0)
+      return true;
+    }
+
+  return false;
+  }
+
+result_t sketch_serialize(const sketch_t *sketch, uint8_t *buffer, uint32_t size, uint32_t *length)
+  {
+  if (sketch == 0 || buffer == 0 || length == 0)
+    return e_bad_parameter;
+
+  if (size < SKETCH_HEADER_SIZE)
+    return e_buffer_too_small;
+
+  uint64_t sum_bits;
+  memcpy(&sum_bits, &sketch->sum, sizeof(sum_bits));
+
+  put_le32(buffer, SKETCH_MAGIC);
+  buffer[4] = SKETCH_VERSION;
+  buffer[5] = SKETCH_SUB_BITS;
+  buffer[6] = (uint8_t)(int8_t)SKETCH_MIN_EXPONENT;
+  buffer[7] = (uint8_t)(int8_t)SKETCH_MAX_EXPONENT;
+  put_le16(buffer + 8, sketch->id);
+  put_le16(buffer + 10, 0);
+  put_le64(buffer + 12, sketch->count);
+  put_le64(buffer + 20, sum_bits);
+  put_le32(buffer + 28, float_bits(sketch->min));
+  put_le32(buffer + 32, float_bits(sketch->max));
+  put_le32(buffer + 36, float_bits(sketch->threshold));
+  put_le64(buffer + 40, sketch->time_above);
+
+  uint32_t pos = SKETCH_HEADER_SIZE;
+  uint32_t num_bins = 0;
+  uint16_t prev = 0;
+  for (uint16_t bin = 0; bin < SKETCH_BINS; bin++)
+    {
+    if (sketch->bins[bin] == 0)
+      continue;
+
+    if (size - pos < SKETCH_MAX_BIN)
+      return e_buffer_too_small;
+
+    pos += put_varint(buffer + pos, bin - prev);
+    pos += put_varint(buffer + pos, sketch->bins[bin]);
+    prev = bin;
+    num_bins++;
+    }
+
+  put_le32(buffer + 48, num_bins);
+  *length = pos;
+  return s_ok;
+  }
+
+result_t sketch_peek(const uint8_t *buffer, uint32_t size, uint16_t *id, float *threshold)
+  {
+  if (buffer == 0 || id == 0 || threshold == 0)
+    return e_bad_parameter;
+
+  if (size < SKETCH_HEADER_SIZE ||
+      fetch_le32(buffer) != SKETCH_MAGIC ||
+      buffer[4] != SKETCH_VERSION ||
+      buffer[5] != SKETCH_SUB_BITS ||
+      (int8_t)buffer[6] != SKETCH_MIN_EXPONENT ||
+      (int8_t)buffer[7] != SKETCH_MAX_EXPONENT)
+    return e_corrupt;
+
+  *id = fetch_le16(buffer + 8);
+  *threshold = bits_float(fetch_le32(buffer + 36));
+  return s_ok;
+  }
+
+// walk the bins, adding them to the sketch if it is not 0
+static result_t read_bins(sketch_t *sketch, const uint8_t *buffer, uint32_t size, uint32_t *length)
+  {
+  uint32_t num_bins = fetch_le32(buffer + 48);
+  uint32_t pos = SKETCH_HEADER_SIZE;
+  uint32_t bin = 0;
+
+  for (uint32_t i = 0; i < num_bins; i++)
+    {
+    uint64_t delta;
+    uint64_t count;
+    if (!fetch_varint(buffer, size, &pos, &delta) ||
+        !fetch_varint(buffer, size, &pos, &count) ||
+        (i > 0 && delta == 0) ||
+        delta >= SKETCH_BINS ||
+        (bin += (uint32_t)delta) >= SKETCH_BINS)
+      return e_corrupt;
+
+    if (sketch != 0)
+      sketch->bins[bin] += count;
+    }
+
+  *length = pos;
+  return s_ok;
+  }
+
+result_t sketch_merge_serialized(sketch_t *sketch, const uint8_t *buffer, uint32_t size, uint32_t *length)
+  {
+  if (sketch == 0 || buffer == 0)
+    return e_bad_parameter;
+
+  result_t result;
+  uint16_t id;
+  float threshold;
+  if (failed(result = sketch_peek(buffer, size, &id, &threshold)))
+    return result;
+
+  if (id != sketch->id || !same_threshold(threshold, sketch->threshold))
+    return e_bad_parameter;
+
+  // check all of the bins before changing the sketch
+  uint32_t used;
+  if (failed(result = read_bins(0, buffer, size, &used)))
+    return result;
+
+  read_bins(sketch, buffer, size, &used);
+
+  double sum;
+  uint64_t sum_bits = fetch_le64(buffer + 20);
+  memcpy(&sum, &sum_bits, sizeof(sum));
+
+  float min = bits_float(fetch_le32(buffer + 28));
+  float max = bits_float(fetch_le32(buffer + 32));
+  sketch->count += fetch_le64(buffer + 12);
+  sketch->sum += sum;
+  sketch->time_above += fetch_le64(buffer + 40);
+  if (min < sketch->min)
+    sketch->min = min;
+  if (max > sketch->max)
+    sketch->max = max;
+
+  if (length != 0)
+    *length = used;
+
+  return s_ok;
+  }
+
+/*************************************************
+ * Sketch sets
+ */
+static const struct {
+  uint16_t id;
+  float threshold;
+  } default_sketches[] = {
+  { id_cylinder_head_temperature1, 505 },   // 450F
+  { id_cylinder_head_temperature2, 505 },
+  { id_cylinder_head_temperature3, 505 },
+  { id_cylinder_head_temperature4, 505 },
+  { id_cylinder_head_temperature5, 505 },
+  { id_cylinder_head_temperature6, 505 },
+  { id_exhaust_gas_temperature1, 1145 },    // 1600F
+  { id_exhaust_gas_temperature2, 1145 },
+  { id_exhaust_gas_temperature3, 1145 },
+  { id_exhaust_gas_temperature4, 1145 },
+  { id_exhaust_gas_temperature5, 1145 },
+  { id_exhaust_gas_temperature6, 1145 },
+  { id_oil_temperature, 383 },              // 230F
+  { id_oil_pressure, NAN },
+  { id_engine_rpm, 2700 },
+  };
+
+#define NUM_DEFAULT_SKETCHES (sizeof(default_sketches) / sizeof(default_sketches[0]))
+
+result_t sketchset_init(sketchset_t *set, bool empty)
+  {
+  if (set == 0)
+    return e_bad_parameter;
+
+  set->num_sketches = 0;
+  memset(set->index, 0, sizeof(set->index));
+
+  if (!empty)
+    for (uint16_t i = 0; i < NUM_DEFAULT_SKETCHES; i++)
+      sketchset_track(set, default_sketches[i].id, default_sketches[i].threshold);
+
+  return s_ok;
+  }
+
+result_t sketchset_track(sketchset_t *set, uint16_t id, float threshold)
+  {
+  if (set == 0 || id > ID_MASK)
+    return e_bad_parameter;
+
+  if (set->index[id] != 0)
+    return e_exists;
+
+  if (set->num_sketches == SKETCHSET_MAX)
+    return e_no_space;
+
+  sketch_init(&set->sketches[set->num_sketches], id, threshold);
+  set->index[id] = (uint8_t)++set->num_sketches;
+  return s_ok;
+  }
+
+static inline void add_value(sketchset_t *set, const canmsg_t *msg, uint64_t timestamp)
+  {
+  variant_t v;
+  float value;
+  sketch_t *sketch = sketchset_find(set, get_can_id(msg));
+  if (sketch != 0 && succeeded(msg_to_variant(msg, &v)) && succeeded(coerce_to_float(&v, &value)))
+    sketch_add(sketch, timestamp, value);
+  }
+
+result_t sketchset_add(sketchset_t *set, const timed_canmsg_t *msgs, uint32_t count)
+  {
+  if (set == 0 || (msgs == 0 && count > 0))
+    return e_bad_parameter;
+
+  for (uint32_t i = 0; i < count; i++)
+    {
+    const canmsg_t *msg = &msgs[i].msg;
+    if (get_can_len(msg) > 0 && msg->data[0] == CANFLY_PACKED_UINT16)
+      {
+      canmsg_t expanded[PACKED_UINT16_MAX];
+      uint16_t num_expanded;
+      if (succeeded(expand_packed_msg(msg, expanded, &num_expanded)))
+        for (uint16_t j = 0; j < num_expanded; j++)
+          add_value(set, &expanded[j], msgs[i].timestamp);
+      }
+    else if (set->index[get_can_id(msg)] != 0)
+      add_value(set, msg, msgs[i].timestamp);
+    }
+
+  return s_ok;
+  }
+
+result_t sketchset_merge_serialized(sketchset_t *set, const uint8_t *buffer, uint32_t size)
+  {
+  if (set == 0 || (buffer == 0 && size > 0))
+    return e_bad_parameter;
+
+  result_t result;
+  for (uint32_t pos = 0; pos < size; )
+    {
+    uint16_t id;
+    float threshold;
+    if (failed(result = sketch_peek(buffer + pos, size - pos, &id, &threshold)))
+      return result;
+
+    if (id > ID_MASK)
+      return e_corrupt;
+
+    sketch_t *sketch = sketchset_find(set, id);
+    if (sketch == 0)
+      {
+      if (failed(result = sketchset_track(set, id, threshold)))
+        return result;
+
+      sketch = sketchset_find(set, id);
+      }
+
+    uint32_t length;
+    if (failed(result = sketch_merge_serialized(sketch, buffer + pos, size - pos, &length)))
+      return result;
+
+    pos += length;
+    }
+
+  return s_ok;
+  }
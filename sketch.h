@@ -0,0 +1,217 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#ifndef __sketch_h__
+#define __sketch_h__
+
+#include "canlog.h"
+
+/*************************************************
+ * Mergeable distribution sketches of engine parameters.
+ *
+ * A sketch is a fixed bin log histogram.  Each power of 2 from 2^-10 to
+ * 2^22 is split into 64 bins, taken straight from the bits of the float,
+ * so a value lands in its bin in O(1) and quantiles are within 0.8% of
+ * the true value.  Negative values have their own mirrored bins and
+ * values closer to 0 than 2^-10 share a zero bin.
+ *
+ * A sketch also holds the count, sum, min, max and the time spent above
+ * a threshold, with the value held between samples.  Sketches of the same
+ * ID from different flights or engines are merged by adding the bins,
+ * which are 64 bit so merging a fleet's worth of flights cannot wrap.
+ *
+ * The serialized form is a header followed by the non empty bins as
+ * varint encoded (index delta, count) pairs, typically a few hundred
+ * bytes.  A serialized sketch can be merged without decoding it first.
+ */
+#define SKETCH_MAGIC 0x4b534643       // 'CFSK'
+#define SKETCH_VERSION 1
+#define SKETCH_SUB_BITS 6
+#define SKETCH_MIN_EXPONENT -10
+#define SKETCH_MAX_EXPONENT 22
+// bins on each side of zero
+#define SKETCH_HALF_BINS ((SKETCH_MAX_EXPONENT - SKETCH_MIN_EXPONENT) << SKETCH_SUB_BITS)
+#define SKETCH_BINS (SKETCH_HALF_BINS * 2 + 1)
+#define SKETCH_HEADER_SIZE 52
+// largest serialized bin, the index delta and count as varints
+#define SKETCH_MAX_BIN 12
+// largest serialized sketch
+#define SKETCH_MAX_SERIALIZED (SKETCH_HEADER_SIZE + SKETCH_BINS * SKETCH_MAX_BIN)
+
+typedef struct _sketch_t {
+  uint16_t id;
+  float threshold;              // time above is measured against this, NAN for none
+  uint64_t count;
+  double sum;
+  float min;
+  float max;
+  uint64_t time_above;          // microseconds above the threshold
+  uint64_t last_time;           // time of the last sample, 0 if none
+  float last_value;
+  uint64_t bins[SKETCH_BINS];   // most negative first
+  } sketch_t;
+
+/**
+ * @brief Initialize an empty sketch
+ * @param sketch    Sketch
+ * @param id        CanFly ID the sketch is of
+ * @param threshold Value to measure the time above, NAN for none
+ * @return s_ok if initialized
+ */
+extern result_t sketch_init(sketch_t *sketch, uint16_t id, float threshold);
+/**
+ * @brief Add a sample
+ * @param sketch    Sketch
+ * @param timestamp Time of the sample, microseconds
+ * @param value     Sample
+ */
+extern void sketch_add(sketch_t *sketch, uint64_t timestamp, float value);
+/**
+ * @brief Merge one sketch into another
+ * @param dst   Sketch to merge into
+ * @param src   Sketch to merge
+ * @return s_ok if merged, e_bad_parameter if the sketches are of different
+ * ID's or thresholds
+ */
+extern result_t sketch_merge(sketch_t *dst, const sketch_t *src);
+/**
+ * @brief Estimate a quantile
+ * @param sketch    Sketch
+ * @param quantile  0..1, for example 0.95 for p95
+ * @param value     Estimated value
+ * @return s_ok if estimated, e_not_found if the sketch is empty
+ */
+extern result_t sketch_quantile(const sketch_t *sketch, float quantile, float *value);
+/**
+ * @brief Count the samples in a set of histogram bins
+ * @param sketch    Sketch
+ * @param edges     Ascending bin edges
+ * @param num_edges Number of edges
+ * @param counts    num_edges + 1 counts, below the first edge, between
+ * each pair of edges and above the last
+ * @return s_ok if counted
+ * @remark A sample is counted by the bin of the sketch it is in, so
+ * samples within 0.8% of an edge may be counted on either side of it.
+ */
+extern result_t sketch_histogram(const sketch_t *sketch, const float *edges, uint16_t num_edges, uint64_t *counts);
+/**
+ * @brief Serialize a sketch
+ * @param sketch    Sketch
+ * @param buffer    Buffer, SKETCH_MAX_SERIALIZED bytes is always enough
+ * @param size      Size of the buffer
+ * @param length    Bytes used
+ * @return s_ok if serialized, e_buffer_too_small if it does not fit
+ */
+extern result_t sketch_serialize(const sketch_t *sketch, uint8_t *buffer, uint32_t size, uint32_t *length);
+/**
+ * @brief Merge a serialized sketch
+ * @param sketch    Sketch to merge into, initialize it with the ID and
+ * threshold of the serialized sketch to decode a sketch
+ * @param buffer    Serialized sketch
+ * @param size      Bytes in the buffer
+ * @param length    Bytes used by the sketch, so sketches can be concatenated
+ * @return s_ok if merged, e_corrupt if the buffer is not a sketch,
+ * e_bad_parameter if the ID or threshold does not match
+ */
+extern result_t sketch_merge_serialized(sketch_t *sketch, const uint8_t *buffer, uint32_t size, uint32_t *length);
+/**
+ * @brief Read the ID and threshold of a serialized sketch
+ * @param buffer    Serialized sketch
+ * @param size      Bytes in the buffer
+ * @param id        CanFly ID
+ * @param threshold Threshold
+ * @return s_ok if read, e_corrupt if the buffer is not a sketch
+ */
+extern result_t sketch_peek(const uint8_t *buffer, uint32_t size, uint16_t *id, float *threshold);
+
+/*************************************************
+ * A set of sketches fed from frames.
+ */
+#define SKETCHSET_MAX 32
+
+typedef struct _sketchset_t {
+  uint16_t num_sketches;
+  uint8_t index[NUM_CAN_IDS];   // sketch + 1 for each ID, 0 if not tracked
+  sketch_t sketches[SKETCHSET_MAX];
+  } sketchset_t;
+
+/**
+ * @brief Initialize a set tracking the engine condition parameters
+ * @param set   Set
+ * @param empty True for an empty set, false to track CHT, EGT, oil
+ * temperature and pressure and rpm with default thresholds
+ * @return s_ok if initialized
+ */
+extern result_t sketchset_init(sketchset_t *set, bool empty);
+/**
+ * @brief Track an ID
+ * @param set       Set
+ * @param id        CanFly ID
+ * @param threshold Value to measure the time above, NAN for none
+ * @return s_ok if tracked, e_exists if already tracked, e_no_space if the set is full
+ */
+extern result_t sketchset_track(sketchset_t *set, uint16_t id, float threshold);
+/**
+ * @brief Find the sketch of an ID
+ * @param set   Set
+ * @param id    CanFly ID
+ * @return sketch, 0 if the ID is not tracked
+ */
+static inline sketch_t *sketchset_find(sketchset_t *set, uint16_t id)
+  {
+  uint8_t index = set->index[id & ID_MASK];
+  return index == 0 ? 0 : &set->sketches[index - 1];
+  }
+/**
+ * @brief Add frames, frames of ID's that are not tracked are ignored
+ * @param set   Set
+ * @param msgs  Frames
+ * @param count Number of frames
+ * @return s_ok if added
+ */
+extern result_t sketchset_add(sketchset_t *set, const timed_canmsg_t *msgs, uint32_t count);
+/**
+ * @brief Merge serialized sketches into a set, ID's not tracked are added
+ * @param set     Set
+ * @param buffer  Concatenated serialized sketches
+ * @param size    Bytes in the buffer
+ * @return s_ok if merged
+ */
+extern result_t sketchset_merge_serialized(sketchset_t *set, const uint8_t *buffer, uint32_t size);
+
+#endif
@@ -0,0 +1,205 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#include "snapshot.h"
+
+#include <string.h>
+
+#define SAMPLE_MASK (SNAPSHOT_SAMPLES - 1)
+
+result_t snapshot_init(snapshot_t *snap, uint32_t rate, snapshot_mode mode, uint32_t delay)
+  {
+  if (snap == 0 || rate == 0 || rate > 1000000 || (1000000 % rate) != 0 ||
+      (mode != sm_hold && mode != sm_linear))
+    return e_bad_parameter;
+
+  memset(snap, 0, sizeof(snapshot_t));
+  snap->mode = mode;
+  snap->period = 1000000 / rate;
+  snap->delay = delay;
+
+  return s_ok;
+  }
+
+static void queue_sample(snapshot_t *snap, uint16_t id, uint64_t time, const variant_t *v)
+  {
+  float value;
+  if (id < SNAPSHOT_FIRST_ID || id > SNAPSHOT_LAST_ID || failed(coerce_to_float(v, &value)))
+    return;
+
+  uint16_t field = id - SNAPSHOT_FIRST_ID;
+  uint64_t bit = 1ULL << field;
+  snapshot_field_t *f = &snap->fields[field];
+
+  // samples must be in time order, a sample older than one already
+  // queued or consumed can't be used
+  if ((f->count > 0 && time < f->times[(f->head + f->count - 1) & SAMPLE_MASK]) ||
+      (f->count == 0 && (snap->row.valid & bit) != 0 && time < snap->row.sampled[field]))
+    {
+    snap->late++;
+    return;
+    }
+
+  if (f->count == SNAPSHOT_SAMPLES)
+    {
+    // ticks are not keeping up, drop the oldest
+    f->head = (f->head + 1) & SAMPLE_MASK;
+    f->count--;
+    snap->overruns++;
+    }
+
+  uint8_t slot = (f->head + f->count) & SAMPLE_MASK;
+  f->times[slot] = time;
+  f->values[slot] = value;
+  f->count++;
+
+  snap->pending |= bit;
+  if (time > snap->input_time)
+    snap->input_time = time;
+
+  // the first tick is the first multiple of the period after the first sample
+  if (snap->next_tick == 0)
+    snap->next_tick = (time / snap->period + 1) * snap->period;
+  }
+
+result_t snapshot_add(snapshot_t *snap, const timed_canmsg_t *msgs, uint32_t count)
+  {
+  if (snap == 0 || (msgs == 0 && count > 0))
+    return e_bad_parameter;
+
+  for (uint32_t i = 0; i < count; i++)
+    {
+    const canmsg_t *msg = &msgs[i].msg;
+    variant_t v;
+
+    if (get_can_len(msg) > 0 && msg->data[0] == CANFLY_PACKED_UINT16)
+      {
+      canmsg_t expanded[PACKED_UINT16_MAX];
+      uint16_t num_expanded;
+      if (failed(expand_packed_msg(msg, expanded, &num_expanded)))
+        continue;
+
+      for (uint16_t j = 0; j < num_expanded; j++)
+        if (succeeded(msg_to_variant(&expanded[j], &v)))
+          queue_sample(snap, get_can_id(&expanded[j]), msgs[i].timestamp, &v);
+      }
+    else
+      {
+      uint16_t id = get_can_id(msg);
+      if (id >= SNAPSHOT_FIRST_ID && id <= SNAPSHOT_LAST_ID && succeeded(msg_to_variant(msg, &v)))
+        queue_sample(snap, id, msgs[i].timestamp, &v);
+      }
+    }
+
+  return s_ok;
+  }
+
+// update the fields with pending samples for a tick
+static void build_row(snapshot_t *snap, uint64_t tick)
+  {
+  snapshot_row_t *row = &snap->row;
+  row->timestamp = tick;
+  row->updated = 0;
+
+  uint64_t visit = snap->pending;
+  while (visit != 0)
+    {
+    uint16_t i = (uint16_t)__builtin_ctzll(visit);
+    uint64_t bit = 1ULL << i;
+    visit &= visit - 1;
+
+    snapshot_field_t *f = &snap->fields[i];
+
+    // consume the samples at or before the tick
+    while (f->count > 0 && f->times[f->head] <= tick)
+      {
+      f->held = f->values[f->head];
+      row->sampled[i] = f->times[f->head];
+      row->valid |= bit;
+      row->updated |= bit;
+      f->head = (f->head + 1) & SAMPLE_MASK;
+      f->count--;
+      }
+
+    if ((row->valid & bit) == 0)
+      continue;                 // only samples after the tick so far
+
+    if (f->count == 0)
+      {
+      // nothing to interpolate towards, the field holds until the next sample
+      row->values[i] = f->held;
+      snap->pending &= ~bit;
+      }
+    else if (snap->mode == sm_linear)
+      {
+      uint64_t t0 = row->sampled[i];
+      uint64_t t1 = f->times[f->head];
+      float v1 = f->values[f->head];
+      row->values[i] = f->held + (v1 - f->held) * ((float)(tick - t0) / (float)(t1 - t0));
+      }
+    else
+      row->values[i] = f->held;
+    }
+  }
+
+result_t snapshot_tick(snapshot_t *snap, uint64_t now, snapshot_row_t *rows, uint32_t *count)
+  {
+  if (snap == 0 || rows == 0 || count == 0)
+    return e_bad_parameter;
+
+  if (now == 0)
+    now = snap->input_time;
+
+  uint32_t size = *count;
+  uint32_t emitted = 0;
+  while (snap->next_tick != 0 && snap->next_tick + snap->delay <= now)
+    {
+    if (emitted == size)
+      {
+      *count = emitted;
+      return e_more_data;
+      }
+
+    build_row(snap, snap->next_tick);
+    memcpy(&rows[emitted++], &snap->row, sizeof(snapshot_row_t));
+    snap->next_tick += snap->period;
+    }
+
+  *count = emitted;
+  return s_ok;
+  }
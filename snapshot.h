@@ -0,0 +1,155 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#ifndef __snapshot_h__
+#define __snapshot_h__
+
+#include "canlog.h"
+
+/*************************************************
+ * Fixed rate snapshots of the EDU block.
+ *
+ * Each EDU parameter is sent on its own schedule.  The snapshot builder
+ * takes the frames as they arrive and emits a row holding every ID from
+ * id_fuel_pressure to id_advance_divergence at a fixed rate.  Ticks are
+ * aligned to multiples of the period.
+ *
+ * Each field keeps a short queue of samples not yet consumed by a tick.
+ * A tick only visits fields with queued samples, or fields that are being
+ * interpolated, so the work per tick is proportional to the number of
+ * changed fields.  The age of a field is not stored, each row holds the
+ * time of the sample a field was taken from, see snapshot_age.
+ *
+ * In sm_linear mode a field is interpolated between the samples either
+ * side of the tick.  That needs the following sample, so the row for a
+ * tick is emitted once the input has run past the tick by the delay given
+ * to snapshot_init.  A field with no following sample is held.
+ */
+#define SNAPSHOT_FIRST_ID id_fuel_pressure
+#define SNAPSHOT_LAST_ID id_advance_divergence
+#define SNAPSHOT_FIELDS (SNAPSHOT_LAST_ID - SNAPSHOT_FIRST_ID + 1)
+// samples queued per field between ticks, must be a power of 2
+#define SNAPSHOT_SAMPLES 8
+
+typedef enum _snapshot_mode {
+  sm_hold,                      // last sample at or before the tick
+  sm_linear,                    // interpolated between the samples either side
+  } snapshot_mode;
+
+/**
+ * @brief A row of EDU values at one tick, field i is ID SNAPSHOT_FIRST_ID + i
+ */
+typedef struct _snapshot_row_t {
+  uint64_t timestamp;           // tick time, microseconds
+  uint64_t valid;               // bit i set once field i has a value
+  uint64_t updated;             // bit i set if field i had a new sample since the last row
+  float values[SNAPSHOT_FIELDS];
+  uint64_t sampled[SNAPSHOT_FIELDS];  // time of the sample the value was taken from
+  } snapshot_row_t;
+
+typedef struct _snapshot_field_t {
+  uint64_t times[SNAPSHOT_SAMPLES];
+  float values[SNAPSHOT_SAMPLES];
+  float held;                   // newest sample at or before the last tick
+  uint8_t head;                 // oldest queued sample
+  uint8_t count;                // number of queued samples
+  } snapshot_field_t;
+
+typedef struct _snapshot_t {
+  snapshot_mode mode;
+  uint32_t period;              // microseconds between ticks
+  uint32_t delay;               // microseconds the input must pass a tick by
+  uint64_t next_tick;           // 0 until the first sample
+  uint64_t input_time;          // newest timestamp added
+  uint64_t pending;             // bit i set if field i must be visited at the next tick
+  uint32_t overruns;            // samples dropped as a field queue was full
+  uint32_t late;                // samples dropped as older than a sample already used
+  snapshot_row_t row;           // the row being built
+  snapshot_field_t fields[SNAPSHOT_FIELDS];
+  } snapshot_t;
+
+/**
+ * @brief Initialize a snapshot builder
+ * @param snap    Builder
+ * @param rate    Rows per second, the period must be a whole number of microseconds
+ * @param mode    sm_hold or sm_linear
+ * @param delay   Microseconds the input must run past a tick before the
+ * row is emitted.  Use 0 for sm_hold, at least the slowest field period
+ * for sm_linear.
+ * @return s_ok if initialized, e_bad_parameter if the rate is not supported
+ */
+extern result_t snapshot_init(snapshot_t *snap, uint32_t rate, snapshot_mode mode, uint32_t delay);
+/**
+ * @brief Add frames to the builder
+ * @param snap    Builder
+ * @param msgs    Frames in timestamp order, ID's outside the EDU block are ignored
+ * @param count   Number of frames
+ * @return s_ok if added
+ * @remark Packed frames are expanded.  Rows are not emitted, call
+ * snapshot_tick to collect them.
+ */
+extern result_t snapshot_add(snapshot_t *snap, const timed_canmsg_t *msgs, uint32_t count);
+/**
+ * @brief Emit the rows that are complete
+ * @param snap    Builder
+ * @param now     Current time, rows are emitted for ticks up to now - delay.
+ * Pass 0 to use the newest timestamp added.
+ * @param rows    Buffer for the rows
+ * @param count   On entry the size of the buffer, on exit the number of rows
+ * @return s_ok if all complete rows were emitted, e_more_data if the buffer
+ * filled first
+ */
+extern result_t snapshot_tick(snapshot_t *snap, uint64_t now, snapshot_row_t *rows, uint32_t *count);
+
+/**
+ * @brief Return the age of a field in a row
+ * @param row     Row
+ * @param id      EDU ID
+ * @return microseconds since the sample the field was taken from, UINT64_MAX
+ * if the field has no value
+ */
+static inline uint64_t snapshot_age(const snapshot_row_t *row, uint16_t id)
+  {
+  uint16_t field = id - SNAPSHOT_FIRST_ID;
+  if (id < SNAPSHOT_FIRST_ID || id > SNAPSHOT_LAST_ID || (row->valid & (1ULL << field)) == 0)
+    return UINT64_MAX;
+
+  return row->timestamp - row->sampled[field];
+  }
+
+#endif
@@ -0,0 +1,233 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#define _GNU_SOURCE
+#include "socketcan.h"
+#include "cantrace.h"
+
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+// maximum number of frames passed to the kernel in one call
+#define SOCKETCAN_BATCH 64
+
+// CanFly only uses standard 11 bit data frames, a shared bus can carry
+// extended (e.g. J1939), remote and error frames as well
+static bool is_canfly_frame(const struct can_frame *frame)
+  {
+  return (frame->can_id & (CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_ERR_FLAG)) == 0;
+  }
+
+static void frame_to_msg(const struct can_frame *frame, canmsg_t *msg)
+  {
+  memset(msg, 0, sizeof(canmsg_t));
+  set_can_id(msg, (uint16_t)(frame->can_id & CAN_SFF_MASK));
+  set_can_len(msg, frame->can_dlc > 8 ? 8 : frame->can_dlc);
+  memcpy(msg->data, frame->data, 8);
+  }
+
+static void msg_to_frame(const canmsg_t *msg, struct can_frame *frame)
+  {
+  memset(frame, 0, sizeof(struct can_frame));
+  frame->can_id = get_can_id(msg);
+  frame->can_dlc = get_can_len(msg);
+  memcpy(frame->data, msg->data, 8);
+  }
+
+result_t socketcan_open(const char *ifname, int *fd)
+  {
+  if (ifname == 0 || fd == 0)
+    return e_bad_parameter;
+
+  int s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  if (s < 0)
+    return e_not_supported;
+
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+  if (ioctl(s, SIOCGIFINDEX, &ifr) < 0)
+    {
+    close(s);
+    return e_not_found;
+    }
+
+  // the kernel timestamps each frame as it is received
+  int on = 1;
+  setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+
+  // only receive standard data frames, error frames are off by default
+  struct can_filter filter;
+  filter.can_id = 0;
+  filter.can_mask = CAN_EFF_FLAG | CAN_RTR_FLAG;
+  setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, &filter, sizeof(filter));
+
+  struct sockaddr_can addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = ifr.ifr_ifindex;
+  if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+    close(s);
+    return e_invalid_operation;
+    }
+
+  *fd = s;
+  return s_ok;
+  }
+
+result_t socketcan_read(int fd, timed_canmsg_t *msgs, uint32_t *count, int timeout_ms)
+  {
+  if (msgs == 0 || count == 0 || *count == 0)
+    return e_bad_parameter;
+
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  int rc = poll(&pfd, 1, timeout_ms);
+  if (rc == 0)
+    return e_timeout_error;
+
+  if (rc < 0)
+    return errno == EINTR ? e_operation_cancelled : e_invalid_operation;
+
+  CANTRACE_BEGIN(trace);
+  struct can_frame frames[SOCKETCAN_BATCH];
+  struct iovec iov[SOCKETCAN_BATCH];
+  struct mmsghdr hdrs[SOCKETCAN_BATCH];
+  uint8_t control[SOCKETCAN_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+
+  uint32_t n = *count > SOCKETCAN_BATCH ? SOCKETCAN_BATCH : *count;
+  memset(hdrs, 0, sizeof(struct mmsghdr) * n);
+  for (uint32_t i = 0; i < n; i++)
+    {
+    iov[i].iov_base = &frames[i];
+    iov[i].iov_len = sizeof(struct can_frame);
+    hdrs[i].msg_hdr.msg_iov = &iov[i];
+    hdrs[i].msg_hdr.msg_iovlen = 1;
+    hdrs[i].msg_hdr.msg_control = control[i];
+    hdrs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+    }
+
+  rc = recvmmsg(fd, hdrs, n, MSG_DONTWAIT, 0);
+  if (rc <= 0)
+    return rc == 0 || errno == EAGAIN ? e_timeout_error : e_invalid_operation;
+
+  // the filter drops other frames, but one set by another user of the
+  // socket may not
+  uint32_t received = 0;
+  for (int i = 0; i < rc; i++)
+    {
+    if (!is_canfly_frame(&frames[i]))
+      continue;
+
+    timed_canmsg_t *msg = &msgs[received++];
+    frame_to_msg(&frames[i], &msg->msg);
+    msg->timestamp = 0;
+
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(&hdrs[i].msg_hdr); cmsg != 0; cmsg = CMSG_NXTHDR(&hdrs[i].msg_hdr, cmsg))
+      {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+        {
+        struct timespec ts;
+        memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+        msg->timestamp = ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+        }
+      }
+    }
+
+  CANTRACE_END(trace, ts_receive, received);
+  if (received == 0)
+    return e_timeout_error;
+
+  *count = received;
+  return s_ok;
+  }
+
+result_t socketcan_write(int fd, const canmsg_t *msgs, uint32_t *count)
+  {
+  if (msgs == 0 || count == 0)
+    return e_bad_parameter;
+
+  struct can_frame frames[SOCKETCAN_BATCH];
+  struct iovec iov[SOCKETCAN_BATCH];
+  struct mmsghdr hdrs[SOCKETCAN_BATCH];
+
+  uint32_t sent = 0;
+  while (sent < *count)
+    {
+    uint32_t n = *count - sent;
+    if (n > SOCKETCAN_BATCH)
+      n = SOCKETCAN_BATCH;
+
+    memset(hdrs, 0, sizeof(struct mmsghdr) * n);
+    for (uint32_t i = 0; i < n; i++)
+      {
+      msg_to_frame(&msgs[sent + i], &frames[i]);
+      iov[i].iov_base = &frames[i];
+      iov[i].iov_len = sizeof(struct can_frame);
+      hdrs[i].msg_hdr.msg_iov = &iov[i];
+      hdrs[i].msg_hdr.msg_iovlen = 1;
+      }
+
+    CANTRACE_BEGIN(trace);
+    int rc = sendmmsg(fd, hdrs, n, 0);
+    CANTRACE_END(trace, ts_transmit, rc > 0 ? rc : 0);
+    if (rc <= 0)
+      {
+      *count = sent;
+      return errno == ENOBUFS || errno == EAGAIN ? e_no_space : e_invalid_operation;
+      }
+
+    sent += (uint32_t)rc;
+    }
+
+  *count = sent;
+  return s_ok;
+  }
+
+void socketcan_close(int fd)
+  {
+  close(fd);
+  }
@@ -0,0 +1,80 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#ifndef __socketcan_h__
+#define __socketcan_h__
+
+#include "canlog.h"
+
+/*************************************************
+ * Linux SocketCAN access, used for live capture and to send
+ * generated traffic to a can or vcan interface.
+ */
+/**
+ * @brief Open a raw socket bound to a can interface
+ * @param ifname  Interface name, e.g. can0 or vcan0
+ * @param fd      Opened socket
+ * @return s_ok if opened, e_not_found if the interface does not exist
+ */
+extern result_t socketcan_open(const char *ifname, int *fd);
+/**
+ * @brief Receive a batch of messages
+ * @param fd          Socket
+ * @param msgs        Buffer to receive into, timestamped by the kernel
+ * @param count       On entry the size of the buffer, on exit the number received
+ * @param timeout_ms  Time to wait for the first message, -1 to wait forever
+ * @return s_ok if messages are returned, e_timeout_error if none arrived
+ * @remark Only standard data frames are returned, extended, remote and
+ * error frames on a shared bus are dropped.
+ */
+extern result_t socketcan_read(int fd, timed_canmsg_t *msgs, uint32_t *count, int timeout_ms);
+/**
+ * @brief Send a batch of messages
+ * @param fd      Socket
+ * @param msgs    Messages to send
+ * @param count   On entry the number of messages, on exit the number sent
+ * @return s_ok if all were sent, e_no_space if the transmit queue is full
+ */
+extern result_t socketcan_write(int fd, const canmsg_t *msgs, uint32_t *count);
+/**
+ * @brief Close a socket opened by socketcan_open
+ * @param fd  Socket
+ */
+extern void socketcan_close(int fd);
+
+#endif
@@ -0,0 +1,367 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#define _GNU_SOURCE
+#include "telemetry.h"
+
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static size_t region_size(uint16_t num_slots)
+  {
+  return sizeof(telemetry_region_t) + (num_slots * sizeof(telemetry_slot_t));
+  }
+
+static inline void cpu_relax(void)
+  {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+  }
+
+// a reader spins this many times on a slot being updated, then yields
+#define READ_SPINS 1024
+// and gives up after this many tries, the publisher died part way through
+// an update or is updating the slot faster than it can be read
+#define READ_RETRIES 100000
+
+// back off before trying a slot again, false once tried too often
+static inline bool back_off(uint32_t *tries)
+  {
+  if (++*tries >= READ_RETRIES)
+    return false;
+
+  if (*tries < READ_SPINS)
+    cpu_relax();
+  else
+    sched_yield();
+
+  return true;
+  }
+
+result_t telemetry_create(const char *name, telemetry_t *tp)
+  {
+  if (name == 0 || tp == 0 || strlen(name) >= sizeof(tp->name))
+    return e_bad_parameter;
+
+  size_t size = region_size(num_canfly_ids);
+
+  int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+  if (fd < 0)
+    return e_invalid_operation;
+
+  if (ftruncate(fd, (off_t)size) != 0)
+    {
+    close(fd);
+    return e_no_space;
+    }
+
+  void *mem = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED)
+    return e_not_enough_memory;
+
+  telemetry_region_t *region = (telemetry_region_t *)mem;
+  memset(region, 0, size);
+  region->version = TELEMETRY_VERSION;
+  region->num_slots = num_canfly_ids;
+  region->slot_size = sizeof(telemetry_slot_t);
+  region->history = TELEMETRY_HISTORY;
+  region->pid = (uint32_t)getpid();
+
+  for (uint16_t id = 0; id < NUM_CAN_IDS; id++)
+    region->slot_index[id] = -1;
+
+  for (uint16_t i = 0; i < num_canfly_ids; i++)
+    {
+    region->slots[i].id = canfly_ids[i].id;
+    region->slots[i].type = canfly_ids[i].type;
+    region->slot_index[canfly_ids[i].id] = (int16_t)i;
+    }
+
+  // readers check the magic after the layout is complete
+  __atomic_store_n(&region->magic, TELEMETRY_MAGIC, __ATOMIC_RELEASE);
+
+  tp->region = region;
+  tp->size = size;
+  tp->publisher = true;
+  strcpy(tp->name, name);
+  return s_ok;
+  }
+
+static void publish_value(telemetry_region_t *region, uint16_t id, uint64_t timestamp, const variant_t *v)
+  {
+  int16_t index = region->slot_index[id];
+  if (index < 0)
+    return;
+
+  telemetry_slot_t *slot = &region->slots[index];
+  uint32_t seq = slot->seq;
+
+  __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  telemetry_sample_t *sample = &slot->history[slot->updates & (TELEMETRY_HISTORY - 1)];
+  sample->timestamp = timestamp;
+  copy_variant(v, &sample->value);
+  slot->latest = *sample;
+  slot->updates++;
+
+  __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+  }
+
+result_t telemetry_publish(telemetry_t *tp, const timed_canmsg_t *msgs, uint32_t count)
+  {
+  if (tp == 0 || msgs == 0 || !tp->publisher)
+    return e_bad_parameter;
+
+  telemetry_region_t *region = tp->region;
+  for (uint32_t i = 0; i < count; i++)
+    {
+    const canmsg_t *msg = &msgs[i].msg;
+    variant_t v;
+
+    if (get_can_len(msg) > 0 && msg->data[0] == CANFLY_PACKED_UINT16)
+      {
+      canmsg_t expanded[PACKED_UINT16_MAX];
+      uint16_t num_expanded;
+      if (failed(expand_packed_msg(msg, expanded, &num_expanded)))
+        continue;
+
+      for (uint16_t j = 0; j < num_expanded; j++)
+        if (succeeded(msg_to_variant(&expanded[j], &v)))
+          publish_value(region, get_can_id(&expanded[j]), msgs[i].timestamp, &v);
+      }
+    else if (succeeded(msg_to_variant(msg, &v)))
+      publish_value(region, get_can_id(msg), msgs[i].timestamp, &v);
+    }
+
+  // the count is stored before waiters is loaded, and a reader stores
+  // waiters before the futex loads the count.  Release and acquire do
+  // not order a store before a later load, so a wakeup could be lost
+  // without sequential consistency on both sides
+  __atomic_add_fetch(&region->updates, 1, __ATOMIC_SEQ_CST);
+
+  // only make a system call when a reader is blocked
+  if (__atomic_load_n(&region->waiters, __ATOMIC_SEQ_CST) != 0)
+    syscall(SYS_futex, &region->updates, FUTEX_WAKE, INT32_MAX, 0, 0, 0);
+
+  return s_ok;
+  }
+
+result_t telemetry_open(const char *name, telemetry_t *tp)
+  {
+  if (name == 0 || tp == 0 || strlen(name) >= sizeof(tp->name))
+    return e_bad_parameter;
+
+  // mapped writable so a reader can register as a waiter
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0)
+    return e_not_found;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(telemetry_region_t))
+    {
+    close(fd);
+    return e_corrupt;
+    }
+
+  size_t size = (size_t)st.st_size;
+  void *mem = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED)
+    return e_not_enough_memory;
+
+  telemetry_region_t *region = (telemetry_region_t *)mem;
+  if (__atomic_load_n(&region->magic, __ATOMIC_ACQUIRE) != TELEMETRY_MAGIC ||
+      region->version != TELEMETRY_VERSION ||
+      region->slot_size != sizeof(telemetry_slot_t) ||
+      region->history != TELEMETRY_HISTORY ||
+      region_size(region->num_slots) > size)
+    {
+    munmap(mem, size);
+    return e_corrupt;
+    }
+
+  tp->region = region;
+  tp->size = size;
+  tp->publisher = false;
+  strcpy(tp->name, name);
+  return s_ok;
+  }
+
+result_t telemetry_close(telemetry_t *tp)
+  {
+  if (tp == 0 || tp->region == 0)
+    return e_bad_parameter;
+
+  munmap(tp->region, tp->size);
+  tp->region = 0;
+
+  if (tp->publisher)
+    shm_unlink(tp->name);
+
+  return s_ok;
+  }
+
+static const telemetry_slot_t *find_slot(const telemetry_t *tp, uint16_t id)
+  {
+  if (id > ID_MASK)
+    return 0;
+
+  int16_t index = tp->region->slot_index[id];
+  if (index < 0 || index >= tp->region->num_slots)
+    return 0;
+
+  return &tp->region->slots[index];
+  }
+
+result_t telemetry_read(const telemetry_t *tp, uint16_t id, telemetry_sample_t *sample, uint32_t *updates)
+  {
+  if (tp == 0 || tp->region == 0 || sample == 0)
+    return e_bad_parameter;
+
+  const telemetry_slot_t *slot = find_slot(tp, id);
+  if (slot == 0)
+    return e_not_found;
+
+  uint32_t count;
+  uint32_t tries = 0;
+  for (;;)
+    {
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if ((seq & 1) == 0)
+      {
+      *sample = slot->latest;
+      count = slot->updates;
+
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+        break;
+      }
+
+    if (!back_off(&tries))
+      return e_timeout_error;
+    }
+
+  if (updates != 0)
+    *updates = count;
+
+  return count == 0 ? e_no_more_information : s_ok;
+  }
+
+result_t telemetry_history(const telemetry_t *tp, uint16_t id, telemetry_sample_t *samples, uint16_t *count)
+  {
+  if (tp == 0 || tp->region == 0 || samples == 0 || count == 0)
+    return e_bad_parameter;
+
+  const telemetry_slot_t *slot = find_slot(tp, id);
+  if (slot == 0)
+    return e_not_found;
+
+  telemetry_sample_t history[TELEMETRY_HISTORY];
+  uint32_t updates;
+  uint32_t tries = 0;
+  for (;;)
+    {
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if ((seq & 1) == 0)
+      {
+      updates = slot->updates;
+      memcpy(history, slot->history, sizeof(history));
+
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+        break;
+      }
+
+    if (!back_off(&tries))
+      return e_timeout_error;
+    }
+
+  uint32_t available = updates < TELEMETRY_HISTORY ? updates : TELEMETRY_HISTORY;
+  uint16_t n = *count < available ? *count : (uint16_t)available;
+
+  // return the most recent n samples, oldest first
+  for (uint16_t i = 0; i < n; i++)
+    samples[i] = history[(updates - n + i) & (TELEMETRY_HISTORY - 1)];
+
+  *count = n;
+  return s_ok;
+  }
+
+uint32_t telemetry_updates(const telemetry_t *tp)
+  {
+  return __atomic_load_n(&tp->region->updates, __ATOMIC_ACQUIRE);
+  }
+
+result_t telemetry_wait(telemetry_t *tp, uint32_t updates, uint32_t timeout_ms)
+  {
+  if (tp == 0 || tp->region == 0)
+    return e_bad_parameter;
+
+  telemetry_region_t *region = tp->region;
+  if (__atomic_load_n(&region->updates, __ATOMIC_ACQUIRE) != updates)
+    return s_ok;
+
+  // pairs with the publisher, see telemetry_publish
+  __atomic_add_fetch(&region->waiters, 1, __ATOMIC_SEQ_CST);
+
+  struct timespec timeout;
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_nsec = (timeout_ms % 1000) * 1000000;
+
+  // the futex returns at once if the count has already changed
+  long rc = syscall(SYS_futex, &region->updates, FUTEX_WAIT, updates, &timeout, 0, 0);
+  int error = errno;
+
+  __atomic_sub_fetch(&region->waiters, 1, __ATOMIC_ACQ_REL);
+
+  if (__atomic_load_n(&region->updates, __ATOMIC_ACQUIRE) != updates)
+    return s_ok;
+
+  return rc != 0 && error == ETIMEDOUT ? e_timeout_error : e_operation_cancelled;
+  }
@@ -0,0 +1,168 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#ifndef __telemetry_h__
+#define __telemetry_h__
+
+#include "canlog.h"
+#include <stddef.h>
+
+/*************************************************
+ * Shared memory publication of decoded parameters.
+ *
+ * One process decodes the bus and publishes the latest value and a
+ * history ring for every ID in CanFlyID.def to a POSIX shared memory
+ * region.  Any number of reader processes map the region read-only.
+ *
+ * Each slot is protected by a sequence lock: the publisher makes the
+ * sequence odd while it updates the slot, a reader copies the slot and
+ * retries if the sequence was odd or changed.  Readers never block the
+ * publisher and reading a value is not a system call.  A reader that
+ * cannot get a consistent copy after many tries, because the publisher
+ * died part way through an update, gives up with e_timeout_error.
+ *
+ * The region header holds a count of updates.  A reader polls it, or
+ * waits on it with telemetry_wait, the publisher only wakes readers
+ * when at least one is waiting.
+ */
+#define TELEMETRY_MAGIC 0x4d544643    // 'CFTM'
+#define TELEMETRY_VERSION 1
+#define TELEMETRY_HISTORY 64          // samples kept for each ID, power of 2
+
+typedef struct _telemetry_sample_t {
+  uint64_t timestamp;
+  variant_t value;
+  } telemetry_sample_t;
+
+typedef struct _telemetry_slot_t {
+  uint32_t seq;                 // odd while the slot is updated
+  uint16_t id;
+  uint16_t type;                // declared CANFLY_ type
+  uint32_t updates;             // number of values published
+  uint32_t pad;
+  telemetry_sample_t latest;
+  telemetry_sample_t history[TELEMETRY_HISTORY];
+  } telemetry_slot_t;
+
+typedef struct _telemetry_region_t {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t num_slots;
+  uint32_t slot_size;
+  uint32_t history;
+  uint32_t pid;                 // publishing process
+  uint32_t updates;             // incremented after each batch
+  uint32_t waiters;             // readers blocked in telemetry_wait
+  uint32_t pad;
+  int16_t slot_index[NUM_CAN_IDS];  // slot for each ID, -1 if not published
+  telemetry_slot_t slots[];
+  } telemetry_region_t;
+
+typedef struct _telemetry_t {
+  telemetry_region_t *region;
+  size_t size;
+  bool publisher;
+  char name[64];
+  } telemetry_t;
+
+/**
+ * @brief Create a region and publish to it
+ * @param name  POSIX shared memory name, e.g. /canfly-telemetry
+ * @param tp    Publisher
+ * @return s_ok if created
+ */
+extern result_t telemetry_create(const char *name, telemetry_t *tp);
+/**
+ * @brief Decode and publish a batch of messages
+ * @param tp    Publisher
+ * @param msgs  Messages, packed messages are expanded
+ * @param count Number of messages
+ * @return s_ok if published, messages that do not decode are skipped
+ */
+extern result_t telemetry_publish(telemetry_t *tp, const timed_canmsg_t *msgs, uint32_t count);
+/**
+ * @brief Open a published region for reading
+ * @param name  POSIX shared memory name
+ * @param tp    Reader
+ * @return s_ok if opened, e_not_found if not published, e_corrupt if
+ * the layout version does not match
+ */
+extern result_t telemetry_open(const char *name, telemetry_t *tp);
+/**
+ * @brief Unmap a region, the publisher also removes it
+ * @param tp    Publisher or reader
+ * @return s_ok if closed
+ */
+extern result_t telemetry_close(telemetry_t *tp);
+/**
+ * @brief Read the latest value of an ID
+ * @param tp        Reader
+ * @param id        CanFly ID
+ * @param sample    Latest value and the time it was received
+ * @param updates   Optional, number of values published for the ID
+ * @return s_ok if read, e_not_found if the ID is not published,
+ * e_no_more_information if no value has been received, e_timeout_error
+ * if the slot is never consistent
+ */
+extern result_t telemetry_read(const telemetry_t *tp, uint16_t id, telemetry_sample_t *sample, uint32_t *updates);
+/**
+ * @brief Read the recent history of an ID
+ * @param tp        Reader
+ * @param id        CanFly ID
+ * @param samples   Buffer for the samples, oldest first
+ * @param count     On entry the size of the buffer, on exit the number read
+ * @return s_ok if read, e_not_found if the ID is not published,
+ * e_timeout_error if the slot is never consistent
+ */
+extern result_t telemetry_history(const telemetry_t *tp, uint16_t id, telemetry_sample_t *samples, uint16_t *count);
+/**
+ * @brief Return the number of batches published
+ * @param tp    Reader
+ * @return update count, compare with a previous value to detect changes
+ */
+extern uint32_t telemetry_updates(const telemetry_t *tp);
+/**
+ * @brief Wait for the publisher to publish
+ * @param tp          Reader
+ * @param updates     Update count the reader has seen
+ * @param timeout_ms  Time to wait
+ * @return s_ok if the count has changed, e_timeout_error if not
+ */
+extern result_t telemetry_wait(telemetry_t *tp, uint32_t updates, uint32_t timeout_ms);
+
+#endif
@@ -0,0 +1,286 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+/*
+ * test_canawait
+ *
+ * Run tasks through waits on a predicate, the next value, all of a set
+ * of ids, a timeout and a cancel, and check each resumes with the right
+ * messages at the right time.
+ */
+#include "../canawait.h"
+#include "test.h"
+
+#include <string.h>
+
+typedef struct _sampler_t {
+  cotask_t task;
+  variant_t valid;
+  uint32_t timeout;
+  uint16_t samples;
+  uint16_t rpm[10];
+  uint64_t times[10];
+  int state;                    // 1 when valid, 2 when sampled, -1 on timeout
+  } sampler_t;
+
+typedef struct _gather_t {
+  cotask_t task;
+  const uint16_t *ids;
+  uint16_t num_ids;
+  result_t result;
+  uint8_t received;
+  timed_canmsg_t msgs[CANAWAIT_MAX_IDS];
+  int state;                    // 1 after the wait, 2 after the sleep
+  } gather_t;
+
+typedef struct _counter_t {
+  cotask_t task;
+  uint16_t id;
+  uint32_t count;
+  uint16_t last;
+  } counter_t;
+
+// wait for the EDU to be valid, then take 10 engine rpm samples
+static costate sample_rpm(cotask_t *task)
+  {
+  sampler_t *sampler = (sampler_t *)task->arg;
+  CO_BEGIN(task);
+  CO_WHEN(task, id_edu_valid, canawait_equals, &sampler->valid, sampler->timeout);
+  if (failed(task->result))
+    {
+    sampler->state = -1;
+    return co_done;
+    }
+
+  sampler->state = 1;
+  for (sampler->samples = 0; sampler->samples < 10; sampler->samples++)
+    {
+    CO_NEXT(task, id_engine_rpm, CANAWAIT_FOREVER);
+    get_param_uint16(&task->msgs[0].msg, &sampler->rpm[sampler->samples]);
+    sampler->times[sampler->samples] = task->msgs[0].timestamp;
+    }
+
+  sampler->state = 2;
+  CO_END(task);
+  }
+
+static costate gather(cotask_t *task)
+  {
+  gather_t *g = (gather_t *)task->arg;
+  CO_BEGIN(task);
+  CO_ALL(task, g->ids, g->num_ids, 100000);
+  g->result = task->result;
+  g->received = task->received;
+  memcpy(g->msgs, task->msgs, sizeof(g->msgs));
+  g->state = 1;
+  CO_SLEEP(task, 1000);
+  g->state = 2;
+  CO_END(task);
+  }
+
+static costate count_values(cotask_t *task)
+  {
+  counter_t *counter = (counter_t *)task->arg;
+  CO_BEGIN(task);
+  for (;;)
+    {
+    CO_NEXT(task, counter->id, CANAWAIT_FOREVER);
+    get_param_uint16(&task->msgs[0].msg, &counter->last);
+    counter->count++;
+    }
+  CO_END(task);
+  }
+
+static void make_msg(timed_canmsg_t *msg, uint64_t timestamp, uint16_t id, uint16_t value)
+  {
+  msg->timestamp = timestamp;
+  create_can_msg_uint16(&msg->msg, id, value);
+  }
+
+static void test_predicate_and_next(canawait_t *loop)
+  {
+  sampler_t sampler;
+  memset(&sampler, 0, sizeof(sampler));
+  create_variant_uint16(1, &sampler.valid);
+  sampler.timeout = 500000;
+  CHECK(succeeded(canawait_start(loop, &sampler.task, sample_rpm, &sampler, 0)));
+  CHECK(canawait_running(loop) == 1);
+
+  timed_canmsg_t msgs[16];
+  uint16_t n = 0;
+  make_msg(&msgs[n++], 10, id_engine_rpm, 100);     // before the EDU is valid
+  make_msg(&msgs[n++], 20, id_edu_valid, 0);        // predicate is false
+  CHECK(succeeded(canawait_dispatch(loop, msgs, n, 1000)));
+  CHECK(sampler.state == 0);
+
+  // the rest of the batch reaches the task once it is resumed
+  n = 0;
+  make_msg(&msgs[n++], 30, id_edu_valid, 1);
+  for (uint16_t i = 0; i < 12; i++)
+    make_msg(&msgs[n++], 40 + i, id_engine_rpm, 2000 + i);
+
+  CHECK(succeeded(canawait_dispatch(loop, msgs, n, 2000)));
+  CHECK(sampler.state == 2);
+  CHECK(sampler.samples == 10);
+  for (uint16_t i = 0; i < 10; i++)
+    CHECK(sampler.rpm[i] == 2000 + i && sampler.times[i] == 40 + i);
+
+  CHECK(canawait_running(loop) == 0);
+  }
+
+static void test_all(canawait_t *loop)
+  {
+  static const uint16_t ids[3] = { id_engine_rpm, id_edu_valid, id_fuel_pressure };
+
+  gather_t complete;
+  memset(&complete, 0, sizeof(complete));
+  complete.ids = ids;
+  complete.num_ids = 3;
+  gather_t partial = complete;
+
+  CHECK(succeeded(canawait_start(loop, &complete.task, gather, &complete, 10000)));
+
+  timed_canmsg_t msgs[3];
+  make_msg(&msgs[0], 10100, id_fuel_pressure, 7);
+  make_msg(&msgs[1], 10200, id_engine_rpm, 2400);
+  CHECK(succeeded(canawait_dispatch(loop, msgs, 2, 10300)));
+  CHECK(complete.state == 0);
+
+  // the second task waits from now, so misses the fuel pressure
+  CHECK(succeeded(canawait_start(loop, &partial.task, gather, &partial, 10300)));
+
+  make_msg(&msgs[0], 10400, id_edu_valid, 1);
+  make_msg(&msgs[1], 10500, id_engine_rpm, 2500);
+  CHECK(succeeded(canawait_dispatch(loop, msgs, 2, 10600)));
+
+  // messages are in the order of the ids given
+  uint16_t value;
+  CHECK(complete.state == 1);
+  CHECK(complete.result == s_ok && complete.received == 7);
+  CHECK(succeeded(get_param_uint16(&complete.msgs[0].msg, &value)) && value == 2400);
+  CHECK(get_can_id(&complete.msgs[1].msg) == id_edu_valid);
+  CHECK(succeeded(get_param_uint16(&complete.msgs[2].msg, &value)) && value == 7);
+
+  // the partial task times out 100ms after it started
+  uint64_t next;
+  CHECK(succeeded(canawait_expire(loop, 110299, &next)));
+  CHECK(partial.state == 0);
+  CHECK(next == 110300);
+  CHECK(succeeded(canawait_expire(loop, 110300, &next)));
+  CHECK(partial.state == 1);
+  CHECK(partial.result == e_timeout_error && partial.received == 3);
+  CHECK(succeeded(get_param_uint16(&partial.msgs[0].msg, &value)) && value == 2500);
+
+  // both sleep for 1ms after their wait
+  CHECK(succeeded(canawait_expire(loop, 111300, &next)));
+  CHECK(complete.state == 2 && partial.state == 2);
+  CHECK(next == UINT64_MAX);
+  CHECK(canawait_running(loop) == 0);
+  }
+
+static void test_timeout(canawait_t *loop)
+  {
+  sampler_t sampler;
+  memset(&sampler, 0, sizeof(sampler));
+  create_variant_uint16(1, &sampler.valid);
+  sampler.timeout = 500000;
+
+  // the loop has been idle since the last test, the timeout runs from the start
+  CHECK(succeeded(canawait_start(loop, &sampler.task, sample_rpm, &sampler, 1000000)));
+
+  // a message that does not match does not end the wait
+  timed_canmsg_t msg;
+  make_msg(&msg, 1200000, id_edu_valid, 0);
+  CHECK(succeeded(canawait_dispatch(loop, &msg, 1, 1200000)));
+  CHECK(succeeded(canawait_expire(loop, 1499999, 0)));
+  CHECK(sampler.state == 0);
+
+  CHECK(succeeded(canawait_expire(loop, 1500000, 0)));
+  CHECK(sampler.state == -1);
+  CHECK(canawait_running(loop) == 0);
+  }
+
+static void test_cancel(canawait_t *loop)
+  {
+  counter_t rpm = { .id = id_engine_rpm };
+  counter_t cht = { .id = id_cylinder_head_temperature3 };
+  CHECK(succeeded(canawait_start(loop, &rpm.task, count_values, &rpm, 2000000)));
+  CHECK(succeeded(canawait_start(loop, &cht.task, count_values, &cht, 2000000)));
+  CHECK(canawait_running(loop) == 2);
+
+  // a bank of temperatures sent packed reaches the task of each
+  uint16_t temperatures[6] = { 150, 151, 152, 153, 154, 155 };
+  canmsg_t packed[2];
+  uint16_t num_packed = 2;
+  CHECK(succeeded(create_can_msgs_packed_uint16(packed, &num_packed, id_cylinder_head_temperature1, 1, temperatures, 6)));
+
+  timed_canmsg_t msgs[4];
+  make_msg(&msgs[0], 1, id_engine_rpm, 2300);
+  msgs[1].timestamp = 2;
+  msgs[1].msg = packed[0];
+  msgs[2].timestamp = 2;
+  msgs[2].msg = packed[1];
+  CHECK(succeeded(canawait_dispatch(loop, msgs, 3, 2000000)));
+  CHECK(rpm.count == 1 && rpm.last == 2300);
+  CHECK(cht.count == 1 && cht.last == 152);
+
+  CHECK(canawait_cancel(&rpm.task) == s_ok);
+  CHECK(canawait_cancel(&rpm.task) == s_false);
+  CHECK(canawait_running(loop) == 1);
+
+  make_msg(&msgs[0], 3, id_engine_rpm, 2400);
+  CHECK(succeeded(canawait_dispatch(loop, msgs, 1, 2000001)));
+  CHECK(rpm.count == 1);
+
+  CHECK(canawait_cancel(&cht.task) == s_ok);
+  CHECK(canawait_running(loop) == 0);
+  }
+
+int main(void)
+  {
+  canawait_t *loop;
+  CHECK(succeeded(canawait_create(16, &loop)));
+
+  test_predicate_and_next(loop);
+  test_all(loop);
+  test_timeout(loop);
+  test_cancel(loop);
+
+  CHECK(succeeded(canawait_close(loop)));
+  return test_failures;
+  }
@@ -0,0 +1,233 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+/*
+ * test_cancoalesce
+ *
+ * Check a slow consumer sees the latest value of every ID, never an old
+ * or torn one, and every value of the never coalesced IDs in order.
+ */
+#include "../cancoalesce.h"
+#include "test.h"
+
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define NUM_BATCHES 20000
+#define BATCH 64
+
+typedef struct _run_t {
+  cancoalesce_t *queue;
+  bool done;
+  uint32_t pushed[NUM_CAN_IDS];
+  } run_t;
+
+static uint32_t received[NUM_CAN_IDS];
+static uint64_t stale;
+static uint64_t torn;
+static uint64_t gaps;
+
+static bool is_never(uint16_t id)
+  {
+  return (id >= id_low_oil_pressure_alarm && id <= id_fuel_flow_rate_alarm) ||
+         (id >= id_status_node_0 && id <= id_status_node_15);
+  }
+
+// the timestamp is derived from the value so a torn read shows
+static void make_value(timed_canmsg_t *msg, uint16_t id, uint32_t value)
+  {
+  create_can_msg_uint32(&msg->msg, id, value);
+  msg->timestamp = ((uint64_t)value << 11) | id;
+  }
+
+static void *producer(void *arg)
+  {
+  run_t *run = (run_t *)arg;
+  timed_canmsg_t msgs[BATCH];
+  uint32_t seed = 7;
+
+  for (uint32_t batch = 0; batch < NUM_BATCHES; batch++)
+    {
+    for (uint16_t i = 0; i < BATCH; i++)
+      {
+      seed = seed * 1103515245 + 12345;
+      uint32_t r = seed >> 8;
+      uint16_t id;
+      if (r % 100 < 2)
+        id = id_low_oil_pressure_alarm + (r >> 8) % (id_fuel_flow_rate_alarm - id_low_oil_pressure_alarm + 1);
+      else if (r % 100 < 4)
+        id = id_status_node_0 + (r >> 8) % 16;
+      else
+        id = 320 + (r >> 8) % 64;
+
+      make_value(&msgs[i], id, ++run->pushed[id]);
+      }
+
+    cancoalesce_push(run->queue, msgs, BATCH);
+    if (batch % 1000 == 0)
+      usleep(100);
+    }
+
+  __atomic_store_n(&run->done, true, __ATOMIC_RELEASE);
+  return 0;
+  }
+
+static void take(const timed_canmsg_t *msgs, uint32_t count, bool overflowed)
+  {
+  for (uint32_t i = 0; i < count; i++)
+    {
+    uint16_t id = get_can_id(&msgs[i].msg);
+    uint32_t value = 0;
+    get_param_uint32(&msgs[i].msg, &value);
+
+    if (msgs[i].timestamp != (((uint64_t)value << 11) | id))
+      torn++;
+
+    if (value <= received[id])
+      stale++;
+    else if (is_never(id) && !overflowed && value != received[id] + 1)
+      gaps++;
+
+    received[id] = value;
+    }
+  }
+
+static void test_slow_consumer(uint32_t events)
+  {
+  memset(received, 0, sizeof(received));
+  stale = torn = gaps = 0;
+
+  cancoalesce_options_t options;
+  memset(&options, 0, sizeof(options));
+  options.events = events;
+  cancoalesce_never(&options, id_low_oil_pressure_alarm, id_fuel_flow_rate_alarm);
+  cancoalesce_never(&options, id_status_node_0, id_status_node_15);
+
+  static run_t run;
+  memset(&run, 0, sizeof(run));
+  CHECK(succeeded(cancoalesce_create(&options, &run.queue)));
+
+  pthread_t thread;
+  CHECK(pthread_create(&thread, 0, producer, &run) == 0);
+
+  // take a few values at a time, slower than they are pushed
+  timed_canmsg_t msgs[100];
+  uint32_t count;
+  while (!__atomic_load_n(&run.done, __ATOMIC_ACQUIRE))
+    {
+    count = 100;
+    if (succeeded(cancoalesce_drain(run.queue, msgs, &count)))
+      take(msgs, count, events < 1024);
+
+    usleep(200);
+    }
+
+  pthread_join(thread, 0);
+  count = 100;
+  while (succeeded(cancoalesce_drain(run.queue, msgs, &count)))
+    {
+    take(msgs, count, events < 1024);
+    count = 100;
+    }
+
+  cancoalesce_stats_t stats;
+  CHECK(succeeded(cancoalesce_stats(run.queue, &stats)));
+  CHECK(stats.values == (uint64_t)NUM_BATCHES * BATCH);
+  CHECK(stats.coalesced > 0);
+  if (events < 1024)
+    CHECK(stats.overflowed > 0);
+  else
+    CHECK(stats.overflowed == 0);
+
+  CHECK(torn == 0);
+  CHECK(stale == 0);
+  CHECK(gaps == 0);
+  // the latest value of every ID arrives
+  CHECK(memcmp(run.pushed, received, sizeof(received)) == 0);
+
+  CHECK(succeeded(cancoalesce_close(run.queue)));
+  }
+
+static void test_coalesce(void)
+  {
+  cancoalesce_options_t options;
+  memset(&options, 0, sizeof(options));
+  options.events = 16;
+  cancoalesce_never(&options, id_status_node_0, id_status_node_0);
+
+  cancoalesce_t *queue;
+  CHECK(succeeded(cancoalesce_create(&options, &queue)));
+
+  timed_canmsg_t msgs[6];
+  make_value(&msgs[0], 320, 1);
+  make_value(&msgs[1], id_status_node_0, 1);
+  make_value(&msgs[2], 320, 2);
+  make_value(&msgs[3], id_status_node_0, 2);
+  make_value(&msgs[4], 321, 1);
+  make_value(&msgs[5], 320, 3);
+  CHECK(succeeded(cancoalesce_push(queue, msgs, 6)));
+
+  // queued values come first, then the latest of each changed ID
+  timed_canmsg_t out[8];
+  uint32_t count = 8;
+  CHECK(succeeded(cancoalesce_drain(queue, out, &count)));
+  CHECK(count == 4);
+  uint32_t value = 0;
+  CHECK(get_can_id(&out[0].msg) == id_status_node_0 && succeeded(get_param_uint32(&out[0].msg, &value)) && value == 1);
+  CHECK(get_can_id(&out[1].msg) == id_status_node_0 && succeeded(get_param_uint32(&out[1].msg, &value)) && value == 2);
+  CHECK(get_can_id(&out[2].msg) == 320 && succeeded(get_param_uint32(&out[2].msg, &value)) && value == 3);
+  CHECK(get_can_id(&out[3].msg) == 321);
+
+  count = 8;
+  CHECK(cancoalesce_drain(queue, out, &count) == e_no_more_information);
+
+  cancoalesce_stats_t stats;
+  CHECK(succeeded(cancoalesce_stats(queue, &stats)));
+  CHECK(stats.values == 6 && stats.coalesced == 2 && stats.events == 2 && stats.drained == 4);
+  CHECK(succeeded(cancoalesce_close(queue)));
+  }
+
+int main(void)
+  {
+  test_coalesce();
+  test_slow_consumer(65536);
+  test_slow_consumer(64);
+
+  return test_failures;
+  }
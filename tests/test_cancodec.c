@@ -0,0 +1,245 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+/*
+ * test_cancodec
+ *
+ * Encode messages that defeat every prediction of the block codec and
+ * check they decode bit for bit, from the padded copy of the tail of a
+ * block as well as the body, and that a damaged block is refused rather
+ * than decoded.
+ */
+#include "../cancodec.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NUM_MSGS 5000
+#define PERIOD 10000
+#define BLOCK_SIZE 1000         // NUM_MSGS is not a multiple of it
+
+static cancodec_t codec;
+static timed_canmsg_t msgs[NUM_MSGS];
+static timed_canmsg_t decoded[NUM_MSGS];
+static uint8_t block[CANCODEC_MAX_BLOCK(NUM_MSGS)];
+
+static uint64_t seed = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t next_random(void)
+  {
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return seed;
+  }
+
+// IDs from CanFlyID.def and some that are not, up to the largest ID
+static const uint16_t ids[] = { 1, 2, 3, 4, 5, 100, 2000, 2046, ID_MASK };
+#define NUM_TEST_IDS (sizeof(ids) / sizeof(ids[0]))
+
+static void make_msgs(void)
+  {
+  // the padding of each message is compared too
+  memset(msgs, 0, sizeof(msgs));
+
+  uint64_t now = 1000000;
+  for (uint32_t i = 0; i < NUM_MSGS; i++)
+    {
+    uint64_t r = next_random();
+    timed_canmsg_t *msg = &msgs[i];
+    uint16_t id = ids[r % NUM_TEST_IDS];
+
+    switch ((r >> 8) % 16)
+      {
+      case 0 :
+        now -= (r >> 16) % 100000;      // backwards
+        break;
+      case 1 :
+        now += (1ULL << 32) + ((r >> 16) % 1000);
+        break;
+      case 2 :
+        now -= (1ULL << 33);            // backwards by more than 2^32
+        break;
+      case 3 :
+        now = r;                        // anywhere at all
+        break;
+      default :
+        now += PERIOD + ((r >> 16) % 64) - 32;
+        break;
+      }
+
+    msg->timestamp = now;
+
+    // any length, and the bits above the ID set now and then
+    uint16_t length = (r >> 24) % 9;
+    msg->msg.flags = id | (length << 12);
+    if (((r >> 28) % 8) == 0)
+      msg->msg.flags |= 0x0800;
+
+    uint64_t data = next_random();
+    if (i > 0 && ((r >> 32) % 4) == 0)
+      memcpy(msg->msg.data, msgs[i - 1].msg.data, 8);
+    else
+      memcpy(msg->msg.data, &data, 8);
+
+    // all 8 bytes are sent whatever the length
+    if (((r >> 36) % 8) == 0)
+      memset(msg->msg.data, 0xFF, 8);
+    }
+  }
+
+static bool round_trip(const timed_canmsg_t *in, uint32_t count)
+  {
+  uint32_t length;
+  if (failed(cancodec_encode(&codec, in, count, block, CANCODEC_MAX_BLOCK(count), &length)))
+    return false;
+
+  memset(decoded, 0, sizeof(decoded));
+  uint32_t decoded_count = count;
+  return succeeded(cancodec_decode(&codec, block, length, decoded, &decoded_count)) &&
+         decoded_count == count &&
+         memcmp(in, decoded, sizeof(timed_canmsg_t) * count) == 0;
+  }
+
+static void test_round_trip(void)
+  {
+  make_msgs();
+  CHECK(round_trip(msgs, NUM_MSGS));
+
+  // short blocks are decoded entirely from the padded copy
+  for (uint32_t count = 0; count <= 64; count++)
+    CHECK(round_trip(msgs + 100, count));
+
+  // the largest message alone, an ID not in CanFlyID.def with the time
+  // sent whole and every byte changed
+  timed_canmsg_t largest[2];
+  memset(largest, 0, sizeof(largest));
+  largest[0].timestamp = 1;
+  largest[0].msg.flags = 2000 | (8 << 12);
+  largest[1].timestamp = UINT64_MAX;
+  largest[1].msg.flags = 2001 | (8 << 12) | 0x0800;
+  memset(largest[1].msg.data, 0xA5, 8);
+  memset(largest[0].msg.data, 0x5A, 8);
+  CHECK(round_trip(largest, 1));
+  CHECK(round_trip(largest, 2));
+  CHECK(round_trip(largest + 1, 1));
+
+  // too small a buffer is refused
+  uint32_t length;
+  CHECK(cancodec_encode(&codec, msgs, NUM_MSGS, block, CANCODEC_MAX_BLOCK(10), &length) == e_buffer_too_small);
+
+  // as is too few messages to decode into
+  CHECK(succeeded(cancodec_encode(&codec, msgs, 10, block, sizeof(block), &length)));
+  uint32_t count = 9;
+  CHECK(cancodec_decode(&codec, block, length, decoded, &count) == e_buffer_too_small);
+  }
+
+static void test_corrupt_block(void)
+  {
+  uint32_t length;
+  uint32_t count = NUM_MSGS;
+  CHECK(succeeded(cancodec_encode(&codec, msgs, 100, block, sizeof(block), &length)));
+
+  // a block cut short
+  CHECK(cancodec_decode(&codec, block, length - 1, decoded, &count) == e_corrupt);
+  CHECK(cancodec_decode(&codec, block, CANCODEC_BLOCK_HEADER_SIZE - 1, decoded, &count) == e_corrupt);
+
+  // the reserved bit of the first tag
+  block[CANCODEC_BLOCK_HEADER_SIZE] |= 0x80;
+  CHECK(cancodec_decode(&codec, block, length, decoded, &count) == e_corrupt);
+  }
+
+static void test_capture(void)
+  {
+  char capture[64];
+  char packed[64];
+  char expanded[64];
+  snprintf(capture, sizeof(capture), "/tmp/test_cancodec.%d.log", (int)getpid());
+  snprintf(packed, sizeof(packed), "/tmp/test_cancodec.%d.cfp", (int)getpid());
+  snprintf(expanded, sizeof(expanded), "/tmp/test_cancodec.%d.out", (int)getpid());
+
+  canlog_t *log;
+  CHECK(succeeded(canlog_create(capture, &log)));
+  CHECK(succeeded(canlog_write(log, msgs, NUM_MSGS)));
+  CHECK(succeeded(canlog_close(log)));
+
+  // the last block holds fewer messages than the rest
+  CHECK(succeeded(cancodec_compress(capture, packed, BLOCK_SIZE - 1)));
+  CHECK(succeeded(cancodec_expand(packed, expanded)));
+
+  CHECK(succeeded(canlog_open(expanded, &log)));
+  uint64_t records = 0;
+  CHECK(succeeded(canlog_count(log, &records)) && records == NUM_MSGS);
+
+  memset(decoded, 0, sizeof(decoded));
+  uint32_t count = NUM_MSGS;
+  CHECK(succeeded(canlog_read(log, decoded, &count)) && count == NUM_MSGS);
+  CHECK(memcmp(msgs, decoded, sizeof(msgs)) == 0);
+  CHECK(succeeded(canlog_close(log)));
+
+  // one byte flipped in the body of the second block
+  FILE *fp = fopen(packed, "r+b");
+  uint8_t prefix[8];
+  uint8_t byte = 0;
+  CHECK(fp != 0 &&
+        fseek(fp, CANCODEC_HEADER_SIZE, SEEK_SET) == 0 &&
+        fread(prefix, sizeof(prefix), 1, fp) == 1);
+
+  long second = CANCODEC_HEADER_SIZE + sizeof(prefix) + (prefix[0] | (prefix[1] << 8) | (prefix[2] << 16) | ((long)prefix[3] << 24));
+  long offset = second + sizeof(prefix) + 40;
+  CHECK(fseek(fp, offset, SEEK_SET) == 0 && fread(&byte, 1, 1, fp) == 1);
+  byte ^= 0x10;
+  CHECK(fseek(fp, offset, SEEK_SET) == 0 && fwrite(&byte, 1, 1, fp) == 1);
+  fclose(fp);
+
+  CHECK(cancodec_expand(packed, expanded) == e_corrupt);
+
+  unlink(capture);
+  unlink(packed);
+  unlink(expanded);
+  }
+
+int main(void)
+  {
+  test_round_trip();
+  test_corrupt_block();
+  test_capture();
+  return test_failures;
+  }
@@ -0,0 +1,289 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+/*
+ * test_canmerge
+ *
+ * Feed the same traffic on two buses, each with its own jitter and
+ * losses, and check the merge delivers every frame that reached either
+ * bus exactly once, in time order, and counts the duplicates and the
+ * frames each bus missed.
+ */
+#include "../canmerge.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define NUM_IDS 64
+#define FIRST_ID 320
+#define PERIOD 10000            // each ID every 10ms
+#define NUM_ROUNDS 2000
+#define NUM_FRAMES (NUM_IDS * NUM_ROUNDS)
+#define JITTER 50
+#define WINDOW 1000
+
+static timed_canmsg_t buses[2][NUM_FRAMES];
+static uint32_t bus_count[2];
+static timed_canmsg_t merged[NUM_FRAMES * 2];
+static uint8_t seen[NUM_FRAMES];
+static uint64_t on_both;
+static uint64_t only_on[2];
+static uint64_t lost;
+static canmerge_t *merge;
+
+static uint64_t state = 1;
+static uint64_t next_random(void)
+  {
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state;
+  }
+
+static int compare_time(const void *a, const void *b)
+  {
+  const timed_canmsg_t *m1 = (const timed_canmsg_t *)a;
+  const timed_canmsg_t *m2 = (const timed_canmsg_t *)b;
+  return m1->timestamp < m2->timestamp ? -1 : m1->timestamp > m2->timestamp ? 1 : 0;
+  }
+
+// every frame carries its own number, so duplicates and losses can be told apart
+static void make_traffic(void)
+  {
+  for (uint32_t frame = 0; frame < NUM_FRAMES; frame++)
+    {
+    uint16_t id = FIRST_ID + frame % NUM_IDS;
+    uint64_t timestamp = 1000 + ((uint64_t)(frame / NUM_IDS) * PERIOD) + (frame % NUM_IDS) * 100;
+    bool drop[2] = { next_random() % 200 == 0, next_random() % 100 == 0 };
+
+    for (uint16_t b = 0; b < 2; b++)
+      if (!drop[b])
+        {
+        timed_canmsg_t *msg = &buses[b][bus_count[b]++];
+        create_can_msg_uint32(&msg->msg, id, frame);
+        msg->timestamp = timestamp + next_random() % JITTER;
+        }
+
+    if (drop[0] && drop[1])
+      lost++;
+    else if (drop[0])
+      only_on[1]++;
+    else if (drop[1])
+      only_on[0]++;
+    else
+      on_both++;
+    }
+
+  // each bus is received in time order
+  qsort(buses[0], bus_count[0], sizeof(timed_canmsg_t), compare_time);
+  qsort(buses[1], bus_count[1], sizeof(timed_canmsg_t), compare_time);
+  }
+
+static void *feed_bus(void *arg)
+  {
+  uint16_t bus = (uint16_t)(intptr_t)arg;
+  uint32_t i = 0;
+  while (i < bus_count[bus])
+    {
+    uint32_t space = canmerge_space(merge, bus);
+    if (space > bus_count[bus] - i)
+      space = bus_count[bus] - i;
+
+    if (space > 0 && succeeded(canmerge_push(merge, bus, &buses[bus][i], space)))
+      i += space;
+    }
+
+  canmerge_close_bus(merge, bus);
+  return 0;
+  }
+
+static void check_merged(uint32_t count)
+  {
+  memset(seen, 0, sizeof(seen));
+  uint64_t out_of_order = 0;
+  uint64_t repeated = 0;
+  for (uint32_t i = 0; i < count; i++)
+    {
+    uint32_t frame = 0;
+    get_param_uint32(&merged[i].msg, &frame);
+    if (frame < NUM_FRAMES && seen[frame]++ != 0)
+      repeated++;
+
+    if (i > 0 && merged[i].timestamp < merged[i - 1].timestamp)
+      out_of_order++;
+    }
+
+  CHECK(count == NUM_FRAMES - lost);
+  CHECK(repeated == 0);
+  CHECK(out_of_order == 0);
+
+  canmerge_bus_stats_t stats[2];
+  CHECK(succeeded(canmerge_stats(merge, 0, &stats[0])));
+  CHECK(succeeded(canmerge_stats(merge, 1, &stats[1])));
+  for (uint16_t b = 0; b < 2; b++)
+    {
+    CHECK(stats[b].received == bus_count[b]);
+    CHECK(stats[b].late == 0 && stats[b].dropped == 0);
+
+    // a miss is counted when the record of the frame is reused, so the
+    // last few frames of each ID are not counted
+    uint64_t missed = only_on[1 - b];
+    CHECK(stats[b].missed <= missed && stats[b].missed + (NUM_IDS * CANMERGE_RECENT) >= missed);
+    }
+
+  CHECK(stats[0].delivered + stats[1].delivered == count);
+  CHECK(stats[0].duplicates + stats[1].duplicates == on_both);
+  }
+
+// push and pop from one thread
+static void test_interleaved(void)
+  {
+  canmerge_config_t config = { 2, 4096, WINDOW, 0 };
+  CHECK(succeeded(canmerge_create(&config, &merge)));
+
+  uint32_t next[2] = { 0, 0 };
+  uint32_t count = 0;
+  for (;;)
+    {
+    for (uint16_t b = 0; b < 2; b++)
+      {
+      if (next[b] == bus_count[b])
+        continue;
+
+      uint32_t space = canmerge_space(merge, b);
+      if (space > 300)
+        space = 300;
+      if (space > bus_count[b] - next[b])
+        space = bus_count[b] - next[b];
+
+      CHECK(succeeded(canmerge_push(merge, b, &buses[b][next[b]], space)));
+      next[b] += space;
+      if (next[b] == bus_count[b])
+        canmerge_close_bus(merge, b);
+      }
+
+    uint32_t n = (NUM_FRAMES * 2) - count;
+    result_t result = canmerge_pop(merge, 0, &merged[count], &n);
+    count += n;
+    if (result == e_stream_closed)
+      break;
+    }
+
+  check_merged(count);
+  CHECK(succeeded(canmerge_close(merge)));
+  }
+
+// a producer thread per bus
+static void test_threads(void)
+  {
+  canmerge_config_t config = { 2, 1024, WINDOW, 0 };
+  CHECK(succeeded(canmerge_create(&config, &merge)));
+
+  pthread_t threads[2];
+  for (intptr_t b = 0; b < 2; b++)
+    CHECK(pthread_create(&threads[b], 0, feed_bus, (void *)b) == 0);
+
+  uint32_t count = 0;
+  for (;;)
+    {
+    uint32_t n = 4096;
+    result_t result = canmerge_pop(merge, 0, &merged[count], &n);
+    count += n;
+    if (result == e_stream_closed)
+      break;
+    }
+
+  pthread_join(threads[0], 0);
+  pthread_join(threads[1], 0);
+
+  check_merged(count);
+  CHECK(succeeded(canmerge_close(merge)));
+  }
+
+// a quiet bus holds the merge up only for the latency
+static void test_quiet_bus(void)
+  {
+  canmerge_config_t config = { 2, 1024, WINDOW, 5000 };
+  CHECK(succeeded(canmerge_create(&config, &merge)));
+
+  timed_canmsg_t msgs[10];
+  for (uint16_t i = 0; i < 10; i++)
+    {
+    create_can_msg_uint32(&msgs[i].msg, FIRST_ID + i, i);
+    msgs[i].timestamp = 1000 * (i + 1);
+    }
+
+  CHECK(succeeded(canmerge_push(merge, 0, msgs, 10)));
+
+  timed_canmsg_t out[10];
+  uint32_t n = 10;
+  CHECK(canmerge_pop(merge, 2000, out, &n) == e_no_more_information && n == 0);
+  n = 10;
+  CHECK(succeeded(canmerge_pop(merge, 8000, out, &n)));
+  CHECK(n == 3 && out[2].timestamp == 3000);
+
+  // the quiet bus then sends a copy of a frame already released
+  timed_canmsg_t copy = msgs[1];
+  CHECK(succeeded(canmerge_push(merge, 1, &copy, 1)));
+  canmerge_close_bus(merge, 0);
+  canmerge_close_bus(merge, 1);
+
+  n = 10;
+  CHECK(succeeded(canmerge_pop(merge, 20000, out, &n)));
+  CHECK(n == 7);
+  n = 10;
+  CHECK(canmerge_pop(merge, 20000, out, &n) == e_stream_closed);
+
+  canmerge_bus_stats_t stats;
+  CHECK(succeeded(canmerge_stats(merge, 1, &stats)));
+  CHECK(stats.duplicates == 1);
+  CHECK(succeeded(canmerge_close(merge)));
+  }
+
+int main(void)
+  {
+  make_traffic();
+
+  test_interleaved();
+  test_threads();
+  test_quiet_bus();
+
+  return test_failures;
+  }
@@ -0,0 +1,137 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+/*
+ * test_canpipe
+ *
+ * Submit random batches through pipes of 1 to 8 workers and check every
+ * message reaches the callback once and each ID's values arrive in the
+ * order they were submitted.
+ */
+#include "../canpipe.h"
+#include "test.h"
+
+#include <string.h>
+
+#define NUM_BATCHES 200
+#define MAX_BATCH 10000
+
+static timed_canmsg_t msgs[MAX_BATCH];
+static uint32_t submitted[NUM_CAN_IDS];
+static uint32_t received[NUM_CAN_IDS];
+static uint64_t out_of_order;
+static uint64_t delivered;
+
+// the values of an ID only reach one worker at a time
+static void check_order(uint16_t worker, uint64_t timestamp, const canmsg_t *msg, const variant_t *value, void *arg)
+  {
+  (void)worker;
+  (void)timestamp;
+  (void)arg;
+
+  uint16_t id = get_can_id(msg);
+  if (value->value.uint32 != received[id] + 1)
+    out_of_order++;
+
+  received[id] = value->value.uint32;
+  __atomic_fetch_add(&delivered, 1, __ATOMIC_RELAXED);
+  }
+
+static uint32_t next_random(uint32_t *seed)
+  {
+  *seed = *seed * 1103515245 + 12345;
+  return *seed >> 8;
+  }
+
+static void run(uint16_t num_threads, uint16_t num_shards)
+  {
+  memset(submitted, 0, sizeof(submitted));
+  memset(received, 0, sizeof(received));
+  out_of_order = 0;
+  delivered = 0;
+
+  canpipe_config_t config = { num_threads, num_shards, MAX_BATCH * 4, v_none, check_order, 0, false };
+  canpipe_t *pipe;
+  CHECK(succeeded(canpipe_create(&config, &pipe)));
+
+  uint32_t seed = num_threads;
+  uint64_t total = 0;
+  for (uint16_t batch = 0; batch < NUM_BATCHES; batch++)
+    {
+    uint32_t count = 1 + next_random(&seed) % MAX_BATCH;
+    for (uint32_t i = 0; i < count; i++)
+      {
+      uint32_t r = next_random(&seed);
+      // most ID's are busy, a few are hot so their shards are stolen
+      uint16_t id = (r & 15) == 0 ? 500 + (r >> 4) % 20 : 300 + (r >> 4) % 200;
+      create_can_msg_uint32(&msgs[i].msg, id, ++submitted[id]);
+      msgs[i].timestamp = total + i;
+      }
+
+    CHECK(succeeded(canpipe_submit(pipe, msgs, count)));
+    total += count;
+    }
+
+  CHECK(succeeded(canpipe_flush(pipe)));
+  CHECK(delivered == total);
+  CHECK(out_of_order == 0);
+  CHECK(memcmp(submitted, received, sizeof(submitted)) == 0);
+
+  uint64_t messages = 0;
+  for (uint16_t w = 0; w < num_threads; w++)
+    {
+    canpipe_worker_stats_t stats;
+    CHECK(succeeded(canpipe_stats(pipe, w, &stats)));
+    CHECK(stats.errors == 0);
+    messages += stats.messages;
+    }
+
+  CHECK(messages == total);
+  CHECK(succeeded(canpipe_close(pipe)));
+  }
+
+int main(void)
+  {
+  for (uint16_t num_threads = 1; num_threads <= 8; num_threads *= 2)
+    {
+    run(num_threads, 0);
+    run(num_threads, 1);
+    }
+
+  return test_failures;
+  }
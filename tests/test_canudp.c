@@ -0,0 +1,268 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+/*
+ * test_canudp
+ *
+ * Send messages to a multicast group looped back to a receiver on this
+ * host and check every one arrives as sent, that a partly filled
+ * datagram waits for its deadline, that a datagram bigger than the
+ * caller's buffer is carried over to the next call, and that a gap in
+ * the sequence is counted as lost.
+ */
+#include "../canudp.h"
+#include "../canendian.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define GROUP "239.255.70.1"
+#define LOCAL "127.0.0.1"
+#define NUM_MSGS 4000
+#define ROUND 500               // messages sent before the receiver catches up
+#define DEADLINE 1000
+#define TIMEOUT_MS 1000
+
+static timed_canmsg_t msgs[NUM_MSGS];
+static timed_canmsg_t received[NUM_MSGS];
+static uint16_t port;
+
+static void make_msgs(void)
+  {
+  // the receiver clears the bytes past the length, as is done here
+  memset(msgs, 0, sizeof(msgs));
+
+  uint64_t seed = 0x2545F4914F6CDD1DULL;
+  uint64_t now = 5000000000ULL;
+  for (uint32_t i = 0; i < NUM_MSGS; i++)
+    {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+
+    // now and then a jump too far to hold as an offset from the base
+    now += (i % 1000) == 999 ? (1ULL << 33) : (seed % 2000);
+
+    uint16_t length = (seed >> 16) % 9;
+    msgs[i].timestamp = now;
+    msgs[i].msg.flags = (uint16_t)(((seed >> 24) % 2047) + 1) | (length << 12);
+    for (uint16_t b = 0; b < length; b++)
+      msgs[i].msg.data[b] = (uint8_t)(seed >> (b * 8));
+    }
+  }
+
+static void make_config(canudp_config_t *config)
+  {
+  memset(config, 0, sizeof(canudp_config_t));
+  config->group = GROUP;
+  config->port = port;
+  config->interface = LOCAL;
+  config->deadline = DEADLINE;
+  config->loopback = true;
+  }
+
+// receive until count messages have arrived or nothing more comes
+static uint32_t receive_all(canudp_receiver_t *receiver, timed_canmsg_t *buffer, uint32_t count, uint32_t batch)
+  {
+  uint32_t n = 0;
+  while (n < count)
+    {
+    uint32_t got = count - n < batch ? count - n : batch;
+    if (failed(canudp_receive(receiver, buffer + n, &got, TIMEOUT_MS)))
+      break;
+
+    n += got;
+    }
+
+  return n;
+  }
+
+static void test_messages(canudp_receiver_t *receiver)
+  {
+  canudp_config_t config;
+  make_config(&config);
+
+  canudp_sender_t *sender;
+  CHECK(succeeded(canudp_sender_open(&config, &sender)));
+
+  memset(received, 0, sizeof(received));
+  uint32_t n = 0;
+  for (uint32_t i = 0; i < NUM_MSGS; i += ROUND)
+    {
+    CHECK(succeeded(canudp_send(sender, msgs + i, ROUND, 0)));
+    CHECK(succeeded(canudp_flush(sender)));
+    n += receive_all(receiver, received + n, i + ROUND - n, NUM_MSGS);
+    }
+
+  CHECK(n == NUM_MSGS);
+  CHECK(memcmp(msgs, received, sizeof(msgs)) == 0);
+
+  canudp_stats_t sent;
+  canudp_stats_t stats;
+  CHECK(succeeded(canudp_sender_stats(sender, &sent)));
+  CHECK(succeeded(canudp_receiver_stats(receiver, &stats)));
+  CHECK(sent.messages == NUM_MSGS && stats.messages == NUM_MSGS);
+  CHECK(sent.errors == 0 && sent.datagrams == stats.datagrams);
+  CHECK(stats.lost == 0 && stats.corrupt == 0);
+
+  CHECK(succeeded(canudp_sender_close(sender)));
+  }
+
+static void test_deadline(canudp_receiver_t *receiver)
+  {
+  canudp_config_t config;
+  make_config(&config);
+
+  canudp_sender_t *sender;
+  CHECK(succeeded(canudp_sender_open(&config, &sender)));
+
+  // a few messages do not fill a datagram, so wait for the deadline
+  uint64_t start = 1000000;
+  uint64_t next;
+  CHECK(succeeded(canudp_send(sender, msgs, 3, start)));
+  CHECK(succeeded(canudp_poll(sender, start + DEADLINE - 1, &next)));
+  CHECK(next == start + DEADLINE);
+
+  uint32_t count = NUM_MSGS;
+  CHECK(canudp_receive(receiver, received, &count, 50) == e_timeout_error);
+
+  CHECK(succeeded(canudp_poll(sender, start + DEADLINE, &next)));
+  CHECK(next == UINT64_MAX);
+
+  memset(received, 0, sizeof(received));
+  CHECK(receive_all(receiver, received, 3, NUM_MSGS) == 3);
+  CHECK(memcmp(msgs, received, sizeof(timed_canmsg_t) * 3) == 0);
+
+  // a datagram holding more than the caller asks for is handed out over
+  // several calls, none of it lost
+  CHECK(succeeded(canudp_send(sender, msgs, 50, start)));
+  CHECK(succeeded(canudp_flush(sender)));
+
+  memset(received, 0, sizeof(received));
+  CHECK(receive_all(receiver, received, 50, 7) == 50);
+  CHECK(memcmp(msgs, received, sizeof(timed_canmsg_t) * 50) == 0);
+
+  CHECK(succeeded(canudp_sender_close(sender)));
+  }
+
+// send a datagram of one message with the given sequence
+static void send_raw(int fd, const struct sockaddr_in *dest, uint32_t sequence, uint32_t magic)
+  {
+  uint8_t datagram[CANUDP_HEADER_SIZE + CANUDP_RECORD_HEADER + 2];
+  memset(datagram, 0, sizeof(datagram));
+  put_le32(datagram, magic);
+  datagram[4] = CANUDP_VERSION;
+  put_le16(datagram + 6, 1);
+  put_le32(datagram + 8, sequence);
+  put_le64(datagram + 12, 1000);
+  put_le32(datagram + CANUDP_HEADER_SIZE, (uint32_t)sequence);
+  put_le16(datagram + CANUDP_HEADER_SIZE + 4, 1 | (2 << 12));
+  datagram[CANUDP_HEADER_SIZE + CANUDP_RECORD_HEADER] = (uint8_t)sequence;
+
+  CHECK(sendto(fd, datagram, sizeof(datagram), 0, (const struct sockaddr *)dest, sizeof(struct sockaddr_in)) == sizeof(datagram));
+  }
+
+static void test_lost(void)
+  {
+  canudp_config_t config;
+  make_config(&config);
+
+  canudp_receiver_t *receiver;
+  CHECK(succeeded(canudp_receiver_open(&config, &receiver)));
+
+  struct sockaddr_in dest;
+  memset(&dest, 0, sizeof(dest));
+  dest.sin_family = AF_INET;
+  dest.sin_port = htons(port);
+  inet_pton(AF_INET, GROUP, &dest.sin_addr);
+
+  struct in_addr local;
+  inet_pton(AF_INET, LOCAL, &local);
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  CHECK(fd >= 0 && setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &local, sizeof(local)) == 0);
+
+  // 3, 4 and 6 are lost, 2 arrives late and is not counted, and a
+  // datagram that is not ours is counted as corrupt
+  send_raw(fd, &dest, 0, CANUDP_MAGIC);
+  send_raw(fd, &dest, 1, CANUDP_MAGIC);
+  send_raw(fd, &dest, 5, CANUDP_MAGIC);
+  send_raw(fd, &dest, 2, CANUDP_MAGIC);
+  send_raw(fd, &dest, 7, CANUDP_MAGIC);
+  send_raw(fd, &dest, 8, 0x12345678);
+
+  CHECK(receive_all(receiver, received, 5, NUM_MSGS) == 5);
+  CHECK(received[2].timestamp == 1005 && received[2].msg.data[0] == 5);
+
+  uint32_t count = NUM_MSGS;
+  CHECK(canudp_receive(receiver, received, &count, 50) == e_timeout_error);
+
+  canudp_stats_t stats;
+  CHECK(succeeded(canudp_receiver_stats(receiver, &stats)));
+  CHECK(stats.datagrams == 5 && stats.messages == 5);
+  CHECK(stats.lost == 3);
+  CHECK(stats.corrupt == 1);
+
+  close(fd);
+  CHECK(succeeded(canudp_receiver_close(receiver)));
+  }
+
+int main(void)
+  {
+  port = (uint16_t)(40000 + (getpid() % 20000));
+  make_msgs();
+
+  canudp_config_t config;
+  make_config(&config);
+
+  canudp_receiver_t *receiver;
+  CHECK(succeeded(canudp_receiver_open(&config, &receiver)));
+  if (test_failures > 0)
+    return test_failures;
+
+  test_messages(receiver);
+  test_deadline(receiver);
+  CHECK(succeeded(canudp_receiver_close(receiver)));
+
+  test_lost();
+  return test_failures;
+  }
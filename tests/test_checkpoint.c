@@ -0,0 +1,214 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+/*
+ * test_checkpoint
+ *
+ * Restart from a checkpoint, and check that slots torn by a crash or
+ * damaged on disk are discarded on their own while the rest restore.
+ */
+#include "../checkpoint.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#define FIRST_ID 300
+#define NUM_IDS 300
+
+static char path[64];
+static timed_canmsg_t msgs[NUM_IDS];
+
+// the value of each ID says which ID it belongs to
+static void fill(uint32_t round)
+  {
+  for (uint16_t i = 0; i < NUM_IDS; i++)
+    {
+    msgs[i].timestamp = ((uint64_t)round * NUM_IDS) + i + 1;
+    create_can_msg_uint32(&msgs[i].msg, FIRST_ID + i, (round * NUM_IDS) + i);
+    }
+  }
+
+static bool value_matches(const checkpoint_t *cp, uint16_t id)
+  {
+  timed_canmsg_t msg;
+  uint32_t value;
+  return succeeded(checkpoint_get(cp, id, &msg, 0)) &&
+         get_can_id(&msg.msg) == id &&
+         succeeded(get_param_uint32(&msg.msg, &value)) &&
+         value % NUM_IDS == (uint32_t)(id - FIRST_ID) &&
+         msg.timestamp == (uint64_t)value + 1;
+  }
+
+static void patch(off_t offset, const void *bytes, size_t length)
+  {
+  int fd = open(path, O_RDWR);
+  CHECK(fd >= 0 && pwrite(fd, bytes, length, offset) == (ssize_t)length);
+  close(fd);
+  }
+
+static void test_restart(void)
+  {
+  checkpoint_t cp;
+  unlink(path);
+  CHECK(succeeded(checkpoint_open(path, &cp)));
+  CHECK(cp.restored == 0 && cp.discarded == 0);
+
+  fill(0);
+  CHECK(succeeded(checkpoint_update(&cp, msgs, NUM_IDS)));
+  fill(1);
+  CHECK(succeeded(checkpoint_update(&cp, msgs, NUM_IDS)));
+  CHECK(succeeded(checkpoint_close(&cp)));
+
+  CHECK(succeeded(checkpoint_open(path, &cp)));
+  CHECK(cp.restored == NUM_IDS && cp.discarded == 0);
+
+  timed_canmsg_t msg;
+  memset(&msg, 0, sizeof(msg));
+  bool stale = false;
+  CHECK(succeeded(checkpoint_get(&cp, FIRST_ID + 7, &msg, &stale)));
+  CHECK(stale);
+  CHECK(msg.timestamp == NUM_IDS + 8);
+  for (uint16_t id = FIRST_ID; id < FIRST_ID + NUM_IDS; id++)
+    CHECK(value_matches(&cp, id));
+
+  CHECK(checkpoint_get(&cp, FIRST_ID - 1, &msg, 0) == e_no_more_information);
+
+  // a new value is no longer stale
+  CHECK(succeeded(checkpoint_update(&cp, msgs, 1)));
+  CHECK(succeeded(checkpoint_get(&cp, FIRST_ID, &msg, &stale)));
+  CHECK(!stale);
+  CHECK(succeeded(checkpoint_close(&cp)));
+  }
+
+static void test_damaged_slots(void)
+  {
+  checkpoint_t cp;
+  uint16_t torn = FIRST_ID + 10;
+  uint16_t corrupt = FIRST_ID + 20;
+
+  // a slot left odd sequenced was being written when the process stopped
+  uint32_t odd = 7;
+  patch(offsetof(checkpoint_file_t, slots[torn].seq), &odd, sizeof(odd));
+
+  // a slot that does not match its checksum was written back partially
+  uint8_t byte = 0x55;
+  patch(offsetof(checkpoint_file_t, slots[corrupt].data[3]), &byte, 1);
+
+  CHECK(succeeded(checkpoint_open(path, &cp)));
+  CHECK(cp.discarded == 2);
+  CHECK(cp.restored == NUM_IDS - 2);
+
+  timed_canmsg_t msg;
+  CHECK(checkpoint_get(&cp, torn, &msg, 0) == e_no_more_information);
+  CHECK(checkpoint_get(&cp, corrupt, &msg, 0) == e_no_more_information);
+  for (uint16_t id = FIRST_ID; id < FIRST_ID + NUM_IDS; id++)
+    if (id != torn && id != corrupt)
+      CHECK(value_matches(&cp, id));
+
+  CHECK(succeeded(checkpoint_close(&cp)));
+  }
+
+static void test_bad_header(void)
+  {
+  checkpoint_t cp;
+  uint16_t version = CHECKPOINT_VERSION + 1;
+  patch(offsetof(checkpoint_file_t, header.version), &version, sizeof(version));
+
+  // a file of another layout is started again
+  CHECK(succeeded(checkpoint_open(path, &cp)));
+  CHECK(cp.restored == 0);
+  timed_canmsg_t msg;
+  CHECK(checkpoint_get(&cp, FIRST_ID, &msg, 0) == e_no_more_information);
+  CHECK(succeeded(checkpoint_close(&cp)));
+
+  CHECK(succeeded(checkpoint_open(path, &cp)));
+  CHECK(cp.restored == 0 && cp.discarded == 0);
+  CHECK(succeeded(checkpoint_close(&cp)));
+  }
+
+// kill a process while it writes, every value restored must be whole
+static void test_killed_writer(void)
+  {
+  for (uint16_t attempt = 0; attempt < 20; attempt++)
+    {
+    pid_t pid = fork();
+    if (pid == 0)
+      {
+      checkpoint_t cp;
+      checkpoint_open(path, &cp);
+      for (uint32_t round = 0; ; round++)
+        {
+        fill(round);
+        checkpoint_update(&cp, msgs, NUM_IDS);
+        }
+      }
+
+    usleep(1000 + (rand() % 5000));
+    kill(pid, SIGKILL);
+    waitpid(pid, 0, 0);
+
+    checkpoint_t cp;
+    CHECK(succeeded(checkpoint_open(path, &cp)));
+    CHECK(cp.restored + cp.discarded >= NUM_IDS - 1);
+    for (uint16_t id = FIRST_ID; id < FIRST_ID + NUM_IDS; id++)
+      {
+      timed_canmsg_t msg;
+      if (succeeded(checkpoint_get(&cp, id, &msg, 0)))
+        CHECK(value_matches(&cp, id));
+      }
+
+    CHECK(succeeded(checkpoint_close(&cp)));
+    }
+  }
+
+int main(void)
+  {
+  snprintf(path, sizeof(path), "/tmp/test_checkpoint.%d", (int)getpid());
+
+  test_restart();
+  test_damaged_slots();
+  test_bad_header();
+  test_killed_writer();
+
+  unlink(path);
+  return test_failures;
+  }
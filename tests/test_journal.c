@@ -0,0 +1,235 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+/*
+ * test_journal
+ *
+ * Recover a file backed journal on reopen, skip a record torn by a power
+ * loss, and keep every latest value while compaction wraps the ring of
+ * sectors.
+ */
+#include "../journal.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+// 8 records per sector
+#define SECTOR_SIZE (JOURNAL_HEADER_SIZE + (8 * JOURNAL_RECORD_SIZE))
+#define NUM_SECTORS 4
+
+#define ENGINE_HOURS 900
+#define FUEL_USED 901
+#define FIRST_COUNTER 910
+#define NUM_COUNTERS 5
+
+static char path[64];
+
+static bool open_journal(journal_t *journal, journal_device_t *device)
+  {
+  return succeeded(journal_file_open(path, SECTOR_SIZE, NUM_SECTORS, device)) &&
+         succeeded(journal_open(journal, device));
+  }
+
+static bool reopen(journal_t *journal, journal_device_t *device)
+  {
+  return succeeded(journal_file_close(device)) && open_journal(journal, device);
+  }
+
+static bool holds_uint32(journal_t *journal, uint16_t id, uint32_t expected)
+  {
+  variant_t v;
+  return succeeded(journal_read(journal, id, &v)) &&
+         v.vt == v_uint32 && v.value.uint32 == expected;
+  }
+
+static void test_reopen(void)
+  {
+  journal_t journal;
+  journal_device_t device;
+  unlink(path);
+  CHECK(open_journal(&journal, &device));
+  CHECK(journal.used == 0 && journal.num_keys == 0);
+
+  variant_t v;
+  CHECK(journal_read(&journal, ENGINE_HOURS, &v) == e_not_found);
+
+  CHECK(succeeded(journal_write(&journal, ENGINE_HOURS, create_variant_uint32(1234, &v))));
+  CHECK(succeeded(journal_write(&journal, FUEL_USED, create_variant_float(56.5f, &v))));
+  CHECK(succeeded(journal_write(&journal, ENGINE_HOURS, create_variant_uint32(1235, &v))));
+
+  // the same value again is not written
+  CHECK(succeeded(journal_write(&journal, ENGINE_HOURS, create_variant_uint32(1235, &v))));
+  CHECK(journal.writes == 3 && journal.unchanged == 1);
+
+  CHECK(reopen(&journal, &device));
+  CHECK(journal.num_keys == 2 && journal.corrupt == 0);
+  CHECK(journal.used == 1 && journal.head_records == 3);
+  CHECK(holds_uint32(&journal, ENGINE_HOURS, 1235));
+  CHECK(succeeded(journal_read(&journal, FUEL_USED, &v)) && v.vt == v_float && v.value.flt == 56.5f);
+
+  CHECK(succeeded(journal_file_close(&device)));
+  }
+
+static void test_torn_record(void)
+  {
+  journal_t journal;
+  journal_device_t device;
+  unlink(path);
+  CHECK(open_journal(&journal, &device));
+
+  variant_t v;
+  CHECK(succeeded(journal_write(&journal, ENGINE_HOURS, create_variant_uint32(100, &v))));
+  CHECK(succeeded(journal_write(&journal, FUEL_USED, create_variant_uint32(7, &v))));
+
+  // power lost part way through programming the next record of the ID,
+  // the bytes that were not programmed are still erased
+  uint32_t offset = (journal.head * SECTOR_SIZE) + JOURNAL_HEADER_SIZE + (journal.head_records * JOURNAL_RECORD_SIZE);
+  uint8_t torn[JOURNAL_RECORD_SIZE];
+  memset(torn, 0xFF, sizeof(torn));
+  torn[0] = (uint8_t)ENGINE_HOURS;
+  torn[1] = (uint8_t)(ENGINE_HOURS >> 8);
+  torn[2] = v_uint32;
+  torn[3] = 0;
+  torn[4] = 101;
+  torn[5] = 0;
+
+  int fd = open(path, O_RDWR);
+  CHECK(fd >= 0 && pwrite(fd, torn, 6, offset) == 6);
+  close(fd);
+
+  CHECK(reopen(&journal, &device));
+  CHECK(journal.corrupt == 1);
+  CHECK(holds_uint32(&journal, ENGINE_HOURS, 100));
+  CHECK(holds_uint32(&journal, FUEL_USED, 7));
+
+  // the torn record is passed over, not written into
+  CHECK(journal.head_records == 3);
+  CHECK(succeeded(journal_write(&journal, ENGINE_HOURS, create_variant_uint32(102, &v))));
+  CHECK(reopen(&journal, &device));
+  CHECK(journal.corrupt == 1);
+  CHECK(holds_uint32(&journal, ENGINE_HOURS, 102));
+  CHECK(holds_uint32(&journal, FUEL_USED, 7));
+
+  CHECK(succeeded(journal_file_close(&device)));
+  }
+
+static void test_compaction(void)
+  {
+  journal_t journal;
+  journal_device_t device;
+  unlink(path);
+  CHECK(open_journal(&journal, &device));
+
+  // written once, so each compaction of its sector has to copy it
+  variant_t v;
+  CHECK(succeeded(journal_write(&journal, ENGINE_HOURS, create_variant_uint32(5000, &v))));
+
+  uint32_t latest[NUM_COUNTERS];
+  memset(latest, 0, sizeof(latest));
+
+  uint32_t wrapped = 0;
+  uint16_t last_head = journal.head;
+  for (uint32_t i = 1; i <= 400; i++)
+    {
+    uint16_t c = i % NUM_COUNTERS;
+    latest[c] = i;
+    CHECK(succeeded(journal_write(&journal, FIRST_COUNTER + c, create_variant_uint32(i, &v))));
+
+    // the idle task does a little compaction now and then
+    if (i % 3 == 0)
+      {
+      result_t result = journal_compact(&journal, 2);
+      CHECK(result == s_ok || result == s_false);
+      }
+
+    if (journal.head < last_head)
+      wrapped++;
+
+    last_head = journal.head;
+
+    for (uint16_t k = 0; k < NUM_COUNTERS; k++)
+      if (latest[k] != 0)
+        CHECK(holds_uint32(&journal, FIRST_COUNTER + k, latest[k]));
+
+    CHECK(holds_uint32(&journal, ENGINE_HOURS, 5000));
+    }
+
+  CHECK(wrapped > 10);
+  CHECK(journal.copies > 0);
+  CHECK(journal.erases > 100);
+  CHECK(journal.used < NUM_SECTORS);
+
+  CHECK(reopen(&journal, &device));
+  CHECK(journal.corrupt == 0);
+  CHECK(journal.num_keys == NUM_COUNTERS + 1);
+  CHECK(holds_uint32(&journal, ENGINE_HOURS, 5000));
+  for (uint16_t k = 0; k < NUM_COUNTERS; k++)
+    CHECK(holds_uint32(&journal, FIRST_COUNTER + k, latest[k]));
+
+  // more keys than fit the sectors are refused rather than lost
+  result_t result = s_ok;
+  uint16_t id;
+  for (id = 1; id < 100 && succeeded(result); id++)
+    result = journal_write(&journal, id, create_variant_uint32(id, &v));
+
+  CHECK(result == e_no_space);
+  CHECK(reopen(&journal, &device));
+  CHECK(holds_uint32(&journal, ENGINE_HOURS, 5000));
+  for (uint16_t k = 0; k < NUM_COUNTERS; k++)
+    CHECK(holds_uint32(&journal, FIRST_COUNTER + k, latest[k]));
+
+  for (uint16_t i = 1; i < id - 1; i++)
+    CHECK(holds_uint32(&journal, i, i));
+
+  CHECK(succeeded(journal_file_close(&device)));
+  }
+
+int main(void)
+  {
+  snprintf(path, sizeof(path), "/tmp/test_journal.%d", (int)getpid());
+
+  test_reopen();
+  test_torn_record();
+  test_compaction();
+
+  unlink(path);
+  return test_failures;
+  }
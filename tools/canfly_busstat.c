@@ -0,0 +1,141 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+/*
+ * canfly_busstat
+ *
+ * Report the bus utilization of a capture log, or of a live interface.
+ *
+ *  canfly_busstat [-b bitrate] -f capture.log
+ *  canfly_busstat [-b bitrate] [-t seconds] -i can0
+ */
+#include "../busstats.h"
+#include "../socketcan.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#define READ_BATCH 65536
+
+static busstats_t stats;
+static timed_canmsg_t msgs[READ_BATCH];
+
+static result_t analyze_log(const char *path)
+  {
+  result_t result;
+  canlog_t *log;
+  if (failed(result = canlog_open(path, &log)))
+    return result;
+
+  uint32_t count = READ_BATCH;
+  while (succeeded(result = canlog_read(log, msgs, &count)))
+    {
+    busstats_add(&stats, msgs, count);
+    count = READ_BATCH;
+    }
+
+  canlog_close(log);
+  return result == e_no_more_information ? s_ok : result;
+  }
+
+static result_t analyze_live(const char *ifname, uint32_t seconds)
+  {
+  result_t result;
+  int fd;
+  if (failed(result = socketcan_open(ifname, &fd)))
+    return result;
+
+  time_t end = time(0) + seconds;
+  while (time(0) < end)
+    {
+    uint32_t count = READ_BATCH;
+    if (succeeded(socketcan_read(fd, msgs, &count, 100)))
+      busstats_add(&stats, msgs, count);
+    }
+
+  socketcan_close(fd);
+  return s_ok;
+  }
+
+int main(int argc, char **argv)
+  {
+  uint32_t bitrate = 250000;
+  uint32_t seconds = 10;
+  const char *path = 0;
+  const char *ifname = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "b:f:i:t:")) != -1)
+    {
+    switch (opt)
+      {
+      case 'b':
+        bitrate = (uint32_t)strtoul(optarg, 0, 10);
+        break;
+      case 'f':
+        path = optarg;
+        break;
+      case 'i':
+        ifname = optarg;
+        break;
+      case 't':
+        seconds = (uint32_t)strtoul(optarg, 0, 10);
+        break;
+      default:
+        path = ifname = 0;
+        break;
+      }
+    }
+
+  if ((path == 0) == (ifname == 0) || failed(busstats_init(&stats, bitrate)))
+    {
+    fprintf(stderr, "usage: %s [-b bitrate] -f capture | -i interface [-t seconds]\n", argv[0]);
+    return 1;
+    }
+
+  result_t result = path != 0 ? analyze_log(path) : analyze_live(ifname, seconds);
+  if (failed(result))
+    {
+    fprintf(stderr, "error %d reading %s\n", (int)result, path != 0 ? path : ifname);
+    return 1;
+    }
+
+  busstats_report(&stats, stdout);
+  return 0;
+  }
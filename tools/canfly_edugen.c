@@ -0,0 +1,286 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+/*
+ * canfly_edugen
+ *
+ * Generate synthetic EDU traffic for load and soak testing.
+ *
+ *  canfly_edugen [options] -o capture.log     write a capture log
+ *  canfly_edugen [options] -i vcan0           send to a can interface
+ *  canfly_edugen [options] -q                 decode on a second thread
+ *
+ *  -d seconds    simulated time to generate, default 60
+ *  -r factor     multiply the default rate of every ID
+ *  -f            inject stale sensor, divergence and alarm burst faults
+ *  -k seconds    write keyframes to a capture log at this interval
+ *  -s seed       random seed
+ *  -x            do not pace to real time when sending to an interface
+ */
+#include "../edugen.h"
+#include "../canqueue.h"
+#include "../socketcan.h"
+#include "../canclock.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#define GEN_BATCH 65536
+#define QUEUE_SIZE 262144
+// time generated on each pass, microseconds
+#define GEN_STEP 10000
+// polls of an empty or full queue before sleeping between them
+#define IDLE_SPINS 64
+
+static edugen_t gen;
+static timed_canmsg_t msgs[GEN_BATCH];
+static timed_canmsg_t queue_msgs[QUEUE_SIZE];
+static canqueue_t queue;
+// cleared, with release, after the last batch is queued
+static atomic_bool generating = true;
+
+// wait for the other side of the queue, yielding at first then sleeping
+static void back_off(uint32_t *idle)
+  {
+  if ((*idle)++ < IDLE_SPINS)
+    sched_yield();
+  else
+    usleep(100);
+  }
+
+static void *decode_worker(void *arg)
+  {
+  uint64_t *decoded = (uint64_t *)arg;
+  timed_canmsg_t batch[1024];
+  uint32_t idle = 0;
+
+  for (;;)
+    {
+    // read before the pop, so a pop that fails after the generator has
+    // stopped has seen the last batch
+    bool more = atomic_load_explicit(&generating, memory_order_acquire);
+    uint32_t count = 1024;
+    if (failed(canqueue_pop(&queue, batch, &count)))
+      {
+      if (!more)
+        break;
+
+      back_off(&idle);
+      continue;
+      }
+
+    idle = 0;
+
+    for (uint32_t i = 0; i < count; i++)
+      {
+      variant_t v;
+      if (succeeded(msg_to_variant(&batch[i].msg, &v)))
+        (*decoded)++;
+      }
+    }
+
+  return 0;
+  }
+
+int main(int argc, char **argv)
+  {
+  const char *path = 0;
+  const char *ifname = 0;
+  bool use_queue = false;
+  bool paced = true;
+  bool faults = false;
+  float rate = 1;
+  uint64_t seed = 1;
+  uint64_t duration = 60;
+  uint64_t keyframes = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "o:i:qd:r:fk:s:x")) != -1)
+    {
+    switch (opt)
+      {
+      case 'o': path = optarg; break;
+      case 'i': ifname = optarg; break;
+      case 'q': use_queue = true; break;
+      case 'd': duration = strtoull(optarg, 0, 10); break;
+      case 'r': rate = strtof(optarg, 0); break;
+      case 'f': faults = true; break;
+      case 'k': keyframes = strtoull(optarg, 0, 10); break;
+      case 's': seed = strtoull(optarg, 0, 10); break;
+      case 'x': paced = false; break;
+      default:
+        return 1;
+      }
+    }
+
+  if ((path != 0) + (ifname != 0) + use_queue != 1)
+    {
+    fprintf(stderr, "usage: %s [-d seconds] [-r factor] [-f] [-k seconds] [-s seed] [-x] -o file | -i interface | -q\n", argv[0]);
+    return 1;
+    }
+
+  edugen_init(&gen, seed);
+  if (rate != 1 && failed(edugen_scale_rates(&gen, rate)))
+    {
+    fprintf(stderr, "bad rate %f\n", rate);
+    return 1;
+    }
+
+  if (faults)
+    {
+    edugen_faults_t model = {
+      .stale_rate = 30,
+      .stale_duration = 10000000,
+      .divergence_rate = 20,
+      .divergence_duration = 5000000,
+      .alarm_burst_rate = 10,
+      .alarm_burst_duration = 2000000,
+      .alarm_burst_period = 10000,
+      };
+    edugen_set_faults(&gen, &model);
+    }
+
+  result_t result;
+  canlog_t *log = 0;
+  int fd = -1;
+  pthread_t worker;
+  uint64_t decoded = 0;
+
+  if (path != 0 && failed(result = canlog_create(path, &log)))
+    {
+    fprintf(stderr, "cannot create %s, error %d\n", path, (int)result);
+    return 1;
+    }
+
+  if (log != 0 && keyframes > 0 && failed(result = canlog_set_keyframes(log, keyframes * 1000000)))
+    {
+    fprintf(stderr, "cannot write keyframes for %s, error %d\n", path, (int)result);
+    return 1;
+    }
+
+  if (ifname != 0 && failed(result = socketcan_open(ifname, &fd)))
+    {
+    fprintf(stderr, "cannot open %s, error %d\n", ifname, (int)result);
+    return 1;
+    }
+
+  if (use_queue)
+    {
+    canqueue_init(&queue, queue_msgs, QUEUE_SIZE);
+    if (pthread_create(&worker, 0, decode_worker, &decoded) != 0)
+      {
+      fprintf(stderr, "cannot start the decode thread\n");
+      return 1;
+      }
+    }
+
+  uint64_t frames = 0;
+  uint64_t started = monotonic_ns();
+  uint64_t end = duration * 1000000;
+
+  for (uint64_t now = GEN_STEP; now <= end; now += GEN_STEP)
+    {
+    result = e_more_data;
+    while (result == e_more_data)
+      {
+      uint32_t count = GEN_BATCH;
+      result = edugen_generate(&gen, now, msgs, &count);
+      frames += count;
+
+      if (log != 0)
+        canlog_write(log, msgs, count);
+      else if (use_queue)
+        {
+        uint32_t queued = 0;
+        uint32_t idle = 0;
+        while (queued < count)
+          {
+          uint32_t n = count - queued;
+          if (failed(canqueue_push(&queue, msgs + queued, &n)))
+            back_off(&idle);
+          else
+            idle = 0;
+
+          queued += n;
+          }
+        }
+      else
+        {
+        for (uint32_t i = 0; i < count; i++)
+          {
+          uint32_t n = 1;
+          // the transmit queue of a real interface fills, so retry
+          while (failed(socketcan_write(fd, &msgs[i].msg, &n)))
+            {
+            n = 1;
+            usleep(100);
+            }
+          }
+        }
+      }
+
+    if (ifname != 0 && paced)
+      {
+      uint64_t elapsed = (monotonic_ns() - started) / 1000;
+      if (elapsed < now)
+        usleep((useconds_t)(now - elapsed));
+      }
+    }
+
+  atomic_store_explicit(&generating, false, memory_order_release);
+  if (use_queue)
+    pthread_join(worker, 0);
+
+  if (log != 0)
+    canlog_close(log);
+
+  if (fd >= 0)
+    socketcan_close(fd);
+
+  double seconds = (monotonic_ns() - started) / 1e9;
+  printf("%llu frames in %.3f s, %.0f frames/s\n", (unsigned long long)frames, seconds, frames / seconds);
+  if (use_queue)
+    printf("%llu frames decoded\n", (unsigned long long)decoded);
+
+  return 0;
+  }
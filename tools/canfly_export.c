@@ -0,0 +1,111 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+/*
+ * canfly_export
+ *
+ * Export a capture log to a wide CSV file or to per-ID column files.
+ *
+ *  canfly_export [-t threads] [-n chunk] [-k] -f capture.log -o out.csv
+ *  canfly_export [-t threads] [-n chunk] -c -f capture.log -o directory
+ *
+ *  -k    repeat the last value of each ID in every CSV row
+ */
+#include "../canexport.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+int main(int argc, char **argv)
+  {
+  canexport_options_t options = { 0, 0, cf_csv, 0, 0, false };
+
+  int opt;
+  while ((opt = getopt(argc, argv, "f:o:ct:n:k")) != -1)
+    {
+    switch (opt)
+      {
+      case 'f': options.capture = optarg; break;
+      case 'o': options.output = optarg; break;
+      case 'c': options.format = cf_columns; break;
+      case 't': options.threads = (uint16_t)strtoul(optarg, 0, 10); break;
+      case 'n': options.chunk_size = (uint32_t)strtoul(optarg, 0, 10); break;
+      case 'k': options.hold = true; break;
+      default:
+        options.capture = 0;
+        break;
+      }
+    }
+
+  if (options.capture == 0 || options.output == 0)
+    {
+    fprintf(stderr, "usage: %s [-t threads] [-n chunk] [-k] [-c] -f capture -o output\n", argv[0]);
+    return 1;
+    }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  canexport_stats_t stats;
+  result_t result = canexport_run(&options, &stats);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds = (end.tv_sec - start.tv_sec) + ((end.tv_nsec - start.tv_nsec) / 1e9);
+
+  if (result == e_out_of_range)
+    {
+    fprintf(stderr, "%s is not in time order, merge it with canfly_merge first\n", options.capture);
+    return 1;
+    }
+
+  if (failed(result))
+    {
+    fprintf(stderr, "export failed, error %d\n", (int)result);
+    return 1;
+    }
+
+  fprintf(stderr, "%llu records, %llu values, %llu errors, %llu rows in %.3f s\n",
+          (unsigned long long)stats.records,
+          (unsigned long long)stats.values,
+          (unsigned long long)stats.errors,
+          (unsigned long long)stats.rows,
+          seconds);
+  return 0;
+  }
@@ -0,0 +1,289 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+/*
+ * canfly_merge
+ *
+ * Merge redundant buses into one time ordered capture, removing the
+ * duplicates, and report what each bus missed.
+ *
+ *  canfly_merge [options] -o merged.log -f bus0.log -f bus1.log...
+ *  canfly_merge [options] [-t seconds] -o merged.log -i can0 -i can1...
+ *
+ *  -w us         duplicate window, default 2000
+ *  -l ms         longest wait for a quiet bus, default 0 for logs, 100 for interfaces
+ *  -c messages   queue per bus, default 65536
+ */
+#include "../canmerge.h"
+#include "../socketcan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#define READ_BATCH 4096
+
+typedef struct _live_bus_t {
+  canmerge_t *merge;
+  uint16_t bus;
+  int fd;
+  } live_bus_t;
+
+static timed_canmsg_t msgs[READ_BATCH];
+static volatile bool running = true;
+
+static uint64_t realtime_us(void)
+  {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+  }
+
+static result_t drain(canmerge_t *merge, uint64_t now, canlog_t *out)
+  {
+  result_t result;
+  uint32_t count = READ_BATCH;
+  while ((result = canmerge_pop(merge, now, msgs, &count)) == s_ok)
+    {
+    canlog_write(out, msgs, count);
+    count = READ_BATCH;
+    }
+
+  return result;
+  }
+
+static result_t merge_logs(canmerge_t *merge, const char **paths, uint16_t count, canlog_t *out)
+  {
+  result_t result = s_ok;
+  canlog_t *logs[CANMERGE_MAX_BUSES] = { 0 };
+  timed_canmsg_t *batch = (timed_canmsg_t *)malloc(sizeof(timed_canmsg_t) * READ_BATCH);
+  if (batch == 0)
+    return e_not_enough_memory;
+
+  for (uint16_t b = 0; b < count && succeeded(result); b++)
+    if (failed(result = canlog_open(paths[b], &logs[b])))
+      fprintf(stderr, "cannot open %s\n", paths[b]);
+
+  // feed each bus as its queue empties, everything is read so no latency is needed
+  while (succeeded(result))
+    {
+    for (uint16_t b = 0; b < count; b++)
+      {
+      if (logs[b] == 0)
+        continue;
+
+      uint32_t space = canmerge_space(merge, b);
+      uint32_t n = space > READ_BATCH ? READ_BATCH : space;
+      if (n == 0)
+        continue;
+
+      if (succeeded(canlog_read(logs[b], batch, &n)))
+        canmerge_push(merge, b, batch, n);
+      else
+        {
+        canlog_close(logs[b]);
+        logs[b] = 0;
+        canmerge_close_bus(merge, b);
+        }
+      }
+
+    if ((result = drain(merge, 0, out)) == e_stream_closed)
+      {
+      result = s_ok;
+      break;
+      }
+
+    result = s_ok;
+    }
+
+  for (uint16_t b = 0; b < count; b++)
+    if (logs[b] != 0)
+      canlog_close(logs[b]);
+
+  free(batch);
+  return result;
+  }
+
+static void *live_reader(void *arg)
+  {
+  live_bus_t *live = (live_bus_t *)arg;
+  timed_canmsg_t batch[256];
+
+  while (running)
+    {
+    uint32_t count = 256;
+    if (succeeded(socketcan_read(live->fd, batch, &count, 100)))
+      canmerge_push(live->merge, live->bus, batch, count);
+    }
+
+  canmerge_close_bus(live->merge, live->bus);
+  return 0;
+  }
+
+static result_t merge_live(canmerge_t *merge, const char **names, uint16_t count, uint32_t seconds, canlog_t *out)
+  {
+  result_t result = s_ok;
+  live_bus_t live[CANMERGE_MAX_BUSES];
+  pthread_t readers[CANMERGE_MAX_BUSES];
+  uint16_t started = 0;
+
+  for (; started < count; started++)
+    {
+    live[started].merge = merge;
+    live[started].bus = started;
+    if (failed(result = socketcan_open(names[started], &live[started].fd)))
+      {
+      fprintf(stderr, "cannot open %s\n", names[started]);
+      break;
+      }
+
+    pthread_create(&readers[started], 0, live_reader, &live[started]);
+    }
+
+  uint64_t end = realtime_us() + ((uint64_t)seconds * 1000000);
+  while (succeeded(result) && realtime_us() < end)
+    {
+    if (drain(merge, realtime_us(), out) != s_ok)
+      usleep(1000);
+    }
+
+  running = false;
+  for (uint16_t b = 0; b < started; b++)
+    {
+    pthread_join(readers[b], 0);
+    socketcan_close(live[b].fd);
+    }
+
+  // the buses are closed, so whatever is left is released
+  if (succeeded(result))
+    while (drain(merge, UINT64_MAX, out) == e_no_more_information)
+      ;
+
+  return result;
+  }
+
+int main(int argc, char **argv)
+  {
+  const char *inputs[CANMERGE_MAX_BUSES];
+  uint16_t num_inputs = 0;
+  bool live = false;
+  bool files = false;
+  const char *output = 0;
+  uint32_t seconds = 10;
+  int32_t latency = -1;
+  canmerge_config_t config = { 0, 65536, 2000, 0 };
+
+  int opt;
+  while ((opt = getopt(argc, argv, "f:i:o:t:w:l:c:")) != -1)
+    {
+    switch (opt)
+      {
+      case 'f':
+      case 'i':
+        if (num_inputs == CANMERGE_MAX_BUSES)
+          {
+          fprintf(stderr, "at most %d buses\n", CANMERGE_MAX_BUSES);
+          return 1;
+          }
+
+        inputs[num_inputs++] = optarg;
+        files |= opt == 'f';
+        live |= opt == 'i';
+        break;
+      case 'o': output = optarg; break;
+      case 't': seconds = (uint32_t)strtoul(optarg, 0, 10); break;
+      case 'w': config.window = (uint32_t)strtoul(optarg, 0, 10); break;
+      case 'l': latency = (int32_t)strtol(optarg, 0, 10); break;
+      case 'c': config.capacity = (uint32_t)strtoul(optarg, 0, 10); break;
+      default:
+        return 1;
+      }
+    }
+
+  if (num_inputs == 0 || output == 0 || (files && live))
+    {
+    fprintf(stderr, "usage: %s [-w us] [-l ms] [-c messages] [-t seconds] -o output -f capture... | -i interface...\n", argv[0]);
+    return 1;
+    }
+
+  config.num_buses = num_inputs;
+  config.latency = latency >= 0 ? (uint32_t)latency * 1000 : live ? 100000 : 0;
+
+  result_t result;
+  canmerge_t *merge;
+  canlog_t *out;
+  if (failed(result = canmerge_create(&config, &merge)))
+    {
+    fprintf(stderr, "cannot create the merge, error %d\n", (int)result);
+    return 1;
+    }
+
+  if (failed(result = canlog_create(output, &out)))
+    {
+    fprintf(stderr, "cannot create %s, error %d\n", output, (int)result);
+    return 1;
+    }
+
+  result = live ? merge_live(merge, inputs, num_inputs, seconds, out) : merge_logs(merge, inputs, num_inputs, out);
+  canlog_close(out);
+
+  if (failed(result))
+    {
+    fprintf(stderr, "merge failed, error %d\n", (int)result);
+    return 1;
+    }
+
+  printf("%-12s %12s %12s %12s %12s %12s %12s\n", "bus", "received", "delivered", "duplicates", "missed", "late", "dropped");
+  for (uint16_t b = 0; b < num_inputs; b++)
+    {
+    canmerge_bus_stats_t stats;
+    canmerge_stats(merge, b, &stats);
+    printf("%-12s %12llu %12llu %12llu %12llu %12llu %12llu\n", inputs[b],
+           (unsigned long long)stats.received,
+           (unsigned long long)stats.delivered,
+           (unsigned long long)stats.duplicates,
+           (unsigned long long)stats.missed,
+           (unsigned long long)stats.late,
+           (unsigned long long)stats.dropped);
+    }
+
+  canmerge_close(merge);
+  return 0;
+  }
@@ -0,0 +1,113 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+/*
+ * canfly_pack
+ *
+ * Compress a capture log, or expand a compressed capture.
+ *
+ *  canfly_pack [-b messages] -c capture.log packed.cfpk
+ *  canfly_pack -x packed.cfpk capture.log
+ */
+#include "../cancodec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+static double monotonic_seconds(void)
+  {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+  }
+
+static long long file_size(const char *path)
+  {
+  struct stat st;
+  return stat(path, &st) == 0 ? (long long)st.st_size : 0;
+  }
+
+int main(int argc, char **argv)
+  {
+  bool compress = false;
+  bool expand = false;
+  uint32_t block_size = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "cxb:")) != -1)
+    {
+    switch (opt)
+      {
+      case 'c': compress = true; break;
+      case 'x': expand = true; break;
+      case 'b': block_size = (uint32_t)strtoul(optarg, 0, 10); break;
+      default:
+        return 1;
+      }
+    }
+
+  if (compress == expand || argc - optind != 2)
+    {
+    fprintf(stderr, "usage: %s [-b messages] -c capture packed | -x packed capture\n", argv[0]);
+    return 1;
+    }
+
+  const char *input = argv[optind];
+  const char *output = argv[optind + 1];
+
+  double start = monotonic_seconds();
+  result_t result = compress ? cancodec_compress(input, output, block_size) : cancodec_expand(input, output);
+  double seconds = monotonic_seconds() - start;
+
+  if (failed(result))
+    {
+    fprintf(stderr, "%s failed, error %d\n", compress ? "compress" : "expand", (int)result);
+    return 1;
+    }
+
+  long long in_size = file_size(input);
+  long long out_size = file_size(output);
+  fprintf(stderr, "%lld to %lld bytes (%.2f:1) in %.3f s\n",
+          in_size, out_size,
+          compress ? (double)in_size / (out_size == 0 ? 1 : out_size) : (double)out_size / (in_size == 0 ? 1 : in_size),
+          seconds);
+  return 0;
+  }
@@ -0,0 +1,268 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+/*
+ * canfly_query
+ *
+ * Return the values of a set of ID's over a time range from any number
+ * of capture logs.
+ *
+ *  canfly_query [options] capture.log...
+ *
+ *  -s seconds    start of the time range
+ *  -e seconds    end of the time range
+ *  -i ids        comma separated ID names or numbers, default all
+ *  -t threads    worker threads, default one per cpu
+ *  -b records    records per block when building a summary
+ *  -q            count the values rather than printing them
+ *  -l            also time a linear scan of the captures, to compare
+ */
+#include "../canquery.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define READ_BATCH 65536
+
+typedef struct _output_t {
+  bool quiet;
+  const char *const *captures;
+  uint64_t values;
+  } output_t;
+
+static timed_canmsg_t msgs[READ_BATCH];
+
+static double monotonic_seconds(void)
+  {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+  }
+
+static const char *id_name(uint16_t id)
+  {
+  const canfly_id_info_t *info = find_canfly_id(id);
+  return info == 0 ? "" : info->name;
+  }
+
+static bool parse_ids(canquery_t *query, char *list)
+  {
+  for (char *name = strtok(list, ","); name != 0; name = strtok(0, ","))
+    {
+    char *end;
+    unsigned long id = strtoul(name, &end, 0);
+    if (*end != 0)
+      {
+      uint16_t i;
+      for (i = 0; i < num_canfly_ids && strcmp(canfly_ids[i].name, name) != 0; i++)
+        ;
+
+      if (i == num_canfly_ids)
+        {
+        fprintf(stderr, "unknown id %s\n", name);
+        return false;
+        }
+
+      id = canfly_ids[i].id;
+      }
+
+    canquery_add_id(query, (uint16_t)id);
+    }
+
+  return true;
+  }
+
+static result_t print_rows(const canquery_row_t *rows, uint32_t count, void *arg)
+  {
+  output_t *out = (output_t *)arg;
+  out->values += count;
+  if (out->quiet)
+    return s_ok;
+
+  for (uint32_t i = 0; i < count; i++)
+    {
+    char text[64];
+    uint16_t length;
+    if (failed(variant_to_string(&rows[i].value, text, sizeof(text), &length)))
+      text[0] = 0;
+
+    printf("%s,%llu.%06u,%s,%s\n",
+           out->captures[rows[i].capture],
+           (unsigned long long)(rows[i].timestamp / 1000000),
+           (unsigned)(rows[i].timestamp % 1000000),
+           id_name(rows[i].id),
+           text);
+    }
+
+  return s_ok;
+  }
+
+static bool wanted(const canquery_t *query, bool all_ids, uint16_t id)
+  {
+  return all_ids || (query->ids[id >> 6] & (1ULL << (id & 63))) != 0;
+  }
+
+// the same query as a single threaded scan of every record
+static result_t linear_scan(const canquery_t *query, uint64_t *values)
+  {
+  bool all_ids = true;
+  for (uint16_t w = 0; w < NUM_CAN_IDS / 64; w++)
+    if (query->ids[w] != 0)
+      all_ids = false;
+
+  *values = 0;
+  for (uint32_t c = 0; c < query->num_captures; c++)
+    {
+    result_t result;
+    canlog_t *log;
+    if (failed(result = canlog_open(query->captures[c], &log)))
+      return result;
+
+    uint32_t count = READ_BATCH;
+    while (succeeded(canlog_read(log, msgs, &count)))
+      {
+      for (uint32_t i = 0; i < count; i++)
+        {
+        if (msgs[i].timestamp < query->start || msgs[i].timestamp >= query->end)
+          continue;
+
+        canmsg_t expanded[PACKED_UINT16_MAX];
+        uint16_t num_expanded = 1;
+        const canmsg_t *msg = &msgs[i].msg;
+        if (get_can_len(msg) > 0 && msg->data[0] == CANFLY_PACKED_UINT16)
+          {
+          if (failed(expand_packed_msg(msg, expanded, &num_expanded)))
+            continue;
+          }
+        else
+          expanded[0] = *msg;
+
+        for (uint16_t j = 0; j < num_expanded; j++)
+          {
+          variant_t value;
+          if (wanted(query, all_ids, get_can_id(&expanded[j])) &&
+              succeeded(msg_to_variant(&expanded[j], &value)))
+            (*values)++;
+          }
+        }
+
+      count = READ_BATCH;
+      }
+
+    canlog_close(log);
+    }
+
+  return s_ok;
+  }
+
+int main(int argc, char **argv)
+  {
+  output_t out = { false, 0, 0 };
+  canquery_t query;
+  canquery_init(&query, 0, 0, print_rows, &out);
+  bool linear = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:e:i:t:b:ql")) != -1)
+    {
+    switch (opt)
+      {
+      case 's': query.start = (uint64_t)(strtod(optarg, 0) * 1000000); break;
+      case 'e': query.end = (uint64_t)(strtod(optarg, 0) * 1000000); break;
+      case 'i':
+        if (!parse_ids(&query, optarg))
+          return 1;
+        break;
+      case 't': query.threads = (uint16_t)strtoul(optarg, 0, 10); break;
+      case 'b': query.block_size = (uint32_t)strtoul(optarg, 0, 10); break;
+      case 'q': out.quiet = true; break;
+      case 'l': linear = true; break;
+      default:
+        return 1;
+      }
+    }
+
+  if (optind >= argc)
+    {
+    fprintf(stderr, "usage: %s [-s seconds] [-e seconds] [-i ids] [-t threads] [-b records] [-q] [-l] capture...\n", argv[0]);
+    return 1;
+    }
+
+  query.captures = (const char *const *)&argv[optind];
+  query.num_captures = (uint32_t)(argc - optind);
+  out.captures = query.captures;
+
+  double start = monotonic_seconds();
+  canquery_stats_t stats;
+  result_t result = canquery_run(&query, &stats);
+  double seconds = monotonic_seconds() - start;
+
+  if (failed(result))
+    {
+    fprintf(stderr, "query failed, error %d\n", (int)result);
+    return 1;
+    }
+
+  fprintf(stderr, "%llu values from %llu records, %llu of %llu blocks in %llu captures (%llu summarised) in %.3f s\n",
+          (unsigned long long)stats.values,
+          (unsigned long long)stats.records,
+          (unsigned long long)stats.scanned,
+          (unsigned long long)stats.blocks,
+          (unsigned long long)stats.captures,
+          (unsigned long long)stats.indexed,
+          seconds);
+
+  if (linear)
+    {
+    uint64_t values;
+    start = monotonic_seconds();
+    if (failed(result = linear_scan(&query, &values)))
+      {
+      fprintf(stderr, "scan failed, error %d\n", (int)result);
+      return 1;
+      }
+
+    seconds = monotonic_seconds() - start;
+    fprintf(stderr, "linear scan: %llu values in %.3f s\n", (unsigned long long)values, seconds);
+    }
+
+  return 0;
+  }
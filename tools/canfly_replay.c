@@ -0,0 +1,222 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+/*
+ * canfly_replay
+ *
+ * Replay captures through the parallel decode stage, keeping the range
+ * of every ID, and report the throughput and how busy each worker was.
+ *
+ *  canfly_replay [-t threads] [-s shards] [-c] [-S name] [-T trace.json] capture.log...
+ *
+ *  -c    coerce every value to a float before the range is kept
+ *  -S    publish the decode counters in the shared memory segment name
+ *        for canfly_top.  Each batch is stamped with the time it is read
+ *        so the latency is from reading to decoding
+ *  -T    trace the decode and rule stages to a Chrome trace file, needs
+ *        a build with CANFLY_TRACE
+ */
+#include "../canpipe.h"
+#include "../canstats.h"
+#include "../cantrace.h"
+#include "../canclock.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#define READ_BATCH 16384
+
+typedef struct _id_range_t {
+  uint64_t count;
+  float min;
+  float max;
+  } id_range_t;
+
+static id_range_t ranges[NUM_CAN_IDS];
+static timed_canmsg_t msgs[READ_BATCH];
+
+// each ID is only decoded by one worker at a time, so its range needs no lock
+static void keep_range(uint16_t worker, uint64_t timestamp, const canmsg_t *msg, const variant_t *value, void *arg)
+  {
+  (void)worker;
+  (void)timestamp;
+  (void)arg;
+
+  float f;
+  if (failed(coerce_to_float(value, &f)))
+    return;
+
+  id_range_t *range = &ranges[get_can_id(msg)];
+  if (range->count++ == 0 || f < range->min)
+    range->min = f;
+  if (range->count == 1 || f > range->max)
+    range->max = f;
+  }
+
+int main(int argc, char **argv)
+  {
+  canpipe_config_t config = {
+    .num_threads = (uint16_t)sysconf(_SC_NPROCESSORS_ONLN),
+    .num_shards = 0,
+    .capacity = READ_BATCH * 8,
+    .coerce = v_none,
+    .callback = keep_range,
+    .arg = 0,
+    .live = false,
+    };
+  const char *trace = 0;
+  const char *stats = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:s:cS:T:")) != -1)
+    {
+    switch (opt)
+      {
+      case 't': config.num_threads = (uint16_t)strtoul(optarg, 0, 10); break;
+      case 's': config.num_shards = (uint16_t)strtoul(optarg, 0, 10); break;
+      case 'c': config.coerce = v_float; break;
+      case 'S': stats = optarg; break;
+      case 'T': trace = optarg; break;
+      default:
+        return 1;
+      }
+    }
+
+  result_t result;
+  if (optind >= argc || config.num_threads == 0)
+    {
+    fprintf(stderr, "usage: %s [-t threads] [-s shards] [-c] [-S name] [-T trace.json] capture.log...\n", argv[0]);
+    return 1;
+    }
+
+  if (trace != 0 && failed(result = cantrace_enable(true)))
+    {
+    fprintf(stderr, "tracing is not built in, error %d\n", (int)result);
+    return 1;
+    }
+
+  if (stats != 0)
+    {
+    if (failed(result = canstats_create(stats)))
+      {
+      fprintf(stderr, "cannot publish %s, error %d\n", stats, (int)result);
+      return 1;
+      }
+
+    config.live = true;
+    }
+
+  canpipe_t *pipe;
+  if (failed(result = canpipe_create(&config, &pipe)))
+    {
+    fprintf(stderr, "cannot create the pipe, error %d\n", (int)result);
+    return 1;
+    }
+
+  uint64_t start = monotonic_ns();
+  uint64_t records = 0;
+  for (int i = optind; i < argc && succeeded(result); i++)
+    {
+    canlog_t *log;
+    if (failed(result = canlog_open(argv[i], &log)))
+      {
+      fprintf(stderr, "cannot open %s\n", argv[i]);
+      break;
+      }
+
+    uint32_t count = READ_BATCH;
+    while (succeeded(result = canlog_read(log, msgs, &count)))
+      {
+      if (stats != 0)
+        {
+        uint64_t now = canstats_now();
+        for (uint32_t j = 0; j < count; j++)
+          msgs[j].timestamp = now;
+        }
+
+      if (failed(result = canpipe_submit(pipe, msgs, count)))
+        break;
+
+      records += count;
+      count = READ_BATCH;
+      }
+
+    canlog_close(log);
+    if (result == e_no_more_information)
+      result = s_ok;
+    }
+
+  canpipe_flush(pipe);
+  double seconds = (monotonic_ns() - start) / 1e9;
+
+  uint16_t ids = 0;
+  for (uint16_t id = 0; id < NUM_CAN_IDS; id++)
+    ids += ranges[id].count > 0;
+
+  printf("%llu records, %u ids in %.3f s, %.0f records/s\n",
+         (unsigned long long)records, ids, seconds, records / seconds);
+  printf("%-8s %12s %10s %10s %10s %8s\n", "worker", "messages", "errors", "runs", "steals", "busy");
+  for (uint16_t w = 0; w < config.num_threads; w++)
+    {
+    canpipe_worker_stats_t stats;
+    canpipe_stats(pipe, w, &stats);
+    printf("%-8u %12llu %10llu %10llu %10llu %7.1f%%\n", w,
+           (unsigned long long)stats.messages,
+           (unsigned long long)stats.errors,
+           (unsigned long long)stats.runs,
+           (unsigned long long)stats.steals,
+           stats.elapsed_ns > 0 ? 100.0 * stats.busy_ns / stats.elapsed_ns : 0);
+    }
+
+  canpipe_close(pipe);
+  if (stats != 0)
+    canstats_close();
+
+  if (trace != 0 && failed(cantrace_dump(trace)))
+    fprintf(stderr, "cannot write %s\n", trace);
+
+  if (failed(result))
+    {
+    fprintf(stderr, "replay failed, error %d\n", (int)result);
+    return 1;
+    }
+
+  return 0;
+  }
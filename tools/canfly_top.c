@@ -0,0 +1,157 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+/*
+ * canfly_top
+ *
+ * Show the decode counters published by a process using canstats.
+ *
+ *  canfly_top [-n name] [-d seconds] [-l lines]
+ */
+#include "../canstats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static canstats_totals_t previous;
+static canstats_totals_t current;
+
+static const char *code_name(uint16_t code)
+  {
+  switch (-(int)code)
+    {
+    case e_bad_parameter : return "e_bad_parameter";
+    case e_bad_type : return "e_bad_type";
+    case e_bad_pointer : return "e_bad_pointer";
+    default : return "";
+    }
+  }
+
+int main(int argc, char **argv)
+  {
+  const char *name = "/canfly-stats";
+  uint32_t delay = 1;
+  uint16_t lines = 20;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:d:l:")) != -1)
+    {
+    switch (opt)
+      {
+      case 'n': name = optarg; break;
+      case 'd': delay = (uint32_t)strtoul(optarg, 0, 10); break;
+      case 'l': lines = (uint16_t)strtoul(optarg, 0, 10); break;
+      default:
+        fprintf(stderr, "usage: %s [-n name] [-d seconds] [-l lines]\n", argv[0]);
+        return 1;
+      }
+    }
+
+  const canstats_segment_t *segment;
+  result_t result;
+  if (failed(result = canstats_open(name, &segment)))
+    {
+    fprintf(stderr, "cannot open %s, error %d\n", name, (int)result);
+    return 1;
+    }
+
+  canstats_merge(segment, &previous);
+  for (;;)
+    {
+    sleep(delay);
+    if (failed(result = canstats_merge(segment, &current)))
+      {
+      fprintf(stderr, "segment %s is not valid\n", name);
+      break;
+      }
+
+    printf("\033[H\033[2J");
+    printf("pid %u, %u threads, %llu frames, %.0f frames/s, %llu without a slot\n",
+           (unsigned)segment->pid,
+           (unsigned)current.threads,
+           (unsigned long long)current.frames,
+           (double)(current.frames - previous.frames) / delay,
+           (unsigned long long)current.overflow);
+
+    uint64_t p50 = 0, p99 = 0, p999 = 0;
+    canstats_percentile(&current, 50, &p50);
+    canstats_percentile(&current, 99, &p99);
+    canstats_percentile(&current, 99.9f, &p999);
+    printf("ingest to decode latency ns: p50 %llu  p99 %llu  p99.9 %llu\n\n",
+           (unsigned long long)p50, (unsigned long long)p99, (unsigned long long)p999);
+
+    for (uint16_t code = 1; code < CANSTATS_NUM_CODES; code++)
+      if (current.failures[code] != 0)
+        printf("failures %4d %-20s %llu\n", -(int)code, code_name(code), (unsigned long long)current.failures[code]);
+
+    // busiest ID's over the last interval
+    printf("\n%5s %-40s %12s %14s\n", "id", "name", "frames/s", "frames");
+    bool shown[NUM_CAN_IDS];
+    memset(shown, 0, sizeof(shown));
+    for (uint16_t line = 0; line < lines; line++)
+      {
+      uint16_t busiest = NUM_CAN_IDS;
+      uint64_t most = 0;
+      for (uint16_t id = 0; id < NUM_CAN_IDS; id++)
+        {
+        uint64_t delta = current.id_frames[id] - previous.id_frames[id];
+        if (!shown[id] && delta > most)
+          {
+          most = delta;
+          busiest = id;
+          }
+        }
+
+      if (busiest == NUM_CAN_IDS)
+        break;
+
+      shown[busiest] = true;
+      const canfly_id_info_t *info = find_canfly_id(busiest);
+      printf("%5u %-40s %12.0f %14llu\n", (unsigned)busiest, info == 0 ? "" : info->name,
+             (double)most / delay, (unsigned long long)current.id_frames[busiest]);
+      }
+
+    fflush(stdout);
+    previous = current;
+    }
+
+  canstats_release(segment);
+  return 0;
+  }
@@ -0,0 +1,165 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+/*
+ * canfly_trigger
+ *
+ * Save the bus traffic around each alarm from a capture log, or from a
+ * live interface, instead of logging everything.
+ *
+ *  canfly_trigger [-p pre] [-a post] [-c capacity] -o directory -f capture.log
+ *  canfly_trigger [-p pre] [-a post] [-c capacity] [-t seconds] -o directory -i can0
+ */
+#include "../trigger.h"
+#include "../socketcan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#define READ_BATCH 4096
+
+static timed_canmsg_t msgs[READ_BATCH];
+
+static result_t replay_log(trigger_t *trigger, const char *path)
+  {
+  result_t result;
+  canlog_t *log;
+  if (failed(result = canlog_open(path, &log)))
+    return result;
+
+  uint32_t count = READ_BATCH;
+  while (succeeded(result = canlog_read(log, msgs, &count)))
+    {
+    trigger_add(trigger, msgs, count);
+    // a log is read much faster than real time, let the writer keep up
+    trigger_flush(trigger);
+    count = READ_BATCH;
+    }
+
+  canlog_close(log);
+  return result == e_no_more_information ? s_ok : result;
+  }
+
+static result_t capture_live(trigger_t *trigger, const char *ifname, uint32_t seconds)
+  {
+  result_t result;
+  int fd;
+  if (failed(result = socketcan_open(ifname, &fd)))
+    return result;
+
+  time_t end = time(0) + seconds;
+  while (time(0) < end)
+    {
+    uint32_t count = READ_BATCH;
+    if (succeeded(socketcan_read(fd, msgs, &count, 100)))
+      trigger_add(trigger, msgs, count);
+    }
+
+  socketcan_close(fd);
+  return s_ok;
+  }
+
+int main(int argc, char **argv)
+  {
+  trigger_options_t options = { 0 };
+  options.capacity = 1 << 18;
+  options.pre = 20000;
+  options.post = 10000;
+  options.alarms = true;
+  uint32_t seconds = 3600;
+  const char *path = 0;
+  const char *ifname = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "a:c:f:i:o:p:t:")) != -1)
+    {
+    switch (opt)
+      {
+      case 'a':
+        options.post = (uint32_t)strtoul(optarg, 0, 10);
+        break;
+      case 'c':
+        options.capacity = (uint32_t)strtoul(optarg, 0, 10);
+        break;
+      case 'f':
+        path = optarg;
+        break;
+      case 'i':
+        ifname = optarg;
+        break;
+      case 'o':
+        options.directory = optarg;
+        break;
+      case 'p':
+        options.pre = (uint32_t)strtoul(optarg, 0, 10);
+        break;
+      case 't':
+        seconds = (uint32_t)strtoul(optarg, 0, 10);
+        break;
+      default:
+        path = ifname = 0;
+        break;
+      }
+    }
+
+  trigger_t *trigger;
+  if ((path == 0) == (ifname == 0) || options.directory == 0 ||
+      failed(trigger_create(&options, &trigger)))
+    {
+    fprintf(stderr, "usage: %s [-p pre] [-a post] [-c capacity] -o directory -f capture | -i interface [-t seconds]\n", argv[0]);
+    return 1;
+    }
+
+  result_t result = path != 0 ? replay_log(trigger, path) : capture_live(trigger, ifname, seconds);
+
+  trigger_stats_t stats;
+  trigger_stats(trigger, &stats);
+  trigger_close(trigger);
+
+  if (failed(result))
+    {
+    fprintf(stderr, "error %d reading %s\n", (int)result, path != 0 ? path : ifname);
+    return 1;
+    }
+
+  printf("%llu frames, %u triggers, %u windows, %u dropped, %u overrun\n",
+         (unsigned long long)stats.frames, stats.triggers, stats.windows, stats.dropped, stats.overrun);
+  return 0;
+  }
@@ -0,0 +1,277 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+/*
+ * canfly_udp
+ *
+ * Gateway telemetry from a CAN interface or a capture to a UDP
+ * multicast group, or receive it again.
+ *
+ *  canfly_udp [options] [-t seconds] -i can0
+ *  canfly_udp [options] [-x] -f capture.log
+ *  canfly_udp [options] -r [-t seconds] [-o capture.log]
+ *
+ *  -g group      multicast group, default 239.255.70.1
+ *  -p port       port, default 5570
+ *  -a address    address of the local interface to use
+ *  -d ms         longest a message waits to be sent, default 100
+ *  -s bytes      datagram size, default 1472
+ *  -x            send a capture as fast as possible rather than at its own pace
+ */
+#include "../canudp.h"
+#include "../socketcan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#define READ_BATCH 256
+
+static timed_canmsg_t msgs[READ_BATCH];
+
+static uint64_t monotonic_us(void)
+  {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+  }
+
+static void print_stats(const char *what, const canudp_stats_t *stats, uint64_t elapsed)
+  {
+  double seconds = elapsed > 0 ? elapsed / 1e6 : 1;
+  printf("%s %llu messages in %llu datagrams, %.1f messages per datagram, %.0f datagrams/s, %llu calls\n",
+         what,
+         (unsigned long long)stats->messages,
+         (unsigned long long)stats->datagrams,
+         stats->datagrams > 0 ? (double)stats->messages / stats->datagrams : 0,
+         stats->datagrams / seconds,
+         (unsigned long long)stats->calls);
+  if (stats->errors > 0 || stats->lost > 0 || stats->corrupt > 0)
+    printf("%llu send errors, %llu datagrams lost, %llu corrupt\n",
+           (unsigned long long)stats->errors,
+           (unsigned long long)stats->lost,
+           (unsigned long long)stats->corrupt);
+  }
+
+static result_t send_interface(canudp_sender_t *sender, const char *name, uint32_t seconds)
+  {
+  int fd;
+  result_t result;
+  if (failed(result = socketcan_open(name, &fd)))
+    {
+    fprintf(stderr, "cannot open %s\n", name);
+    return result;
+    }
+
+  uint64_t end = monotonic_us() + ((uint64_t)seconds * 1000000);
+  uint64_t next = UINT64_MAX;
+  uint64_t now;
+  while ((now = monotonic_us()) < end)
+    {
+    // wake in time for the next deadline
+    int timeout = next == UINT64_MAX ? 100 : next > now ? (int)((next - now + 999) / 1000) : 0;
+    uint32_t count = READ_BATCH;
+    if (succeeded(socketcan_read(fd, msgs, &count, timeout)))
+      canudp_send(sender, msgs, count, monotonic_us());
+
+    canudp_poll(sender, monotonic_us(), &next);
+    }
+
+  socketcan_close(fd);
+  return s_ok;
+  }
+
+static result_t send_capture(canudp_sender_t *sender, const char *path, bool paced)
+  {
+  canlog_t *log;
+  result_t result;
+  if (failed(result = canlog_open(path, &log)))
+    {
+    fprintf(stderr, "cannot open %s\n", path);
+    return result;
+    }
+
+  uint64_t start = monotonic_us();
+  uint64_t first = 0;
+  bool have_first = false;
+  uint32_t count = READ_BATCH;
+  while (succeeded(result = canlog_read(log, msgs, &count)))
+    {
+    uint32_t i = 0;
+    while (i < count)
+      {
+      // send the messages that are due, then wait for the next or a deadline
+      uint64_t now = monotonic_us();
+      if (!have_first)
+        {
+        first = msgs[0].timestamp;
+        have_first = true;
+        }
+
+      uint32_t due = count - i;
+      if (paced)
+        for (due = 0; i + due < count && msgs[i + due].timestamp - first <= now - start; due++)
+          ;
+
+      if (due > 0)
+        {
+        canudp_send(sender, msgs + i, due, now);
+        i += due;
+        continue;
+        }
+
+      uint64_t next;
+      canudp_poll(sender, now, &next);
+      uint64_t wake = start + (msgs[i].timestamp - first);
+      if (next < wake)
+        wake = next;
+
+      if (wake > now)
+        usleep((useconds_t)(wake - now));
+      }
+
+    count = READ_BATCH;
+    }
+
+  canlog_close(log);
+  return result == e_no_more_information ? s_ok : result;
+  }
+
+static result_t receive(canudp_receiver_t *receiver, uint32_t seconds, canlog_t *out)
+  {
+  uint64_t end = monotonic_us() + ((uint64_t)seconds * 1000000);
+  while (monotonic_us() < end)
+    {
+    uint32_t count = READ_BATCH;
+    if (succeeded(canudp_receive(receiver, msgs, &count, 100)) && out != 0)
+      canlog_write(out, msgs, count);
+    }
+
+  return s_ok;
+  }
+
+int main(int argc, char **argv)
+  {
+  canudp_config_t config = { "239.255.70.1", 5570, 0, 0, 100000, 1, true };
+  const char *interface = 0;
+  const char *capture = 0;
+  const char *output = 0;
+  bool receiving = false;
+  bool paced = true;
+  uint32_t seconds = 10;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "g:p:a:d:s:i:f:xro:t:")) != -1)
+    {
+    switch (opt)
+      {
+      case 'g': config.group = optarg; break;
+      case 'p': config.port = (uint16_t)strtoul(optarg, 0, 10); break;
+      case 'a': config.interface = optarg; break;
+      case 'd': config.deadline = (uint32_t)strtoul(optarg, 0, 10) * 1000; break;
+      case 's': config.size = (uint16_t)strtoul(optarg, 0, 10); break;
+      case 'i': interface = optarg; break;
+      case 'f': capture = optarg; break;
+      case 'x': paced = false; break;
+      case 'r': receiving = true; break;
+      case 'o': output = optarg; break;
+      case 't': seconds = (uint32_t)strtoul(optarg, 0, 10); break;
+      default:
+        return 1;
+      }
+    }
+
+  if (receiving ? (interface != 0 || capture != 0) : ((interface == 0) == (capture == 0)))
+    {
+    fprintf(stderr, "usage: %s [-g group] [-p port] [-a address] [-d ms] [-s bytes] [-t seconds] -i interface | [-x] -f capture\n"
+                    "       %s [-g group] [-p port] [-a address] [-t seconds] -r [-o output]\n", argv[0], argv[0]);
+    return 1;
+    }
+
+  result_t result;
+  uint64_t start = monotonic_us();
+  canudp_stats_t stats;
+  if (receiving)
+    {
+    canudp_receiver_t *receiver;
+    canlog_t *out = 0;
+    if (failed(result = canudp_receiver_open(&config, &receiver)))
+      {
+      fprintf(stderr, "cannot join %s:%u, error %d\n", config.group, config.port, (int)result);
+      return 1;
+      }
+
+    if (output != 0 && failed(result = canlog_create(output, &out)))
+      {
+      fprintf(stderr, "cannot create %s, error %d\n", output, (int)result);
+      return 1;
+      }
+
+    result = receive(receiver, seconds, out);
+    if (out != 0)
+      canlog_close(out);
+
+    canudp_receiver_stats(receiver, &stats);
+    canudp_receiver_close(receiver);
+    print_stats("received", &stats, monotonic_us() - start);
+    }
+  else
+    {
+    canudp_sender_t *sender;
+    if (failed(result = canudp_sender_open(&config, &sender)))
+      {
+      fprintf(stderr, "cannot send to %s:%u, error %d\n", config.group, config.port, (int)result);
+      return 1;
+      }
+
+    result = interface != 0 ? send_interface(sender, interface, seconds) : send_capture(sender, capture, paced);
+    canudp_flush(sender);
+    canudp_sender_stats(sender, &stats);
+    canudp_sender_close(sender);
+    print_stats("sent", &stats, monotonic_us() - start);
+    }
+
+  if (failed(result))
+    {
+    fprintf(stderr, "failed, error %d\n", (int)result);
+    return 1;
+    }
+
+  return 0;
+  }
@@ -0,0 +1,329 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#include "trigger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+// frozen windows waiting for the writer
+#define TRIGGER_WINDOWS 16
+// frames copied from the ring per write
+#define WRITE_BATCH 1024
+
+typedef struct _window_t {
+  uint64_t start;               // first frame
+  uint64_t end;                 // frame after the last
+  } window_t;
+
+struct _trigger_t {
+  trigger_options_t options;
+  char directory[256];
+  uint32_t mask;
+  timed_canmsg_t *ring;
+
+  // owned by the ingest thread
+  uint64_t head;                // frames added
+  uint64_t reserved;            // frames added, or being added
+  bool capturing;
+  window_t capture;
+  uint64_t alarm_active[(ALARM_ID_LAST + 64) / 64];
+  uint64_t frames;
+  uint32_t triggers;
+  uint32_t windows;
+  uint32_t dropped;
+
+  // frozen windows, single producer and consumer
+  window_t queue[TRIGGER_WINDOWS];
+  uint32_t queue_head;
+  uint32_t queue_tail;
+
+  // owned by the writer thread
+  pthread_t thread;
+  bool stop;
+  uint32_t written;
+  uint32_t overrun;
+  uint32_t file_number;
+  timed_canmsg_t batch[WRITE_BATCH];
+  };
+
+static void sleep_ms(uint32_t ms)
+  {
+  struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000 };
+  nanosleep(&ts, 0);
+  }
+
+static void save_window(trigger_t *trigger, const window_t *window)
+  {
+  char path[320];
+  snprintf(path, sizeof(path), "%s/trigger_%u.cflg", trigger->directory, trigger->file_number++);
+
+  canlog_t *log;
+  if (failed(canlog_create(path, &log)))
+    return;
+
+  for (uint64_t first = window->start; first < window->end; )
+    {
+    uint32_t count = window->end - first > WRITE_BATCH ? WRITE_BATCH : (uint32_t)(window->end - first);
+    for (uint32_t i = 0; i < count; i++)
+      trigger->batch[i] = trigger->ring[(first + i) & trigger->mask];
+
+    // the copy is only good if ingest has not started on the slots since
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&trigger->reserved, __ATOMIC_RELAXED) > first + trigger->mask + 1)
+      {
+      canlog_close(log);
+      remove(path);
+      __atomic_add_fetch(&trigger->overrun, 1, __ATOMIC_RELAXED);
+      return;
+      }
+
+    canlog_write(log, trigger->batch, count);
+    first += count;
+    }
+
+  canlog_close(log);
+  __atomic_add_fetch(&trigger->written, 1, __ATOMIC_RELAXED);
+  }
+
+static void *writer(void *arg)
+  {
+  trigger_t *trigger = (trigger_t *)arg;
+
+  for (;;)
+    {
+    bool stop = __atomic_load_n(&trigger->stop, __ATOMIC_ACQUIRE);
+    uint32_t tail = trigger->queue_tail;
+    if (tail == __atomic_load_n(&trigger->queue_head, __ATOMIC_ACQUIRE))
+      {
+      // stop is read first so a window queued before it is not missed
+      if (stop)
+        break;
+
+      sleep_ms(trigger->options.poll_ms);
+      continue;
+      }
+
+    const window_t *window = &trigger->queue[tail % TRIGGER_WINDOWS];
+    if (__atomic_load_n(&trigger->head, __ATOMIC_ACQUIRE) < window->end)
+      {
+      sleep_ms(trigger->options.poll_ms);
+      continue;
+      }
+
+    save_window(trigger, window);
+    __atomic_store_n(&trigger->queue_tail, tail + 1, __ATOMIC_RELEASE);
+    }
+
+  return 0;
+  }
+
+result_t trigger_create(const trigger_options_t *options, trigger_t **trigger)
+  {
+  if (options == 0 || trigger == 0 || options->directory == 0 ||
+      strlen(options->directory) >= sizeof(((trigger_t *)0)->directory) ||
+      options->capacity == 0 || (options->capacity & (options->capacity - 1)) != 0 ||
+      (uint64_t)(options->pre + options->post + 1) * 2 > options->capacity)
+    return e_bad_parameter;
+
+  trigger_t *tp = (trigger_t *)calloc(1, sizeof(trigger_t));
+  if (tp == 0)
+    return e_not_enough_memory;
+
+  // the ring is allocated and touched here, never on the ingest path
+  if ((tp->ring = (timed_canmsg_t *)calloc(options->capacity, sizeof(timed_canmsg_t))) == 0)
+    {
+    free(tp);
+    return e_not_enough_memory;
+    }
+
+  tp->options = *options;
+  if (tp->options.poll_ms == 0)
+    tp->options.poll_ms = 10;
+
+  strcpy(tp->directory, options->directory);
+  tp->options.directory = tp->directory;
+  tp->mask = options->capacity - 1;
+
+  if (pthread_create(&tp->thread, 0, writer, tp) != 0)
+    {
+    free(tp->ring);
+    free(tp);
+    return e_generic_error;
+    }
+
+  *trigger = tp;
+  return s_ok;
+  }
+
+static bool is_trigger(trigger_t *trigger, const timed_canmsg_t *msg)
+  {
+  if (trigger->options.alarms && is_alarm_msg(&msg->msg))
+    {
+    // only the change to active triggers, not every frame of an active alarm
+    uint16_t id = get_can_id(&msg->msg);
+    uint64_t bit = 1ULL << (id & 63);
+    uint64_t *word = &trigger->alarm_active[id >> 6];
+    variant_t v;
+    bool active;
+    if (succeeded(msg_to_variant(&msg->msg, &v)) && succeeded(coerce_to_bool(&v, &active)))
+      {
+      bool was_active = (*word & bit) != 0;
+      if (active)
+        *word |= bit;
+      else
+        *word &= ~bit;
+
+      if (active && !was_active)
+        return true;
+      }
+    }
+
+  return trigger->options.predicate != 0 && trigger->options.predicate(msg, trigger->options.arg);
+  }
+
+static void freeze(trigger_t *trigger)
+  {
+  trigger->capturing = false;
+
+  uint32_t head = trigger->queue_head;
+  if (head - __atomic_load_n(&trigger->queue_tail, __ATOMIC_ACQUIRE) == TRIGGER_WINDOWS)
+    {
+    __atomic_store_n(&trigger->dropped, trigger->dropped + 1, __ATOMIC_RELAXED);
+    return;
+    }
+
+  trigger->queue[head % TRIGGER_WINDOWS] = trigger->capture;
+  __atomic_store_n(&trigger->queue_head, head + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&trigger->windows, trigger->windows + 1, __ATOMIC_RELAXED);
+  }
+
+result_t trigger_add(trigger_t *trigger, const timed_canmsg_t *msgs, uint32_t count)
+  {
+  if (trigger == 0 || (msgs == 0 && count > 0))
+    return e_bad_parameter;
+
+  uint64_t head = trigger->head;
+  uint32_t pre = trigger->options.pre;
+  uint32_t post = trigger->options.post;
+  // a window may span half the ring, leaving the writer the other half
+  uint64_t max_window = (trigger->mask + 1) >> 1;
+
+  // tell the writer which slots are about to change
+  __atomic_store_n(&trigger->reserved, head + count, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  for (uint32_t i = 0; i < count; i++)
+    {
+    uint64_t seq = head + i;
+    trigger->ring[seq & trigger->mask] = msgs[i];
+
+    if (is_trigger(trigger, &msgs[i]))
+      {
+      __atomic_store_n(&trigger->triggers, trigger->triggers + 1, __ATOMIC_RELAXED);
+      if (!trigger->capturing)
+        {
+        trigger->capturing = true;
+        trigger->capture.start = seq >= pre ? seq - pre : 0;
+        trigger->capture.end = seq + 1 + post;
+        }
+      else if (seq + 1 + post > trigger->capture.end)
+        {
+        trigger->capture.end = seq + 1 + post;
+        if (trigger->capture.end - trigger->capture.start > max_window)
+          trigger->capture.end = trigger->capture.start + max_window;
+        }
+      }
+
+    if (trigger->capturing && seq + 1 >= trigger->capture.end)
+      freeze(trigger);
+    }
+
+  __atomic_store_n(&trigger->head, head + count, __ATOMIC_RELEASE);
+  __atomic_store_n(&trigger->frames, trigger->frames + count, __ATOMIC_RELAXED);
+
+  return s_ok;
+  }
+
+result_t trigger_flush(trigger_t *trigger)
+  {
+  if (trigger == 0)
+    return e_bad_parameter;
+
+  while (__atomic_load_n(&trigger->queue_tail, __ATOMIC_ACQUIRE) != trigger->queue_head)
+    sleep_ms(trigger->options.poll_ms);
+
+  return s_ok;
+  }
+
+result_t trigger_stats(trigger_t *trigger, trigger_stats_t *stats)
+  {
+  if (trigger == 0 || stats == 0)
+    return e_bad_parameter;
+
+  stats->frames = __atomic_load_n(&trigger->frames, __ATOMIC_RELAXED);
+  stats->triggers = __atomic_load_n(&trigger->triggers, __ATOMIC_RELAXED);
+  stats->windows = __atomic_load_n(&trigger->windows, __ATOMIC_RELAXED);
+  stats->written = __atomic_load_n(&trigger->written, __ATOMIC_RELAXED);
+  stats->dropped = __atomic_load_n(&trigger->dropped, __ATOMIC_RELAXED);
+  stats->overrun = __atomic_load_n(&trigger->overrun, __ATOMIC_RELAXED);
+
+  return s_ok;
+  }
+
+result_t trigger_close(trigger_t *trigger)
+  {
+  if (trigger == 0)
+    return e_bad_parameter;
+
+  if (trigger->capturing)
+    {
+    trigger->capture.end = trigger->head;
+    freeze(trigger);
+    }
+
+  __atomic_store_n(&trigger->stop, true, __ATOMIC_RELEASE);
+  pthread_join(trigger->thread, 0);
+
+  free(trigger->ring);
+  free(trigger);
+  return s_ok;
+  }
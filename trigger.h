@@ -0,0 +1,122 @@
+/*
+Copyright (C) 2016-2022 Kotuku Aerospace Limited
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+If a file does not contain a copyright header, either because it is incomplete
+or a binary file then the above copyright notice will apply.
+
+Portions of this repository may have further copyright notices that may be
+identified in the respective files.  In those cases the above copyright notice and
+the GPL3 are subservient to that copyright notice.
+
+Portions of this repository contain code fragments from the following
+providers.
+
+
+If any file has a copyright notice or portions of code have been used
+and the original copyright notice is not yet transcribed to the repository
+then the original copyright notice is to be respected.
+
+If any material is included in the repository that is not open source
+it must be removed as soon as possible after the code fragment is identified.
+
+If you wish to use any of this code in a commercial application then
+you must obtain a licence from the copyright holder.  Contact
+support@kotuku.aero for information on the commercial licences.
+*/
+#ifndef __trigger_h__
+#define __trigger_h__
+
+#include "canlog.h"
+
+/*************************************************
+ * Pre/post trigger capture.
+ *
+ * Every frame is copied into a ring that is continuously overwritten.
+ * When an alarm goes active, or a frame matches a predicate, a window of
+ * frames from before and after the trigger is frozen and handed to a
+ * writer thread, which saves it as a capture log.  Triggers that arrive
+ * while the post trigger frames are being collected extend the window.
+ *
+ * trigger_add does no system calls, takes no locks and never waits for
+ * the writer.  The writer reads the window straight from the ring and
+ * checks afterwards that ingest has not lapped it, a window that was
+ * overwritten before it could be saved is discarded and counted.
+ *
+ * Windows are written to <directory>/trigger_<n>.cflg
+ */
+typedef bool (*trigger_predicate)(const timed_canmsg_t *msg, void *arg);
+
+typedef struct _trigger_options_t {
+  const char *directory;        // where windows are written
+  uint32_t capacity;            // frames in the ring, a power of 2
+  uint32_t pre;                 // frames saved from before the trigger
+  uint32_t post;                // frames saved from after the trigger
+  bool alarms;                  // trigger when an alarm goes active
+  trigger_predicate predicate;  // extra trigger, 0 for none
+  void *arg;                    // passed to the predicate
+  uint32_t poll_ms;             // how often the writer looks for windows
+  } trigger_options_t;
+
+typedef struct _trigger_stats_t {
+  uint64_t frames;              // frames added
+  uint32_t triggers;            // trigger frames, including those that extended a window
+  uint32_t windows;             // windows frozen
+  uint32_t written;             // windows saved
+  uint32_t dropped;             // windows lost as the writer queue was full
+  uint32_t overrun;             // windows lost as the ring lapped them
+  } trigger_stats_t;
+
+typedef struct _trigger_t trigger_t;
+
+/**
+ * @brief Create a capture ring and start its writer
+ * @param options Options, the ring holds at least twice pre + post frames
+ * @param trigger Created capture
+ * @return s_ok if created
+ */
+extern result_t trigger_create(const trigger_options_t *options, trigger_t **trigger);
+/**
+ * @brief Add frames to the ring, from the ingest thread
+ * @param trigger Capture
+ * @param msgs    Frames
+ * @param count   Number of frames
+ * @return s_ok if added
+ */
+extern result_t trigger_add(trigger_t *trigger, const timed_canmsg_t *msgs, uint32_t count);
+/**
+ * @brief Wait until the windows frozen so far are written
+ * @param trigger Capture
+ * @return s_ok when written
+ * @remark For replaying captures faster than real time, not for use on
+ * the ingest path.
+ */
+extern result_t trigger_flush(trigger_t *trigger);
+/**
+ * @brief Return the capture statistics
+ * @param trigger Capture
+ * @param stats   Statistics
+ * @return s_ok
+ */
+extern result_t trigger_stats(trigger_t *trigger, trigger_stats_t *stats);
+/**
+ * @brief Stop the capture, a window still collecting is cut short and
+ * all frozen windows are written before returning
+ * @param trigger Capture
+ * @return s_ok if closed
+ */
+extern result_t trigger_close(trigger_t *trigger);
+
+#endif
@@ -37,6 +37,13 @@ you must obtain a licence from the copyright holder.  Contact
 support@kotuku.aero for information on the commercial licences.
 */
 #include "neutron.h"
+#include "cantrace.h"
+#include "canstats.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
 
 const variant_t *create_variant_nodata(variant_t *v)
   {
@@ -120,6 +127,14 @@ const variant_t *create_variant_utc(const tm_t* value, variant_t* v)
   return v;
   }
 
+const variant_t *create_variant_epoch(uint32_t value, variant_t *v)
+  {
+  v->value.epoch = value;
+  v->vt = v_epoch;
+
+  return v;
+  }
+
 static float get_float(const canmsg_t *msg)
   {
   uint32_t value = (((uint32_t)msg->data[1]) << 24) |
@@ -143,7 +158,7 @@ static uint32_t get_uint32(const canmsg_t *msg)
     ((uint32_t)msg->data[4]);
   }
 
-result_t msg_to_variant(const canmsg_t *msg, variant_t *v)
+static inline result_t decode_variant(const canmsg_t *msg, variant_t *v)
   {
   if (msg == 0 || v == 0)
     return e_bad_parameter;
@@ -231,7 +246,16 @@ result_t msg_to_variant(const canmsg_t *msg, variant_t *v)
   return s_ok;
   }
 
-result_t variant_to_msg(const variant_t *v, uint16_t id, uint16_t type, canmsg_t *msg)
+result_t msg_to_variant(const canmsg_t *msg, variant_t *v)
+  {
+  CANTRACE_BEGIN(trace);
+  result_t result = decode_variant(msg, v);
+  CANTRACE_END(trace, ts_decode, msg != 0 ? get_can_id(msg) : 0);
+  CANSTATS_COUNT(msg, result);
+  return result;
+  }
+
+static inline result_t encode_variant(const variant_t *v, uint16_t id, uint16_t type, canmsg_t *msg)
   {
   result_t result;
   set_can_id(msg, id);
@@ -336,6 +360,14 @@ result_t variant_to_msg(const variant_t *v, uint16_t id, uint16_t type, canmsg_t
   return s_ok;
   }
 
+result_t variant_to_msg(const variant_t *v, uint16_t id, uint16_t type, canmsg_t *msg)
+  {
+  CANTRACE_BEGIN(trace);
+  result_t result = encode_variant(v, id, type, msg);
+  CANTRACE_END(trace, ts_encode, id);
+  return result;
+  }
+
 result_t coerce_to_bool(const variant_t *src, bool *value)
   {
   switch (src->vt)
@@ -704,16 +736,66 @@ result_t coerce_to_float(const variant_t *src, float *value)
 
 result_t coerce_to_utc(const variant_t* src, tm_t* value)
   {
-  if(src->vt != v_utc)
-    return e_bad_type;
+  if(src == 0 || value == 0)
+    return e_bad_pointer;
 
+  switch(src->vt)
+    {
+    case v_utc :
+      memcpy(value, &src->value.utc, sizeof(tm_t));
+      break;
+    case v_epoch :
+      epoch_to_tm(src->value.epoch, value);
+      break;
+    default :
+      return e_bad_type;
+    }
+
+  return s_ok;
+  }
+
+result_t coerce_to_epoch(const variant_t *src, uint32_t *value)
+  {
   if(src == 0 || value == 0)
     return e_bad_pointer;
 
-  memcpy(value, &src->value.utc, sizeof(tm_t));
+  switch(src->vt)
+    {
+    case v_utc :
+      {
+      int64_t seconds = tm_to_epoch(&src->value.utc);
+      if(seconds < 0 || seconds > UINT32_MAX)
+        return e_out_of_range;
+
+      *value = (uint32_t)seconds;
+      }
+      break;
+    case v_epoch :
+      *value = src->value.epoch;
+      break;
+    default :
+      return e_bad_type;
+    }
+
   return s_ok;
   }
 
+// milliseconds since the epoch of a time variant
+static bool time_of(const variant_t *v, int64_t *ms)
+  {
+  switch(v->vt)
+    {
+    case v_utc :
+      *ms = tm_to_epoch_ms(&v->value.utc);
+      return true;
+    case v_epoch :
+      *ms = (int64_t)v->value.epoch * 1000;
+      return true;
+    default :
+      return false;
+    }
+  }
+
 const variant_t *copy_variant(const variant_t *src, variant_t *dst)
   {
   dst->vt = src->vt;
@@ -737,6 +819,20 @@ int compare_variant(const variant_t *v1, const variant_t *v2)
 
   result_t result;
 
+  // times compare as integers, never equal any other type and sort
+  // after them so swapping the operands flips the sign
+  int64_t time1;
+  int64_t time2;
+  bool is_time1 = time_of(v1, &time1);
+  bool is_time2 = time_of(v2, &time2);
+  if (is_time1 || is_time2)
+    {
+    if (!is_time1 || !is_time2)
+      return is_time1 ? 1 : -1;
+
+    return time1 > time2 ? 1 : time1 == time2 ? 0 : -1;
+    }
+
   variant_type comp_type;
 
   // coerce to best type
@@ -958,9 +1054,600 @@ result_t coerce_variant(const variant_t *src, variant_t *dst, variant_type to_ty
       create_variant_float(value, dst);
       }
       break;
+    case v_utc :
+      {
+      tm_t value;
+      if (failed(result = coerce_to_utc(src, &value)))
+        return result;
+      create_variant_utc(&value, dst);
+      }
+      break;
+    case v_epoch :
+      {
+      uint32_t value;
+      if (failed(result = coerce_to_epoch(src, &value)))
+        return result;
+      create_variant_epoch(value, dst);
+      }
+      break;
     default:
       return e_bad_parameter;
     }
 
   return s_ok;
-  }
\ No newline at end of file
+  }
+
+/*************************************************
+ * Text conversion
+ */
+static const char digit_pairs[] =
+  "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+  "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+#define POW10_MIN -54
+#define POW10_MAX 39
+
+static const double pow10_table[] = {
+  1e-54, 1e-53, 1e-52, 1e-51, 1e-50, 1e-49, 1e-48, 1e-47, 1e-46, 1e-45,
+  1e-44, 1e-43, 1e-42, 1e-41, 1e-40, 1e-39, 1e-38, 1e-37, 1e-36, 1e-35,
+  1e-34, 1e-33, 1e-32, 1e-31, 1e-30, 1e-29, 1e-28, 1e-27, 1e-26, 1e-25,
+  1e-24, 1e-23, 1e-22, 1e-21, 1e-20, 1e-19, 1e-18, 1e-17, 1e-16, 1e-15,
+  1e-14, 1e-13, 1e-12, 1e-11, 1e-10, 1e-9, 1e-8, 1e-7, 1e-6, 1e-5, 1e-4,
+  1e-3, 1e-2, 1e-1, 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+  1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+  1e23, 1e24, 1e25, 1e26, 1e27, 1e28, 1e29, 1e30, 1e31, 1e32, 1e33, 1e34,
+  1e35, 1e36, 1e37, 1e38, 1e39
+  };
+
+static const uint32_t pow10_int[] = {
+  1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+  };
+
+// longest text a single variant formats to
+#define MAX_VARIANT_TEXT 48
+
+static inline double pow10_of(int16_t exponent)
+  {
+  return pow10_table[exponent - POW10_MIN];
+  }
+
+static uint16_t format_uint(uint32_t value, char *out)
+  {
+  char tmp[10];
+  char *p = tmp + 10;
+
+  while (value >= 100)
+    {
+    uint32_t q = value / 100;
+    p -= 2;
+    memcpy(p, digit_pairs + ((value - (q * 100)) << 1), 2);
+    value = q;
+    }
+
+  if (value >= 10)
+    {
+    p -= 2;
+    memcpy(p, digit_pairs + (value << 1), 2);
+    }
+  else
+    *--p = (char)('0' + value);
+
+  uint16_t len = (uint16_t)(tmp + 10 - p);
+  memcpy(out, p, len);
+  return len;
+  }
+
+static uint16_t format_int(int32_t value, char *out)
+  {
+  if (value >= 0)
+    return format_uint((uint32_t)value, out);
+
+  *out = '-';
+  return 1 + format_uint(0u - (uint32_t)value, out + 1);
+  }
+
+// format a value with leading zeros to a minimum width
+static uint16_t format_padded(uint32_t value, uint16_t width, char *out)
+  {
+  char tmp[10];
+  uint16_t len = format_uint(value, tmp);
+  uint16_t pad = len < width ? width - len : 0;
+
+  memset(out, '0', pad);
+  memcpy(out + pad, tmp, len);
+  return pad + len;
+  }
+
+// find the shortest decimal that reads back as the same float
+static uint16_t format_float(float value, char *out)
+  {
+  char *p = out;
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+
+  if ((bits & 0x7F800000) == 0x7F800000)
+    {
+    if ((bits & 0x007FFFFF) != 0)
+      {
+      memcpy(p, "nan", 3);
+      return 3;
+      }
+
+    if (bits >> 31)
+      *p++ = '-';
+
+    memcpy(p, "inf", 3);
+    return (uint16_t)(p - out) + 3;
+    }
+
+  if (bits >> 31)
+    *p++ = '-';
+
+  float magnitude = value < 0 ? -value : value;
+  double x = magnitude;
+  if (x == 0)
+    {
+    *p++ = '0';
+    return (uint16_t)(p - out);
+    }
+
+  // integers are exact
+  if (x < 16777216.0 && x == (double)(uint32_t)x)
+    return (uint16_t)(p - out) + format_uint((uint32_t)x, p);
+
+  // estimate the decimal exponent from the binary one, then correct it
+  int16_t e2 = (int16_t)((bits >> 23) & 0xFF) - 127;
+  int16_t e10 = (int16_t)((e2 * 78913) >> 18);
+  if (e10 < POW10_MIN + 9)
+    e10 = POW10_MIN + 9;
+
+  while (e10 < POW10_MAX && x >= pow10_of(e10 + 1))
+    e10++;
+
+  while (e10 > POW10_MIN + 9 && x < pow10_of(e10))
+    e10--;
+
+  uint32_t digits = 0;
+  uint16_t precision;
+  int16_t exponent = e10;
+  for (precision = 1; precision <= 9; precision++)
+    {
+    exponent = e10;
+    double scaled = x / pow10_of(e10 - precision + 1);
+    digits = (uint32_t)(scaled + 0.5);
+    if (digits >= pow10_int[precision])
+      {
+      // rounded up to the next power of 10
+      digits /= 10;
+      exponent++;
+      }
+
+    if (exponent - precision + 1 > POW10_MAX)
+      continue;
+
+    if ((float)(digits * pow10_of(exponent - precision + 1)) == magnitude)
+      break;
+    }
+
+  if (precision > 9)
+    {
+    // not reached for any finite float, kept as a safe fallback
+    int len = snprintf(p, MAX_VARIANT_TEXT - 1, "%.9g", (double)magnitude);
+    return (uint16_t)(p - out) + (uint16_t)len;
+    }
+
+  // remove trailing zeros
+  while (precision > 1 && digits % 10 == 0)
+    {
+    digits /= 10;
+    precision--;
+    }
+
+  char text[10];
+  format_padded(digits, precision, text);
+
+  if (exponent >= 0 && exponent < 9)
+    {
+    if (exponent + 1 >= precision)
+      {
+      // an integer, pad with zeros
+      memcpy(p, text, precision);
+      p += precision;
+      memset(p, '0', exponent + 1 - precision);
+      p += exponent + 1 - precision;
+      }
+    else
+      {
+      memcpy(p, text, exponent + 1);
+      p += exponent + 1;
+      *p++ = '.';
+      memcpy(p, text + exponent + 1, precision - exponent - 1);
+      p += precision - exponent - 1;
+      }
+    }
+  else if (exponent < 0 && exponent >= -5)
+    {
+    *p++ = '0';
+    *p++ = '.';
+    memset(p, '0', -exponent - 1);
+    p += -exponent - 1;
+    memcpy(p, text, precision);
+    p += precision;
+    }
+  else
+    {
+    *p++ = text[0];
+    if (precision > 1)
+      {
+      *p++ = '.';
+      memcpy(p, text + 1, precision - 1);
+      p += precision - 1;
+      }
+
+    *p++ = 'e';
+    *p++ = exponent < 0 ? '-' : '+';
+    p += format_padded(exponent < 0 ? -exponent : exponent, 2, p);
+    }
+
+  return (uint16_t)(p - out);
+  }
+
+static uint16_t format_utc(const tm_t *utc, char *out)
+  {
+  char *p = out;
+  p += format_padded(utc->year, 4, p);
+  *p++ = '-';
+  p += format_padded(utc->month, 2, p);
+  *p++ = '-';
+  p += format_padded(utc->day, 2, p);
+  *p++ = 'T';
+  p += format_padded(utc->hour, 2, p);
+  *p++ = ':';
+  p += format_padded(utc->minute, 2, p);
+  *p++ = ':';
+  p += format_padded(utc->second, 2, p);
+  if (utc->milliseconds != 0)
+    {
+    *p++ = '.';
+    p += format_padded(utc->milliseconds, 3, p);
+    }
+
+  *p++ = 'Z';
+  return (uint16_t)(p - out);
+  }
+
+// format into a buffer of at least MAX_VARIANT_TEXT characters
+static result_t format_variant(const variant_t *v, char *out, uint16_t *length)
+  {
+  switch (v->vt)
+    {
+    case v_none :
+      *length = 0;
+      break;
+    case v_bool :
+      *length = v->value.boolean ? 4 : 5;
+      memcpy(out, v->value.boolean ? "true" : "false", *length);
+      break;
+    case v_int8 :
+      *length = format_int(v->value.int8, out);
+      break;
+    case v_uint8 :
+      *length = format_uint(v->value.uint8, out);
+      break;
+    case v_int16 :
+      *length = format_int(v->value.int16, out);
+      break;
+    case v_uint16 :
+      *length = format_uint(v->value.uint16, out);
+      break;
+    case v_int32 :
+      *length = format_int(v->value.int32, out);
+      break;
+    case v_uint32 :
+      *length = format_uint(v->value.uint32, out);
+      break;
+    case v_float :
+      *length = format_float(v->value.flt, out);
+      break;
+    case v_utc :
+      *length = format_utc(&v->value.utc, out);
+      break;
+    case v_epoch :
+      {
+      tm_t utc;
+      epoch_to_tm(v->value.epoch, &utc);
+      *length = format_utc(&utc, out);
+      }
+      break;
+    default :
+      return e_bad_type;
+    }
+
+  return s_ok;
+  }
+
+result_t variant_to_string(const variant_t *v, char *buffer, uint16_t size, uint16_t *length)
+  {
+  if (v == 0 || buffer == 0)
+    return e_bad_parameter;
+
+  result_t result;
+  uint16_t len;
+  if (size > MAX_VARIANT_TEXT)
+    result = format_variant(v, buffer, &len);
+  else
+    {
+    char text[MAX_VARIANT_TEXT];
+    if (succeeded(result = format_variant(v, text, &len)))
+      {
+      if (len >= size)
+        return e_buffer_too_small;
+
+      memcpy(buffer, text, len);
+      }
+    }
+
+  if (failed(result))
+    return result;
+
+  buffer[len] = 0;
+  if (length != 0)
+    *length = len;
+
+  return s_ok;
+  }
+
+result_t variants_to_string(const variant_t *values, uint32_t count, char separator, char *buffer, uint32_t size, uint32_t *length)
+  {
+  if (values == 0 || buffer == 0 || size == 0)
+    return e_bad_parameter;
+
+  result_t result;
+  uint32_t pos = 0;
+  for (uint32_t i = 0; i < count; i++)
+    {
+    uint16_t len;
+    if (size - pos > MAX_VARIANT_TEXT + 1)
+      {
+      // room for any value, format in place
+      if (failed(result = format_variant(&values[i], buffer + pos, &len)))
+        return result;
+      }
+    else
+      {
+      char text[MAX_VARIANT_TEXT];
+      if (failed(result = format_variant(&values[i], text, &len)))
+        return result;
+
+      // the value, the separator and the terminator
+      if (pos + len + 2 > size)
+        return e_buffer_too_small;
+
+      memcpy(buffer + pos, text, len);
+      }
+
+    pos += len;
+    buffer[pos++] = separator;
+    }
+
+  if (pos >= size)
+    return e_buffer_too_small;
+
+  buffer[pos] = 0;
+  if (length != 0)
+    *length = pos;
+
+  return s_ok;
+  }
+
+// parse an optionally signed decimal integer
+static result_t parse_integer(const char *str, uint16_t length, bool *negative, uint64_t *magnitude)
+  {
+  uint16_t i = 0;
+  *negative = false;
+  *magnitude = 0;
+
+  if (i < length && (str[i] == '-' || str[i] == '+'))
+    *negative = str[i++] == '-';
+
+  if (i == length)
+    return e_parse_error;
+
+  for (; i < length; i++)
+    {
+    uint8_t digit = (uint8_t)(str[i] - '0');
+    if (digit > 9)
+      return e_parse_error;
+
+    *magnitude = (*magnitude * 10) + digit;
+    if (*magnitude > 0xFFFFFFFFULL)
+      return e_out_of_range;
+    }
+
+  return s_ok;
+  }
+
+// parse a fixed number of digits
+static bool parse_digits(const char *str, uint16_t count, uint16_t *value)
+  {
+  *value = 0;
+  for (uint16_t i = 0; i < count; i++)
+    {
+    uint8_t digit = (uint8_t)(str[i] - '0');
+    if (digit > 9)
+      return false;
+
+    *value = (*value * 10) + digit;
+    }
+
+  return true;
+  }
+
+static result_t parse_utc(const char *str, uint16_t length, tm_t *utc)
+  {
+  // YYYY-MM-DDTHH:MM:SS[.mmm][Z]
+  if (length < 19 ||
+      str[4] != '-' || str[7] != '-' ||
+      (str[10] != 'T' && str[10] != 't' && str[10] != ' ') ||
+      str[13] != ':' || str[16] != ':' ||
+      !parse_digits(str, 4, &utc->year) ||
+      !parse_digits(str + 5, 2, &utc->month) ||
+      !parse_digits(str + 8, 2, &utc->day) ||
+      !parse_digits(str + 11, 2, &utc->hour) ||
+      !parse_digits(str + 14, 2, &utc->minute) ||
+      !parse_digits(str + 17, 2, &utc->second))
+    return e_parse_error;
+
+  uint16_t pos = 19;
+  utc->milliseconds = 0;
+  if (pos < length && str[pos] == '.')
+    {
+    pos++;
+    uint16_t scale = 100;
+    uint16_t start = pos;
+    for (; pos < length && str[pos] >= '0' && str[pos] <= '9'; pos++)
+      {
+      // digits past milliseconds are ignored
+      utc->milliseconds += (str[pos] - '0') * scale;
+      scale /= 10;
+      }
+
+    if (pos == start)
+      return e_parse_error;
+    }
+
+  if (pos < length && (str[pos] == 'Z' || str[pos] == 'z'))
+    pos++;
+
+  if (pos != length)
+    return e_parse_error;
+
+  if (utc->month < 1 || utc->month > 12 || utc->day < 1 || utc->day > 31 ||
+      utc->hour > 23 || utc->minute > 59 || utc->second > 60)
+    return e_out_of_range;
+
+  // a day past the end of the month, such as 02-30 or 02-29 of a common
+  // year, comes back as a day of the next month
+  tm_t date;
+  civil_from_days(days_from_civil(utc->year, utc->month, utc->day), &date);
+  if (date.month != utc->month || date.day != utc->day)
+    return e_out_of_range;
+
+  return s_ok;
+  }
+
+result_t string_to_variant(const char *str, uint16_t length, variant_type vt, variant_t *v)
+  {
+  if (str == 0 || v == 0)
+    return e_bad_parameter;
+
+  result_t result;
+  bool negative;
+  uint64_t magnitude;
+
+  switch (vt)
+    {
+    case v_none :
+      if (length != 0)
+        return e_parse_error;
+
+      create_variant_nodata(v);
+      break;
+    case v_bool :
+      if ((length == 4 && memcmp(str, "true", 4) == 0) || (length == 1 && str[0] == '1'))
+        create_variant_bool(true, v);
+      else if ((length == 5 && memcmp(str, "false", 5) == 0) || (length == 1 && str[0] == '0'))
+        create_variant_bool(false, v);
+      else
+        return e_parse_error;
+      break;
+    case v_int8 :
+    case v_int16 :
+    case v_int32 :
+      {
+      if (failed(result = parse_integer(str, length, &negative, &magnitude)))
+        return result;
+
+      uint64_t limit = vt == v_int8 ? 127 : vt == v_int16 ? 32767 : 2147483647;
+      if (magnitude > limit + (negative ? 1 : 0))
+        return e_out_of_range;
+
+      int64_t value = negative ? -(int64_t)magnitude : (int64_t)magnitude;
+      if (vt == v_int8)
+        create_variant_int8((int8_t)value, v);
+      else if (vt == v_int16)
+        create_variant_int16((int16_t)value, v);
+      else
+        create_variant_int32((int32_t)value, v);
+      }
+      break;
+    case v_uint8 :
+    case v_uint16 :
+    case v_uint32 :
+      {
+      if (failed(result = parse_integer(str, length, &negative, &magnitude)))
+        return result;
+
+      uint64_t limit = vt == v_uint8 ? 255 : vt == v_uint16 ? 65535 : 4294967295U;
+      if ((negative && magnitude != 0) || magnitude > limit)
+        return e_out_of_range;
+
+      if (vt == v_uint8)
+        create_variant_uint8((uint8_t)magnitude, v);
+      else if (vt == v_uint16)
+        create_variant_uint16((uint16_t)magnitude, v);
+      else
+        create_variant_uint32((uint32_t)magnitude, v);
+      }
+      break;
+    case v_float :
+      {
+      // strtof needs a terminated string
+      char text[MAX_VARIANT_TEXT];
+      if (length == 0 || length >= MAX_VARIANT_TEXT)
+        return e_parse_error;
+
+      memcpy(text, str, length);
+      text[length] = 0;
+
+      char *end;
+      errno = 0;
+      float value = strtof(text, &end);
+      if (end != text + length)
+        return e_parse_error;
+
+      if (errno == ERANGE && isinf(value))
+        return e_out_of_range;
+
+      create_variant_float(value, v);
+      }
+      break;
+    case v_utc :
+      {
+      tm_t utc;
+      if (failed(result = parse_utc(str, length, &utc)))
+        return result;
+
+      create_variant_utc(&utc, v);
+      }
+      break;
+    case v_epoch :
+      {
+      tm_t utc;
+      if (failed(result = parse_utc(str, length, &utc)))
+        return result;
+
+      create_variant_utc(&utc, v);
+      uint32_t epoch;
+      if (failed(result = coerce_to_epoch(v, &epoch)))
+        return result;
+
+      create_variant_epoch(epoch, v);
+      }
+      break;
+    default :
+      return e_bad_type;
+    }
+
+  return s_ok;
+  }